@@ -20,10 +20,14 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <getopt.h>
+#include <stdint.h>
 #include "utils.h"
 #include "htslib/hts.h"
 #include "htslib/vcf.h"
-#include "htslib/synced_bcf_reader.h"
+#include "htslib/bgzf.h"
+#include "anno_pool.h"
+#include "anno_thread_pool.h"
+#include "vcol.h"
 
 // split mode
 #define SPLIT_NONE     1          //  bcftools query mode, one bcf1_t per line
@@ -74,6 +78,9 @@ struct _col {
     int number; // BCF_VL_*
     int unpack;
     int id; //header index id for INFO/FORMAT
+    int hl; // BCF_HL_INFO or BCF_HL_FMT if read from a field, resolved once per record
+    int per_sample; // 0 for columns shared by all samples, only format once per allele
+    int bin_type; // BCF_HT_INT or BCF_HT_REAL kept as numbers in binary output, otherwise BCF_HT_STR
     char *key;
     void (*setter)(bcf_hdr_t *hdr, bcf1_t *, col_t *, int ale,  mval_t *);
 };
@@ -82,13 +89,20 @@ struct _convert_cols {
     int m, l;
     col_t **cols;
     int max_unpack;
+    int gt_id; // -1 if no GT in header
 };
 
 /* value for each node in print cached matrix */
 struct _mval {
     enum col_type type;
     int sample_id;
+    void *field; // bcf_info_t or bcf_fmt_t of current record
     kstring_t a;
+    // number for binary output
+    union {
+        int32_t i;
+        float f;
+    } v;
 };
 
 struct _multi_cols_cache_per_allele {
@@ -105,6 +119,12 @@ struct _multi_cols_cache_per_sample {
 struct _multi_cols_cache {
     int m_samples;
     struct _multi_cols_cache_per_sample *mcols;
+    // values of shared columns for each allele
+    struct _multi_cols_cache_per_sample shared;
+    // INFO/FORMAT fields of each column in current record
+    void **fields;
+    // skip flags of samples, decoded from GT
+    uint8_t *skips;
 };
 
 /* declared setter functions */
@@ -129,9 +149,17 @@ struct args {
     int split_flag;
     int skip_uncover;
     int no_gt;
+    int n_thread;
+    int n_record;
+    // compress output in BGZF blocks
+    int bgzf;
+    // columnar binary output, see vcol.h
+    int binary;
     ccols_t *convert;
-    mcache_t *cache;
-    kstring_t *mempool;
+    // matrix cache for each thread
+    mcache_t **caches;
+    htsFile *fp_input;
+    FILE *fp_out;
     bcf_hdr_t *hdr;
 };
 
@@ -141,19 +169,35 @@ struct args args = {
     .print_header = 1,
     .skip_uncover = 0,
     .no_gt = 0,
+    .n_thread = 1,
+    .n_record = RECORDS_PER_CHUNK,
+    .bgzf = 0,
+    .binary = 0,
     .split_flag = SPLIT_DEFAULT,
     .convert = NULL,
-    .cache = NULL,
-    .mempool = NULL,
+    .caches = NULL,
+    .fp_input = NULL,
+    .fp_out = NULL,
     .hdr = NULL,
 };
 
+// converted lines of a chunk of records
+struct tsv_batch {
+    struct anno_pool *pool;
+    kstring_t str;
+    // columns of this row group in binary output
+    struct vcol_chunk *chunks;
+    int n_rows;
+};
+
 ccols_t *ccols_init()
 {
     ccols_t *c = (ccols_t *)malloc(sizeof(ccols_t));
     c->m = c->l = 0;
     c->cols = 0;
-    c->max_unpack = 0;
+    // ID and alleles are always unpacked, like the synced reader does
+    c->max_unpack = BCF_UN_STR;
+    c->gt_id = -1;
     return c;
 }
 
@@ -192,6 +236,9 @@ ccols_t *format_string_init(char *s, bcf_hdr_t *h, int *n_sample)
     }
 
 
+    c->gt_id = bcf_hdr_id2int(h, BCF_DT_ID, "GT");
+    if ( !bcf_hdr_idinfo_exists(h, BCF_HL_FMT, c->gt_id) ) c->gt_id = -1;
+
     if ( has_sample ) {
       *n_sample = bcf_hdr_nsamples(h);
     } else {
@@ -242,17 +289,22 @@ col_t *register_key (char *p, bcf_hdr_t *h)
 	c->type = c->type == is_unknown || c->type == is_format ? is_gt : c->type;
 	c->unpack |= BCF_UN_FMT;
 	c->id = bcf_hdr_id2int(h, BCF_DT_ID, "GT");
+        c->hl = BCF_HL_FMT;
+        c->per_sample = 1;
     }
     else if ( same_string(q, "TGT") ) {
         c->setter = setter_tgt;
 	c->type = c->type == is_unknown || c->type == is_format ? is_gt : c->type;
 	c->unpack |= BCF_UN_FMT;
 	c->id = bcf_hdr_id2int(h, BCF_DT_ID, "GT");
+        c->hl = BCF_HL_FMT;
+        c->per_sample = 1;
     }
     else if (same_string(q, "SAMPLE")) {
 	c->setter = setter_sample;
 	c->type = is_sample;
 	c->unpack |= BCF_UN_FMT;
+        c->per_sample = 1;
     }
     else if (same_string(q, "CHROM")) {
 	c->setter = setter_chrom;
@@ -296,6 +348,8 @@ col_t *register_key (char *p, bcf_hdr_t *h)
 		error("Tag %s not exists in header!", q);
             c->unpack |= BCF_UN_FMT;
             c->number = bcf_hdr_id2length(h, BCF_HL_FMT, c->id);
+            c->hl = BCF_HL_FMT;
+            c->per_sample = 1;
 	} else {
 	    c->type = c->type == is_unknown ? is_info : c->type;
 	    c->setter = setter_info;
@@ -304,6 +358,7 @@ col_t *register_key (char *p, bcf_hdr_t *h)
 		error("Tag %s not exists in header!", q);
 	    c->unpack |= BCF_UN_SHR;
             c->number = bcf_hdr_id2length(h, BCF_HL_INFO, c->id);
+            c->hl = BCF_HL_INFO;
 	}
     }
 #undef same_string	
@@ -321,54 +376,64 @@ mcache_t *mcache_init(int nsamples)
 	ps->n_alleles = ps->m_alleles = 0;
 	ps->alvals = 0;
     }
+    m->fields = calloc(args.convert->l, sizeof(void*));
+    m->skips = calloc(m->m_samples, sizeof(uint8_t));
     return m;
 }
 
+// enlarge memory cache, values are reset before set
+static void cache_alleles(mcache_ps_t *ps, int n_alleles)
+{
+    int j, k;
+    if (ps->m_alleles < n_alleles) {
+        // only new slots are allocated, the old ones are reused
+        j = ps->m_alleles;
+        ps->m_alleles = n_alleles;
+        ps->alvals = (mcache_pa_t*)realloc(ps->alvals, ps->m_alleles *sizeof(mcache_pa_t));
+        for (; j< ps->m_alleles; ++j) {
+            mcache_pa_t *pa = &ps->alvals[j];
+            pa->n_cols = args.convert->l;
+            pa->mvals = (mval_t*)calloc(pa->n_cols, sizeof(mval_t));
+            for (k=0; k<pa->n_cols; ++k) {
+                pa->mvals[k].a.l = pa->mvals[k].a.m = 0;
+                pa->mvals[k].a.s = 0; 
+            }
+        }
+    }
+    ps->n_alleles = n_alleles;
+}
+
 void set_matrix_cache(mcache_t *m, int n_alleles)
 {
-    int i, j, k;
-    for (i =0; i< m->m_samples; ++i) {
-	// enlarger memory cache
-	mcache_ps_t *ps = &m->mcols[i];
-	if (ps->m_alleles <= n_alleles) {
-	    ps->m_alleles = n_alleles;
-	    ps->alvals = (mcache_pa_t*)realloc(ps->alvals, ps->m_alleles *sizeof(mcache_pa_t));
-	    for (j=ps->n_alleles; j< ps->m_alleles; ++j) {
-		mcache_pa_t *pa = &ps->alvals[j];
-		pa->n_cols = args.convert->l;
-		pa->mvals = (mval_t*)calloc(pa->n_cols, sizeof(mval_t));
-		for (k=0; k<pa->n_cols; ++k) {
-		    pa->mvals[k].a.l = pa->mvals[k].a.m = 0;
-		    pa->mvals[k].a.s = 0; 
-		}
-	    }
-	}
-	
-	ps->n_alleles = n_alleles;
-	for (j=0; j<ps->n_alleles; ++j) {
-	    mcache_pa_t *pa = &ps->alvals[j];
-	    for (k=0; k<pa->n_cols; ++k)
-		pa->mvals[k].a.l = 0;	
-	}
+    int i;
+    for (i =0; i< m->m_samples; ++i)
+        cache_alleles(&m->mcols[i], n_alleles);
+    cache_alleles(&m->shared, n_alleles);
+}
+
+static void release_alleles(mcache_ps_t *ps)
+{
+    int j, k;
+    for (j=0; j<ps->m_alleles; ++j) {
+        mcache_pa_t *pa = &ps->alvals[j];
+        for (k=0; k<pa->n_cols; ++k) {
+            if (pa->mvals[k].a.m)
+                free(pa->mvals[k].a.s);		
+        }
+        free(pa->mvals);
     }
+    free(ps->alvals);
 }
 
 void release_mcache(mcache_t *m)
 {
-    int i, j, k;
-    for (i =0; i< m->m_samples; ++i) {
-	mcache_ps_t *ps = &m->mcols[i];
-	for (j=0; j<ps->n_alleles; ++j) {
-	    mcache_pa_t *pa = &ps->alvals[j];
-	    for (k=0; k<pa->n_cols; ++k) {
-		if (pa->mvals[k].a.m)
-		    free(pa->mvals[k].a.s);		
-	    }
-	    free(pa->mvals);
-	}
-	free(ps->alvals);
-    }
+    int i;
+    for (i =0; i< m->m_samples; ++i)
+        release_alleles(&m->mcols[i]);
+    release_alleles(&m->shared);
     free(m->mcols);
+    free(m->fields);
+    free(m->skips);
     free(m);
 }
 
@@ -382,26 +447,51 @@ void release_args()
     }
     free(args.convert->cols);
     free(args.convert);
-    release_mcache(args.cache);
+    for (i=0; i<args.n_thread; ++i)
+        release_mcache(args.caches[i]);
+    free(args.caches);
+}
+
+// BGZF end-of-file marker, an empty block
+static const char bgzf_eof[28] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0";
+
+// compress str into BGZF blocks; blocks are independent, so chunks can be compressed in parallel
+static void bgzf_blocks(kstring_t *str)
+{
+    kstring_t z = KSTRING_INIT;
+    size_t i;
+    for (i = 0; i < str->l; i += BGZF_BLOCK_SIZE) {
+        size_t slen = str->l - i < BGZF_BLOCK_SIZE ? str->l - i : BGZF_BLOCK_SIZE;
+        size_t dlen = BGZF_MAX_BLOCK_SIZE;
+        ks_resize(&z, z.l + BGZF_MAX_BLOCK_SIZE);
+        if ( bgzf_compress(z.s + z.l, &dlen, str->s + i, slen, -1) )
+            error("Failed to compress output.");
+        z.l += dlen;
+    }
+    free(str->s);
+    *str = z;
+}
 
-    if (args.mempool->m)
-	free(args.mempool->s);
-    args.mempool->l = args.mempool->m = 0;
-    args.mempool->s = 0;
+static void write_string(kstring_t *str)
+{
+    if (str->l == 0) return;
+    if (fwrite(str->s, 1, str->l, args.fp_out) != str->l)
+        error("Failed to write output : %s.", strerror(errno));
 }
 
 // convert the header of output
 int convert_header()
 {
     ccols_t *cols = args.convert;
+    kstring_t str = KSTRING_INIT;
     int i;
     for (i=0; i<cols->l; ++i) {
-	if (i) kputc('\t', args.mempool);
-	else kputc('#', args.mempool);
+	if (i) kputc('\t', &str);
+	else kputc('#', &str);
 	col_t *c = cols->cols[i];
 	switch(c->type) {
 	    case is_bed :
-		kputs("CHROM\tSTART\tEND", args.mempool);
+		kputs("CHROM\tSTART\tEND", &str);
 		break;
 
 	    case is_unknown:
@@ -419,13 +509,15 @@ int convert_header()
 	    case is_format:
 	    case is_sample:
 	    default:
-		kputs(c->key, args.mempool);
+		kputs(c->key, &str);
 		break;
 
 	}
     }
-    printf("%s\n",args.mempool->s);
-    args.mempool->l = 0;
+    kputc('\n', &str);
+    if (args.bgzf) bgzf_blocks(&str);
+    write_string(&str);
+    free(str.s);
     return 0;
 }
 
@@ -453,77 +545,239 @@ int init_split_flag(char *s)
     return flag;
 }
 
-int convert_line(bcf_hdr_t *hdr, bcf1_t *line)
+// Resolve INFO/FORMAT fields of all columns once per record.
+static void resolve_fields(bcf1_t *line, mcache_t *cache)
+{
+    int k;
+    for (k = 0; k < args.convert->l; ++k) {
+        col_t *col = args.convert->cols[k];
+        if (col->hl == BCF_HL_INFO)
+            cache->fields[k] = bcf_get_info_id(line, col->id);
+        else if (col->hl == BCF_HL_FMT)
+            cache->fields[k] = bcf_get_fmt_id(line, col->id);
+        else
+            cache->fields[k] = NULL;
+    }
+}
+
+// Decode GT of all samples once per record and flag the samples skipped by
+// --skip-ref and --skip-uncover. Return 0 if no GT in this record.
+static int decode_skips(bcf1_t *line, mcache_t *cache)
+{
+    if (args.convert->gt_id == -1)
+        return 0;
+    bcf_fmt_t *fmt = bcf_get_fmt_id(line, args.convert->gt_id);
+    if (fmt == NULL)
+        return 0;
+
+    int i, k;
+    uint8_t *skips = cache->skips;
+    // no branch in the inner loop, so the compiler could vectorize it
+#define BRANCH(type_t) do {                                             \
+        for (i = 0; i < cache->m_samples; ++i) {                        \
+            type_t *ptr = (type_t*)(fmt->p + i*fmt->size);              \
+            int cover = 0, alt = 0;                                     \
+            for (k = 0; k < fmt->n; ++k) {                              \
+                cover |= (ptr[k]>>1) != 0;                              \
+                alt |= (ptr[k]>>1) > 1;                                 \
+            }                                                           \
+            skips[i] = (args.skip_uncover && !cover) || (args.skip_ref && !alt); \
+        }                                                               \
+    } while(0)
+
+    switch(fmt->type) {
+        case BCF_BT_INT8:
+            BRANCH(int8_t);
+            break;
+
+        case BCF_BT_INT16:
+            BRANCH(int16_t);
+            break;
+
+        case BCF_BT_INT32:
+            BRANCH(int32_t);
+            break;
+
+        default:
+            error("FIXME: type %d in bcf_format_gt?", fmt->type);
+    }
+#undef BRANCH
+    return 1;
+}
+
+// Columns of one INT/REAL value per row are kept as numbers in binary output.
+static int binary_type(bcf_hdr_t *hdr, col_t *c)
+{
+    if (c->setter == setter_pos)
+        return BCF_HT_INT;
+    if (c->setter == setter_qual)
+        return BCF_HT_REAL;
+    if (c->setter == setter_bed)
+        error("BED is not supported in binary output, use CHROM,POS instead.");
+    if (c->setter != setter_info && c->setter != setter_format)
+        return BCF_HT_STR;
+    int type = bcf_hdr_id2type(hdr, c->hl, c->id);
+    if (type != BCF_HT_INT && type != BCF_HT_REAL)
+        return BCF_HT_STR;
+    if (c->number == BCF_VL_FIXED && bcf_hdr_id2number(hdr, c->hl, c->id) == 1)
+        return type;
+    // one value for each allele
+    if ((c->number == BCF_VL_A || c->number == BCF_VL_R) && (args.split_flag & SPLIT_ALT))
+        return type;
+    return BCF_HT_STR;
+}
+
+static void read_number(int bin_type, int type, void *data, int n, int idx, mval_t *val)
+{
+    int missing = 1;
+    double x = 0;
+#define BRANCH(type_t, is_missing, is_vector_end) do {                  \
+        type_t v = ((type_t*)data)[idx];                                \
+        if (v != is_missing && v != is_vector_end) { x = v; missing = 0; } \
+    } while(0)
+
+    if (idx >= 0 && idx < n) {
+        switch(type) {
+            case BCF_BT_INT8:
+                BRANCH(int8_t, bcf_int8_missing, bcf_int8_vector_end);
+                break;
+
+            case BCF_BT_INT16:
+                BRANCH(int16_t, bcf_int16_missing, bcf_int16_vector_end);
+                break;
+
+            case BCF_BT_INT32:
+                BRANCH(int32_t, bcf_int32_missing, bcf_int32_vector_end);
+                break;
+
+            case BCF_BT_FLOAT:
+                do {
+                    float v = ((float*)data)[idx];
+                    if (!bcf_float_is_missing(v) && !bcf_float_is_vector_end(v)) { x = v; missing = 0; }
+                } while(0);
+                break;
+
+            default:
+                error("todo: type %d", type);
+        }
+    }
+#undef BRANCH
+    if (bin_type == BCF_HT_INT)
+        val->v.i = missing ? bcf_int32_missing : (int32_t)x;
+    else if (missing)
+        bcf_float_set_missing(val->v.f);
+    else
+        val->v.f = x;
+}
+
+// Read the number of a binary column, pick the value of allele same as the text setters.
+static void binary_value(bcf1_t *line, col_t *c, int ale, mval_t *val)
+{
+    if (c->setter == setter_pos) {
+        val->v.i = line->pos + 1;
+        return;
+    }
+    if (c->setter == setter_qual) {
+        val->v.f = line->qual;
+        return;
+    }
+    int idx = ale == -1 || c->number == BCF_VL_FIXED ? 0 : c->number == BCF_VL_A ? ale - 1 : ale;
+    if (c->hl == BCF_HL_INFO) {
+        bcf_info_t *inf = (bcf_info_t*)val->field;
+        if (inf == NULL || inf->len <= 0 || (ale == 0 && c->number == BCF_VL_A))
+            read_number(c->bin_type, inf ? inf->type : BCF_BT_INT32, NULL, 0, -1, val);
+        else
+            // single value is used for all alleles, same as setter_info
+            read_number(c->bin_type, inf->type, inf->vptr, inf->len, inf->len == 1 ? 0 : idx, val);
+    }
+    else {
+        bcf_fmt_t *fmt = (bcf_fmt_t*)val->field;
+        if (fmt == NULL || fmt->n <= 0 || (ale == 0 && c->number == BCF_VL_A))
+            read_number(c->bin_type, BCF_BT_INT32, NULL, 0, -1, val);
+        else
+            read_number(c->bin_type, fmt->type, fmt->p + val->sample_id*fmt->size, fmt->n, idx, val);
+    }
+}
+
+static void set_value(bcf_hdr_t *hdr, bcf1_t *line, col_t *col, int ale, mval_t *val)
+{
+    if (args.binary && col->bin_type != BCF_HT_STR)
+        binary_value(line, col, ale, val);
+    else
+        col->setter(hdr, line, col, ale, val);
+}
+
+static void put_value(struct tsv_batch *b, int k, col_t *col, mval_t *val)
+{
+    if (!args.binary) {
+        if (k) kputc('\t', &b->str);
+        kputs(val->a.s, &b->str);
+    }
+    else if (col->bin_type == BCF_HT_INT) {
+        vcol_push_int(&b->chunks[k], val->v.i);
+    }
+    else if (col->bin_type == BCF_HT_REAL) {
+        vcol_push_float(&b->chunks[k], val->v.f);
+    }
+    else {
+        vcol_push_string(&b->chunks[k], val->a.s);
+    }
+}
+
+static void put_row_end(struct tsv_batch *b)
+{
+    if (!args.binary) kputc('\n', &b->str);
+    b->n_rows++;
+}
+
+int convert_line(bcf_hdr_t *hdr, bcf1_t *line, mcache_t *cache, struct tsv_batch *b)
 {
     if (line == NULL)
 	error ("null line.");
     bcf_unpack(line, args.convert->max_unpack);
     
-    mcache_t *cache = args.cache;
-    // ccols_t *cols = args.convert;
-    // int n_alleles = args.split_flag & SPLIT_ALT ? line->n_allele : 1;
+    ccols_t *cols = args.convert;
     int n_alleles = line->n_allele;
     set_matrix_cache(cache, n_alleles);
+    resolve_fields(line, cache);
+
+    // Check if samples are uncovered or reference only. For multi samples, some sample may have different genotypes.
+    int check_gt = 0;
+    if ( args.skip_uncover || args.skip_ref )
+        check_gt = decode_skips(line, cache);
 
     int i, j, k;
 
+    // format columns not related to samples once for each allele
+    for (j=0; j < n_alleles; ++j) {
+        int iallele = args.split_flag & SPLIT_ALT ? j : -1;
+        if ( iallele == 0 && args.skip_ref == 1 )
+            continue;
+        mcache_pa_t *pa = &cache->shared.alvals[j];
+        for (k = 0; k < pa->n_cols; ++k) {
+            col_t *col = cols->cols[k];
+            if (col->per_sample)
+                continue;
+            mval_t *val = &pa->mvals[k];
+            val->type = col->type;
+            val->sample_id = 0;
+            val->field = cache->fields[k];
+            val->a.l = 0;
+            set_value(hdr, line, col, iallele, val);
+        }
+        if ( !(args.split_flag & SPLIT_ALT))
+            break;
+    }
+
     for (i=0; i<cache->m_samples; ++i) { 
 	// iterate samples
+        if ( check_gt && cache->skips[i] )
+            continue;
+
 	mcache_ps_t *ps = &cache->mcols[i];
-	//ps->n_alleles = n_alleles;
 
         // Foreach allele
-	for (j=0; j < ps->n_alleles; ++j) { // ???
-	    
-	    // if (n_alleles > 1 && args.skip_ref && j==0)
-            // continue;
-            // if ( args.skip_uncover || args.skip_ref ) {
-            int skip_uncover = 0, skip_ref = 0;
-            // Check if this allele absent in this sample. For multi samples, some sample may have different genotypes.
-            int no_such_allele = 1;
-            if ( args.skip_uncover )
-                skip_uncover = 1;
-            if ( args.skip_ref )
-                skip_ref = 1;
-            // int i_allele = 0;
-            bcf_fmt_t *fmt = bcf_get_fmt(hdr, line, "GT");
-            // if ( fmt == NULL) 
-                // error ("no found GT tag in line : %s,%d", hdr->id[BCF_DT_CTG][line->rid].key, line->pos+1);
-            if ( fmt != NULL ) {
-                int sample_id = i;
-                
-#define BRANCH(type_t, missing, vector_end) do {                        \
-                    type_t *ptr = (type_t*)(fmt->p + sample_id*fmt->size); \
-                    int i;                                              \
-                    for (i=0; i<fmt->n; ++i) {                          \
-                        if ( (ptr[i]>>1) ) skip_uncover = 0;            \
-                        if ( (ptr[i]>>1) > 1) skip_ref = 0;             \
-                        if ( (ptr[i]>>1) -1 == j) no_such_allele = 0;   \
-                    }                                                   \
-                } while(0)
-                
-                switch(fmt->type) {
-                    case BCF_BT_INT8:
-                        BRANCH(int8_t, bcf_int8_missing, bcf_int8_vector_end);
-                        break;
-                        
-                    case BCF_BT_INT16:
-                        BRANCH(int16_t, bcf_int16_missing, bcf_int16_vector_end);
-                        break;
-                    
-                    case BCF_BT_INT32:
-                        BRANCH(int32_t, bcf_int32_missing, bcf_int32_vector_end);
-                        break;
-                        
-                    default:
-                        error("FIXME: type %d in bcf_format_gt?", fmt->type);
-                }
-#undef BRANCH
-                if ( skip_uncover || skip_ref)
-                    continue;
-
-            }
-            
+	for (j=0; j < ps->n_alleles; ++j) {
             mcache_pa_t *pa = &ps->alvals[j];
 	    int iallele = -1;
 	    if (args.split_flag & SPLIT_ALT)
@@ -532,18 +786,22 @@ int convert_line(bcf_hdr_t *hdr, bcf1_t *line)
                 continue;
             
 	    for (k = 0; k < pa->n_cols; ++k) {		
-		col_t *col = args.convert->cols[k];
-		mval_t *val = &pa->mvals[k];		
-		val->type = col->type;
-		val->sample_id = i;		
-		/* setter function */
-		col->setter(hdr, line, col, iallele, val);
-		if (k) kputc('\t', args.mempool);
-		kputs(val->a.s, args.mempool);
-		//debug_print("%s", val->a.s);
+		col_t *col = cols->cols[k];
+		mval_t *val;
+                if (col->per_sample) {
+                    val = &pa->mvals[k];
+                    val->type = col->type;
+                    val->sample_id = i;
+                    val->field = cache->fields[k];
+                    val->a.l = 0;
+                    /* setter function */
+                    set_value(hdr, line, col, iallele, val);
+                } else {
+                    val = &cache->shared.alvals[j].mvals[k];
+                }
+                put_value(b, k, col, val);
 	    } // end cols
-	    kputc('\n', args.mempool);
-
+            put_row_end(b);
 
             if ( !(args.split_flag & SPLIT_ALT))
                 break;
@@ -552,16 +810,16 @@ int convert_line(bcf_hdr_t *hdr, bcf1_t *line)
     return 0;
 }
 
-int convert_line_no_gt(bcf_hdr_t *hdr, bcf1_t *line)
+int convert_line_no_gt(bcf_hdr_t *hdr, bcf1_t *line, mcache_t *cache, kstring_t *str)
 {
     if (line == NULL)
 	error ("null line.");
     bcf_unpack(line, args.convert->max_unpack);
 
-    mcache_t *cache = args.cache;
 
     int n_alleles = 1;
     set_matrix_cache(cache, n_alleles);
+    resolve_fields(line, cache);
 
     int i, k;
 
@@ -578,13 +836,15 @@ int convert_line_no_gt(bcf_hdr_t *hdr, bcf1_t *line)
             mval_t *val = &pa->mvals[k];		
             val->type = col->type;
             val->sample_id = i;		
+            val->field = cache->fields[k];
+            val->a.l = 0;
             /* setter function */
             col->setter(hdr, line, col, iallele, val);
-            if (k) kputc('\t', args.mempool);
-            kputs(val->a.s, args.mempool);
+            if (k) kputc('\t', str);
+            kputs(val->a.s, str);
                 //debug_print("%s", val->a.s);
         } // end cols
-        kputc('\n', args.mempool);
+        kputc('\n', str);
 
             // if ( !(args.split_flag & SPLIT_ALT))
             // break;
@@ -684,7 +944,7 @@ void setter_tgt(bcf_hdr_t *hdr, bcf1_t *line, col_t *c, int ale, mval_t *val)
     if (ale != -1)
 	error ("GT, TGT only used with split-allele mode.");
 
-    bcf_fmt_t *fmt = bcf_get_fmt_id(line, c->id);
+    bcf_fmt_t *fmt = (bcf_fmt_t*)val->field;
 
     if (fmt == NULL)
 	error ("no found GT tag in line : %s,%d", hdr->id[BCF_DT_CTG][line->rid].key, line->pos+1);
@@ -695,6 +955,7 @@ void setter_tgt(bcf_hdr_t *hdr, bcf1_t *line, col_t *c, int ale, mval_t *val)
 	type_t *ptr = (type_t*)(fmt->p + sample_id*fmt->size);\
 	int i;\
 	for (i=0; i<fmt->n; ++i) {\
+	    if ( ptr[i] == vector_end ) break; \
 	    if ( i ) kputc("/|"[ptr[i]&1], &val->a);\
 	    if ( !(ptr[i]>>1) ) kputc('.', &val->a); \
 	    else kputs(line->d.allele[(ptr[i]>>1)-1], &val->a);	\
@@ -724,7 +985,7 @@ void setter_gt(bcf_hdr_t *hdr, bcf1_t *line, col_t *c, int ale, mval_t *val)
     if (ale != -1)
 	error ("GT, TGT only used with split-allele mode.");
 
-    bcf_fmt_t *fmt = bcf_get_fmt_id(line, c->id);
+    bcf_fmt_t *fmt = (bcf_fmt_t*)val->field;
 
     if (fmt == NULL)
 	error ("no found GT tag in line : %s,%d", hdr->id[BCF_DT_CTG][line->rid].key, line->pos+1);
@@ -735,6 +996,7 @@ void setter_gt(bcf_hdr_t *hdr, bcf1_t *line, col_t *c, int ale, mval_t *val)
 	type_t *ptr = (type_t*)(fmt->p + sample_id*fmt->size);\
 	int i;\
 	for (i=0; i<fmt->n; ++i) {\
+	    if ( ptr[i] == vector_end ) break; \
 	    if ( i ) kputc("/|"[ptr[i]&1], &val->a);\
 	    if ( !(ptr[i]>>1) ) kputc('.', &val->a); \
 	    else kputw((ptr[i]>>1)-1, &val->a);	\
@@ -774,7 +1036,7 @@ void process_fmt_array(int iallele, kstring_t *string, int n, int type, void *da
 		else kputw(p[i], string);			\
 	    }								\
 	} else {\
-	    if (p[iallele] == is_vector_end || p[iallele] == is_missing) kputc('.', string); \
+	    if (iallele >= n || p[iallele] == is_vector_end || p[iallele] == is_missing) kputc('.', string); \
 	    else kputw(p[iallele], string);				\
 	}								\
 } while(0)
@@ -831,15 +1093,16 @@ void process_fmt_array(int iallele, kstring_t *string, int n, int type, void *da
 		  int i = 0;
 		  if (iallele == -1) {
 		      for (i=0; i<n; ++i) {
-			  if (p[i] == bcf_float_vector_end) break;
+			  if (bcf_float_is_vector_end(p[i])) break;
 			  if (i) kputc(',', string);
-			  if (p[i] == bcf_float_missing) kputc('.', string);
+			  if (bcf_float_is_missing(p[i])) kputc('.', string);
 			  else ksprintf(string, "%g", p[i]);
 		      }
 		  } else {
 		      //assert(iallele <= n);
-		      if (p[iallele] == bcf_float_vector_end || p[iallele] == bcf_float_missing) kputc('.', string);
-		      else ksprintf(string, "%g", p[i]);
+		      // fewer values than alleles, same as the binary output
+		      if (iallele >= n || bcf_float_is_vector_end(p[iallele]) || bcf_float_is_missing(p[iallele])) kputc('.', string);
+		      else ksprintf(string, "%g", p[iallele]);
 		  }
 	      } while(0);	      
 	      break;
@@ -853,7 +1116,7 @@ void process_fmt_array(int iallele, kstring_t *string, int n, int type, void *da
 void setter_info(bcf_hdr_t *hdr, bcf1_t *line, col_t *c, int ale, mval_t *val)
 {
     assert(c->id>0);
-    bcf_info_t *inf = bcf_get_info_id(line, c->id);
+    bcf_info_t *inf = (bcf_info_t*)val->field;
     if (inf == NULL) {
 	kputc('.', &val->a);
 	return;
@@ -912,7 +1175,7 @@ void setter_info(bcf_hdr_t *hdr, bcf1_t *line, col_t *c, int ale, mval_t *val)
 }
 void setter_format(bcf_hdr_t *hdr, bcf1_t *line, col_t *c, int ale, mval_t *val)
 {
-    bcf_fmt_t *fmt = bcf_get_fmt_id (line, c->id);
+    bcf_fmt_t *fmt = (bcf_fmt_t*)val->field;
     //debug_print("id: %d", c->id);
     if (fmt == NULL) {
 	kputc('.', &val->a);
@@ -932,6 +1195,102 @@ void setter_format(bcf_hdr_t *hdr, bcf1_t *line, col_t *c, int ale, mval_t *val)
     process_fmt_array(iallele, &val->a, fmt->n, fmt->type, fmt->p + val->sample_id*fmt->size);
 }
 
+// Convert a chunk of records into its own string, run in the worker threads.
+void *convert_batch(void *arg, int idx)
+{
+    struct tsv_batch *b = (struct tsv_batch*)arg;
+    struct anno_pool *pool = b->pool;
+    mcache_t *cache = ((mcache_t**)pool->arg)[idx];
+    int i;
+    if ( args.binary ) {
+        b->chunks = malloc(args.convert->l*sizeof(struct vcol_chunk));
+        for ( i = 0; i < args.convert->l; ++i )
+            vcol_chunk_init(&b->chunks[i], args.convert->cols[i]->bin_type);
+    }
+    for ( i = 0; i < pool->n_reader; ++i ) {
+        bcf1_t *line = pool->readers[i];
+        if ( line->rid == -1 )
+            continue;
+        if ( args.skip_ref == 1 && bcf_get_variant_types(line) == VCF_REF )
+            continue;
+        convert_line(args.hdr, line, cache, b);
+    }
+    if ( args.binary ) {
+        if ( b->n_rows )
+            vcol_group_write(&b->str, b->n_rows, b->chunks, args.convert->l);
+        for ( i = 0; i < args.convert->l; ++i )
+            vcol_chunk_destroy(&b->chunks[i]);
+        free(b->chunks);
+    }
+    if ( args.bgzf )
+        bgzf_blocks(&b->str);
+    return b;
+}
+
+// write converted chunks in the input order
+static void write_batch(struct tsv_batch *b)
+{
+    int i;
+    write_string(&b->str);
+    free(b->str.s);
+    for ( i = 0; i < b->pool->n_reader; ++i )
+        bcf_destroy(b->pool->readers[i]);
+    free(b->pool->readers);
+    free(b->pool);
+}
+
+static struct tsv_batch *read_batch()
+{
+    struct anno_pool *pool = anno_reader(args.fp_input, args.hdr, args.n_record);
+    if ( pool->n_reader == 0 ) {
+        free(pool->readers);
+        free(pool);
+        return NULL;
+    }
+    pool->arg = args.caches;
+    struct tsv_batch *b = malloc(sizeof(*b));
+    b->pool = pool;
+    b->str.l = b->str.m = 0;
+    b->str.s = NULL;
+    b->chunks = NULL;
+    b->n_rows = 0;
+    return b;
+}
+
+int convert_main()
+{
+    struct tsv_batch *b;
+    if ( args.n_thread == 1 ) {
+        while ( (b = read_batch()) ) {
+            write_batch(convert_batch(b, 0));
+            free(b);
+        }
+        return 0;
+    }
+
+    struct thread_pool *p = thread_pool_init(args.n_thread);
+    struct thread_pool_process *q = thread_pool_process_init(p, args.n_thread*2, 0);
+    struct thread_pool_result *r;
+    while ( (b = read_batch()) ) {
+        int block;
+        do {
+            block = thread_pool_dispatch2(p, q, convert_batch, b, 1);
+            if ( ( r = thread_pool_next_result(q) ) ) {
+                write_batch((struct tsv_batch*)r->data);
+                thread_pool_delete_result(r, 1);
+            }
+        } while ( block == -1 );
+    }
+    thread_pool_process_flush(q);
+    while ( (r = thread_pool_next_result(q)) ) {
+        write_batch((struct tsv_batch*)r->data);
+        thread_pool_delete_result(r, 1);
+    }
+    thread_pool_process_destroy(q);
+    thread_pool_destroy(p);
+    return 0;
+}
+
 int usage(void)
 {
     fprintf(stderr,"About : Convert BCF/VCF to tsv file by selecting tags.\n");
@@ -944,13 +1303,16 @@ int usage(void)
     fprintf(stderr,"\t-r, --skip-ref      Skip reference positions, when GT is \"0/0\"]`.\n");
     fprintf(stderr,"\t-u, --skip-uncover  Skip uncover positions.\n");
     fprintf(stderr,"\t-G, --no-GT         No check GT tag. For convert INFO only.\n");
+    fprintf(stderr,"\t-o, --output        Output file, default is stdout.\n");
+    fprintf(stderr,"\t-z, --bgzf          Compress output in BGZF format.\n");
+    fprintf(stderr,"\t-b, --binary        Columnar binary output, numbers are not converted to text. Read it by vcol.h or vcol_view.\n");
+    fprintf(stderr,"\t-t, --thread        Threads, records are converted in chunks in parallel.\n");
+    fprintf(stderr,"\t-n, --records       Records per thread chunk, default is %d.\n", RECORDS_PER_CHUNK);
     fprintf(stderr,"Website :\n");
     fprintf(stderr,"https://github.com/shiquan/vcfanno\n");
     return 1;
 }
 
-kstring_t *mempool = NULL;
-
 int run(int argc, char**argv)
 {
     struct option const long_opts[] = {
@@ -960,12 +1322,18 @@ int run(int argc, char**argv)
 	{"split", required_argument, NULL, 's'},
 	{"print-header", no_argument, NULL, 'p'},
         {"no-GT", no_argument, NULL, 'G'},
+        {"output", required_argument, NULL, 'o'},
+        {"bgzf", no_argument, NULL, 'z'},
+        {"binary", no_argument, NULL, 'b'},
+        {"thread", required_argument, NULL, 't'},
+        {"records", required_argument, NULL, 'n'},
 	{0, 0, 0, 0}
     };
 
     char c;
     char *format = NULL, *flag = NULL;
-    while ((c = getopt_long(argc, argv, "f:s:Gurph?", long_opts, NULL)) >= 0) {
+    const char *output = NULL;
+    while ((c = getopt_long(argc, argv, "f:s:o:t:n:bzGurph?", long_opts, NULL)) >= 0) {
 	switch (c) {
 	    case 'f':
 		format = strdup(optarg);
@@ -990,6 +1358,28 @@ int run(int argc, char**argv)
             case 'G':
                 args.no_gt = 1;
                 break;
+
+            case 'o':
+                output = optarg;
+                break;
+
+            case 'z':
+                args.bgzf = 1;
+                break;
+
+            case 'b':
+                args.binary = 1;
+                break;
+
+            case 't':
+                args.n_thread = atoi(optarg);
+                if ( args.n_thread < 1 ) args.n_thread = 1;
+                break;
+
+            case 'n':
+                args.n_record = atoi(optarg);
+                if ( args.n_record < 1 ) args.n_record = RECORDS_PER_CHUNK;
+                break;
                 
 	    case 'h':
 	    case '?':
@@ -1000,6 +1390,8 @@ int run(int argc, char**argv)
     }
     if (format == NULL)
 	error("-f is required by vcf2tsv.");
+    if (args.binary && args.bgzf)
+        error("-b and -z could not be used together.");
 
     char *input = NULL;
 
@@ -1012,49 +1404,63 @@ int run(int argc, char**argv)
 	input = argv[optind];
     }
 
-    bcf_srs_t *sr = bcf_sr_init();
-    sr->require_index = 0;
-    if (!bcf_sr_add_reader(sr, input))
-	error("Failed to open %s : %s\n", argv[optind], bcf_sr_strerror(sr->errnum));
+    args.fp_input = hts_open(input, "r");
+    if ( args.fp_input == NULL )
+	error("Failed to open %s : %s.", input, strerror(errno));
+    args.hdr = bcf_hdr_read(args.fp_input);
+    if ( args.hdr == NULL )
+        error("Failed to parse header of %s.", input);
 
-    bcf_hdr_t *header = sr->readers[0].header;
-    assert(header);
+    args.fp_out = output == NULL ? stdout : fopen(output, "w");
+    if ( args.fp_out == NULL )
+        error("%s : %s.", output, strerror(errno));
 
     if ( flag ) {
 	args.split_flag = init_split_flag(flag);
 	free(flag);
     }
-    int nsamples = 0;
-    args.convert = format_string_init(format, header, &nsamples);
+    int i, nsamples = 0;
+    args.convert = format_string_init(format, args.hdr, &nsamples);
     free(format);
 
-    args.mempool = (kstring_t*)malloc(sizeof(kstring_t));
-    args.mempool->m = args.mempool->l = 0;
-    args.mempool->s = 0;
-    args.cache = mcache_init(nsamples);
-    if ( args.print_header )
+    args.caches = malloc(args.n_thread*sizeof(mcache_t*));
+    for ( i = 0; i < args.n_thread; ++i )
+        args.caches[i] = mcache_init(nsamples);
+    
+    if ( args.binary ) {
+        kstring_t str = KSTRING_INIT;
+        char **names = malloc(args.convert->l*sizeof(char*));
+        int *types = malloc(args.convert->l*sizeof(int));
+        for ( i = 0; i < args.convert->l; ++i ) {
+            col_t *c = args.convert->cols[i];
+            c->bin_type = binary_type(args.hdr, c);
+            names[i] = c->key;
+            types[i] = c->bin_type;
+        }
+        vcol_header_write(&str, args.convert->l, names, types);
+        write_string(&str);
+        free(str.s);
+        free(names);
+        free(types);
+    }
+    else if ( args.print_header )
 	convert_header();
 
-    while ( bcf_sr_next_line(sr) ) {
-	bcf1_t *line = bcf_sr_get_line(sr, 0);
+    convert_main();
 
-        if (line->rid == -1)
-            continue;
-        //if ( args.no_gt == 1 ) {
-        //convert_line_no_gt(header, line);
-        //} else {
-        if ( args.skip_ref == 1 && bcf_get_variant_types(line) == VCF_REF )
-            continue;
-        convert_line(header, line);
-        //}
-	if ( args.mempool->l )
-            printf("%s",args.mempool->s);
-	args.mempool->l = 0;
+    if ( args.binary ) {
+        kstring_t str = KSTRING_INIT;
+        vcol_end_write(&str);
+        write_string(&str);
+        free(str.s);
     }
-    if ( args.mempool->l )
-        printf("%s",args.mempool->s);
+
+    if ( args.bgzf && fwrite(bgzf_eof, 1, sizeof(bgzf_eof), args.fp_out) != sizeof(bgzf_eof) )
+        error("Failed to write output : %s.", strerror(errno));
+    if ( output ) fclose(args.fp_out);
     release_args();
-    bcf_sr_destroy(sr);
+    bcf_hdr_destroy(args.hdr);
+    hts_close(args.fp_input);
     return 0;
 }
 
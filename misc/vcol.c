@@ -0,0 +1,305 @@
+// vcol.c - columnar binary output of vcf2tsv and its reader, see vcol.h for the layout
+#include <string.h>
+#include <errno.h>
+#include "utils.h"
+#include "vcol.h"
+#include "htslib/khash.h"
+
+KHASH_MAP_INIT_STR(vcol_dict, int)
+
+typedef kh_vcol_dict_t dict_t;
+
+static void put_bytes(kstring_t *s, const void *p, size_t l)
+{
+    if (l) kputsn((const char*)p, l, s);
+}
+static void put_u32(kstring_t *s, uint32_t v)
+{
+    put_bytes(s, &v, sizeof(v));
+}
+static void put_u64(kstring_t *s, uint64_t v)
+{
+    put_bytes(s, &v, sizeof(v));
+}
+
+void vcol_chunk_init(struct vcol_chunk *c, int type)
+{
+    memset(c, 0, sizeof(*c));
+    c->type = type;
+    c->last = -1;
+    if (type == BCF_HT_STR)
+        c->dict = kh_init(vcol_dict);
+}
+
+void vcol_chunk_destroy(struct vcol_chunk *c)
+{
+    if (c->dict) {
+        dict_t *d = (dict_t*)c->dict;
+        khiter_t k;
+        for (k = kh_begin(d); k != kh_end(d); ++k)
+            if (kh_exist(d, k)) free((char*)kh_key(d, k));
+        kh_destroy(vcol_dict, d);
+    }
+    free(c->data.s);
+    free(c->offs.s);
+    free(c->blob.s);
+}
+
+void vcol_push_int(struct vcol_chunk *c, int32_t v)
+{
+    put_bytes(&c->data, &v, sizeof(v));
+    c->n++;
+}
+
+void vcol_push_float(struct vcol_chunk *c, float v)
+{
+    put_bytes(&c->data, &v, sizeof(v));
+    c->n++;
+}
+
+void vcol_push_string(struct vcol_chunk *c, const char *s)
+{
+    dict_t *d = (dict_t*)c->dict;
+    if (s == NULL) s = "";
+    if (c->last >= 0 && strcmp(c->blob.s + ((uint32_t*)c->offs.s)[c->last], s) == 0) {
+        put_u32(&c->data, c->last);
+        c->n++;
+        return;
+    }
+    khiter_t k = kh_get(vcol_dict, d, s);
+    int idx;
+    if (k == kh_end(d)) {
+        int ret;
+        idx = c->n_dict++;
+        k = kh_put(vcol_dict, d, strdup(s), &ret);
+        kh_val(d, k) = idx;
+        put_u32(&c->offs, c->blob.l);
+        // keep the NUL, so readers could use strings in the blob directly
+        put_bytes(&c->blob, s, strlen(s)+1);
+    }
+    else {
+        idx = kh_val(d, k);
+    }
+    c->last = idx;
+    put_u32(&c->data, idx);
+    c->n++;
+}
+
+void vcol_header_write(kstring_t *out, int n_cols, char **names, int *types)
+{
+    int i;
+    put_bytes(out, VCOL_MAGIC, 8);
+    put_u32(out, VCOL_BOM);
+    put_u32(out, n_cols);
+    for (i = 0; i < n_cols; ++i) {
+        int l = strlen(names[i]);
+        put_u32(out, types[i]);
+        put_u32(out, l);
+        put_bytes(out, names[i], l);
+    }
+}
+
+void vcol_group_write(kstring_t *out, int n_rows, struct vcol_chunk *chunks, int n_cols)
+{
+    int i;
+    put_u32(out, n_rows);
+    for (i = 0; i < n_cols; ++i) {
+        struct vcol_chunk *c = &chunks[i];
+        assert(c->n == n_rows);
+        if (c->type == BCF_HT_STR) {
+            // pad the blob, so the indexes after it are aligned
+            int pad = (4 - c->blob.l % 4) % 4;
+            put_u64(out, 8 + c->offs.l + c->blob.l + pad + c->data.l);
+            put_u32(out, c->n_dict);
+            put_u32(out, c->blob.l + pad);
+            put_bytes(out, c->offs.s, c->offs.l);
+            put_bytes(out, c->blob.s, c->blob.l);
+            for (; pad > 0; --pad) kputc('\0', out);
+        }
+        else {
+            put_u64(out, c->data.l);
+        }
+        put_bytes(out, c->data.s, c->data.l);
+    }
+}
+
+void vcol_end_write(kstring_t *out)
+{
+    put_u32(out, 0);
+}
+
+static int read_u32(FILE *fp, uint32_t *v)
+{
+    return fread(v, sizeof(*v), 1, fp) == 1 ? 0 : -1;
+}
+
+struct vcol_file *vcol_open(const char *fname)
+{
+    FILE *fp = strcmp(fname, "-") == 0 ? stdin : fopen(fname, "rb");
+    if (fp == NULL) {
+        warnings("%s : %s.", fname, strerror(errno));
+        return NULL;
+    }
+    char magic[8];
+    uint32_t bom, n;
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, VCOL_MAGIC, 8) || read_u32(fp, &bom) || read_u32(fp, &n)) {
+        warnings("%s is not a vcol file.", fname);
+        if (fp != stdin) fclose(fp);
+        return NULL;
+    }
+    if (bom != VCOL_BOM) {
+        warnings("%s was written in another byte order.", fname);
+        if (fp != stdin) fclose(fp);
+        return NULL;
+    }
+    struct vcol_file *f = malloc(sizeof(*f));
+    memset(f, 0, sizeof(*f));
+    f->fp = fp;
+    f->n_cols = n;
+    f->names = calloc(n, sizeof(char*));
+    f->types = calloc(n, sizeof(int));
+    f->cols = calloc(n, sizeof(struct vcol_column));
+    int i;
+    for (i = 0; i < f->n_cols; ++i) {
+        uint32_t type, l;
+        if (read_u32(fp, &type) || read_u32(fp, &l)) break;
+        f->types[i] = type;
+        f->names[i] = malloc(l+1);
+        if (fread(f->names[i], 1, l, fp) != l) break;
+        f->names[i][l] = '\0';
+    }
+    if (i < f->n_cols) {
+        warnings("Truncated header of %s.", fname);
+        vcol_close(f);
+        return NULL;
+    }
+    return f;
+}
+
+int vcol_next_group(struct vcol_file *f)
+{
+    uint32_t n_rows;
+    if (read_u32(f->fp, &n_rows)) {
+        warnings("Truncated file, no end of row groups.");
+        return -1;
+    }
+    f->n_rows = n_rows;
+    if (n_rows == 0) return 0;
+
+    int i;
+    for (i = 0; i < f->n_cols; ++i) {
+        struct vcol_column *c = &f->cols[i];
+        uint64_t size;
+        if (fread(&size, sizeof(size), 1, f->fp) != 1) goto truncated;
+        if (size > c->m) {
+            c->m = size;
+            c->buf = realloc(c->buf, c->m);
+        }
+        if (fread(c->buf, 1, size, f->fp) != size) goto truncated;
+        if (f->types[i] == BCF_HT_STR) {
+            if (size < 8) goto corrupted;
+            uint32_t *u = (uint32_t*)c->buf;
+            c->n_dict = u[0];
+            if (size != 8 + 4*(uint64_t)c->n_dict + u[1] + 4*(uint64_t)n_rows) goto corrupted;
+            c->offs = u + 2;
+            c->blob = c->buf + 8 + 4*c->n_dict;
+            c->values = c->blob + u[1];
+        }
+        else {
+            if (size != 4*(uint64_t)n_rows) goto corrupted;
+            c->values = c->buf;
+        }
+    }
+    return n_rows;
+
+  truncated:
+    warnings("Truncated row group.");
+    return -1;
+  corrupted:
+    warnings("Corrupted column %s.", f->names[i]);
+    return -1;
+}
+
+const int32_t *vcol_int(struct vcol_file *f, int col)
+{
+    return f->types[col] == BCF_HT_INT ? (const int32_t*)f->cols[col].values : NULL;
+}
+
+const float *vcol_float(struct vcol_file *f, int col)
+{
+    return f->types[col] == BCF_HT_REAL ? (const float*)f->cols[col].values : NULL;
+}
+
+const char *vcol_string(struct vcol_file *f, int col, int row)
+{
+    struct vcol_column *c = &f->cols[col];
+    if (f->types[col] != BCF_HT_STR) return NULL;
+    uint32_t idx = ((uint32_t*)c->values)[row];
+    if (idx >= c->n_dict) return NULL;
+    return c->blob + c->offs[idx];
+}
+
+void vcol_close(struct vcol_file *f)
+{
+    int i;
+    for (i = 0; i < f->n_cols; ++i) {
+        free(f->names[i]);
+        free(f->cols[i].buf);
+    }
+    free(f->names);
+    free(f->types);
+    free(f->cols);
+    if (f->fp != stdin) fclose(f->fp);
+    free(f);
+}
+
+#ifdef VCOL_MAIN
+// print a vcol file as vcf2tsv text
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: vcol_view in.vcol\n");
+        return 1;
+    }
+    struct vcol_file *f = vcol_open(argv[1]);
+    if (f == NULL) return 1;
+
+    kstring_t str = { 0, 0, 0};
+    int i, j, n;
+    for (j = 0; j < f->n_cols; ++j) {
+        kputc(j ? '\t' : '#', &str);
+        kputs(f->names[j], &str);
+    }
+    kputc('\n', &str);
+    fputs(str.s, stdout);
+
+    while ((n = vcol_next_group(f)) > 0) {
+        for (i = 0; i < n; ++i) {
+            str.l = 0;
+            for (j = 0; j < f->n_cols; ++j) {
+                if (j) kputc('\t', &str);
+                if (f->types[j] == BCF_HT_INT) {
+                    int32_t v = vcol_int(f, j)[i];
+                    if (v == bcf_int32_missing) kputc('.', &str);
+                    else kputw(v, &str);
+                }
+                else if (f->types[j] == BCF_HT_REAL) {
+                    float v = vcol_float(f, j)[i];
+                    if (bcf_float_is_missing(v)) kputc('.', &str);
+                    else ksprintf(&str, "%g", v);
+                }
+                else {
+                    const char *s = vcol_string(f, j, i);
+                    if (s == NULL) error("Corrupted string index.");
+                    kputs(s, &str);
+                }
+            }
+            kputc('\n', &str);
+            fwrite(str.s, 1, str.l, stdout);
+        }
+    }
+    free(str.s);
+    vcol_close(f);
+    return n < 0;
+}
+#endif
@@ -0,0 +1,81 @@
+// vcol.h - columnar binary output of vcf2tsv and its reader
+//
+// File layout, integers are in host byte order and checked by the byte order mark.
+//
+//   magic "VCOL\1\0\0\0", uint32 byte order mark 0x01020304
+//   uint32 n_cols, then for each column: uint32 type, uint32 l_name, name
+//   row groups, each one is :
+//     uint32 n_rows, 0 for the end of file
+//     for each column: uint64 size of the column chunk, then the chunk :
+//       BCF_HT_INT  : int32[n_rows], missing is bcf_int32_missing
+//       BCF_HT_REAL : float[n_rows], missing is bcf_float_missing
+//       BCF_HT_STR  : uint32 n_dict, uint32 l_blob, uint32 offset[n_dict],
+//                     blob of NUL terminated strings padded to 4 bytes,
+//                     uint32 index[n_rows] into the dictionary
+//
+#ifndef VCOL_HEADER
+#define VCOL_HEADER
+#include <stdio.h>
+#include <stdint.h>
+#include "htslib/kstring.h"
+#include "htslib/vcf.h"
+
+#define VCOL_MAGIC "VCOL\1\0\0\0"
+#define VCOL_BOM   0x01020304
+
+// values of one column in a row group
+struct vcol_chunk {
+    int type; // BCF_HT_INT, BCF_HT_REAL or BCF_HT_STR
+    int n;
+    // values, or indexes of strings in the dictionary
+    kstring_t data;
+    // dictionary
+    void *dict;
+    int n_dict;
+    kstring_t offs;
+    kstring_t blob;
+    // index of last string, values of shared columns repeat for each sample
+    int last;
+};
+
+extern void vcol_chunk_init(struct vcol_chunk *c, int type);
+extern void vcol_chunk_destroy(struct vcol_chunk *c);
+extern void vcol_push_int(struct vcol_chunk *c, int32_t v);
+extern void vcol_push_float(struct vcol_chunk *c, float v);
+extern void vcol_push_string(struct vcol_chunk *c, const char *s);
+
+extern void vcol_header_write(kstring_t *out, int n_cols, char **names, int *types);
+// serialize a row group, every chunk should have n_rows values
+extern void vcol_group_write(kstring_t *out, int n_rows, struct vcol_chunk *chunks, int n_cols);
+extern void vcol_end_write(kstring_t *out);
+
+// column of current row group in reader
+struct vcol_column {
+    size_t m;
+    char *buf;
+    int n_dict;
+    uint32_t *offs;
+    char *blob;
+    // int32, float, or indexes of strings
+    void *values;
+};
+
+struct vcol_file {
+    FILE *fp;
+    int n_cols;
+    char **names;
+    int *types;
+    // rows in current group
+    int n_rows;
+    struct vcol_column *cols;
+};
+
+extern struct vcol_file *vcol_open(const char *fname);
+// load next row group, return rows of it, 0 for the end of file and -1 on error
+extern int vcol_next_group(struct vcol_file *f);
+extern const int32_t *vcol_int(struct vcol_file *f, int col);
+extern const float *vcol_float(struct vcol_file *f, int col);
+extern const char *vcol_string(struct vcol_file *f, int col, int row);
+extern void vcol_close(struct vcol_file *f);
+
+#endif
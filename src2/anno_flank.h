@@ -2,11 +2,39 @@
 #define SEQIDX_H
 
 #include "utils.h"
-#include "htslib/faidx.h"
+#include "htslib/vcf.h"
+#include "anno_pool.h"
+#include "ref_store.h"
 
 struct seqidx {
     const char *file;
-    faidx_t *idx;
+    // 2-bit reference genome shared by all threads
+    struct ref_store *store;
+    // reference window of current chunk, bases of [win_start, win_start+win.l) on contig win_name
+    kstring_t win_name;
+    int win_start;
+    kstring_t win;
+    // extra bases around records kept in the chunk window, for annotators need more than the flank sequence
+    int margin;
 };
 
+// Append bases of 0-based [start, end] on contig to str, clipped to the contig. Return the number of bases
+// appended, or -1 if contig not found.
+extern int seqidx_fetch(struct seqidx *idx, const char *name, int start, int end, kstring_t *str);
+
+// Fetch reference window of 0-based [start, end] on contig, clipped to the contig. Return 0 on success.
+extern int seqidx_window_fetch(struct seqidx *idx, const char *name, int start, int end);
+// Return bases of 0-based [start, end] in the window, NULL if not covered by the window.
+extern const char *seqidx_window_seq(struct seqidx *idx, const char *name, int start, int end);
+
+// Fetch reference window covering all records of current chunk and their flank sequences, the window is kept
+// in the index for annotators of this chunk. Return 1 if chunk is too sparse or contig not found.
+extern int seqidx_chunk_window(struct seqidx *idx, bcf_hdr_t *hdr, struct anno_pool *pool);
+// Keep at least margin bases around records in the chunk window.
+extern void seqidx_set_margin(struct seqidx *idx, int margin);
+
+extern int bcf_add_flankseq(struct seqidx *idx, bcf_hdr_t *hdr, bcf1_t *line);
+// Add FLKSEQ for records of current chunk, slice from one reference window.
+extern int bcf_add_flankseq_chunk(struct seqidx *idx, bcf_hdr_t *hdr, struct anno_pool *pool);
+
 #endif 
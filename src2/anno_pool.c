@@ -44,8 +44,10 @@ struct anno_pool *anno_reader(htsFile *fp, bcf_hdr_t *hdr, int n_record) {
     
     for ( ;; ) {
         p->readers[p->n_reader] = bcf_init();
-        if ( bcf_read(fp, hdr, p->readers[p->n_reader]) )
+        if ( bcf_read(fp, hdr, p->readers[p->n_reader]) ) {
+            bcf_destroy(p->readers[p->n_reader]);
             break;
+        }
         p->n_reader++;
         if ( p->n_reader == p->m )
             break;        
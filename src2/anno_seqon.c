@@ -1,9 +1,11 @@
 // anno_seqon.c -- Sequence Ontology and Human Genome Variantion Society nomenclature annotation
+#include <limits.h>
 #include "anno_seqon.h"
 #include "name_list.h"
 #include "gea.h"
 #include "sort_list.h"
 #include "stack_lite.h"
+#include "htslib/khash.h"
 
 static char *safe_duplicate_string(char *str)
 {
@@ -12,6 +14,12 @@ static char *safe_duplicate_string(char *str)
 }
 
 #define MAX_GAP_GENE_DISTANCE 10000
+// block size of per worker arena, enough for most records without a new block
+#define MC_ARENA_BLOCK (1<<16)
+
+// Parsed records are cached across chunks, keyed by the virtual file offset of the record. So records
+// overlapped with several chunks, like long genes, will be parsed and unpacked only once per run.
+KHASH_MAP_INIT_INT64(gea_cache, struct gea_record*)
 
 // molecular consequence
 struct MolecularConsequenceTerms {
@@ -92,15 +100,19 @@ struct {
 
 int file_is_GEA(const char *fn)
 {
+    if ( bea_check_format(fn) == 0 ) return 0;
     return gea_check_format(fn);
 }
 
 extern struct mc_handler *mc_handler_init(const char *rna_fname, const char *data_fname, const char *reference_fname, const char *name_list);
 extern struct mc_handler *mc_handler_duplicate(struct mc_handler *h);
 extern void mc_handler_destroy(struct mc_handler *h, int l);
+extern int mc_handler_load_memory(struct mc_handler *h);
+extern int mc_handler_load_rna_memory(struct mc_handler *h);
+
+static void mc_cache_evict(struct mc_handler *h, int rid, int pos);
 
-extern struct mc *mc_init(const char *chrom, int start, int end, char *ref, char *alt);
-extern int mc_destroy(struct mc *h);
+extern struct mc *mc_init(struct arena *a, const char *chrom, int start, int end, char *ref, char *alt);
 extern int mc_anno_trans(struct mc *n, struct mc_handler *h);
 extern int mc_handler_fill_buffer_chunk(struct mc_handler *h, char* name, int start, int end);
 extern int mc_anno_trans_chunk(struct mc *n, struct mc_handler *h);
@@ -115,6 +127,22 @@ struct mc_handler *mc_handler_init(const char *rna_fname, const char *data_fname
     h->rna_fai = fai_load(rna_fname);
     
     if ( h->rna_fai == NULL ) error("Failed to load index of %s : %s.", rna_fname, strerror(errno));
+
+    if ( bea_check_format(data_fname) == 0 ) {
+        h->fp_idx = bea_open(data_fname, "r");
+        if ( h->fp_idx == NULL ) error("%s : %s.", data_fname, strerror(errno));
+
+        h->csi = hts_idx_load(data_fname, HTS_FMT_CSI);
+        if ( h->csi == NULL ) error("Failed to load index of %s : %s.", data_fname, strerror(errno));
+
+        h->hdr = bea_hdr_read(h->fp_idx);
+        if ( h->hdr == NULL ) error("Failed to read header of %s.", data_fname);
+
+        if ( name_list ) h->name_hash = name_hash_init(name_list);
+        h->bounds = gea_bounds_init(h->hdr);
+        return h;
+    }
+    
     if ( gea_check_format(data_fname) ) error("Unsupported data format. Please try GenomeElementAnnotation format. %s.", data_fname);
     
     h->fp_idx = hts_open(data_fname, "r");
@@ -127,10 +155,43 @@ struct mc_handler *mc_handler_init(const char *rna_fname, const char *data_fname
     if ( h->hdr == NULL ) error("Failed to read header of %s.", data_fname);
     
     if ( name_list ) h->name_hash = name_hash_init(name_list);
-    
+
+    h->bounds = gea_bounds_init(h->hdr);
     return h;
 }
 
+// Read whole database into memory and release the file handlers.
+int mc_handler_load_memory(struct mc_handler *h)
+{
+    if ( h->gidx ) return 0;
+    h->gidx = gea_index_load(h->data_fname, h->hdr);
+    if ( h->gidx == NULL ) {
+        error_print("Failed to load %s into memory.", h->data_fname);
+        return 1;
+    }
+    if ( h->csi ) hts_idx_destroy(h->csi);
+    else tbx_destroy(h->idx);
+    hts_close(h->fp_idx);
+    h->csi = NULL;
+    h->idx = NULL;
+    h->fp_idx = NULL;
+    return 0;
+}
+
+// Pack transcript sequences into memory and release the fasta handler.
+int mc_handler_load_rna_memory(struct mc_handler *h)
+{
+    if ( h->rna_store ) return 0;
+    h->rna_store = rna_store_load(h->rna_fname);
+    if ( h->rna_store == NULL ) {
+        error_print("Failed to load %s into memory.", h->rna_fname);
+        return 1;
+    }
+    fai_destroy(h->rna_fai);
+    h->rna_fai = NULL;
+    return 0;
+}
+
 struct mc_handler *mc_handler_duplicate(struct mc_handler *h)
 {
     struct mc_handler *d = malloc(sizeof(*d));
@@ -139,23 +200,51 @@ struct mc_handler *mc_handler_duplicate(struct mc_handler *h)
     d->data_fname = h->data_fname;
     d->reference_fname = h->reference_fname;
     
-    d->rna_fai = fai_load(d->rna_fname);
-    d->idx = tbx_index_load(d->data_fname);
-    d->fp_idx = hts_open(d->data_fname, "r");
+    if ( h->rna_store ) d->rna_store = h->rna_store;
+    else d->rna_fai = fai_load(d->rna_fname);
+    if ( h->gidx ) {
+        // in-memory database is read only, share it
+        d->gidx = h->gidx;
+    }
+    else if ( h->csi ) {
+        d->csi = hts_idx_load(d->data_fname, HTS_FMT_CSI);
+        d->fp_idx = bea_open(d->data_fname, "r");
+    }
+    else {
+        d->idx = tbx_index_load(d->data_fname);
+        d->fp_idx = hts_open(d->data_fname, "r");
+    }
 
     d->hdr = h->hdr;
     d->name_hash = h->name_hash;    
+    d->bounds = h->bounds;
     return d;
 }
 void mc_handler_destroy(struct mc_handler *h, int l)
 {
-    fai_destroy(h->rna_fai);
-    tbx_destroy(h->idx);
-    hts_close(h->fp_idx);
-    if (l==0) gea_hdr_destroy(h->hdr);
-    int i;
-    for ( i = 0; i < h->n_record; ++i ) gea_destroy((struct gea_record*)h->records[i]);
-    if ( h->n_record) free(h->records);
+    if ( h->rna_store ) {
+        if ( l == 0 ) rna_store_destroy(h->rna_store);
+    }
+    else fai_destroy(h->rna_fai);
+    free(h->rna_buf.s);
+    free(h->aa_buf[0]);
+    free(h->aa_buf[1]);
+    if ( h->gidx ) {
+        if ( l == 0 ) gea_index_destroy(h->gidx);
+    }
+    else {
+        if ( h->csi ) hts_idx_destroy(h->csi);
+        else tbx_destroy(h->idx);
+        hts_close(h->fp_idx);
+    }
+    if (l==0) {
+        gea_hdr_destroy(h->hdr);
+        gea_bounds_destroy(h->bounds);
+    }
+    mc_cache_evict(h, -1, 0);
+    if ( h->cache_hash ) kh_destroy(gea_cache, (khash_t(gea_cache)*)h->cache_hash);
+    free(h->cache);
+    free(h->records);
     free(h);
 }
 
@@ -167,13 +256,13 @@ static int check_mitochondrial_chrom(const char *chrom)
     return strcmp(chrom, mito) == 0;
 }
 /*
-  Init variant.
+  Init variant, the variant is allocated from arena and released by arena_reset().
 */
-struct mc *mc_init(const char *chrom, int start, int end, char *ref, char *alt)
+struct mc *mc_init(struct arena *a, const char *chrom, int start, int end, char *ref, char *alt)
 {
-    struct mc *h = malloc(sizeof(*h));
-    memset(h, 0, sizeof(*h));
+    struct mc *h = arena_calloc(a, sizeof(*h));
    
+    h->arena = a;
     h->chr = chrom;
     h->start = start;
     h->end   = end;
@@ -191,25 +280,21 @@ struct mc *mc_init(const char *chrom, int start, int end, char *ref, char *alt)
 
         for ( ;; ) {
             if ( ref == NULL || alt == NULL ) break;
+            // check length first, do not step over the allele
+            if ( lr == 0 || la == 0 ) break;
             if (*ref == *alt) {
                 ref++; alt++; lr--; la--;
                 h->start++;
             }
-            else if ( *(ref+lr-1) == *(alt+la-1) && lr > 0 && la > 0) {
+            else if ( *(ref+lr-1) == *(alt+la-1) ) {
                 lr--, la--;
                 h->end--;
             }
             else break;
         }
 
-        if ( lr > 0) {
-            h->ref = safe_duplicate_string(ref);
-            h->ref[lr] = '\0';
-        }
-        if ( la > 0 ) {
-            h->alt = safe_duplicate_string(alt);
-            h->alt[la] = '\0';
-        }
+        if ( lr > 0) h->ref = arena_strndup(a, ref, lr);
+        if ( la > 0 ) h->alt = arena_strndup(a, alt, la);
         if ( la == 0 ) {
             if ( lr == 0 ) h->type = var_type_ref;
             else h->type = var_type_del;
@@ -222,18 +307,13 @@ struct mc *mc_init(const char *chrom, int start, int end, char *ref, char *alt)
     }
     else if ( ref == NULL ) {
         h->type = var_type_ins;
-        h->alt = safe_duplicate_string(alt);
+        h->alt = arena_strdup(a, alt);
     }
     else if ( alt == NULL ) {
         h->type = var_type_del;
-        h->ref = safe_duplicate_string(ref);
-    }
-    if (*alt == 'N') {
-        if ( h->ref ) free(h->ref);
-        if ( h->alt ) free(h->alt);
-        free(h);
-        return NULL;
+        h->ref = arena_strdup(a, ref);
     }
+    if (*alt == 'N') return NULL;
     // for insert, end smaller than start.
     if ( lr == 0 && h->end < h->start ) {
         h->end = h->start;
@@ -246,36 +326,61 @@ struct mc *mc_init(const char *chrom, int start, int end, char *ref, char *alt)
     return h;
 }
 
-int mc_destroy(struct mc *h)
+struct gea_cache_node {
+    uint64_t offset;
+    struct gea_record *v;
+};
+
+static struct gea_record *mc_cache_get(struct mc_handler *h, uint64_t offset)
 {
-    if ( h == NULL ) return 0;
-    if ( h->ref ) free(h->ref);
-    if ( h->alt ) free(h->alt);
-    int i;
-    for ( i = 0; i < h->n_tran; ++i) {
-        struct mc_inf *inf = &h->trans[i].inf;
-        struct mc_type *type = &h->trans[i].type;
-        if ( inf->transcript ) free(inf->transcript);
-        if ( inf->gene ) free(inf->gene);
-        if ( inf->ref ) free(inf->ref);
-        if ( inf->alt ) free(inf->alt);
-        if ( type->aminos ) free(type->aminos);        
+    if ( h->cache_hash == NULL ) return NULL;
+    khash_t(gea_cache) *hash = (khash_t(gea_cache)*)h->cache_hash;
+    khint_t k = kh_get(gea_cache, hash, offset);
+    return k == kh_end(hash) ? NULL : kh_val(hash, k);
+}
+
+static void mc_cache_put(struct mc_handler *h, uint64_t offset, struct gea_record *v)
+{
+    if ( h->cache_hash == NULL ) h->cache_hash = kh_init(gea_cache);
+    khash_t(gea_cache) *hash = (khash_t(gea_cache)*)h->cache_hash;
+    int ret;
+    khint_t k = kh_put(gea_cache, hash, offset, &ret);
+    kh_val(hash, k) = v;
+    if ( h->n_cache == h->m_cache ) {
+        h->m_cache = h->m_cache == 0 ? 64 : h->m_cache<<1;
+        h->cache = realloc(h->cache, h->m_cache*sizeof(struct gea_cache_node));
     }
-    free(h->trans);
-    free(h);
+    struct gea_cache_node *node = &((struct gea_cache_node*)h->cache)[h->n_cache++];
+    node->offset = offset;
+    node->v = v;
+}
 
-    return 0;
+// Evict the records end before the sweep position or located on other chromosomes. Set rid to -1 to clean all.
+static void mc_cache_evict(struct mc_handler *h, int rid, int pos)
+{
+    if ( h->n_cache == 0 ) return;
+    khash_t(gea_cache) *hash = (khash_t(gea_cache)*)h->cache_hash;
+    struct gea_cache_node *cache = (struct gea_cache_node*)h->cache;
+    int i, j;
+    for ( i = 0, j = 0; i < h->n_cache; ++i ) {
+        if ( cache[i].v->rid == rid && cache[i].v->chromEnd >= pos ) {
+            if ( i != j ) cache[j] = cache[i];
+            j++;
+            continue;
+        }
+        khint_t k = kh_get(gea_cache, hash, cache[i].offset);
+        if ( k != kh_end(hash) ) kh_del(gea_cache, hash, k);
+        gea_destroy(cache[i].v);
+    }
+    h->n_cache = j;
 }
 
 static void clean_buffer_chunk(struct mc_handler *h)
 {
-    int i;
-    for ( i = 0; i < h->n_record; ++i ) gea_destroy((struct gea_record*)h->records[i]);
+    // records are owned by cache, do NOT free them here
     h->n_record = 0;
     h->i_record = 0;
     h->end_pos_for_skip = 0;
-    h->last_gene = NULL;
-    h->next_gene = NULL;
 }
 
 struct list_buffer {
@@ -288,51 +393,136 @@ struct list_buffer *list_buffer_create()
     return l;
 }
 
+// 1 if record is not in the transcripts/genes list
+static int mc_record_is_filtered(struct mc_handler *h, struct gea_record *v)
+{
+    if ( h->name_hash == NULL ) return 0;
+    // the list names transcripts, gene records are always kept
+    if ( gea_is_transcript(h->hdr, v) && !name_hash_key_exists(h->name_hash, v->name) ) return 1;
+    return 0;
+}
+
+// Load gene bounds of contig rid on first use. Bounds are shared by duplicated handlers, each thread reads the
+// contig with its own file handler.
+static void mc_bounds_load(struct mc_handler *h, int rid, const char *name)
+{
+    struct gea_bounds *b = h->bounds;
+    if ( rid < 0 || rid >= b->n_ctg ) return;
+    pthread_mutex_lock(&b->lock);
+    if ( gea_bounds_loaded(b, rid) ) {
+        pthread_mutex_unlock(&b->lock);
+        return;
+    }
+    if ( h->gidx ) {
+        int i;
+        for ( i = h->gidx->ctg_first[rid]; i < h->gidx->ctg_first[rid+1]; ++i ) {
+            struct gea_record *v = &h->gidx->records[i];
+            if ( mc_record_is_filtered(h, v) ) continue;
+            gea_bounds_push(b, h->hdr, rid, v);
+        }
+    }
+    else {
+        int id = h->idx ? tbx_name2id(h->idx, name) : rid;
+        hts_itr_t *itr = NULL;
+        if ( id >= 0 ) {
+            if ( h->csi ) itr = hts_itr_query(h->csi, id, 0, INT_MAX, bea_readrec);
+            else itr = tbx_itr_queryi(h->idx, id, 0, INT_MAX);
+        }
+        kstring_t string = {0,0,0};
+        struct gea_record *v = gea_init();
+        while ( itr ) {
+            if ( h->csi ) {
+                if ( hts_itr_next(h->fp_idx->fp.bgzf, itr, v, h->hdr) < 0 ) break;
+            }
+            else {
+                if ( tbx_itr_next(h->fp_idx, h->idx, itr, &string) < 0 ) break;
+                if ( gea_parse(&string, h->hdr, v) ) continue;
+            }
+            if ( mc_record_is_filtered(h, v) ) continue;
+            gea_bounds_push(b, h->hdr, rid, v);
+        }
+        gea_destroy(v);
+        free(string.s);
+        hts_itr_destroy(itr);
+    }
+    gea_bounds_finish(b, rid);
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void list_buffer_push(struct list_buffer **header, struct list_buffer **tail, struct gea_record *v)
+{
+    struct list_buffer *b = list_buffer_create();
+    b->data = v;
+    if ( *header == NULL ) *header = b;
+    if ( *tail == NULL ) *tail = *header;
+    else {
+        (*tail)->next = b;  *tail = b;
+    }
+}
+
 // return length of list
 static int retrieve_gea_records_from_region(struct mc_handler *h, int id, int start, int end, struct list_buffer **header, struct list_buffer **tail, int *tail_edge)
 {
-    // retrieve annotation records from database
-    hts_itr_t *itr = tbx_itr_queryi(h->idx, id, start, end+1);
-    kstring_t string = {0,0,0};
     int l = 0;
     *tail_edge = 0;
+
+    if ( h->gidx ) {
+        int i, lo, hi;
+        gea_index_query(h->gidx, id, start, end+1, &lo, &hi);
+        for ( i = lo; i < hi; ++i ) {
+            if ( h->gidx->chromEnd[i] <= start ) continue;
+            struct gea_record *v = &h->gidx->records[i];
+            if ( mc_record_is_filtered(h, v) ) continue;
+            if ( v->chromEnd > *tail_edge ) *tail_edge = v->chromEnd;
+            list_buffer_push(header, tail, v);
+            l++;
+        }
+        return l;
+    }
     
-    while ( tbx_itr_next(h->fp_idx, h->idx, itr, &string) >= 0 ) {
-        struct gea_record *r = gea_init();
-        if ( gea_parse(&string, h->hdr, r) ) continue;
-        const char *type = h->hdr->id[GEA_DT_BIOTYPE][r->biotype].key;
-        if ( h->name_hash) {
-            if (strcmp(type, "mRNA") == 0 || strcmp(type, "ncRNA") == 0 ) {
-                if (!name_hash_key_exists(h->name_hash, r->name)) continue;
-            }
-            else if ( strcmp(type, "gene") == 0 ) {
-                if (!name_hash_key_exists(h->name_hash, r->geneName)) continue;
+    // retrieve annotation records from database
+    hts_itr_t *itr;
+    if ( h->csi ) itr = hts_itr_query(h->csi, id, start, end+1, bea_readrec_raw);
+    else itr = tbx_itr_queryi(h->idx, id, start, end+1);
+    kstring_t string = {0,0,0};
+
+    // r is the buffer to read new record, after moved into the cache, allocate a new one
+    struct gea_record *r = NULL;
+    for ( ;; ) {
+        struct gea_record *v;
+        if ( r == NULL ) r = gea_init();
+        if ( h->csi ) {
+            // binary records are only decoded when not cached
+            if ( hts_itr_next(h->fp_idx->fp.bgzf, itr, &string, h->hdr) < 0 ) break;
+            v = mc_cache_get(h, itr->curr_off);
+            if ( v == NULL ) {
+                if ( bea_decode(h->hdr, &string, r) ) break;
+                v = r; r = NULL;
+                mc_cache_put(h, itr->curr_off, v);
             }
         }
-              
-        gea_unpack(h->hdr, r, GEA_UN_TRANS|GEA_UN_CIGAR);
-        if ( r->chromEnd > *tail_edge ) *tail_edge = r->chromEnd;
-        struct list_buffer *b = list_buffer_create();
-        b->data = r;
-        
-        if ( *header == NULL ) *header = b;
-        if ( *tail == NULL ) *tail = *header;
         else {
-            (*tail)->next = b;  *tail = b;
+            if ( tbx_itr_next(h->fp_idx, h->idx, itr, &string) < 0 ) break;
+            v = mc_cache_get(h, itr->curr_off);
+            if ( v == NULL ) {
+                if ( gea_parse(&string, h->hdr, r) ) continue;
+                gea_unpack(h->hdr, r, GEA_UN_TRANS|GEA_UN_CIGAR);
+                v = r; r = NULL;
+                mc_cache_put(h, itr->curr_off, v);
+            }
         }
+        if ( mc_record_is_filtered(h, v) ) continue;
+
+        if ( v->chromEnd > *tail_edge ) *tail_edge = v->chromEnd;
+        list_buffer_push(header, tail, v);
         l++;
     }
+    if ( r ) gea_destroy(r);
     free(string.s);
     tbx_itr_destroy(itr);
     
     return l;
 }
-static int is_gene(const struct gea_hdr *h, struct gea_record *v)
-{
-    char *bt = (char*)h->id[GEA_DT_BIOTYPE][v->biotype].key;
-    if ( strcmp(bt, "Gene") == 0 || strcmp(bt, "mRNA") == 0 || strcmp(bt, "ncRNA") == 0 ) return 1;
-    return 0;
-}
 // Update buffer for each chunk.
 int mc_handler_fill_buffer_chunk(struct mc_handler *h, char* name, int start, int end)
 {
@@ -343,8 +533,12 @@ int mc_handler_fill_buffer_chunk(struct mc_handler *h, char* name, int start, in
 
     //debug_print("%s:%d-%d", name, start, end);
     
-    int id;
-    id = tbx_name2id(h->idx, name);
+    // contig id of records, same as id of tabix index for BEA and in-memory database
+    int rid = gea_hdr_id2int(h->hdr, GEA_DT_CTG, name);
+    int id = h->idx ? tbx_name2id(h->idx, name) : rid;
+
+    // records end before this chunk will not be used any more
+    mc_cache_evict(h, rid, start);
     if ( id == -1 ) return 0;
     
     int l;
@@ -353,68 +547,9 @@ int mc_handler_fill_buffer_chunk(struct mc_handler *h, char* name, int start, in
     l = retrieve_gea_records_from_region(h, id, start, end, &header, &tail, &tail_edge);
 
     // 2018-08-10, update filter name list    
-    
-    // if retrieved buffer did NOT cover the chunk, trying to find more upstream records, used to
-    // annotate intergenic variants
-    if ( header == NULL || header->data->chromStart > start) {
-        int l1;
-        struct list_buffer *s = NULL, *t = NULL;
-        int edge;
-        l1 = retrieve_gea_records_from_region(h, id, start - MAX_GAP_GENE_DISTANCE, start, &s, &t, &edge);
-        if ( l1 > 0 ) {
-            struct list_buffer *p = s, *g = NULL;
-            for ( ;; ) {
-                if ( p == NULL ) break;
-                // temp point 
-                struct list_buffer *q = NULL;                
-                if ( is_gene(h->hdr, (struct gea_record*)p->data) ) { q = g; g = p; }
-                else q = p;
-                p = p->next;
-                if (q) {
-                    gea_destroy((struct gea_record*)q->data);
-                    free(q);
-                }
-            }
-            // update header
-            if ( g) {
-                g->next = header;
-                header = g;
-            }
-        }
-    }
 
-   /* // if the chunk was NOT fully covered, find more downstream records */
-    if ( tail == NULL || tail_edge < end ) {
-        int l2;
-        struct list_buffer *s = NULL, *t = NULL;
-        int edge;
-
-        // here we retrieve all records downstream, better idea could be read downstream record one by one and check the
-        // biotype at the same time. Because we only need to the most nearest gene downstream.
-        l2 = retrieve_gea_records_from_region(h, id, end, end + MAX_GAP_GENE_DISTANCE, &s, &t, &edge);
-        
-        if ( l2 > 0 ) {
-            struct list_buffer *p = s, *g = NULL;
-            for ( ;; ) {
-                if ( p == NULL ) break;
-                // temp point
-                if ( g == NULL && is_gene(h->hdr, (struct gea_record*)p->data) ) { g = p; p = p->next; g->next = NULL;}
-                else {
-                    struct list_buffer *q = NULL;
-                    q = p;
-                    p = p->next;                    
-                    gea_destroy((struct gea_record*)q->data);
-                    free(q);
-                }
-            }
-            // g could be NULL
-            if ( g) {                
-                if (tail == NULL ) { tail = g; header = tail;}
-                else { tail->next = g; tail = g;}
-
-            }
-        }
-    }
+    // up/downstream genes of intergenic variants are found in the gene boundaries, so there is no need to
+    // retrieve the flanking regions of this chunk
 
     if ( header == NULL ) return 0;
     
@@ -442,26 +577,37 @@ int mc_handler_fill_buffer_chunk(struct mc_handler *h, char* name, int start, in
  */
 
 // find the block of variants located, could be overlapped with multiblocks, so both start and end block will be exported
-static int find_the_block(struct gea_record *v, int *s, int *e, int pos)
+// blocks are sorted by coordinate, search by binary search from block `from`, blocks before it end before pos
+static int find_the_block(struct gea_record *v, int *s, int *e, int pos, int from)
 {
     *s = 0; *e = 0;
     if ( pos < v->chromStart || pos > v->chromEnd ) return 1;
-    int i;
-    for ( i = 0; i < v->blockCount; ++i ) {
-        int start = v->blockPair[0][i];
-        int end   = v->blockPair[1][i];
-        if ( pos < start) { *e = i; break; }
-        else {
-            *s = i;
-            if ( pos <= end ) { *e = i; break; }
-        }
-    }
+    int lo, hi, mid;
+    // k, first block start after pos
+    lo = from; hi = v->blockCount;
+    while ( lo < hi ) {
+        mid = (lo + hi) >> 1;
+        if ( v->blockPair[0][mid] <= pos ) lo = mid + 1;
+        else hi = mid;
+    }
+    int k = lo;
+    // first block end at or after pos, located in this block if it starts before pos
+    lo = from; hi = k;
+    while ( lo < hi ) {
+        mid = (lo + hi) >> 1;
+        if ( v->blockPair[1][mid] < pos ) lo = mid + 1;
+        else hi = mid;
+    }
+    if ( lo < k ) { *s = *e = lo; return 0; }
+    // intron between block k-1 and k, or before the first block
+    if ( k > 0 ) *s = k - 1;
+    if ( k < v->blockCount ) { *e = k; return 0; }
     // out of range
-    if ( i == v->blockCount && *s > 0 && *e == 0 ) return 1;
-    return 0;
+    return *s > 0;
 }
 
 // find the position on the exon region and offset if variant located in the intron region
+// *id is the block to start searching, set to exon ID on success
 // 0 on success, 1 on out of range
 static int find_locate(struct gea_hdr *hdr, struct gea_record *v, int *pos, int *offset, int start, int *id)
 {
@@ -471,7 +617,7 @@ static int find_locate(struct gea_hdr *hdr, struct gea_record *v, int *pos, int
     *pos = 0;
     *offset = 0;
     // for location out of range set pos and offset to 0, annotate as '?'
-    if ( find_the_block(v, &b1, &b2, start ) ) { *pos = 0, *offset = 0; return 1;}
+    if ( find_the_block(v, &b1, &b2, start, *id) ) { *pos = 0, *offset = 0; return 1;}
 
     struct gea_coding_transcript *c = &v->c;
     if ( b1 == b2 ) {
@@ -630,8 +776,8 @@ static int predict_molecular_consequence_snp(struct mc *mc, struct mc_type *type
     if ( ori[cod] == *alt ) {
         type->mut_amino = type->ori_amino;
         type->con1 = mc_nocall;
-        if ( *mc->ref != ori[cod] ) inf->ref = strndup(ori+cod,1);
-        if ( *mc->alt != *alt ) inf->alt = safe_duplicate_string(alt);
+        if ( *mc->ref != ori[cod] ) inf->ref = arena_strndup(mc->arena, ori+cod, 1);
+        if ( *mc->alt != *alt ) inf->alt = arena_strdup(mc->arena, alt);
         return 0;
     }
     else if ( ori[cod] != *ref) warnings("Inconsistance nucletide between refenence and transcript: %s,%d,%s,%d,%c,%c ", mc->chr, mc->start, v->name, inf->pos, ori[cod], *ref);
@@ -652,13 +798,13 @@ static int predict_molecular_consequence_snp(struct mc *mc, struct mc_type *type
         else if ( type->loc_amino == 1 ) type->con1 = mc_start_loss;
     }
 
-    if ( *mc->ref != *ref ) inf->ref = safe_duplicate_string(ref);
-    if ( *mc->alt != *alt ) inf->alt = safe_duplicate_string(alt);
+    if ( *mc->ref != *ref ) inf->ref = arena_strdup(mc->arena, ref);
+    if ( *mc->alt != *alt ) inf->alt = arena_strdup(mc->arena, alt);
     
     return 0;
 }
 
-static int trim_amino_acid_ends(int *lori_aa, int *ori_aa, int *lmut_aa, int *mut_aa, int *head, int *tail, int e)
+static int trim_amino_acid_ends(int *lori_aa, uint8_t *ori_aa, int *lmut_aa, uint8_t *mut_aa, int *head, int *tail, int e)
 {
     int i;
     //for (i = 0; i < *lori_aa && i < *lmut_aa && (*ori_aa)[i] == (*mut_aa)[i]; ++i);
@@ -673,8 +819,8 @@ static int trim_amino_acid_ends(int *lori_aa, int *ori_aa, int *lmut_aa, int *mu
         //int j;
         //for ( j = 0; j < *lori_aa; ++j) ori_aa[j] = ori_aa[i+j];
         //for ( j = 0; j < *lori_aa; ++j) mut_aa[j] = mut_aa[i+j];
-        memmove(ori_aa, ori_aa + i, *lori_aa *sizeof(int));
-        memmove(mut_aa, mut_aa + i, *lmut_aa *sizeof(int));
+        memmove(ori_aa, ori_aa + i, *lori_aa);
+        memmove(mut_aa, mut_aa + i, *lmut_aa);
     }
     if ( e == 2 ) {
         for ( i = 0;; ++i ) {
@@ -685,20 +831,20 @@ static int trim_amino_acid_ends(int *lori_aa, int *ori_aa, int *lmut_aa, int *mu
     }
     return *head+*tail;
 }
-static int *convert_bases_to_amino_acid(int l, char *s, int *l_aa,int mito)
+// Translate s into the handler buffer, ori and mut sequences use buffer 0 and 1. Entries after the stop
+// codon are zeroed to the length of the sequence, same as a freshly allocated array.
+static uint8_t *convert_bases_to_amino_acid(struct mc_handler *h, int which, int l, char *s, int *l_aa,int mito)
 {
-    int i;
     *l_aa = 0;
     if (l<3) return NULL;
-    int *aa = (int*)calloc(l/3,sizeof(int));
-    for (i=0; i<l/3; i++) {
-        aa[i] = codon2aminoid(s+i*3,mito);
-        if ( aa[i] == C4_Stop ) {
-            i++; // put stop codon at the end
-            break;
-        }
-    }
-    *l_aa = i;
+    if ( h->m_aa_buf[which] < l/3 ) {
+        h->m_aa_buf[which] = l/3;
+        kroundup32(h->m_aa_buf[which]);
+        h->aa_buf[which] = realloc(h->aa_buf[which], h->m_aa_buf[which]);
+    }
+    uint8_t *aa = h->aa_buf[which];
+    *l_aa = translate_codons(s, l, aa, mito, 1);
+    memset(aa + *l_aa, 0, l/3 - *l_aa);
     return aa;
 }
 //
@@ -740,8 +886,8 @@ static int trim_capped_sequences_and_check_mutated_end(struct mc_handler *h, str
     int offset = trim_capped_sequences(ori, mut, lori, lmut, 3);
  
     //fprintf(stderr, "name:%s,offset:%d\n",v->name,offset);  
-    if (lref > 0) inf->ref = strdup(ref);
-    if (lalt > 0) inf->alt = strdup(alt);
+    if (lref > 0) inf->ref = arena_strdup(mc->arena, ref);
+    if (lalt > 0) inf->alt = arena_strdup(mc->arena, alt);
 
     //if (offset) {
         // adjust offset by trim capped bases, cod is 0 based, convert offset to 0based by -1 
@@ -798,27 +944,40 @@ static int trim_capped_sequences_and_check_mutated_end(struct mc_handler *h, str
     // alternative sequence.    
     if ( *lmut < 3 ) {
         // expand 10 base in the downstream in the reference sequence
-        faidx_t *fai = fai_load(h->reference_fname);
-        if (fai) {
-            char *seq;
-            int   l;
-            if ( v->strand == strand_is_plus ) seq = faidx_fetch_seq(fai, mc->chr, v->cEnd, v->cEnd+10, &l);
-            else {
-                seq = faidx_fetch_seq(fai, mc->chr, v->cStart - 10, v->cStart, &l);
-                compl_seq(seq, l);
-            }
-            if ( l && seq ) {
+        kstring_t seq = {0,0,0};
+        int has_ref = 0;
+        int start = v->strand == strand_is_plus ? v->cEnd : v->cStart - 10;
+        if ( h->seqidx ) {
+            has_ref = 1;
+            // try the reference window of this chunk first
+            const char *win = seqidx_window_seq(h->seqidx, mc->chr, start, start+10);
+            if ( win ) kputsn(win, 11, &seq);
+            else seqidx_fetch(h->seqidx, mc->chr, start, start+10, &seq);
+        }
+        else {
+            faidx_t *fai = fai_load(h->reference_fname);
+            if ( fai ) {
+                int l = 0;
+                has_ref = 1;
+                seq.s = faidx_fetch_seq(fai, mc->chr, start, start+10, &l);
+                if ( seq.s ) seq.l = seq.m = l;
+                fai_destroy(fai);
+            }
+        }
+        if ( has_ref ) {
+            if ( seq.l && v->strand != strand_is_plus ) compl_seq(seq.s, seq.l);
+            if ( seq.l ) {
                 kstring_t str = {0,0,0};
                 kputs(*mut, &str);
-                kputs(seq, &str);
+                kputs(seq.s, &str);
                 type->mut_amino = codon2aminoid(str.s,mc->is_mito);
                 free(str.s);
             }
             
             if ( type->mut_amino == C4_Stop) type->con1 = mc_stop_retained;
             else type->con1 = mc_stop_loss;
-            
-            fai_destroy(fai);
+
+            free(seq.s);
             return 0;
         }
         else {
@@ -832,10 +991,12 @@ static int trim_capped_sequences_and_check_mutated_end(struct mc_handler *h, str
     return 1;
 }
 // For deletion, lmut should always be 0, so no need to check it here
-static int predict_molecular_consequence_deletion(struct mc_handler *h, struct mc *mc, struct mc_type *type, struct mc_inf *inf, struct gea_record *v, int lref, char *ref, int lori, int lmut, char *ori, char *mut)
+static int predict_molecular_consequence_deletion(struct mc_handler *h, struct mc *mc, struct mc_type *type, struct mc_inf *inf, struct gea_record *v, int lref, char *ref, int lori, int lmut, char *ori, char *mut, int ltotal)
 {
     int cod;
     cod = (inf->loc-1)%3;
+    // bases retrieved beyond the (lazy) window, so the length check below is the same as on the whole window
+    ltotal -= lori;
     // re-alignment of reference and alternative alleles
     if ( trim_capped_sequences_and_check_mutated_end(h, mc, type, inf, v, lref, 0, ref, NULL, &lori, &ori, &lmut, &mut, &cod, 0) == 0 ) return 0;
     
@@ -843,15 +1004,15 @@ static int predict_molecular_consequence_deletion(struct mc_handler *h, struct m
     type->loc_amino = (inf->loc+2)/3; // 1 based
     type->loc_end_amino = (inf->end_loc+2)/3;
     
-    int *ori_aa, *mut_aa;
+    uint8_t *ori_aa, *mut_aa;
     int lori_aa, lmut_aa;
 
-    ori_aa = convert_bases_to_amino_acid(lori, ori, &lori_aa, mc->is_mito);
-    mut_aa = convert_bases_to_amino_acid(lmut, mut, &lmut_aa, mc->is_mito);
+    ori_aa = convert_bases_to_amino_acid(h, 0, lori, ori, &lori_aa, mc->is_mito);
+    mut_aa = convert_bases_to_amino_acid(h, 1, lmut, mut, &lmut_aa, mc->is_mito);
     if ( lori_aa == 0 ) return 0;
     
     // check the amino acids length
-    if ( lori < 10000 && ((v->c.cds_length - v->c.utr5_length - inf->loc)/3 +1 > lori_aa )) {
+    if ( ltotal + lori < 10000 && ((v->c.cds_length - v->c.utr5_length - inf->loc)/3 +1 > lori_aa )) {
         inf->inframe_stop = 1;
         //warnings("In frame stop codon found. %s, %s:%d", inf->transcript, mc->chr, mc->start);
     }
@@ -926,15 +1087,13 @@ static int predict_molecular_consequence_deletion(struct mc_handler *h, struct m
                     type->ori_amino = ori_aa[0];
                     type->ori_end_amino = ori_aa[l];
                     type->n = 1;
-                    type->aminos = calloc(1,sizeof(int));
+                    type->aminos = arena_alloc(mc->arena, sizeof(int));
                     type->aminos[0] = mut_aa[0];
                 }
             }
         }
 
     }
-    if ( lori_aa ) free(ori_aa);
-    if ( lmut_aa ) free(mut_aa);
 
     return 0;
 }
@@ -953,11 +1112,11 @@ static int predict_molecular_consequence_delins(struct mc_handler *h, struct mc
     //if ( strncmp(ref, ori, lref) != 0 ) inf->ref = strndup(ori, lref);
     //if ( strncmp(alt, mut, lalt) != 0 ) inf->alt = strndup(mut, lalt);
     
-    int *ori_aa, *mut_aa;
+    uint8_t *ori_aa, *mut_aa;
     int lori_aa, lmut_aa;
 
-    ori_aa = convert_bases_to_amino_acid(lori, ori, &lori_aa, mc->is_mito);
-    mut_aa = convert_bases_to_amino_acid(lmut, mut, &lmut_aa, mc->is_mito);
+    ori_aa = convert_bases_to_amino_acid(h, 0, lori, ori, &lori_aa, mc->is_mito);
+    mut_aa = convert_bases_to_amino_acid(h, 1, lmut, mut, &lmut_aa, mc->is_mito);
 
     //assert(lori_aa >0);
     if ( lori_aa == 0 ) return 0;
@@ -980,7 +1139,7 @@ static int predict_molecular_consequence_delins(struct mc_handler *h, struct mc
         type->ori_amino = ori_aa[0];
         type->ori_end_amino = ori_aa[l1-1];
         type->n = l2;
-        type->aminos = malloc(sizeof(int)*type->n);
+        type->aminos = arena_alloc(mc->arena, sizeof(int)*type->n);
         int i;
         for ( i=0; i<type->n; ++i) {
             type->aminos[i] = mut_aa[i];
@@ -1008,8 +1167,6 @@ static int predict_molecular_consequence_delins(struct mc_handler *h, struct mc
         type->fs = mut_aa[lmut_aa-1] == C4_Stop ? lmut_aa : -1;
     }
 
-    if ( lori_aa>0 || ori_aa ) free(ori_aa);
-    if ( lmut_aa>0 || mut_aa ) free(mut_aa);
     return 0;
 }
 
@@ -1032,11 +1189,11 @@ static int predict_molecular_consequence_insertion(struct mc_handler *h, struct
     type->loc_amino = inf->loc/3+1;
     //type->loc_end_amino = type->loc_amino+1; 
     
-    int *ori_aa, *mut_aa;
+    uint8_t *ori_aa, *mut_aa;
     int lori_aa, lmut_aa;
 
-    ori_aa = convert_bases_to_amino_acid(lori, ori, &lori_aa, mc->is_mito);
-    mut_aa = convert_bases_to_amino_acid(lmut, mut, &lmut_aa, mc->is_mito);
+    ori_aa = convert_bases_to_amino_acid(h, 0, lori, ori, &lori_aa, mc->is_mito);
+    mut_aa = convert_bases_to_amino_acid(h, 1, lmut, mut, &lmut_aa, mc->is_mito);
 
     if ( lori_aa == 0 ) {
         return 0;
@@ -1078,7 +1235,7 @@ static int predict_molecular_consequence_insertion(struct mc_handler *h, struct
                 type->n = lori_aa;
                 if ( type->n <= 1 ) goto insert_a_stop_gained;
             }
-            type->aminos = malloc(sizeof(int)*type->n);
+            type->aminos = arena_alloc(mc->arena, sizeof(int)*type->n);
             
             type->ori_end_amino = -1;            
             int i;
@@ -1109,13 +1266,13 @@ static int predict_molecular_consequence_insertion(struct mc_handler *h, struct
             if ( head > 0 ) { // inframe insert, trim start
                 type->loc_amino += head-1;
                 type->loc_end_amino = type->loc_amino+1;
-                type->aminos = malloc(sizeof(int)*type->n);
+                type->aminos = arena_alloc(mc->arena, sizeof(int)*type->n);
                 int i;
                 for ( i=0; i < type->n; ++i ) type->aminos[i] = mut_aa[i];
             }
             else if (mut_aa[lalt/3] == ori_aa[0] ) { // inframe insert, trim end
                 type->loc_end_amino = type->loc_amino +1;
-                type->aminos = malloc(sizeof(int)*type->n);
+                type->aminos = arena_alloc(mc->arena, sizeof(int)*type->n);
                 int i;
                 for ( i=0; i < type->n; ++i ) type->aminos[i] = mut_aa[i];                
             }
@@ -1135,7 +1292,7 @@ static int predict_molecular_consequence_insertion(struct mc_handler *h, struct
                 /* else { */
                 type->loc_amino = type->loc_end_amino = (inf->loc+2)/3;
                 type->ori_amino = ori_aa[0];                                    
-                type->aminos = malloc(sizeof(int)*type->n);
+                type->aminos = arena_alloc(mc->arena, sizeof(int)*type->n);
                 int i;
                 for ( i=0; i < type->n; ++i ) {
                     type->aminos[i] = mut_aa[i];
@@ -1151,13 +1308,9 @@ static int predict_molecular_consequence_insertion(struct mc_handler *h, struct
         }
     }
 
-    if ( lori_aa ) free(ori_aa);
-    if ( lmut_aa ) free(mut_aa);
     return 0;
 
   insert_a_stop_gained:
-    if ( lori_aa ) free(ori_aa);
-    if ( lmut_aa ) free(mut_aa);
     type->con1 = mc_stop_gained;
     type->mut_amino = 0;
     type->n = 0;
@@ -1165,6 +1318,21 @@ static int predict_molecular_consequence_insertion(struct mc_handler *h, struct
     return 0;
 }
 
+// window size of transcript sequence for indels, see compare_reference_and_alternative_allele()
+#define MC_RNA_WINDOW_INIT 300
+#define MC_RNA_WINDOW_MAX  10001
+
+// 1 if both original and mutated sequences have an in-frame stop codon at or after the first changed codon
+static int mc_window_is_complete(const char *ori, int lori, const char *mut, int lmut, int mito)
+{
+    int d;
+    for ( d = 0; d < lori && d < lmut && ori[d] == mut[d]; ++d );
+    d = d/3*3;
+    if ( find_stop_codon(ori+d, lori-d, mito) == -1 ) return 0;
+    if ( find_stop_codon(mut+d, lmut-d, mito) == -1 ) return 0;
+    return 1;
+}
+
 /*
  * This function used to parse reference allele and alternative allele sequences. Notice that, all the capped codon will be trimmed.
  * Original sequences generated by bounding the reference allele to disrupted cod   * Mutated sequences reconstruct from original sequences, for frameshift, all remained sequences will be export in this function.
@@ -1203,9 +1371,27 @@ static int compare_reference_and_alternative_allele (struct mc_handler *h,struct
     // start aa location may be changed becase realignment, but ori_seq will be "stable" (reset if duplicate) in this function;
     // ori_seq is a temp sequence, will be free before level this function.
 
-    *ori = faidx_fetch_seq(h->rna_fai, name, start, start + 10000, lori);
-    
-    if ( *ori == NULL || *lori == 0 ) return -1;
+    // length of the sequence retrieved from rna fasta, at most 10001 bases
+    int ltotal;
+    int id = -1;
+    if ( h->rna_store ) {
+        id = rna_store_name2id(h->rna_store, name);
+        if ( id == -1 ) return -1;
+        ltotal = rna_store_seq_len(h->rna_store, id) - start;
+        if ( ltotal > MC_RNA_WINDOW_MAX ) ltotal = MC_RNA_WINDOW_MAX;
+        if ( ltotal <= 0 ) return -1;
+        // SNV only need the affected codon, others start with a short window and extend it on demand
+        int w = mc->type == var_type_snp ? 3 : MC_RNA_WINDOW_INIT + lref + lalt;
+        if ( w > ltotal ) w = ltotal;
+        h->rna_buf.l = 0;
+        *lori = rna_store_fetch(h->rna_store, id, start, start + w, &h->rna_buf);
+        *ori = h->rna_buf.s;
+    }
+    else {
+        *ori = faidx_fetch_seq(h->rna_fai, name, start, start + 10000, lori);
+        if ( *ori == NULL || *lori == 0 ) return -1;
+        ltotal = *lori;
+    }
     
     // Sometime trancated transcript records will disturb downstream analysis.
     if ( *lori < 3 ) {
@@ -1220,6 +1406,18 @@ static int compare_reference_and_alternative_allele (struct mc_handler *h,struct
     //              a deletion overlapped with two codon will influence two frames, fn_ref == 2 && since new frame will be build fn_alt == 1;
     // int fn_ref, fn_alt;
     construct_alternative_sequence(ref, alt, lref, lalt, cod, *ori, *lori, mut, lmut);
+
+    // extend the window until both frames reach a stop codon behind the changed bases, so the amino acids
+    // are the same as translated from the whole 10001 bases window
+    while ( h->rna_store && mc->type != var_type_snp && *lori < ltotal
+            && mc_window_is_complete(*ori, *lori, *mut, *lmut, mc->is_mito) == 0 ) {
+        int w = *lori * 4;
+        if ( w > ltotal ) w = ltotal;
+        *lori += rna_store_fetch(h->rna_store, id, start + *lori, start + w, &h->rna_buf);
+        *ori = h->rna_buf.s;
+        if ( *lmut ) free(*mut);
+        construct_alternative_sequence(ref, alt, lref, lalt, cod, *ori, *lori, mut, lmut);
+    }
     //static int trim_capped_sequences_and_check_mutated_end(struct mc_handler *h, struct mc *mc, struct mc_type *type, struct mc_inf *inf, struct gea_record *v, int *lori, char **ori, int *lmut, char **mut)
     //if ( mc->type != var_type_snp ) {
         // consider the offset of bases only when insert or delete
@@ -1234,7 +1432,7 @@ static int compare_reference_and_alternative_allele (struct mc_handler *h,struct
 
             // for complex cases, we will build the alternative allele sequence and the amino acids
         case var_type_del:
-            predict_molecular_consequence_deletion(h, mc, type, inf, v, lref, ref, *lori, *lmut, *ori, *mut);
+            predict_molecular_consequence_deletion(h, mc, type, inf, v, lref, ref, *lori, *lmut, *ori, *mut, ltotal);
             break;
             
         case var_type_ins:
@@ -1262,11 +1460,11 @@ static int protein_update_state(struct mc_handler *h, struct mc *mc, struct mc_i
     if ( compare_reference_and_alternative_allele(h, inf, type, mc, v, lref, ref, lalt, alt, &lori, &ori, &lmut, &mut) == -1 ) {
         warnings("Failed to predict variant type of %s:%d:%s>%s", mc->chr, mc->start, ref, alt);
         if ( lmut > 0 ) free(mut);
-        if ( lori > 0 ) free(ori);
+        if ( lori > 0 && h->rna_store == NULL ) free(ori);
         return 1;
     }
     if ( lmut > 0 ) free(mut);
-    if ( lori > 0 ) free(ori);
+    if ( lori > 0 && h->rna_store == NULL ) free(ori);
     return 0;
 }
 
@@ -1325,6 +1523,15 @@ static int coding_transcript_update_molecular_consequence_state(struct mc_handle
 
     return 0;
 }
+// splice state of intronic location, offset is the distance to the nearest exon
+static enum mol_con intron_splice_state(int offset)
+{
+    if ( offset < 0 && offset > -splice_site_options.range ) return mc_splice_acceptor;
+    if ( offset < 0 && offset > -splice_site_options.acceptor_region ) return mc_intron_splice_sites;
+    if ( offset > 0 && offset < splice_site_options.range ) return mc_splice_donor;
+    if ( offset > 0 && offset < splice_site_options.donor_region ) return mc_intron_splice_sites;
+    return mc_unknown;
+}
 static int transcript_function_update(struct mc_handler *h, int is_coding, struct gea_record *v, int *ex, int *pos, int *offset, int position, enum func_region_type *func, enum mol_con *con1, enum mol_con *con_splice, int *loc)
 {
     if ( find_locate(h->hdr, v, pos, offset, position, ex) ) {
@@ -1348,10 +1555,7 @@ static int transcript_function_update(struct mc_handler *h, int is_coding, struc
                 *con1 = mc_utr5_intron;
                 *func = func_region_utr5_intron;
                 // check splice sites
-                if ( *offset < 0 && *offset > -splice_site_options.range ) *con_splice = mc_splice_acceptor;
-                else if ( *offset < 0 && *offset >-splice_site_options.acceptor_region ) *con_splice = mc_intron_splice_sites;
-                else if ( *offset >0 && *offset < splice_site_options.range ) *con_splice = mc_splice_donor;
-                else if ( *offset >0 && *offset < splice_site_options.donor_region ) *con_splice = mc_intron_splice_sites;                
+                *con_splice = intron_splice_state(*offset);
             }
             else {
                 
@@ -1365,10 +1569,7 @@ static int transcript_function_update(struct mc_handler *h, int is_coding, struc
             if ( *offset ) {
                 *con1 = mc_coding_intron;
                 *func = func_region_intron;
-                if ( *offset < 0 && *offset > -splice_site_options.range ) *con_splice = mc_splice_acceptor;
-                else if ( *offset < 0 && *offset >-splice_site_options.acceptor_region ) *con_splice = mc_intron_splice_sites;
-                else if (*offset >0 && *offset < splice_site_options.range ) *con_splice = mc_splice_donor;
-                else if ( *offset >0 && *offset < splice_site_options.donor_region ) *con_splice = mc_intron_splice_sites;              
+                *con_splice = intron_splice_state(*offset);
             }
             else {
                 // there is no coding_exon type, to interpret molecular type for coding region thereafter
@@ -1381,10 +1582,7 @@ static int transcript_function_update(struct mc_handler *h, int is_coding, struc
                 *con1 = mc_utr3_intron;
                 *func = func_region_utr3_intron;
                 // check splice sites
-                if ( *offset < 0 && *offset > -splice_site_options.range ) *con_splice = mc_splice_acceptor;
-                else if ( *offset < 0 && *offset >-splice_site_options.acceptor_region ) *con_splice = mc_intron_splice_sites;
-                else if (*offset >0 && *offset < splice_site_options.range ) *con_splice = mc_splice_donor;
-                else if ( *offset >0 && *offset < splice_site_options.donor_region ) *con_splice = mc_intron_splice_sites;                        
+                *con_splice = intron_splice_state(*offset);
             }
             else {
                 *con1 = mc_utr3_exon;
@@ -1397,10 +1595,7 @@ static int transcript_function_update(struct mc_handler *h, int is_coding, struc
         if ( *offset ) {
             *func = func_region_noncoding_intron;
             *con1 = mc_noncoding_intron;
-            if ( *offset < 0 && *offset > -splice_site_options.range ) *con_splice = mc_splice_acceptor;
-            else if ( *offset < 0 && *offset >-splice_site_options.acceptor_region ) *con_splice = mc_intron_splice_sites;
-            else if (*offset >0 && *offset < splice_site_options.range ) *con_splice = mc_splice_donor;
-            else if ( *offset >0 && *offset < splice_site_options.donor_region ) *con_splice = mc_intron_splice_sites;                           
+            *con_splice = intron_splice_state(*offset);
         }
         else {
             *con1 = mc_noncoding_exon;
@@ -1422,14 +1617,13 @@ static int transcript_molecular_consequence_update(struct mc_handler *h, struct
     // update hgvs locations
     struct mc_inf  *inf = &trans->inf;
     struct mc_type *type = &trans->type;
-    const char     *bt = h->hdr->id[GEA_DT_BIOTYPE][v->biotype].key;
     
-    assert ( strcmp(bt, "mRNA") == 0 || strcmp(bt, "ncRNA") == 0);
+    assert ( gea_is_transcript(h->hdr, v) );
 
     
     inf->strand = v->strand == strand_is_plus ? '+' : '-';
-    inf->transcript = safe_duplicate_string(v->name);
-    inf->gene = safe_duplicate_string(v->geneName);
+    inf->transcript = v->name;
+    inf->gene = v->geneName;
 
     //debug_print("%s\t%d\t%s\t%s\t%s", n->chr, n->start, n->ref, n->alt, inf->transcript);
      
@@ -1444,8 +1638,7 @@ static int transcript_molecular_consequence_update(struct mc_handler *h, struct
     if ( whole_gene_deletion_state_update(n, v) )  type->con1 = mc_exon_loss;
     //{ type->con1 = mc_exon_loss; return 0; }    
     
-    int is_coding = 0;
-    if ( strcmp(bt, "mRNA") == 0 ) is_coding = 1;
+    int is_coding = gea_is_mrna(h->hdr, v);
     
     transcript_function_update(h, is_coding, v, &ex1, &inf->pos, &inf->offset, n->start, &type->func1, &type->con1, &type->con2, &inf->loc);
     if ( (type->con2 == mc_splice_donor || type->con2 == mc_splice_acceptor || type->con2 == mc_noncoding_splice_region || type->con2 == mc_intron_splice_sites ) && (type->con1==mc_noncoding_intron || type->con1==mc_coding_intron || type->con1==mc_utr3_intron || type->con1==mc_utr3_intron)){
@@ -1460,6 +1653,8 @@ static int transcript_molecular_consequence_update(struct mc_handler *h, struct
         enum mol_con con1 = mc_unknown;
         enum mol_con con2 = mc_unknown;
 
+        // end is located at or after the block of start
+        ex2 = ex1;
         transcript_function_update(h, is_coding, v, &ex2, &inf->end_pos, &inf->end_offset, n->end, &type->func2, &con1, &con2, &inf->end_loc);
         if ( v->strand == strand_is_minus ) {
             int t = inf->pos;
@@ -1494,11 +1689,11 @@ static int transcript_molecular_consequence_update(struct mc_handler *h, struct
     if ( type->con1 != mc_unknown ) {
         if ( v->strand == strand_is_minus ) {        
             if ( n->ref ) {
-                inf->ref = safe_duplicate_string(n->ref);
+                inf->ref = arena_strdup(n->arena, n->ref);
                 compl_seq(inf->ref, strlen(inf->ref));
             }
             if (n->alt) {
-                inf->alt = safe_duplicate_string(n->alt);
+                inf->alt = arena_strdup(n->arena, n->alt);
                 compl_seq(inf->alt, strlen(inf->alt));
             }        
         }
@@ -1511,8 +1706,8 @@ static int transcript_molecular_consequence_update(struct mc_handler *h, struct
     // init reference sequences and alternative sequences
     int ref_length = n->ref == NULL ? 0    : strlen(n->ref);
     int alt_length = n->alt == NULL ? 0    : strlen(n->alt);
-    char *ref_seq  = n->ref == NULL ? NULL : safe_duplicate_string(n->ref);
-    char *alt_seq  = n->alt == NULL ? NULL : safe_duplicate_string(n->alt);
+    char *ref_seq  = n->ref == NULL ? NULL : arena_strndup(n->arena, n->ref, ref_length);
+    char *alt_seq  = n->alt == NULL ? NULL : arena_strndup(n->arena, n->alt, alt_length);
     
     // for reverse strand, complent sequence
     if ( inf->strand == '-' ) {        
@@ -1520,25 +1715,22 @@ static int transcript_molecular_consequence_update(struct mc_handler *h, struct
         if ( alt_seq ) compl_seq(alt_seq, alt_length);
     }
     
-    if ( strcmp(bt, "mRNA") == 0 )
+    if ( is_coding )
         coding_transcript_update_molecular_consequence_state (h, n, inf, type, v, ref_seq, ref_length, alt_seq, alt_length);
     else 
         noncoding_transcript_update_molecular_conseqeunce_state (h, n, inf, type, v, ref_seq, ref_length, alt_seq, alt_length);
     
-    if ( ref_seq != NULL ) free(ref_seq);
-    if ( alt_seq != NULL ) free(alt_seq);
-
     // update variant functional types
     // check_func_vartype(h, n, n->n_tran, v);
     return 0;
 }
 
-static int up_downstream_gene_update(struct mc *n, struct gea_record *last, struct gea_record *next)
+static int up_downstream_gene_update(struct mc *n, const struct gea_bounds *b, const struct gea_bound *last, const struct gea_bound *next)
 {
     struct intergenic_core *inter = &n->inter;
     
     if ( last != NULL && next != NULL ) {
-        int mid = (next->chromStart + last->chromEnd)/2;
+        int mid = (next->start + last->end)/2;
         if ( n->start < mid ) goto near_last_gene;
         else goto near_next_gene;
     }
@@ -1550,29 +1742,29 @@ static int up_downstream_gene_update(struct mc *n, struct gea_record *last, stru
     return 1;
 
   near_last_gene:
-    inter->gene = last->geneName == NULL ? NULL : safe_duplicate_string(last->geneName);
+    inter->gene = gea_bound_name(b, last);
     if ( last->strand == strand_is_plus ) {
         // forward strand, variant located in the downstream of gene, gene length should be added for TSS 
-        inter->gap_length = n->start - last->chromStart;
+        inter->gap_length = n->start - last->start;
         inter->con1 = inter->gap_length <= 1000 ? mc_downstream_1KB : mc_downstream_10KB;
     }
     else {
         // backward strand, var in upstream and treat chromEnd as TSS
-        inter->gap_length = n->start - last->chromEnd;
+        inter->gap_length = n->start - last->end;
         inter->con1 = inter->gap_length <= 1000 ? mc_upstream_1KB : mc_upstream_10KB ;
     }
     return 0;
 
   near_next_gene:
-    inter->gene = next->geneName == NULL ? NULL : safe_duplicate_string(next->geneName);
+    inter->gene = gea_bound_name(b, next);
     if ( next->strand == strand_is_plus ) {
         // forward strand, variant located in the downstream of gene, gene length should be added for TSS 
-        inter->gap_length = n->start - next->chromStart;
+        inter->gap_length = n->start - next->start;
         inter->con1 = inter->gap_length <= 1000 ? mc_upstream_1KB : mc_upstream_10KB;
     }
     else {
         // backward strand, var in upstream and treat chromEnd as TSS
-        inter->gap_length = n->start - next->chromEnd;
+        inter->gap_length = n->start - next->end;
         inter->con1 = inter->gap_length <= 1000 ? mc_downstream_1KB : mc_downstream_10KB;
     }
     return 0;
@@ -1623,20 +1815,14 @@ static int count_all_overlapped_records(struct mc_handler *h, struct mc *n, int
             }
         }
 
-        const char *bt = h->hdr->id[GEA_DT_BIOTYPE][v->biotype].key;
-        // only consider coding transcript
-        // Since upstream gene records had be filled, and all records in the chunk keep in coordinate,
-        // last_gene will alway point to the last gene record or be NULL.
-        if ( (strcmp(bt, "mRNA") == 0 || strcmp(bt, "Gene") == 0 ) && v->chromEnd < n->start) h->last_gene = v;
-
         // check if variant located in this record
         if ( n->start > v->chromEnd ) continue; 
         if ( n->end < v->chromStart ) break;
         
-        if ( strcmp(bt, "mRNA") == 0 || strcmp(bt, "ncRNA") == 0 ) (*a)++;
+        if ( gea_is_transcript(h->hdr, v) ) (*a)++;
 
         // if no Gene record in database, skip to check intragenic variant
-        if ( strcmp(bt, "Gene") == 0 ) *intragenic_flag = 1;
+        if ( gea_is_gene(h->hdr, v) ) *intragenic_flag = 1;
         // count all records
         (*c)++;
 
@@ -1644,21 +1830,6 @@ static int count_all_overlapped_records(struct mc_handler *h, struct mc *n, int
     return i;
 }
 
-// 0 on sucess, 1 on failure
-static int next_gene_record_update(struct mc_handler *h, int i)
-{
-    int j;
-    if ( i < h->n_record ) {
-        for (j = i; j < h->n_record; ++j) {
-            struct gea_record *v = (struct gea_record*)h->records[j];
-            char *bt = (char*)h->hdr->id[GEA_DT_BIOTYPE][v->biotype].key;
-            if ( strcmp(bt, "mRNA") && strcmp(bt, "ncRNA") && strcmp(bt, "Gene") ) continue;
-            h->next_gene = v;
-            return 0;
-        }
-    }
-    return 1;
-}
 // 0 on intragenic, 1 on otherwise
 static int intragenic_variant_state_update(struct mc *n, int intragenic_flag)
 {
@@ -1674,9 +1845,8 @@ static int intragenic_variant_state_update(struct mc *n, int intragenic_flag)
 static int tfbs_variant_state_update(struct mc *n, struct mc_handler *h, struct gea_record *v)
 {
     struct intergenic_core *inter = &n->inter;
-    char *bt = (char*)h->hdr->id[GEA_DT_BIOTYPE][v->biotype].key;
     //inter->con1 =  inter->con2 = mc_unknown;
-    if ( strcmp(bt, "TFBS") == 0 ) { 
+    if ( gea_is_tfbs(h->hdr, v) ) { 
         if (n->start <= v->chromStart && n->end >= v->chromEnd ) inter->con1 = mc_tfbs_ablation;
         else inter->con1 = mc_tfbs_variant;
         return 0; 
@@ -1710,22 +1880,21 @@ static int transcripts_variant_state_update(struct mc *n, struct mc_handler *h,
     // for variant in the intron region, motif should also be checked.
     int j, i;
     int tfbs_region_skip = 0;
-    n->trans = malloc(a*sizeof(struct mc_core));    
+    n->trans = arena_alloc(n->arena, a*sizeof(struct mc_core));
     n->n_tran = 0;    
     
     for ( i = h->i_record, j = 0; i < h->n_record && j < c; ++i,++j ) {
         struct gea_record *v = (struct gea_record*)h->records[i];
-        const char *bt = h->hdr->id[GEA_DT_BIOTYPE][v->biotype].key;        
         if ( n->end < v->chromStart || n->start > v->chromEnd) continue;
         // for this part we only consider transcripts
         // intron region also could be overlapped with motifs
-        if ( strcmp(bt, "TFBS") == 0 ) {
+        if ( gea_is_tfbs(h->hdr, v) ) {
             if ( tfbs_region_skip == 0 ) {
                 if ( tfbs_variant_state_update(n, h, v) == 0 ) tfbs_region_skip = 1;
             }
             continue;
         }
-        if ( strcmp(bt, "mRNA") && strcmp(bt, "ncRNA") ) continue;
+        if ( !gea_is_transcript(h->hdr, v) ) continue;
         
         // clean core structure for updating transcript record
         struct mc_core *trans = &n->trans[n->n_tran];
@@ -1758,11 +1927,12 @@ static int intergenic_update_molecular_consequence_state(struct mc *n, struct mc
         // intragenic variant
         if ( intragenic_variant_state_update(n, intragenic_flag) == 0 ) return 0;
 
-        // find the upstream nearest gene if possibe
-        next_gene_record_update(h, i);
-
-        // check the gaps between variant and nearby genes
-        up_downstream_gene_update(n, h->last_gene, h->next_gene);
+        // find the nearest up/downstream genes and check the gaps between variant and them
+        int rid = gea_hdr_id2int(h->hdr, GEA_DT_CTG, n->chr);
+        mc_bounds_load(h, rid, n->chr);
+        const struct gea_bound *last = gea_bounds_upstream(h->bounds, rid, n->start, MAX_GAP_GENE_DISTANCE);
+        const struct gea_bound *next = gea_bounds_downstream(h->bounds, rid, n->end, MAX_GAP_GENE_DISTANCE);
+        up_downstream_gene_update(n, h->bounds, last, next);
         
         return 0;
     }
@@ -1828,21 +1998,26 @@ static int anno_mc_update_buffer(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1
     bcf_unpack(line, BCF_UN_INFO);
     
     int i;
-    // clean buffer
-    for ( i = 0; i < file->n_allele; ++i ) mc_destroy(file->files[i]);
+    // clean buffer, release the objects of last record
+    arena_reset(file->arena);
     file->n_allele = line->n_allele-1; // emit ref
-    file->files = malloc(file->n_allele*sizeof(struct mc));
+    file->files = arena_alloc(file->arena, file->n_allele*sizeof(struct mc*));
     for ( i = 0; i < file->n_allele; ++i )
-        file->files[i] = mc_init(bcf_seqname(hdr, line), line->pos+1, line->pos+line->rlen, line->d.allele[0], line->d.allele[i+1]);
+        file->files[i] = mc_init(file->arena, bcf_seqname(hdr, line), line->pos+1, line->pos+line->rlen, line->d.allele[0], line->d.allele[i+1]);
     return 0;
 }
-static int empty_tag_string(kstring_t *str)
+// check tag string appended from offset beg
+static int empty_tag_substring(kstring_t *str, size_t beg)
 {
-    int i;
-    for (i=0; i<str->l; ++i ) 
+    size_t i;
+    for (i=beg; i<str->l; ++i ) 
         if (str->s[i] != '|' && str->s[i] != ',' && str->s[i] != '.') return 0;
     return 1;
 }
+static int empty_tag_string(kstring_t *str)
+{
+    return empty_tag_substring(str, 0);
+}
 static void generate_hgvsnom_string_empty(kstring_t *str)
 {
     kputc('.', str);    
@@ -2242,16 +2417,15 @@ static void generate_hgvsnom_string_exonLoss(struct mc *mc, struct mc_type *type
     if (mc->type == var_type_ins ) ksprintf(str,"ins%s",mc->alt);
     else ksprintf(str,"del%s",mc->alt);
 }
-static char *generate_hgvsnom_string(struct mc *h)
+static void generate_hgvsnom_string(struct mc *h, kstring_t *str)
 {
-    if ( h->n_tran == 0 ) return NULL;
-    
-    kstring_t str = {0,0,0};    
+    if ( h->n_tran == 0 ) return;
+    size_t beg = str->l;
 
     int i;
     for ( i = 0; i < h->n_tran; ++i ) {
 
-        if ( i ) kputc('|', &str);
+        if ( i ) kputc('|', str);
         
         struct mc_type *type = &h->trans[i].type;
         struct mc_inf *inf = &h->trans[i].inf;
@@ -2270,13 +2444,13 @@ static char *generate_hgvsnom_string(struct mc *h)
             case mc_tfbs_variant:
             case mc_intragenic:
             case mc_whole_gene:
-                generate_hgvsnom_string_empty(&str);
+                generate_hgvsnom_string_empty(str);
                 break;
 
             
             case mc_noncoding_splice_region:
             case mc_noncoding_exon:
-                generate_hgvsnom_string_NoncodingExon(h, type, inf, &str);
+                generate_hgvsnom_string_NoncodingExon(h, type, inf, str);
                 break;
 
             case mc_noncoding_intron:
@@ -2287,16 +2461,16 @@ static char *generate_hgvsnom_string(struct mc *h)
             case mc_splice_donor:
             case mc_splice_acceptor:
             case mc_intron_splice_sites:
-                generate_hgvsnom_string_intron(h, type, inf, &str);
+                generate_hgvsnom_string_intron(h, type, inf, str);
                 break;
 
             case mc_utr5_exon:
             case mc_utr3_exon:
-                generate_hgvsnom_string_UtrExon(h, type, inf, &str);
+                generate_hgvsnom_string_UtrExon(h, type, inf, str);
                 break;
 
             case mc_exon_loss:
-                generate_hgvsnom_string_exonLoss(h, type, inf, &str);
+                generate_hgvsnom_string_exonLoss(h, type, inf, str);
                 break;
                 
             case mc_stop_gained:
@@ -2308,7 +2482,7 @@ static char *generate_hgvsnom_string(struct mc *h)
             case mc_disruption_inframe_deletion:
             case mc_disruption_inframe_insertion:
             case mc_coding_variant:
-                generate_hgvsnom_string_CodingDelins(h, type, inf, &str);
+                generate_hgvsnom_string_CodingDelins(h, type, inf, str);
                 break;
                 
             case mc_start_loss:
@@ -2317,11 +2491,11 @@ static char *generate_hgvsnom_string(struct mc *h)
             case mc_stop_retained:
             case mc_missense:
             case mc_synonymous:
-                generate_hgvsnom_string_CodingSNV(h, type, inf, &str);
+                generate_hgvsnom_string_CodingSNV(h, type, inf, str);
                 break;
 
             case mc_nocall:
-                generate_hgvsnom_string_NoCall(h, type, inf, &str);
+                generate_hgvsnom_string_NoCall(h, type, inf, str);
                 break;
                 
             default:
@@ -2330,28 +2504,23 @@ static char *generate_hgvsnom_string(struct mc *h)
 
     }
     
-    if ( empty_tag_string(&str) ) {
-        free(str.s);
-        return NULL;
+    // nothing generated for this allele
+    if ( empty_tag_substring(str, beg) ) {
+        str->l = beg;
+        if ( str->s ) str->s[beg] = '\0';
     }
-    
-    return str.s;
 }
-static int generate_annovar_string(struct mc *h, struct mc_type *type, struct mc_inf *inf, kstring_t *str)
+static int generate_annovar_string(struct mc *h, struct mc_type *type, struct mc_inf *inf, kstring_t *str, size_t beg)
 {
     char *ref = inf->ref != NULL ? inf->ref : h->ref;
     char *alt = inf->alt != NULL ? inf->alt : h->alt;
 
     if ( inf->offset != 0 ) return 0;
-    if ( str->l ) kputc(',', str);
+    if ( str->l > beg ) kputc(',', str);
 
-    char *name = strdup(inf->transcript);
-    int l, i;
-    l = strlen(name);    
-    for ( i = 0; i < l; ++i ) { if (name[i] == '.') name[i] = '\0'; }
-    ksprintf(str, "%s:%s:", inf->gene, name);
+    // transcript name without version
+    ksprintf(str, "%s:%.*s:", inf->gene, (int)strcspn(inf->transcript, "."), inf->transcript);
     ksprintf(str, "exon%d:c.", type->count);
-    free(name);
     if ( inf->end_loc != inf->loc ) {
         ksprintf(str, "%d_%d", inf->loc, inf->end_loc);        
         if ( inf->ref == NULL ) { // insertion
@@ -2436,11 +2605,10 @@ static int generate_annovar_string(struct mc *h, struct mc_type *type, struct mc
 }
 // generate variant string in annovar format
 // OR4F5:NM_001005484:exon1:c.T809A:p.V270E
-static char *generate_annovar_name(struct mc *h)
+static void generate_annovar_name(struct mc *h, kstring_t *str)
 {
-    if ( h->n_tran == 0 ) return NULL;
-    
-    kstring_t str = {0,0,0};    
+    if ( h->n_tran == 0 ) return;
+    size_t beg = str->l;
 
     int i;
     for ( i = 0; i < h->n_tran; ++i ) {        
@@ -2490,7 +2658,7 @@ static char *generate_annovar_name(struct mc *h)
             case mc_missense:
             case mc_synonymous:
             case mc_nocall:
-                generate_annovar_string(h, type, inf, &str);
+                generate_annovar_string(h, type, inf, str, beg);
                 break;
                 
             default:
@@ -2498,12 +2666,11 @@ static char *generate_annovar_name(struct mc *h)
         }
     }
     
-    if ( empty_tag_string(&str) ) {
-        free(str.s);
-        return NULL;
+    // nothing generated for this allele
+    if ( empty_tag_substring(str, beg) ) {
+        str->l = beg;
+        if ( str->s ) str->s[beg] = '\0';
     }
-    
-    return str.s;
 }
 
 /*        
@@ -2616,85 +2783,80 @@ static char *generate_annovar_name(struct mc *h)
 }
 */
         
-static char *generate_gene_string(struct mc *h)
+static void generate_gene_string(struct mc *h, kstring_t *str)
 {
-    kstring_t str = {0,0,0};
     if ( h->n_tran == 0 ) {
-        //kputs(h->inter.gene, &str);
-        return NULL;    
+        //kputs(h->inter.gene, str);
+        return;    
     }
     
     int i;
     for ( i = 0; i < h->n_tran; ++i ) {
-        if ( i ) kputc('|', &str);
+        if ( i ) kputc('|', str);
         struct mc_inf *inf = &h->trans[i].inf;
-        if ( inf->gene ) kputs(inf->gene, &str);
-        else kputc('.', &str);
+        if ( inf->gene ) kputs(inf->gene, str);
+        else kputc('.', str);
     }   
-    return str.s;
+    return;
 }
-static char *generate_transcript_string(struct mc *h)
+static void generate_transcript_string(struct mc *h, kstring_t *str)
 {
-    kstring_t str = {0,0,0};
     int i, k, l;
     for ( i = 0; i < h->n_tran; ++i ) {
-        if ( i ) kputc('|', &str);
+        if ( i ) kputc('|', str);
         struct mc_inf *inf = &h->trans[i].inf;
-        kputs(inf->transcript, &str);
+        kputs(inf->transcript, str);
         l = strlen(inf->transcript);
         for ( k = 0; k < l; ++k )
             if ( inf->transcript[k] == '.') break;
     }
-    return str.s;
+    return;
 }
-static char *generate_vartype_string(struct mc *h)
+static void generate_vartype_string(struct mc *h, kstring_t *str)
 {
-    kstring_t str = {0,0,0};
     if ( h->n_tran == 0 ) {
-        kputs(MCT[h->inter.con1].sname, &str);
-        return str.s;
+        kputs(MCT[h->inter.con1].sname, str);
+        return;
     }
 
     int i;
     for ( i = 0; i < h->n_tran; ++i ) {
-        if ( i ) kputc('|', &str);
+        if ( i ) kputc('|', str);
         struct mc_type *type = &h->trans[i].type;
-        kputs(MCT[type->con1].sname, &str);
+        kputs(MCT[type->con1].sname, str);
         if ( type->con2 != mc_unknown ) {
-            kputc('+', &str);
-            kputs(MCT[type->con2].sname, &str);
+            kputc('+', str);
+            kputs(MCT[type->con2].sname, str);
         }
     }
-    return str.s;    
+    return;    
 }
-static char *generate_molecular_consequence_string(struct mc *h)
+static void generate_molecular_consequence_string(struct mc *h, kstring_t *str)
 {
-    kstring_t str = {0,0,0};
     int i;
     struct intergenic_core *inter = &h->inter;
     for ( i = 0; i < h->n_tran; ++i ) {
-        if (i) kputc('|', &str);
+        if (i) kputc('|', str);
         struct mc_type *type = &h->trans[i].type;
         if ( type->con1 == mc_unknown ) {
-            if ( type->con2 != mc_unknown ) ksprintf(&str, "+%s", MCT[type->con2].lname);
-            else kputs("unknown", &str);
+            if ( type->con2 != mc_unknown ) ksprintf(str, "+%s", MCT[type->con2].lname);
+            else kputs("unknown", str);
         }
         else {
-            kputs(MCT[type->con1].lname, &str);
-            if ( type->con2 != mc_unknown ) ksprintf(&str, "+%s", MCT[type->con2].lname);
-            if ( (type->con1 == mc_noncoding_intron || type->con1 == mc_coding_intron) && inter->con1 != mc_unknown ) ksprintf(&str, "+%s", MCT[inter->con1].lname);
+            kputs(MCT[type->con1].lname, str);
+            if ( type->con2 != mc_unknown ) ksprintf(str, "+%s", MCT[type->con2].lname);
+            if ( (type->con1 == mc_noncoding_intron || type->con1 == mc_coding_intron) && inter->con1 != mc_unknown ) ksprintf(str, "+%s", MCT[inter->con1].lname);
         }
     }
 
     if ( i == 0 ) {
         assert(inter->con1 != mc_unknown);
-        kputs(MCT[inter->con1].lname, &str);
+        kputs(MCT[inter->con1].lname, str);
     }
-    return str.s;
+    return;
 }
-static char *generate_molecular_consequence_string_uniq(struct mc *h)
+static void generate_molecular_consequence_string_uniq(struct mc *h, kstring_t *str)
 {
-    kstring_t str = {0,0,0};
     int i;
     struct intergenic_core *inter = &h->inter;
     struct anno_stack *s = anno_stack_init();
@@ -2710,29 +2872,28 @@ static char *generate_molecular_consequence_string_uniq(struct mc *h)
         anno_stack_push(s, (char*)MCT[inter->con1].lname);
     }
     for ( i = 0; i < s->l; ++i) {
-        if ( i ) kputc('+', &str);
-        kputs(s->a[i], &str);
+        if ( i ) kputc('+', str);
+        kputs(s->a[i], str);
     }
     anno_stack_destroy(s);
-    return str.s;
+    return;
 }
-static char *generate_exonintron_string(struct mc *h)
+static void generate_exonintron_string(struct mc *h, kstring_t *str)
 {
-    kstring_t str = {0,0,0};
     int i;
     for ( i = 0; i < h->n_tran; ++i ) {
-        if ( i ) kputc('|', &str);
+        if ( i ) kputc('|', str);
         struct mc_type *type = &h->trans[i].type;
         struct mc_inf *inf = &h->trans[i].inf;
         if ( inf->offset != 0 )
-            ksprintf(&str, "I%d", type->count);
+            ksprintf(str, "I%d", type->count);
         else {
-            ksprintf(&str, "E%d", type->count);
+            ksprintf(str, "E%d", type->count);
             if ( type->count2 != 0 )
-                ksprintf(&str, "/C%d", type->count2);
+                ksprintf(str, "/C%d", type->count2);
         }
     }
-    return str.s;
+    return;
 }
 static int generate_upstream_downstream_gap_value(struct mc *h ) {
     return h->inter.gap_length;
@@ -2843,24 +3004,110 @@ static char *generate_oldnom_string(struct hgvs *h)
 
 }
 */
-static char *generate_aalength_string(struct mc *h)
+static void generate_aalength_string(struct mc *h, kstring_t *str)
 {
-    kstring_t str = {0,0,0};
     int i;
     for ( i = 0; i < h->n_tran; ++i ) {
-        if ( i ) kputc('|', &str);
-        kputw(h->trans[i].inf.aa_length, &str);
-    }
-    return str.s;
+        if ( i ) kputc('|', str);
+        kputw(h->trans[i].inf.aa_length, str);
+    }
+    return;
+}
+// Supported tags, their header lines and generators. IVSnom and Oldnom are accepted but not generated for now.
+static const struct mc_tag {
+    const char *key;
+    const char *hdr_line;
+    mc_generator_func gen;
+} mc_tags[] = {
+    { "HGVSnom", "##INFO=<ID=HGVSnom,Number=A,Type=String,Description=\"HGVS nomenclature for the description of DNA sequence variants\">", generate_hgvsnom_string, },
+    { "ANNOVARname", "##INFO=<ID=ANNOVARname,Number=A,Type=String,Description=\"Variant description in ANNOVAR format.\">", generate_annovar_name, },
+    { "Gene", "##INFO=<ID=Gene,Number=A,Type=String,Description=\"Gene names\">", generate_gene_string, },
+    { "Transcript", "##INFO=<ID=Transcript,Number=A,Type=String,Description=\"Transcript names\">", generate_transcript_string, },
+    { "VarType", "##INFO=<ID=VarType,Number=A,Type=String,Description=\"Variant type.\">", generate_vartype_string, },
+    { "MolecularConsequence", "##INFO=<ID=MolecularConsequence,Number=A,Type=String,Description=\"Predicted molecular consequence of variant.\">", generate_molecular_consequence_string, },
+    { "MC1", "##INFO=<ID=MC1,Number=A,Type=String,Description=\"Predicted molecular consequence of variant.\">", generate_molecular_consequence_string_uniq, },
+    { "ExonIntron", "##INFO=<ID=ExonIntron,Number=A,Type=String,Description=\"Exon/CDS or intron id on transcripts.\">", generate_exonintron_string, },
+    { "IVSnom", "##INFO=<ID=IVSnom,Number=A,Type=String,Description=\"Old style nomenclature for the description of intron variants. Not recommand to use it.\">", NULL, },
+    { "Oldnom", "##INFO=<ID=Oldnom,Number=A,Type=String,Description=\"Old style nomenclature, compared with HGVSnom use gene position instead of UTR/coding position.\">", NULL, },
+    { "AAlength", "##INFO=<ID=AAlength,Number=A,Type=String,Description=\"Amino acid length for each transcript. 0 for noncoding transcript.\">", generate_aalength_string, },
+    { NULL, NULL, NULL, },
+};
+
+static const struct mc_tag *mc_tag_find(const char *key)
+{
+    const struct mc_tag *t;
+    for ( t = mc_tags; t->key; ++t )
+        if ( strcmp(t->key, key) == 0 ) return t;
+    return NULL;
 }
+
 //static int anno_hgvs_setter_info(struct anno_hgvs_file *file, bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col)
+static void anno_mc_update_info(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *line, kstring_t *str)
+{
+    int i;
+    for ( i = 0; i < file->n_col; ++i ) {
+        if ( empty_tag_string(&str[i]) ) continue;
+        struct anno_col *col = &file->cols[i];
+        if ( col->replace == REPLACE_MISSING ) {
+            int ret = bcf_get_info_string(hdr, line, col->hdr_key, &file->tmps, &file->mtmps);
+            if ( ret > 0 && (file->tmps[0]!= '.' || file->tmps[1] != 0 ) ) continue;
+        }
+        bcf_update_info_string_fixed(hdr, line, col->hdr_key, str[i].s);
+    }
+}
+
+// Cache key of a variant, consequences only depend on position, length and alleles.
+static void anno_mc_cache_key(struct anno_mc_file *file, bcf1_t *line)
+{
+    kstring_t *key = &file->cache_key;
+    int i;
+    key->l = 0;
+    kputw(line->rlen, key);
+    for ( i = 0; i < line->n_allele; ++i ) {
+        kputc(i < 2 ? '\t' : ',', key);
+        kputs(line->d.allele[i], key);
+    }
+}
+
+static void anno_mc_cache_push(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *line, kstring_t *str, int empty)
+{
+    kstring_t val = {0,0,0};
+    int i;
+    for ( i = 0; i < file->n_col && empty == 0; ++i ) {
+        if ( i ) kputc('\t', &val);
+        if ( str[i].l ) kputsn(str[i].s, str[i].l, &val);
+    }
+    vc_cache_push(&file->batch, bcf_seqname(hdr, line), line->pos, file->cache_key.s, file->cache_key.l, val.s, empty ? -1 : val.l);
+    free(val.s);
+}
+
+// Apply cached tags, return 1 if the cached record is broken.
+static int anno_mc_cache_apply(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *line, const char *val, int l_val)
+{
+    if ( l_val < 0 ) return 0;
+    kstring_t *str = file->strs;
+    int i = 0, j, beg = 0;
+    for ( j = 0; j < file->n_col; ++j ) str[j].l = 0;
+    for ( j = 0; j <= l_val; ++j ) {
+        if ( j < l_val && val[j] != '\t' ) continue;
+        if ( i == file->n_col ) break;
+        kputsn(val+beg, j-beg, &str[i++]);
+        beg = j+1;
+    }
+    int ret = i != file->n_col || j <= l_val;
+    if ( ret == 0 ) anno_mc_update_info(file, hdr, line, str);
+    return ret;
+}
+
 static int anno_mc_setter(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *line)
 {
     int i, j;
     struct mc_handler *h = file->h;
     int empty = 1;
-    kstring_t *str = malloc(file->n_col*sizeof(kstring_t));
-    for ( i = 0; i < file->n_col; ++i ) memset(&str[i], 0, sizeof(kstring_t));
+    // intergenic states (TFBS, intragenic) depend on the records in the chunk buffer, do not cache them
+    int cacheable = 1;
+    kstring_t *str = file->strs;
+    for ( i = 0; i < file->n_col; ++i ) str[i].l = 0;
 
     for ( i = 0; i < file->n_allele; ++i ) {
         struct mc *f = file->files[i];
@@ -2876,6 +3123,7 @@ static int anno_mc_setter(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *lin
         }
         //int ret;
         int ret = mc_anno_trans_chunk(f, h);
+        if ( ret == -1 ) cacheable = 0;
 
         //continue;
         
@@ -2885,94 +3133,14 @@ static int anno_mc_setter(struct anno_mc_file *file, bcf_hdr_t *hdr, bcf1_t *lin
         }
         
         for ( j = 0; j < file->n_col; ++j ) {
-            struct anno_col *col = &file->cols[j];
-            if ( strcmp(col->hdr_key, "HGVSnom") == 0 ) {
-                char *name = generate_hgvsnom_string(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);
-                }
-            }
-            else if ( strcmp(col->hdr_key, "Gene") == 0 ) {
-                char *name = generate_gene_string(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);
-                }
-            }
-            else if ( strcmp(col->hdr_key, "Transcript") == 0 ) {
-                char *name = generate_transcript_string(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);                    
-                }
-            }
-            else if ( strcmp(col->hdr_key, "VarType") == 0 ) {
-                //char *name = generate_vartype_string(f);
-                char *name = generate_vartype_string(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);
-                }
-            }
-            else if ( strcmp(col->hdr_key, "MolecularConsequence") == 0 ) {
-                char *name = generate_molecular_consequence_string(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);
-                }
-            }
-            else if ( strcmp(col->hdr_key, "ANNOVARname") == 0 ) {
-                char *name = generate_annovar_name(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);
-                }
-            }
-            else if ( strcmp(col->hdr_key, "MC1") == 0 ) {
-                char *name = generate_molecular_consequence_string_uniq(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);
-                }
-            }
-            
-            else if ( strcmp(col->hdr_key, "ExonIntron") == 0 ) {
-                char *name = generate_exonintron_string(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);
-                }
-            }
-            else if ( strcmp(col->hdr_key, "AAlength") == 0 ) {
-                char *name = generate_aalength_string(f);
-                if (name) {
-                    kputs(name, &str[j]);
-                    free(name);
-                }
-            }           
+            if ( file->gens[j] == NULL ) continue;
+            file->gens[j](f, &str[j]);
         }
         empty = 0;
     }
-    if ( empty == 1 ) {
-        for ( j = 0; j < file->n_col; ++j ) free(str[j].s);
-        free(str);
-        return 1;
-    }
-    // update INFO
-    for ( i = 0; i < file->n_col; ++i ) {
-        if ( empty_tag_string(&str[i]) ) continue;
-        struct anno_col *col = &file->cols[i];
-        if ( col->replace == REPLACE_MISSING ) {
-            int ret = bcf_get_info_string(hdr, line, col->hdr_key, &file->tmps, &file->mtmps);
-            if ( ret > 0 && (file->tmps[0]!= '.' || file->tmps[1] != 0 ) ) continue;
-        }
-        bcf_update_info_string_fixed(hdr, line, col->hdr_key, str[i].s);
-    }
-    
-    for ( i = 0; i < file->n_col; ++i ) free(str[i].s);
-    free(str);
-    return 0;
+    if ( file->cache && cacheable ) anno_mc_cache_push(file, hdr, line, str, empty);
+    if ( empty == 0 ) anno_mc_update_info(file, hdr, line, str);
+    return empty;
 }
 
 struct anno_mc_file *anno_mc_file_duplicate(struct anno_mc_file *f)
@@ -2986,19 +3154,69 @@ struct anno_mc_file *anno_mc_file_duplicate(struct anno_mc_file *f)
     d->cols = malloc(d->n_col*sizeof(struct anno_col));
     int i;
     for ( i = 0; i < d->n_col; ++i) anno_col_copy(&f->cols[i], &d->cols[i]);
+    d->gens = malloc(d->n_col*sizeof(mc_generator_func));
+    memcpy(d->gens, f->gens, d->n_col*sizeof(mc_generator_func));
+    d->strs = calloc(d->n_col, sizeof(kstring_t));
+    d->arena = arena_init(MC_ARENA_BLOCK);
+    if ( f->cache ) d->cache = vc_cache_ref(f->cache);
     return d;
 }
+void anno_mc_file_set_reference(struct anno_mc_file *f, struct seqidx *idx)
+{
+    f->h->seqidx = idx;
+}
+
+int anno_mc_file_load_memory(struct anno_mc_file *f)
+{
+    return mc_handler_load_memory(f->h);
+}
+
+int anno_mc_file_load_rna_memory(struct anno_mc_file *f)
+{
+    return mc_handler_load_rna_memory(f->h);
+}
+
+int anno_mc_file_cache_open(struct anno_mc_file *f, const char *fname, const char *name_list)
+{
+    struct mc_handler *h = f->h;
+    // cached tags are invalid once databases or tags changed, databases are checked by size and modification time,
+    // reference genome by its path
+    uint32_t checksum = vc_cache_file_checksum(h->data_fname, 0);
+    checksum = vc_cache_file_checksum(h->rna_fname, checksum);
+    if ( name_list ) checksum = vc_cache_file_checksum(name_list, checksum);
+    kstring_t key = {0,0,0};
+    int i;
+    for ( i = 0; i < f->n_col; ++i ) {
+        if ( i ) kputc(',', &key);
+        kputs(f->cols[i].hdr_key, &key);
+    }
+    const char *mito = getenv("BCFANNO_MITOCHR");
+    ksprintf(&key, ";mito=%s;reference=%s", mito ? mito : "", h->reference_fname ? h->reference_fname : "");
+    f->cache = vc_cache_open(fname, checksum, key.s);
+    free(key.s);
+    return f->cache == NULL;
+}
 
 void anno_mc_file_destroy(struct anno_mc_file *f, int l)
 {
     int i;
-    // clear buffer
-    for ( i = 0; i < f->n_allele; ++i ) mc_destroy(f->files[i]);
-    if ( f->n_allele ) free(f->files);
+    // consequence objects of last record are released with the arena
+    arena_destroy(f->arena);
     mc_handler_destroy(f->h, l);
+    if ( f->cache ) {
+        vc_cache_flush(f->cache, &f->batch);
+        vc_cache_close(f->cache);
+        free(f->batch.buf.s);
+        free(f->cache_key.s);
+    }
     //if ( f->tmps) free(f->tmps);
-    for ( i = 0; i < f->n_col; ++i ) free(f->cols[i].hdr_key);
+    for ( i = 0; i < f->n_col; ++i ) {
+        free(f->cols[i].hdr_key);
+        free(f->strs[i].s);
+    }
     free(f->cols);
+    free(f->gens);
+    free(f->strs);
     free(f);
 }
 
@@ -3045,8 +3263,7 @@ struct anno_mc_file *anno_mc_file_init(bcf_hdr_t *hdr, const char *column, const
             else if (*ss == '-') { col->replace = REPLACE_EXISTING; ss++; }
             if ( ss[0] == '\0') continue;
             if ( strncmp(ss, "INFO/", 5) == 0 ) ss += 5;
-            if ( strcmp(ss, "HGVSnom")  && strcmp(ss, "Gene") && strcmp(ss, "Transcript") && strcmp(ss, "VarType") && strcmp(ss, "ExonIntron") && strcmp(ss, "IVSnom")
-                 && strcmp(ss, "Oldnom") && strcmp(ss, "AAlength") && strcmp(ss, "ANNOVARname") && strcmp(ss, "MolecularConsequence") && strcmp(ss, "MC1")){
+            if ( mc_tag_find(ss) == NULL ) {
                 warnings("Do NOT support tag %s.", ss);
                 continue;
             }
@@ -3057,45 +3274,25 @@ struct anno_mc_file *anno_mc_file_init(bcf_hdr_t *hdr, const char *column, const
         free(s);
     }    
 
-    // update header
-#define BRANCH(_key, _description) do {                                 \
-        int id;                                                         \
-        id = bcf_hdr_id2int(hdr, BCF_DT_ID, _key);                      \
-        if (id == -1) {                                                 \
-            bcf_hdr_append(hdr, _description);                          \
-            bcf_hdr_sync(hdr);                                          \
-            id = bcf_hdr_id2int(hdr, BCF_DT_ID, _key);                  \
-            assert(bcf_hdr_idinfo_exists(hdr, BCF_HL_INFO, id));        \
-        }                                                               \
-    } while(0)
+    // update header and compile the generator table, so the setter no longer matches tags per record
     int i;
+    f->gens = malloc(f->n_col*sizeof(mc_generator_func));
     for ( i = 0; i < f->n_col; ++i ) {
         struct anno_col *col = &f->cols[i];
-        if ( strcmp(col->hdr_key, "HGVSnom") == 0 ) 
-            BRANCH("HGVSnom", "##INFO=<ID=HGVSnom,Number=A,Type=String,Description=\"HGVS nomenclature for the description of DNA sequence variants\">");
-        else if ( strcmp(col->hdr_key, "ANNOVARname") == 0 )
-            BRANCH("ANNOVARname", "##INFO=<ID=ANNOVARname,Number=A,Type=String,Description=\"Variant description in ANNOVAR format.\">");
-        else if ( strcmp(col->hdr_key, "Gene") == 0 ) 
-            BRANCH("Gene","##INFO=<ID=Gene,Number=A,Type=String,Description=\"Gene names\">");
-        else if ( strcmp(col->hdr_key, "Transcript") == 0 ) 
-            BRANCH("Transcript","##INFO=<ID=Transcript,Number=A,Type=String,Description=\"Transcript names\">");
-        else if ( strcmp(col->hdr_key, "VarType") == 0 ) 
-            BRANCH("VarType", "##INFO=<ID=VarType,Number=A,Type=String,Description=\"Variant type.\">");
-        else if ( strcmp(col->hdr_key, "MolecularConsequence") == 0 ) 
-            BRANCH("MolecularConsequence", "##INFO=<ID=MolecularConsequence,Number=A,Type=String,Description=\"Predicted molecular consequence of variant.\">");
-        else if ( strcmp(col->hdr_key, "MC1") == 0 ) 
-            BRANCH("MC1", "##INFO=<ID=MC1,Number=A,Type=String,Description=\"Predicted molecular consequence of variant.\">");
-        else if ( strcmp(col->hdr_key, "ExonIntron") == 0 ) 
-            BRANCH("ExonIntron","##INFO=<ID=ExonIntron,Number=A,Type=String,Description=\"Exon/CDS or intron id on transcripts.\">");
-        else if ( strcmp(col->hdr_key, "IVSnom") == 0 ) 
-            BRANCH("IVSnom", "##INFO=<ID=IVSnom,Number=A,Type=String,Description=\"Old style nomenclature for the description of intron variants. Not recommand to use it.\">");
-        else if ( strcmp(col->hdr_key, "Oldnom") == 0 ) 
-            BRANCH("Oldnom", "##INFO=<ID=Oldnom,Number=A,Type=String,Description=\"Old style nomenclature, compared with HGVSnom use gene position instead of UTR/coding position.\">");
-        else if ( strcmp(col->hdr_key, "AAlength") == 0 ) 
-            BRANCH("AAlength", "##INFO=<ID=AAlength,Number=A,Type=String,Description=\"Amino acid length for each transcript. 0 for noncoding transcript.\">");
-    }
-#undef BRANCH
+        const struct mc_tag *t = mc_tag_find(col->hdr_key);
+        assert(t);
+        f->gens[i] = t->gen;
+        int id = bcf_hdr_id2int(hdr, BCF_DT_ID, t->key);
+        if (id == -1) {
+            bcf_hdr_append(hdr, t->hdr_line);
+            bcf_hdr_sync(hdr);
+            id = bcf_hdr_id2int(hdr, BCF_DT_ID, t->key);
+            assert(bcf_hdr_idinfo_exists(hdr, BCF_HL_INFO, id));
+        }
+    }
 
+    f->strs = calloc(f->n_col, sizeof(kstring_t));
+    f->arena = arena_init(MC_ARENA_BLOCK);
     f->h = mc_handler_init(rna, data, reference, name_list);
     return f;
 }
@@ -3108,7 +3305,12 @@ int anno_mc_chunk(struct anno_mc_file *f, bcf_hdr_t *hdr, struct anno_pool *pool
     // 2) if partly cover the chunk which could be interpret as start or end record located in intergenic region, update buffer by retrieving the most nearby gene (limited to 10K)
 
     // Notice : Gene, MOTIFs or other regulatory region will be filled in buffer
-    mc_handler_fill_buffer_chunk(f->h, (char*)bcf_seqname(hdr, pool->readers[pool->i_chunk]), pool->curr_start, pool->curr_end+1);
+    // With cache, buffer is only filled if any variant in this chunk missed the cache.
+    int filled = 0;
+    if ( f->cache == NULL ) {
+        mc_handler_fill_buffer_chunk(f->h, (char*)bcf_seqname(hdr, pool->readers[pool->i_chunk]), pool->curr_start, pool->curr_end+1);
+        filled = 1;
+    }
 
     // annotate each record in the chunk
     int i;
@@ -3117,6 +3319,18 @@ int anno_mc_chunk(struct anno_mc_file *f, bcf_hdr_t *hdr, struct anno_pool *pool
 
         // Do we need to annotate REF allele ?
         if ( bcf_get_variant_types(line) == VCF_REF ) continue;
+
+        if ( f->cache ) {
+            const char *val;
+            int l_val;
+            anno_mc_cache_key(f, line);
+            if ( vc_cache_get(f->cache, bcf_seqname(hdr, line), line->pos, f->cache_key.s, f->cache_key.l, &val, &l_val)
+                 && anno_mc_cache_apply(f, hdr, line, val, l_val) == 0 ) continue;
+            if ( filled == 0 ) {
+                mc_handler_fill_buffer_chunk(f->h, (char*)bcf_seqname(hdr, pool->readers[pool->i_chunk]), pool->curr_start, pool->curr_end+1);
+                filled = 1;
+            }
+        }
         
         // update buffer for one variant per time, gene and regulatory element will be treat seperately
         // regulatory element will be checked only if variant located outside of exome (intron and intergenic region will be checked)
@@ -3125,6 +3339,7 @@ int anno_mc_chunk(struct anno_mc_file *f, bcf_hdr_t *hdr, struct anno_pool *pool
         // generate tags
         anno_mc_setter(f, hdr, line);
     }
+    if ( f->cache && f->batch.n >= VC_CACHE_BATCH ) vc_cache_flush(f->cache, &f->batch);
     
     return 0;
 }
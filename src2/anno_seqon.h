@@ -9,6 +9,10 @@
 #include "anno_pool.h"
 #include "anno_col.h"
 #include "variant_type.h"
+#include "rna_store.h"
+#include "vc_cache.h"
+#include "arena.h"
+#include "anno_flank.h"
 
 extern int file_is_GEA(const char *fn);
 
@@ -16,9 +20,22 @@ struct mc_handler {
     const char *rna_fname;
     const char *data_fname;
     const char *reference_fname;
+    // reference index and chunk window of the worker, if set reference_fname will not be loaded, do NOT free it
+    struct seqidx *seqidx;
     faidx_t *rna_fai;
+    // transcript sequences packed in memory, shared by all handlers, rna_fai will not be used
+    struct rna_store *rna_store;
+    // decoded transcript window, reused across variants
+    kstring_t rna_buf;
+    // translated amino acids of original and mutated sequences, reused across variants
+    uint8_t *aa_buf[2];
+    int m_aa_buf[2];
     tbx_t *idx;
+    // CSI index of binary GEA, if set, data file is BEA and idx is NULL
+    hts_idx_t *csi;
     htsFile *fp_idx;
+    // whole database loaded in memory, shared by all handlers, idx, csi and fp_idx will not be used
+    struct gea_index *gidx;
     struct gea_hdr *hdr;
     
     void *name_hash;
@@ -33,9 +50,15 @@ struct mc_handler {
     // gene and regulatory records
     void **records;
 
-    // point to nearest gene record, used to interupt the up/downstream gene of intergenic variants
-    void *last_gene;
-    void *next_gene;
+    // gene boundaries of whole database, used to find the up/downstream gene of intergenic variants,
+    // shared by all handlers
+    struct gea_bounds *bounds;
+
+    // parsed records cached across chunks, records in the buffer above point to the cache
+    int n_cache;
+    int m_cache;
+    void *cache;
+    void *cache_hash;
 };
 enum func_region_type {
     _func_region_promote_to_int = -1,
@@ -103,7 +126,7 @@ struct intergenic_core {
     // Should be molecular consequence in intergenic region only.
     enum mol_con con1; // motifs
     enum mol_con con2; // up/downstream or inside of gene
-    char *gene; // up/downstream gene name
+    const char *gene; // up/downstream gene name, point to gene boundaries of handler
     int gap_length; // gap between up/downstream gene and variant
 };
 
@@ -134,7 +157,7 @@ struct mc_type {
     // fast access for single amino acid change
     int mut_amino;
 
-    // buffered sequences for mutated amino acids
+    // buffered sequences for mutated amino acids, allocated from the arena of the record
     int n;
     int *aminos;
 
@@ -148,12 +171,12 @@ struct mc_type {
 };
 
 struct mc_inf {
-    // transcript name or Loc name in same case, name1
-    char *transcript;
+    // transcript name or Loc name in same case, name1, point to the GEA record
+    const char *transcript;
     // transcript version
     // int version;
-    // gene name
-    char *gene;
+    // gene name, point to the GEA record
+    const char *gene;
     // Amino acid length, for noncoding transcript should always be 0.
     int aa_length;    
     
@@ -166,7 +189,7 @@ struct mc_inf {
     int end_loc;
 
     // the bases used to cache the realigned insertion or deletion, for repeat sequences after realignment the insert or
-    // deleted bases may be changed. Need to be freed at the end.
+    // deleted bases may be changed. Allocated from the arena of the record.
     char *ref;
     char *alt;
     
@@ -192,6 +215,8 @@ struct mc_core {
 
 // molecular consequence description structure
 struct mc {
+    // the record and all its transcripts are allocated from this arena, released together by arena_reset()
+    struct arena *arena;
     // point to chrom of VCF header, do NOT free it
     const char *chr;
     // check if it is mitochondrial genes, mito gene use a different genetic code map
@@ -211,19 +236,38 @@ struct mc {
     struct intergenic_core inter;
 };
 
+// append tag string of this variant to str
+typedef void (*mc_generator_func)(struct mc *, kstring_t *str);
+
 struct anno_mc_file {
     struct mc_handler *h;
     int n_allele; // assume n_allele == 1 
     struct mc **files;
     int n_col;
     struct anno_col *cols;
+    mc_generator_func *gens; // generator for each column, compiled in anno_mc_file_init
+    kstring_t *strs; // tag strings of each column, reused across records
+    // per worker memory of the consequence objects, reset for each record
+    struct arena *arena;
     char *tmps;
     int mtmps;
+    // persistent consequence cache shared by all threads, new records of this file are flushed in batch
+    struct vc_cache *cache;
+    struct vc_cache_batch batch;
+    kstring_t cache_key;
 };
 
 extern struct anno_mc_file *anno_mc_file_init(bcf_hdr_t *hdr, const char *column, const char *data, const char *rna, const char *reference, const char *name_list);
 extern struct anno_mc_file *anno_mc_file_duplicate(struct anno_mc_file *f);
 extern void anno_mc_file_destroy(struct anno_mc_file *f, int l);
+// Load the whole GEA database into memory, call it before duplicate the file for other threads.
+extern int anno_mc_file_load_memory(struct anno_mc_file *f);
+// Load transcript sequences into memory, call it before duplicate the file for other threads.
+extern int anno_mc_file_load_rna_memory(struct anno_mc_file *f);
+// Open persistent consequence cache, call it before duplicate the file for other threads.
+extern int anno_mc_file_cache_open(struct anno_mc_file *f, const char *fname, const char *name_list);
+// Share reference index and chunk window of the worker with the handler.
+extern void anno_mc_file_set_reference(struct anno_mc_file *f, struct seqidx *idx);
 //extern void anno_mc_core(struct anno_mc_file *f, bcf_hdr_t *hdr, bcf1_t *line);
 extern int anno_mc_chunk(struct anno_mc_file *f, bcf_hdr_t *hdr, struct anno_pool *pool);
 
@@ -360,7 +360,9 @@ void thread_pool_process_detach(struct thread_pool *p, struct thread_pool_proces
         if ( curr == q ) {
             q->next->prev = q->prev;
             q->prev->next = q->next;
-            p->q_head = q->prev = NULL;
+            // keep the other queues attached
+            p->q_head = q->next;
+            q->next = q->prev = NULL;
 
             // Last one
             if ( p->q_head == q )
@@ -403,9 +405,11 @@ static void *thread_pool_worker(void *arg) {
                 break;
 
             // Iterate over queues,
-            // finding one with jobs and also room to put the result.          
+            // finding one with jobs and also room to put the result.
+            // Compare with jobs in processing, not awake threads; woken threads still
+            // scanning here are not running yet and could block each other forever.
             if ( q && q->input_head
-                 && q->qsize - q->n_output > p->tsize - p->n_waiting) {
+                 && q->qsize - q->n_output > q->n_processing) {
                 work_to_do = 1;
                 break;
             }
@@ -485,9 +489,9 @@ static void *thread_pool_worker(void *arg) {
 
         if ( --q->ref_count == 0 )
             thread_pool_process_destroy(q);
-        else
-            // Out of jobs on this queue, so restart search from next one.
-            // This is equivalent to "work stead"
+        // Out of jobs on this queue, so restart search from next one.
+        // This is equivalent to "work stead". Queue may be detached already.
+        else if ( q->next )
             p->q_head = q->next;
 
         pthread_mutex_unlock(&p->pool_mutex);
@@ -24,22 +24,35 @@ static int match_allele(bcf1_t *line, bcf1_t *dat)
     // if no matchs
     return 1;
 }
+// contig id in the index of database, -1 if not found
+static int anno_vcf_name2id(struct anno_vcf_file *f, const char *name)
+{
+    if ( f->tbx_idx ) return tbx_name2id(f->tbx_idx, name);
+    if ( f->bcf_idx ) return bcf_hdr_name2id(f->hdr, name);
+    error("Failed to reload index of %s.", f->fname);
+    return -1;
+}
 // fill_buffer update returns
 // return -1 on no change
 //         0 on empty
 //         else number of records
+// The buffer is keyed by the contig id of database, so the handler can be shared by inputs with different headers.
 static int anno_vcf_update_buffer(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_t *line)
 {
     struct anno_vcf_buffer *b = f->buffer;
-    if ( b->cached && b->buffer[0]->rid == line->rid && b->buffer[b->cached-1]->pos >= line->pos && b->buffer[0]->pos <= line->pos)
+    int tid = anno_vcf_name2id(f, bcf_seqname(hdr, line));
+    if ( b->cached && b->last_rid == tid && b->buffer[b->cached-1]->pos >= line->pos && b->buffer[0]->pos <= line->pos)
         return -1;
-    else b->cached = 0;
-    if ( b->last_rid != line->rid ) {
-        b->no_such_chrom = 0;
-        b->last_rid = line->rid;
-    }
-    else if ( b->no_such_chrom == 1 )
+    b->cached = 0;
+    b->last_rid = tid;
+    if ( tid == -1 ) {
+        if ( b->no_such_chrom == 0 ) {
+            warnings("No chromosome %s found in %s.", bcf_seqname(hdr, line), f->fname);
+            b->no_such_chrom = 1;
+        }
         return 0;
+    }
+    else b->no_such_chrom = 0;
 
     if ( f->itr ) {
         hts_itr_destroy(f->itr);
@@ -51,30 +64,8 @@ static int anno_vcf_update_buffer(struct anno_vcf_file *f, bcf_hdr_t *hdr, bcf1_
             l = line->d.var[i].n;
     int end_pos = l < 0 ? line->pos - l : line->pos;
 
-    if ( f->tbx_idx ) {
-        int tid = tbx_name2id(f->tbx_idx, bcf_seqname(hdr, line));
-        if ( tid == -1 ) {
-            if ( b->no_such_chrom == 0 ) {
-                warnings("No chromosome %s found in %s.", bcf_seqname(hdr, line), f->fname);
-                b->no_such_chrom = 1;
-            }
-            return 0;
-        }
-        f->itr = tbx_itr_queryi(f->tbx_idx, tid, line->pos, end_pos+1);
-    }
-    else if ( f->bcf_idx ) {
-        // check id in header of database
-        int tid = bcf_hdr_name2id(f->hdr, bcf_seqname(hdr, line));
-        if ( tid == -1 ) {
-            if ( b->no_such_chrom == 0 )  {
-                warnings("No chromsome %s found in %s.", bcf_seqname(hdr, line), f->fname);
-                b->no_such_chrom = 1;
-            }
-            return 0;
-        }
-        f->itr = bcf_itr_queryi(f->bcf_idx, tid, line->pos, end_pos+1);
-    }
-    else goto load_index_failed;
+    if ( f->tbx_idx ) f->itr = tbx_itr_queryi(f->tbx_idx, tid, line->pos, end_pos+1);
+    else f->itr = bcf_itr_queryi(f->bcf_idx, tid, line->pos, end_pos+1);
 
     // no record
     if ( f->itr == NULL )
@@ -128,39 +119,22 @@ int anno_vcf_update_buffer_chunk(struct anno_vcf_file *f, bcf_hdr_t *hdr, struct
     struct anno_vcf_buffer *b = f->buffer;
     b->cached = 0;
     b->i_chunk = 0;
-    if ( b->last_rid != line->rid ) {
-        b->no_such_chrom = 0;
-        b->last_rid = line->rid;
-    }
-    else if ( b->no_such_chrom == 1 )
+
+    int tid = anno_vcf_name2id(f, bcf_seqname(hdr, line));
+    b->last_rid = tid;
+    if ( tid == -1 ) {
+        if ( b->no_such_chrom == 0 ) {
+            warnings("No chromosome %s found in %s.", bcf_seqname(hdr, line), f->fname);
+            b->no_such_chrom = 1;
+        }
         return 0;
+    }
+    else b->no_such_chrom = 0;
     
     assert( f->itr == NULL );
 
-    if ( f->tbx_idx ) {
-        int tid = tbx_name2id(f->tbx_idx, bcf_seqname(hdr, line));
-        if ( tid == -1 ) {
-            if ( b->no_such_chrom == 0 ) {
-                warnings("No chromosome %s found in %s.", bcf_seqname(hdr, line), f->fname);
-                b->no_such_chrom = 1;
-            }
-            return 0;
-        }
-        f->itr = tbx_itr_queryi(f->tbx_idx, tid, pool->curr_start, pool->curr_end+1);
-    }
-    else if ( f->bcf_idx ) {
-        // check id in header of database
-        int tid = bcf_hdr_name2id(f->hdr, bcf_seqname(hdr, line));
-        if ( tid == -1 ) {
-            if ( b->no_such_chrom == 0 )  {
-                warnings("No chromsome %s found in %s.", bcf_seqname(hdr, line), f->fname);
-                b->no_such_chrom = 1;
-            }
-            return 0;
-        }
-        f->itr = bcf_itr_queryi(f->bcf_idx, tid, pool->curr_start, pool->curr_end+1);    
-    }
-    else error("Failed to reload index of %s.", f->fname);
+    if ( f->tbx_idx ) f->itr = tbx_itr_queryi(f->tbx_idx, tid, pool->curr_start, pool->curr_end+1);
+    else f->itr = bcf_itr_queryi(f->bcf_idx, tid, pool->curr_start, pool->curr_end+1);
 
     // no record
     if ( f->itr == NULL )
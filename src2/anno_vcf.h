@@ -10,6 +10,7 @@
 
 struct anno_vcf_buffer {
     int no_such_chrom;
+    // contig id in the index of database
     int last_rid;
     int cached, max;
     int i_chunk;
@@ -0,0 +1,72 @@
+#include "utils.h"
+#include "arena.h"
+
+// keep block data aligned
+#define ARENA_HDR_SIZE ((sizeof(struct arena_block) + 15) & ~(size_t)15)
+#define arena_block_data(b) ((char*)(b) + ARENA_HDR_SIZE)
+
+struct arena *arena_init(size_t block_size)
+{
+    struct arena *a = calloc(1, sizeof(*a));
+    a->block_size = block_size;
+    return a;
+}
+
+void arena_destroy(struct arena *a)
+{
+    if ( a == NULL ) return;
+    struct arena_block *b = a->first;
+    while ( b ) {
+        struct arena_block *n = b->next;
+        free(b);
+        b = n;
+    }
+    free(a);
+}
+
+void arena_reset(struct arena *a)
+{
+    a->curr = a->first;
+    if ( a->curr ) a->curr->used = 0;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    struct arena_block *b = a->curr;
+    // blocks after curr are left from the last round, reuse them
+    while ( b && b->used + size > b->size ) {
+        b = b->next;
+        if ( b ) b->used = 0;
+    }
+    if ( b == NULL ) {
+        size_t l = size > a->block_size ? size : a->block_size;
+        b = malloc(ARENA_HDR_SIZE + l);
+        if ( b == NULL ) error("Failed to allocate memory.");
+        b->next = NULL;
+        b->size = l;
+        b->used = 0;
+        if ( a->last ) a->last->next = b;
+        else a->first = b;
+        a->last = b;
+    }
+    a->curr = b;
+    void *p = arena_block_data(b) + b->used;
+    b->used += size;
+    return p;
+}
+
+void *arena_calloc(struct arena *a, size_t size)
+{
+    void *p = arena_alloc(a, size);
+    memset(p, 0, size);
+    return p;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t l)
+{
+    char *p = arena_alloc(a, l + 1);
+    memcpy(p, s, l);
+    p[l] = '\0';
+    return p;
+}
@@ -0,0 +1,32 @@
+#ifndef ARENA_HEADER
+#define ARENA_HEADER
+
+#include <stddef.h>
+#include <string.h>
+
+// Bump allocator for short-lived objects. Memory is released all at once by arena_reset(), blocks are kept and
+// reused by the next round, so a worker could annotate records without calling malloc/free for each object.
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+struct arena {
+    struct arena_block *first;
+    struct arena_block *curr;
+    struct arena_block *last;
+    size_t block_size;
+};
+
+extern struct arena *arena_init(size_t block_size);
+extern void arena_destroy(struct arena *a);
+// Release all objects allocated from this arena.
+extern void arena_reset(struct arena *a);
+// Allocated memory is aligned to 8 bytes and NOT initialised, except for arena_calloc().
+extern void *arena_alloc(struct arena *a, size_t size);
+extern void *arena_calloc(struct arena *a, size_t size);
+extern char *arena_strndup(struct arena *a, const char *s, size_t l);
+#define arena_strdup(a, s) arena_strndup(a, s, strlen(s))
+
+#endif
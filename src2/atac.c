@@ -10,9 +10,13 @@
 #include "utils.h"
 #include "bed_utils.h"
 #include "wrap_pileup.h"
+#include "anno_pool.h"
+#include "anno_thread_pool.h"
+#include "number.h"
 #include "htslib/vcf.h"
 #include "htslib/sam.h"
 #include "htslib/faidx.h"
+#include "htslib/thread_pool.h"
 
 
 enum abt {
@@ -32,6 +36,8 @@ static const char *hts_bcf_wmode(int file_type)
 struct args {
     const char *vcf_fname;
     const char *bam_fname;
+    const char *bam_list_fname;
+    const char *sample_name;
     const char *bed_fname;
     const char *fasta_fname;
     const char *out_fname;
@@ -46,9 +52,22 @@ struct args {
     int output_type;
     int qual_thres;
     
+    int n_thread;
+    int n_record;
+    // BGZF decompression threads, shared by all alignment files
+    int n_hts_thread;
+    htsThreadPool hts_pool;
+
+    // alignment files and the VCF sample of each
+    int n_bam;
+    char **bam_fnames;
+    int *sample_ids;
+
 } args = {
     .vcf_fname = NULL,
     .bam_fname = NULL,
+    .bam_list_fname = NULL,
+    .sample_name = NULL,
     .bed_fname = NULL,
     .fasta_fname = NULL,
     .out_fname = NULL,
@@ -59,244 +78,369 @@ struct args {
     .bcf_hdr = NULL,
     .output_type = 0,
     .qual_thres = 20,
+    .n_thread = 1,
+    .n_record = RECORDS_PER_CHUNK,
+    .n_hts_thread = 0,
+    .hts_pool = { NULL, 0 },
+    .n_bam = 0,
+    .bam_fnames = NULL,
+    .sample_ids = NULL,
 };
 
 // Chromatin Accessible Auxiliary, CAA
-// For each peak we cache all covered reads and piled for each position.
+// Handler of one alignment file. Each worker holds its own file handler, the index is shared.
 struct CAA {
-    int tid;
-    int start, end; // current block
-    samFile *fp; // for each CAA, hold a file handler, thread safe
+    samFile *fp;
     hts_idx_t *sam_idx; // index of alignment file
-    hts_itr_t *sam_itr; // update for each position?
+    hts_itr_t *sam_itr; // reads overlapping cached variants
     bam_hdr_t *sam_hdr; // 
+    bam1_t *b;
 
-    bcf_hdr_t *bcf_hdr; // point to args::bcf_hdr
-    
-    //struct plp_ref *ref;
-    bam_plp_t plp_iter; // returned by bam_plp_init
-    int n_plp;
-    //faidx_t *fai;
-    //char *ref;
-    //int ref_len;
-
-    struct bedaux *bed; // point to args::bed, do NOT free it.
     struct args *args; // point to args, for accessing some parameters
 
-    int id; // GT id
-    int sample_id;
+    int sample_id; // sample index in VCF
+    const char *fname;
+};
 
-    int last_pos;
-    const bam_pileup1_t *last_plp;
+// Peak cache of one worker. Variants located in the same peak are counted together, for each alignment file the
+// reads overlapping them are fetched once and the CIGAR of each read is walked once.
+struct CAA_peak {
+    // sorted unique variant positions (0-based) of current peak
+    int n_pos, m_pos;
+    int *pos;
+    // n_sample x n_pos, depth of reads spanning each position, deletions included
+    uint32_t *depth;
+    // n_sample x n_pos x 16, base counts of each position, indexed by 4 bits base code
+    uint32_t *count;
     
-    char *name; // sample name in vcf
-};
+    int n_caa;
+    struct CAA **caa;
+    int n_sample;
+
+    // FORMAT buffers
+    int m_ac;
+    int32_t *ac;
+    float *af;
 
-#define CAA_seqname(_C,_T) _C->sam_hdr->target_name[_T]
+    bcf_hdr_t *bcf_hdr; // point to args::bcf_hdr
+    struct bedaux *bed; // point to args::bed, do NOT free it.
+    struct bed_cursor cursor;
+};
 
-void CAA_destroy(struct CAA *CAA)
+void CAA_destroy(struct CAA *CAA, int l)
 {
-    //fai_destroy(CAA->fai);
     bam_hdr_destroy(CAA->sam_hdr);
     sam_close(CAA->fp);
-    hts_idx_destroy(CAA->sam_idx);
-
-    //if ( CAA->->ref[0] ) free(CAA->ref->ref[0]);
-    //if ( CAA->ref->ref[1] ) free(CAA->ref->ref[1]);
-    if ( CAA->sam_itr ) free(CAA->sam_itr);
-
+    if ( l == 0 ) hts_idx_destroy(CAA->sam_idx);
+    if ( CAA->sam_itr ) hts_itr_destroy(CAA->sam_itr);
+    bam_destroy1(CAA->b);
     free(CAA);
 }
 
-struct CAA *CAA_init(const char *alignment_fname)//, const char *reference_fname)
+static struct CAA *CAA_open(const char *alignment_fname)
 {
     struct CAA *CAA = malloc(sizeof(*CAA));
     memset(CAA, 0, sizeof(*CAA));
+    CAA->fname = alignment_fname;
 
-    CAA->tid = -1;
     htsFile *fp = hts_open(alignment_fname, "r");
     if (fp == NULL) error("Failed to open %s: %s.", alignment_fname, strerror(errno));
     htsFormat type = *hts_get_format(fp);
     hts_close(fp);
 
     CAA->fp = sam_open_format(alignment_fname, "rb", &type);
-    CAA->sam_hdr = sam_hdr_read(CAA->fp);
-    CAA->sam_idx = sam_index_load(CAA->fp, alignment_fname);
-    //CAA->fai = fai_load(reference_fname);
-
     if ( CAA->fp == NULL ) error("%s: %s.", alignment_fname, strerror(errno));
+    if ( args.hts_pool.pool ) hts_set_thread_pool(CAA->fp, &args.hts_pool);
+    CAA->sam_hdr = sam_hdr_read(CAA->fp);
     if ( CAA->sam_hdr == NULL ) error("Failed to read BAM header of %s.", alignment_fname);
-    if ( CAA->sam_idx == NULL ) error("Failed to load index of %s.", alignment_fname);
-    //if ( CAA->fai == NULL ) error("Failed to load index %s.", reference_fname);
-
-    //static plp_ref_t ref = {{NULL,NULL}, {-1,-1}, {0,0}};
-    //CAA->ref = &ref;
+    CAA->b = bam_init1();
     return CAA;
 }
 
-const bam_pileup1_t *CAA_variant_pos(struct CAA *CAA, int _tid, int _pos);
-
-static int plp_func(void *data, bam1_t *b)
+struct CAA *CAA_init(const char *alignment_fname)
 {
-    int ret;
+    struct CAA *CAA = CAA_open(alignment_fname);
+    CAA->sam_idx = sam_index_load(CAA->fp, alignment_fname);
+    if ( CAA->sam_idx == NULL ) error("Failed to load index of %s.", alignment_fname);
+    return CAA;
+}
 
-    struct CAA *CAA = (struct CAA*)data;
-    struct args *args = CAA->args;
+struct CAA *CAA_duplicate(struct CAA *CAA)
+{
+    struct CAA *d = CAA_open(CAA->fname);
+    d->sam_idx = CAA->sam_idx;
+    d->args = CAA->args;
+    d->sample_id = CAA->sample_id;
+    return d;
+}
 
-    for ( ;; ) {
-        ret = CAA->sam_itr == NULL ? sam_read1(CAA->fp, CAA->sam_hdr, b) : sam_itr_next(CAA->fp, CAA->sam_itr, b);
-        if ( ret < 0 ) break;
-        if ( b->core.tid < 0  || (b->core.flag & BAM_FUNMAP)) continue;
-        if ( b->core.qual < args->qual_thres || (b->core.flag & BAM_FQCFAIL)) continue;
-        if ( b->core.flag & BAM_FDUP ) continue;
-        break;
+struct CAA_peak *CAA_peak_init(struct args *args)
+{
+    struct CAA_peak *pk = malloc(sizeof(*pk));
+    memset(pk, 0, sizeof(*pk));
+    pk->bcf_hdr = args->bcf_hdr;
+    pk->bed = args->bed;
+    bed_cursor_init(&pk->cursor, pk->bed);
+    pk->n_sample = bcf_hdr_nsamples(args->bcf_hdr);
+    pk->n_caa = args->n_bam;
+    pk->caa = malloc(pk->n_caa*sizeof(void*));
+    int i;
+    for ( i = 0; i < pk->n_caa; ++i ) {
+        pk->caa[i] = CAA_init(args->bam_fnames[i]);
+        pk->caa[i]->args = args;
+        pk->caa[i]->sample_id = args->sample_ids[i];
     }
+    return pk;
+}
 
-    return ret;
+struct CAA_peak *CAA_peak_duplicate(struct CAA_peak *pk)
+{
+    struct CAA_peak *d = malloc(sizeof(*d));
+    memset(d, 0, sizeof(*d));
+    d->bcf_hdr = pk->bcf_hdr;
+    d->bed = pk->bed;
+    bed_cursor_init(&d->cursor, d->bed);
+    d->n_sample = pk->n_sample;
+    d->n_caa = pk->n_caa;
+    d->caa = malloc(d->n_caa*sizeof(void*));
+    int i;
+    for ( i = 0; i < d->n_caa; ++i ) d->caa[i] = CAA_duplicate(pk->caa[i]);
+    return d;
 }
 
-const bam_pileup1_t *CAA_new_region_init(struct CAA *CAA, int tid, int pos)
+void CAA_peak_destroy(struct CAA_peak *pk, int l)
 {
-    int start, end;
-    int ret, has_ref;
-    struct bedaux *bed = CAA->bed;
-    ret = bed_position_covered(bed, CAA_seqname(CAA,tid), pos, &start, &end);
-    
-    if ( ret == 0 ) return NULL; // Not located in open accessible regions
-   
-    if ( CAA->sam_itr ) hts_itr_destroy(CAA->sam_itr);
+    int i;
+    for ( i = 0; i < pk->n_caa; ++i ) CAA_destroy(pk->caa[i], l);
+    free(pk->caa);
+    free(pk->pos);
+    free(pk->depth);
+    free(pk->count);
+    free(pk->ac);
+    free(pk->af);
+    free(pk);
+}
 
-    CAA->tid = tid;
-    CAA->start = start;
-    CAA->end = end;   
+static int read_filter(struct args *args, bam1_t *b)
+{
+    if ( b->core.tid < 0 || (b->core.flag & BAM_FUNMAP) || b->core.n_cigar == 0 ) return 1;
+    if ( b->core.qual < args->qual_thres || (b->core.flag & BAM_FQCFAIL)) return 1;
+    if ( b->core.flag & BAM_FDUP ) return 1;
+    return 0;
+}
 
-    CAA->sam_itr = bam_itr_queryi(CAA->sam_idx, tid, start, end);
-    CAA->plp_iter = bam_plp_init(plp_func, CAA);
-    
-    /*
-    has_ref = plp_get_ref(CAA->ref, CAA->sam_hdr, CAA->fai, tid, &CAA->ref, &CAA->ref_len);
-    
-    if (has_ref == 0 ) {
-        warning("No such chromosome %s at reference.", CAA_seqname(CAA,tid));
-        return NULL;
-    }
-    */
-    return CAA_variant_pos(CAA, tid, pos);
+static int cmpint(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
 }
 
-// 
-const bam_pileup1_t *CAA_variant_pos(struct CAA *CAA, int _tid, int _pos)
+// Add bases of reads at the cached variant positions to the counts of the sample.
+static void CAA_count(struct CAA *CAA, struct CAA_peak *pk, const char *name)
 {
-    // new chromosome or new region
-    if ( CAA->tid != _tid || CAA->end < _pos )
-        return CAA_new_region_init(CAA, _tid, _pos);
-
-    // last position cached
-    if ( CAA->last_pos == _pos ) {
-        debug_print("Return last cached plp. No test.");
-        return CAA->last_plp;
-    }
-    // if ( CAA->has_ref == 0 ) return NULL;
+    int tid = bam_name2id(CAA->sam_hdr, name);
+    if ( tid < 0 ) return;
 
-    int n_plp;
-    int tid;
-    int pos;
-    for ( ;; ) {
-        
-        const bam_pileup1_t *plp = bam_plp_auto(CAA->plp_iter, &tid, &pos, &n_plp);
-        //debug_print("1: %s\t%d", CAA_seqname(CAA,_tid), _pos);
-        if ( plp == NULL ) break; // ends
-        //debug_print("2: %s\t%d", CAA_seqname(CAA,tid), pos);
-        pos = pos +1; // 0 based to 1 based
-        if ( pos < _pos ) 
-            continue;
-        else if ( pos == _pos ) {
-            CAA->n_plp = n_plp;
-            return plp; // that's it
+    const int *pos = pk->pos;
+    int n = pk->n_pos;
+    uint32_t *depth = pk->depth + CAA->sample_id*n;
+    uint32_t *count = pk->count + CAA->sample_id*n*16;
+
+    if ( CAA->sam_itr ) hts_itr_destroy(CAA->sam_itr);
+    CAA->sam_itr = sam_itr_queryi(CAA->sam_idx, tid, pos[0], pos[n-1]+1);
+    if ( CAA->sam_itr == NULL ) return;
+
+    int i, k;
+    bam1_t *b = CAA->b;
+    while ( sam_itr_next(CAA->fp, CAA->sam_itr, b) >= 0 ) {
+        if ( read_filter(CAA->args, b) ) continue;
+        int rpos = b->core.pos;
+        int end = bam_endpos(b);
+        // first variant position not before read
+        int lo = 0, hi = n;
+        while ( lo < hi ) {
+            int mid = (lo + hi) >> 1;
+            if ( pos[mid] < rpos ) lo = mid + 1;
+            else hi = mid;
         }
-        else {
-            // there is no reads cover this location, plp_auto will skip uncover locs
-            CAA->n_plp = n_plp;
-            CAA->last_pos = pos;
-            CAA->last_plp = plp;
-            return NULL;
+        if ( lo == n || pos[lo] >= end ) continue;
+        for ( k = lo; k < n && pos[k] < end; ++k ) depth[k]++;
+
+        uint32_t *cigar = bam_get_cigar(b);
+        uint8_t *seq = bam_get_seq(b);
+        int qpos = 0;
+        k = lo;
+        for ( i = 0; i < b->core.n_cigar && k < n; ++i ) {
+            int op = bam_cigar_op(cigar[i]);
+            int len = bam_cigar_oplen(cigar[i]);
+            int type = bam_cigar_type(op);
+            if ( type == 3 ) { // M, =, X
+                for ( ; k < n && pos[k] < rpos + len; ++k ) {
+                    int q = qpos + pos[k] - rpos;
+                    if ( q >= b->core.l_qseq ) continue;
+                    count[k*16 + bam_seqi(seq, q)]++;
+                }
+            }
+            else if ( type == 2 ) { // D, N
+                for ( ; k < n && pos[k] < rpos + len; ++k );
+            }
+            if ( type & 1 ) qpos += len;
+            if ( type & 2 ) rpos += len;
         }
-        // error("Input record is not sorted ? %s:%d,%d", CAA_seqname(CAA,tid), _pos,pos); 
     }
-    return NULL;
 }
 
-int anno_vcf_atac(struct CAA *CAA, bcf1_t *l, const bam_pileup1_t *plp)
+// Fill PeakAC and PeakAF of each sample for variant at k-th cached position. Samples without alignment or not
+// covered are set to missing.
+int anno_vcf_atac(struct CAA_peak *pk, bcf1_t *l, int k)
 {
-    int i;
-    // char *ref
+    int i, j, s;
     // chr pos ref alt ref_depth alt_depth
-    bcf_unpack(l, BCF_UN_ALL);
-    uint32_t *d = calloc(l->n_allele, sizeof(*d));
-    float *f = calloc(l->n_allele, sizeof(*f));
-    uint32_t sum = 0;
-    for ( i = 0; i < CAA->n_plp; i++ ) {
-        const bam_pileup1_t *p = plp+i;
-        if ( !p->is_del ) {
-            if ( p->qpos >= p->b->core.l_qseq ) continue;
-            char c = "=ACMGRSVTWYHKDBN"[bam_seqi(bam_get_seq(p->b), p->qpos)];
-            if (c == 'N' ) continue;
-            //debug_print("%d\t%d\t%c",p->b->core.pos,p->qpos,c);
-            int j;
-            for ( j = 0; j < l->n_allele; ++j ) {
-                if ( c== *l->d.allele[j] ) { d[j]++; sum++; break; }               
-            }
+    bcf_unpack(l, BCF_UN_STR);
+    int n_allele = l->n_allele;
+    if ( pk->m_ac < pk->n_sample*n_allele ) {
+        pk->m_ac = pk->n_sample*n_allele;
+        pk->ac = realloc(pk->ac, pk->m_ac*sizeof(int32_t));
+        pk->af = realloc(pk->af, pk->m_ac*sizeof(float));
+    }
+    int has_ac = 0, has_af = 0;
+    for ( s = 0; s < pk->n_sample; ++s ) {
+        int32_t *d = pk->ac + s*n_allele;
+        float *f = pk->af + s*n_allele;
+        const uint32_t *count = pk->count + (s*pk->n_pos + k)*16;
+        d[0] = bcf_int32_missing;
+        bcf_float_set_missing(f[0]);
+        for ( i = 1; i < n_allele; ++i ) {
+            d[i] = bcf_int32_vector_end;
+            bcf_float_set_vector_end(f[i]);
         }
-        else {
-
+        if ( pk->depth[s*pk->n_pos + k] == 0 ) continue;
+        has_ac = 1;
+        uint32_t sum = 0;
+        memset(d, 0, n_allele*sizeof(int32_t));
+        for ( i = 0; i < 16; i++ ) {
+            char c = "=ACMGRSVTWYHKDBN"[i];
+            if ( c == 'N' || count[i] == 0 ) continue;
+            for ( j = 0; j < n_allele; ++j ) {
+                if ( c == *l->d.allele[j] ) { d[j] += count[i]; sum += count[i]; break; }
+            }
             // for indels
         }
+        if ( sum > 0 ) {
+            has_af = 1;
+            for ( i = 0; i < n_allele; ++i ) f[i] = (float)d[i]/sum;
+        }
     }
-    if ( sum > 0 ) {
-        for ( i = 0; i < l->n_allele; ++i ) f[i] = (float)d[i]/sum;
-        bcf_update_format_float(CAA->bcf_hdr, l, "PeakAF", f, l->n_allele);
-    }
-    // printf("%s\t%d\t%s\t%s\t%d\t%d\n", CAA->bcf_hdr->id[BCF_DT_CTG][l->rid].key, l->pos+1, l->d.allele[0],
-    // l->n_allele > 1? l->d.allele[1] : ".", d[0], l->n_allele>1? d[1] : 0);
-    bcf_update_format_int32(CAA->bcf_hdr, l, "PeakAC", d, l->n_allele);
-
+    if ( has_af ) bcf_update_format_float(pk->bcf_hdr, l, "PeakAF", pk->af, pk->n_sample*n_allele);
+    if ( has_ac ) bcf_update_format_int32(pk->bcf_hdr, l, "PeakAC", pk->ac, pk->n_sample*n_allele);
     return 0;
 }
-int bcf2bam_rid(bcf_hdr_t *bcf_hdr, bam_hdr_t *sam_hdr, int tid)
+
+// Count and annotate records located in the same peak.
+static void CAA_peak_annotate(struct CAA_peak *pk, bcf1_t **lines, int n)
 {
-    const char *n = bcf_hdr->id[BCF_DT_CTG][tid].key;
     int i;
-    for ( i = 0; i < sam_hdr->n_targets; ++i ) {
-        if ( strcmp(n, sam_hdr->target_name[i]) == 0 ) 
-            return i;
+    if ( pk->m_pos < n ) {
+        pk->m_pos = n;
+        pk->pos = realloc(pk->pos, pk->m_pos*sizeof(int));
+        pk->depth = realloc(pk->depth, pk->n_sample*pk->m_pos*sizeof(uint32_t));
+        pk->count = realloc(pk->count, pk->n_sample*pk->m_pos*16*sizeof(uint32_t));
+    }
+    for ( i = 0; i < n; ++i ) pk->pos[i] = lines[i]->pos;
+    qsort(pk->pos, n, sizeof(int), cmpint);
+    pk->n_pos = 0;
+    for ( i = 0; i < n; ++i )
+        if ( pk->n_pos == 0 || pk->pos[i] != pk->pos[pk->n_pos-1] ) pk->pos[pk->n_pos++] = pk->pos[i];
+    memset(pk->depth, 0, pk->n_sample*pk->n_pos*sizeof(uint32_t));
+    memset(pk->count, 0, pk->n_sample*pk->n_pos*16*sizeof(uint32_t));
+
+    const char *name = bcf_seqname(pk->bcf_hdr, lines[0]);
+    for ( i = 0; i < pk->n_caa; ++i ) CAA_count(pk->caa[i], pk, name);
+
+    for ( i = 0; i < n; ++i ) {
+        int lo = 0, hi = pk->n_pos - 1;
+        while ( lo < hi ) {
+            int mid = (lo + hi) >> 1;
+            if ( pk->pos[mid] < lines[i]->pos ) lo = mid + 1;
+            else hi = mid;
+        }
+        anno_vcf_atac(pk, lines[i], lo);
     }
-    return -1;
 }
-int anno_vcf_atac_main(struct CAA *CAA)
+
+// Annotate a chunk of records, records located in one peak are grouped.
+void *anno_atac(void *arg, int idx)
 {
-    //int tid, pos;
-    //char *ref = NULL;
-    //int ref_len = 0;
+    struct anno_pool *pool = (struct anno_pool*)arg;
+    struct CAA_peak *pk = ((struct CAA_peak**)pool->arg)[idx];
+    int i = 0, j;
+    while ( i < pool->n_reader ) {
+        bcf1_t *l = pool->readers[i];
+        int start, end;
+        if ( l->rid == -1 || bed_cursor_covered(&pk->cursor, bcf_seqname(pk->bcf_hdr, l), l->pos+1, &start, &end) == 0 ) {
+            ++i;
+            continue;
+        }
+        for ( j = i + 1; j < pool->n_reader; ++j ) {
+            bcf1_t *l1 = pool->readers[j];
+            if ( l1->rid != l->rid || l1->pos+1 < start || l1->pos+1 > end ) break;
+        }
+        CAA_peak_annotate(pk, pool->readers + i, j - i);
+        i = j;
+    }
+    return pool;
+}
 
-    bcf1_t *line = bcf_init();
+static void write_chunk(struct anno_pool *pool)
+{
+    int i;
+    for ( i = 0; i < pool->n_reader; ++i ) {
+        bcf_write1(args.fp_out, args.bcf_hdr, pool->readers[i]);
+        bcf_destroy(pool->readers[i]);
+    }
+    free(pool->readers);
+}
 
-    for (;;) {
-        if ( bcf_read(args.fp_input, args.bcf_hdr, line)!= 0 ) break;
-        if ( line->rid == -1 ) goto out;
-        
-        // if ( bcf_get_variant_types(line) == VCF_REF ) goto output_line;
-        // if ( bed_region_covered(args.bed, args.bcf_hdr->target_name[tid], line->pos+1, line->pos+1) == 0 ) goto out;
-        int tid = bcf2bam_rid(args.bcf_hdr, CAA->sam_hdr, line->rid);
-        const bam_pileup1_t *plp = CAA_variant_pos(CAA, tid, line->pos+1);
-        if ( plp != NULL && CAA->n_plp != 0 )
-            anno_vcf_atac(CAA, line, plp);
-
-      out:
-        bcf_write1(args.fp_out, args.bcf_hdr, line);
-        continue;
+int anno_vcf_atac_main(struct CAA_peak **pks)
+{
+    if ( args.n_thread == 1 ) {
+        for ( ;; ) {
+            struct anno_pool *pool = anno_reader(args.fp_input, args.bcf_hdr, args.n_record);
+            int n = pool->n_reader;
+            pool->arg = pks;
+            write_chunk(anno_atac(pool, 0));
+            free(pool);
+            if ( n == 0 ) break;
+        }
+        return 0;
     }
-    bcf_destroy(line);
 
+    struct thread_pool *p = thread_pool_init(args.n_thread);
+    struct thread_pool_process *q = thread_pool_process_init(p, args.n_thread*2, 0);
+    struct thread_pool_result *r;
+    for ( ;; ) {
+        struct anno_pool *pool = anno_reader(args.fp_input, args.bcf_hdr, args.n_record);
+        if ( pool->n_reader == 0 ) {
+            free(pool->readers);
+            free(pool);
+            break;
+        }
+        pool->arg = pks;
+        int block;
+        do {
+            block = thread_pool_dispatch2(p, q, anno_atac, pool, 1);
+            if ( ( r = thread_pool_next_result(q) ) ) {
+                write_chunk((struct anno_pool*)r->data);
+                thread_pool_delete_result(r, 1);
+            }
+        } while ( block == -1 );
+    }
+    thread_pool_process_flush(q);
+    while ( (r = thread_pool_next_result(q)) ) {
+        write_chunk((struct anno_pool*)r->data);
+        thread_pool_delete_result(r, 1);
+    }
+    thread_pool_process_destroy(q);
+    thread_pool_destroy(p);
     return 0;
 }
 
@@ -306,17 +450,74 @@ int usage()
     // SAMPLE_TREATMENT_INTERUPT
     // SAMPLE_
     fprintf(stderr, "bcfanno_atac\n");
-    fprintf(stderr, "  -bed    region.bed\n");
+    fprintf(stderr, "  -bed    region.bed, several files separated by comma are merged\n");
     fprintf(stderr, "  -bam    aln.bam\n");
+    fprintf(stderr, "  -bams   list of alignments, each line is a sample name in the VCF and its BAM file, separated by tab\n");
     fprintf(stderr, "  -vcf    wgs.vcf\n");
     //fprintf(stderr, "  -fasta  ref.fa\n");
-    fprintf(stderr, "  -s      sample name, if not set annotated to first sample in the VCF\n");
+    fprintf(stderr, "  -s      sample name of -bam, if not set annotated to first sample in the VCF\n");
+    fprintf(stderr, "  -t      threads, peaks are annotated in parallel\n");
+    fprintf(stderr, "  -r      records per thread chunk, default is %d\n", RECORDS_PER_CHUNK);
+    fprintf(stderr, "  -@      BGZF decompression threads, shared by all alignments\n");
+    fprintf(stderr, "  -O      output type, b|u|z|v\n");
+    fprintf(stderr, "  -o      output file\n");
     return 1;
 }
+
+// Load alignment files and map them to the VCF samples. Alignments of the same sample are merged.
+static void load_bam_list()
+{
+    int i, n_sample = bcf_hdr_nsamples(args.bcf_hdr);
+    if ( n_sample == 0 ) error("No sample found in %s.", args.vcf_fname);
+
+    if ( args.bam_fname ) {
+        args.n_bam = 1;
+        args.bam_fnames = malloc(sizeof(char*));
+        args.sample_ids = malloc(sizeof(int));
+        args.bam_fnames[0] = strdup(args.bam_fname);
+        args.sample_ids[0] = 0;
+        if ( args.sample_name ) {
+            args.sample_ids[0] = bcf_hdr_id2int(args.bcf_hdr, BCF_DT_SAMPLE, args.sample_name);
+            if ( args.sample_ids[0] < 0 ) error("No sample %s found in %s.", args.sample_name, args.vcf_fname);
+        }
+        return;
+    }
+
+    int n = 0;
+    char **lines = hts_readlines(args.bam_list_fname, &n);
+    if ( lines == NULL || n == 0 ) error("Failed to read %s.", args.bam_list_fname);
+    args.bam_fnames = malloc(n*sizeof(char*));
+    args.sample_ids = malloc(n*sizeof(int));
+    kstring_t str = { 0, 0, 0,};
+    for ( i = 0; i < n; ++i ) {
+        str.l = 0;
+        kputs(lines[i], &str);
+        free(lines[i]);
+        int n_field = 0;
+        int *s = ksplit(&str, '\t', &n_field);
+        if ( n_field == 0 ) {
+            free(s);
+            continue;
+        }
+        if ( n_field < 2 ) error("Format error, line %d of %s should be sample name and BAM file.", i+1, args.bam_list_fname);
+        int id = bcf_hdr_id2int(args.bcf_hdr, BCF_DT_SAMPLE, str.s + s[0]);
+        if ( id < 0 ) error("No sample %s found in %s.", str.s + s[0], args.vcf_fname);
+        args.sample_ids[args.n_bam] = id;
+        args.bam_fnames[args.n_bam++] = strdup(str.s + s[1]);
+        free(s);
+    }
+    free(str.s);
+    free(lines);
+    if ( args.n_bam == 0 ) error("No alignment found in %s.", args.bam_list_fname);
+}
+
 int parse_args(int argc, char **argv)
 {
     int i;
     const char *output_type = 0;
+    const char *thread = 0;
+    const char *record = 0;
+    const char *hts_thread = 0;
     // if ( argc == 1 ) return usage();
     
     for ( i = 1; i < argc; ) {
@@ -329,10 +530,20 @@ int parse_args(int argc, char **argv)
             var = &args.bed_fname;
         else if ( strcmp(a, "-bam") == 0 )
             var = &args.bam_fname;
+        else if ( strcmp(a, "-bams") == 0 )
+            var = &args.bam_list_fname;
         else if ( strcmp(a, "-vcf") == 0 )
             var = &args.vcf_fname;
         else if ( strcmp(a, "-fasta") == 0 )
             var = &args.fasta_fname;
+        else if ( strcmp(a, "-s") == 0 )
+            var = &args.sample_name;
+        else if ( strcmp(a, "-t") == 0 )
+            var = &thread;
+        else if ( strcmp(a, "-r") == 0 )
+            var = &record;
+        else if ( strcmp(a, "-@") == 0 )
+            var = &hts_thread;
         else if ( strcmp(a, "-O") == 0 )
             var = &output_type;
         else if ( strcmp(a, "-o") == 0 )
@@ -348,14 +559,21 @@ int parse_args(int argc, char **argv)
     }
 
     if ( args.vcf_fname == NULL ) error("Parameter -vcf is required. Use -h for more information");
-    if ( args.bam_fname == NULL ) error("Parameter -bam is required. Use -h for more information");
+    if ( args.bam_fname == NULL && args.bam_list_fname == NULL ) error("Parameter -bam or -bams is required. Use -h for more information");
+    if ( args.bam_fname && args.bam_list_fname ) error("Parameter -bam and -bams are exclusive.");
     if ( args.bed_fname == NULL ) error("Parameter -bed is required. Use -h for more information");
     //if ( args.fasta_fname == NULL ) error("-fasta is required.");
 
-    args.bed = bedaux_init();
-    bed_read(args.bed, args.bed_fname);
+    if ( thread ) args.n_thread = str2int((char*)thread);
+    if ( record ) args.n_record = str2int((char*)record);
+    if ( hts_thread ) args.n_hts_thread = str2int((char*)hts_thread);
+    if ( args.n_thread < 1 ) args.n_thread = 1;
+    if ( args.n_record < 1 ) args.n_record = RECORDS_PER_CHUNK;
+
+    // regions are sorted and merged by chromosomes in parallel
+    set_bed_threads(args.n_thread);
+    args.bed = bed_read_several_files(args.bed_fname);
     if ( args.bed->flag & bed_bit_empty) error("Could not load BED file. %s.", args.bed_fname);
-    bed_merge(args.bed);
 
     args.fp_input = hts_open(args.vcf_fname, "r");
     if ( args.fp_input == NULL ) error("%s : %s.", args.vcf_fname, strerror(errno));
@@ -379,6 +597,13 @@ int parse_args(int argc, char **argv)
         hts_open(args.out_fname, hts_bcf_wmode(out_type));
     
     args.bcf_hdr = bcf_hdr_read(args.fp_input);
+    if ( args.bcf_hdr == NULL ) error("Failed to parse header of %s.", args.vcf_fname);
+    load_bam_list();
+
+    if ( args.n_hts_thread > 0 ) {
+        args.hts_pool.pool = hts_tpool_init(args.n_hts_thread);
+        if ( args.hts_pool.pool == NULL ) error("Failed to init BGZF threads.");
+    }
 
 #define BRANCH(_key, _description) do {                                 \
         int id;                                                         \
@@ -401,24 +626,31 @@ int parse_args(int argc, char **argv)
 }
 void memory_release()
 {
+    int i;
     hts_close(args.fp_input);
     hts_close(args.fp_out);
+    bcf_hdr_destroy(args.bcf_hdr);
+    bed_destroy(args.bed);
+    for ( i = 0; i < args.n_bam; ++i ) free(args.bam_fnames[i]);
+    free(args.bam_fnames);
+    free(args.sample_ids);
+    if ( args.hts_pool.pool ) hts_tpool_destroy(args.hts_pool.pool);
 }
 int main(int argc, char **argv)
 {
     if ( parse_args(argc, argv) ) return 1;
     
-    struct CAA *CAA = CAA_init(args.bam_fname);
-    CAA->args = &args;
-    CAA->bed = args.bed;
-    CAA->bcf_hdr = args.bcf_hdr;
-    CAA->id = bcf_hdr_id2int(args.bcf_hdr, BCF_DT_ID, "GT");    
-    if ( CAA->id <0 ) error("No GT tag found at input VCF.");
+    // alignment handlers for each thread
+    struct CAA_peak **pks = malloc(args.n_thread*sizeof(void*));
+    int i;
+    pks[0] = CAA_peak_init(&args);
+    for ( i = 1; i < args.n_thread; ++i ) pks[i] = CAA_peak_duplicate(pks[0]);
     
-    anno_vcf_atac_main(CAA);
+    anno_vcf_atac_main(pks);
 
     // release memory
-    CAA_destroy(CAA);
+    for ( i = args.n_thread - 1; i >= 0; --i ) CAA_peak_destroy(pks[i], i);
+    free(pks);
     memory_release();
     
     return 0;
@@ -11,6 +11,7 @@
 
 #include "number.h"
 #include "anno_flank.h"
+#include "motif.h"
 
 // for genepredext format, this format has been instead by GenomeElementAnnotation file.
 //#include "genepred.h"
@@ -18,9 +19,17 @@
 
 // for GenomeElementAnnotation file
 #include "anno_seqon.h"
+#include "ref_store.h"
 
 #include "version.h"
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "htslib/hfile.h"
 
 struct anno_index {
     // point to hdr_out, DO NOT free it
@@ -37,10 +46,10 @@ struct anno_index {
     struct anno_mc_file *mc_file;
     // flank sequence
     struct seqidx *seqidx;
+    // PWM scores of motifs
+    struct MTF *motif;
 };
 
-extern int bcf_add_flankseq(struct seqidx *idx, bcf_hdr_t *hdr, bcf1_t *line);
-
 static const char *hts_bcf_wmode(int file_type)
 {
     if ( file_type == FT_BCF ) return "wbu";    // uncompressed BCF
@@ -48,6 +57,17 @@ static const char *hts_bcf_wmode(int file_type)
     if ( file_type & FT_GZ ) return "wz";       // compressed VCF
     return "w";                                 // uncompressed VCF
 }
+// -O b|u|z|v, return -1 if not recognised
+static int hts_output_type(char c)
+{
+    switch (c) {
+        case 'b': return FT_BCF_GZ;
+        case 'u': return FT_BCF;
+        case 'z': return FT_VCF_GZ;
+        case 'v': return FT_VCF;
+        default : return -1;
+    }
+}
 
 int usage()
 {
@@ -64,6 +84,15 @@ int usage()
     fprintf(stderr, "   --unsort                       set if input is not sorted by cooridinate, **bad performance**\n");
     fprintf(stderr, "   --flank                        if set this flag and reference genome specified in configure, FLKSEQ tag will be generated\n");
     fprintf(stderr, "   --mito                         set the mitochodrial sequence name, default is chrM. Human mito use a different genetic code map!\n");
+    fprintf(stderr, "   --gea-in-memory                load the whole gene_data database into memory once, shared by all threads\n");
+    fprintf(stderr, "   --refseq-in-memory             pack the refseq transcript sequences into memory once, shared by all threads\n");
+    fprintf(stderr, "   --mc-cache FILE                reuse consequences predicted in previous runs, new variants are added to FILE\n");
+    fprintf(stderr, "   --batch FILE                   annotate each VCF/BCF listed in FILE, one path per line, databases are loaded once\n");
+    fprintf(stderr, "   --outdir DIR                   output directory of batch mode, output is named after input and -O\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Server mode, keep databases resident and annotate VCF/BCF streamed by clients :\n");
+    fprintf(stderr, "       bcfanno serve -c config.json --socket PATH [-t thread] [options]\n");
+    fprintf(stderr, "       bcfanno client --socket PATH [-o output] [-O b|u|z|v] in.vcf.gz\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Homepage: https://github.com/shiquan/bcfanno\n");
     fprintf(stderr, "\n");
@@ -108,6 +137,18 @@ struct args {
     int input_unsorted;
     // if this flag and reference genome is set, FLKSEQ will be annotated
     int flank_seq_is_need;
+
+    // load GEA database into memory instead of query the index for each chunk
+    int gea_in_memory;
+    int refseq_in_memory;
+    // persistent consequence cache across runs
+    const char *mc_cache_fname;
+
+    // unix socket path of server mode, databases are loaded once and shared by client sessions
+    const char *socket_fname;
+    // batch mode, annotate each input listed in batch file into outdir, databases are loaded once
+    const char *batch_fname;
+    const char *outdir;
     
     // records to cache per thread
     int n_record;
@@ -131,6 +172,12 @@ struct args {
     .n_thread     = 1,
     .input_unsorted = 0,
     .flank_seq_is_need = 0,
+    .gea_in_memory = 0,
+    .refseq_in_memory = 0,
+    .mc_cache_fname = NULL,
+    .socket_fname = NULL,
+    .batch_fname  = NULL,
+    .outdir       = NULL,
     .n_record     = RECORDS_PER_CHUNK,
     .indexs       = NULL,
     .total_record = 0,
@@ -172,6 +219,18 @@ struct anno_index *anno_index_init(bcf_hdr_t *hdr, struct bcfanno_config *config
     if ( refgene_config->genepred_fname && refgene_config->refseq_fname ) {
         if ( file_is_GEA(refgene_config->genepred_fname) == 0 ) {
             idx->mc_file = anno_mc_file_init(hdr, refgene_config->columns, refgene_config->genepred_fname, refgene_config->refseq_fname, config->reference_path, refgene_config->trans_list_fname);
+            if ( idx->mc_file && args.gea_in_memory ) {
+                if ( anno_mc_file_load_memory(idx->mc_file) )
+                    error("Failed to load %s into memory.", refgene_config->genepred_fname);
+            }
+            if ( idx->mc_file && args.refseq_in_memory ) {
+                if ( anno_mc_file_load_rna_memory(idx->mc_file) )
+                    error("Failed to load %s into memory.", refgene_config->refseq_fname);
+            }
+            if ( idx->mc_file && args.mc_cache_fname ) {
+                if ( anno_mc_file_cache_open(idx->mc_file, args.mc_cache_fname, refgene_config->trans_list_fname) )
+                    error("Failed to open consequence cache %s.", args.mc_cache_fname);
+            }
             annotation_file_is_gea_format = 1;
         }
         else {
@@ -183,8 +242,17 @@ struct anno_index *anno_index_init(bcf_hdr_t *hdr, struct bcfanno_config *config
     if ( config->reference_path ) {
         idx->seqidx = load_sequence_index(config->reference_path);
         if ( idx->seqidx ) bcf_header_add_flankseq(hdr);
+        if ( idx->seqidx && idx->mc_file ) anno_mc_file_set_reference(idx->mc_file, idx->seqidx);
     }
     else idx->seqidx = NULL;
+
+    if ( config->motif.motif_fname ) {
+        if ( idx->seqidx == NULL ) error("Reference is required for motifs annotation.");
+        idx->motif = anno_motif_file_init(hdr, config->motif.motif_fname, config->motif.bed_fname,
+                                          config->motif.index_fname, idx->seqidx->store, config->motif.min);
+        // motifs around records are scored from the chunk window
+        seqidx_set_margin(idx->seqidx, anno_motif_margin(idx->motif));
+    }
     
     idx->hdr_out = hdr;
     
@@ -207,6 +275,8 @@ struct anno_index *anno_index_duplicate(struct anno_index *idx)
     // if ( idx->hgvs ) d->hgvs = anno_hgvs_file_duplicate(idx->hgvs);
     if ( idx->mc_file ) d->mc_file = anno_mc_file_duplicate(idx->mc_file);
     if ( idx->seqidx ) d->seqidx = sequence_index_duplicate(idx->seqidx);
+    if ( d->seqidx && d->mc_file ) anno_mc_file_set_reference(d->mc_file, d->seqidx);
+    if ( idx->motif ) d->motif = anno_motif_file_duplicate(idx->motif);
     return d;
 }
 void anno_index_destroy(struct anno_index *idx, int l)
@@ -219,6 +289,7 @@ void anno_index_destroy(struct anno_index *idx, int l)
     if ( idx->bed_files ) free(idx->bed_files);
     // if ( idx->hgvs ) anno_hgvs_file_destroy(idx->hgvs);
     if ( idx->mc_file) anno_mc_file_destroy(idx->mc_file, l);
+    if ( idx->motif ) anno_motif_file_destroy(idx->motif, l);
     if ( idx->seqidx ) sequence_index_destroy(idx->seqidx);
     free(idx);
 }
@@ -237,7 +308,9 @@ int parse_args(int argc, char **argv)
     const char *thread = 0;
     const char *record = 0;
     const char *mito = 0;
-    for (i = 1; i < argc; ) {
+    // server mode, "bcfanno serve -c config.json --socket path"
+    int serve_mode = argc > 1 && strcmp(argv[1], "serve") == 0;
+    for (i = 1 + serve_mode; i < argc; ) {
 	const char *a = argv[i++];
 	if ( strcmp(a, "-h") == 0 || strcmp(a, "--help") == 0)
 	    return usage();
@@ -245,6 +318,8 @@ int parse_args(int argc, char **argv)
 	// quiet mode
 	if ( strcmp(a, "-q") == 0 || strcmp(a, "--quiet") == 0 ) {
 	    quiet_mode = 1;
+	    ref_store_set_quiet(1);
+	    motif_set_quiet(1);
 	    continue;
 	}
         
@@ -260,6 +335,14 @@ int parse_args(int argc, char **argv)
             args.flank_seq_is_need = 1;
             continue;
         }
+        if ( strcmp(a, "--gea-in-memory") == 0 ) {
+            args.gea_in_memory = 1;
+            continue;
+        }
+        if ( strcmp(a, "--refseq-in-memory") == 0 ) {
+            args.refseq_in_memory = 1;
+            continue;
+        }
             
         const char **var = 0;
 	if ( strcmp(a, "-c") == 0 || strcmp(a, "--config") == 0 ) 
@@ -274,6 +357,14 @@ int parse_args(int argc, char **argv)
             var = &record;
         else if ( strcmp(a, "--mito") == 0 )
             var = &mito;
+        else if ( strcmp(a, "--mc-cache") == 0 )
+            var = &args.mc_cache_fname;
+        else if ( strcmp(a, "--socket") == 0 && serve_mode )
+            var = &args.socket_fname;
+        else if ( strcmp(a, "--batch") == 0 )
+            var = &args.batch_fname;
+        else if ( strcmp(a, "--outdir") == 0 )
+            var = &args.outdir;
         
 	if ( var != 0 ) {
 	    if (i == argc) error("Missing an argument after %s", a);
@@ -283,7 +374,7 @@ int parse_args(int argc, char **argv)
         
         if ( a[0] == '-' && a[1] ) error("Unknown parameter. %s", a);
 
-        if ( args.fname_input == 0 ) {
+        if ( args.fname_input == 0 && serve_mode == 0 && args.batch_fname == 0 ) {
 	    args.fname_input = a;
 	    continue;
 	}
@@ -311,6 +402,49 @@ int parse_args(int argc, char **argv)
 	bcfanno_config_debug(args.config);
     }
 
+    if ( thread ) {
+        args.n_thread = str2int((char*)thread);
+        if ( args.n_thread < 1 ) args.n_thread = 1;
+    }
+    if ( record ) {
+        args.n_record = str2int((char*)record);
+        if ( args.n_record < 0 ) args.n_record = 1000;
+    }
+
+    // set Mito environment
+    if ( mito == NULL ) 
+        setenv("BCFANNO_MITOCHR", "chrM", 1);
+    else 
+        setenv("BCFANNO_MITOCHR", mito, 1);
+
+    if ( quiet_mode == 0 ) {
+        const char *mito_par =  getenv("BCFANNO_MITOCHR");
+        LOG_print("Set environment parameter BCFANNO_MITOCHR to %s", mito_par);
+    }
+
+    // init output type
+    args.output_type = FT_VCF;
+    if ( output_fname_type != 0 ) {
+        args.output_type = hts_output_type(output_fname_type[0]);
+        if ( args.output_type == -1 )
+            error("The output type \"%s\" not recognised\n", output_fname_type);
+    }
+
+    if ( serve_mode || args.batch_fname ) {
+        if ( serve_mode && args.socket_fname == NULL ) error("No socket is specified for server mode. Use --socket PATH.");
+        if ( args.batch_fname && args.outdir == NULL ) error("No output directory is specified for batch mode. Use --outdir DIR.");
+        // inputs and outputs of batch mode come from the batch file and --outdir
+        if ( args.batch_fname && args.fname_input ) error("Input file %s could not be used with --batch, list it in the batch file.", args.fname_input);
+        if ( args.batch_fname && args.fname_output ) error("-o could not be used with --batch, outputs are written into --outdir.");
+        // indexs are initialised with an empty header, annotation header lines are merged into header of each input
+        args.hdr = bcf_hdr_init("w");
+        args.indexs = malloc(args.n_thread*sizeof(struct anno_index));    
+        args.indexs[0] = anno_index_init(args.hdr, args.config);
+        for ( i = 1; i < args.n_thread; ++i )
+            args.indexs[i] = anno_index_duplicate(args.indexs[0]);
+        return 0;
+    }
+
     // if input file is not set, use stdin
     if ( args.fname_input == 0 && (!isatty(fileno(stdin))) )
         args.fname_input = "-";
@@ -329,33 +463,8 @@ int parse_args(int argc, char **argv)
     if ( type.format  != vcf && type.format != bcf )
         error("Unsupported input format, only accept BCF/VCF format. %s", args.fname_input);
 
-    if ( thread ) {
-        args.n_thread = str2int((char*)thread);
-        if ( args.n_thread < 1 ) args.n_thread = 1;
-    }
-    if ( record ) {
-        args.n_record = str2int((char*)record);
-        if ( args.n_record < 0 ) args.n_record = 1000;
-    }
-        
-    // init output type
-    int out_type = FT_VCF;
-    if ( output_fname_type != 0 ) {
-	switch (output_fname_type[0]) {
-	    case 'b':
-		out_type = FT_BCF_GZ; break;
-	    case 'u':
-		out_type = FT_BCF; break;
-	    case 'z':
-		out_type = FT_VCF_GZ; break;
-	    case 'v':
-		out_type = FT_VCF; break;
-	    default :
-		error("The output type \"%d\" not recognised\n", out_type);
-	};
-    }
     // init output file handler
-    args.fp_out = args.fname_output == 0 ? hts_open("-", hts_bcf_wmode(out_type)) : hts_open(args.fname_output, hts_bcf_wmode(out_type));
+    args.fp_out = args.fname_output == 0 ? hts_open("-", hts_bcf_wmode(args.output_type)) : hts_open(args.fname_output, hts_bcf_wmode(args.output_type));
 
 //    if ( annotation_file_is_gea_format == 0 ) { // assume it is genepredext format
         // set genepredExt format
@@ -366,18 +475,6 @@ int parse_args(int argc, char **argv)
     args.hdr = bcf_hdr_read(args.fp_input);
     if ( args.hdr == NULL)
 	error("Failed to parse header of input.");
-
-
-    // set Mito environment
-    if ( mito == NULL ) 
-        setenv("BCFANNO_MITOCHR", "chrM", 1);
-    else 
-        setenv("BCFANNO_MITOCHR", mito, 1);
-
-    if ( quiet_mode == 0 ) {
-        const char *mito_par =  getenv("BCFANNO_MITOCHR");
-        LOG_print("Set environment parameter BCFANNO_MITOCHR to %s", mito_par);
-    }
         
     /******************
          INIT indexs   
@@ -405,8 +502,8 @@ int parse_args(int argc, char **argv)
 
 void memory_release()
 {
-    hts_close(args.fp_input);
-    hts_close(args.fp_out);
+    if ( args.fp_input ) hts_close(args.fp_input);
+    if ( args.fp_out ) hts_close(args.fp_out);
     bcfanno_config_destroy(args.config);
     bcf_hdr_destroy(args.hdr);
     int i;
@@ -421,6 +518,8 @@ void *anno_core(void *arg, int idx)
 
     struct anno_index *index = args.indexs[idx];
     struct anno_pool  *pool  = (struct anno_pool*) arg;
+    // in server mode, records are read with the header of client session
+    bcf_hdr_t *hdr = pool->arg ? (bcf_hdr_t*)pool->arg : index->hdr_out;
     
     int i, j ;
     // IMPROVE HERE: read line by line may not require sorted input but highly CPU consume, read a chunk of records
@@ -438,13 +537,18 @@ void *anno_core(void *arg, int idx)
             // if ( index->mc_file ) do not support unsorted input
 
             for ( j = 0; j < index->n_vcf; ++j )
-                anno_vcf_core(index->vcf_files[j], index->hdr_out, line);
+                anno_vcf_core(index->vcf_files[j], hdr, line);
         
             for ( j = 0; j < index->n_bed; ++j )
-                anno_bed_core(index->bed_files[j], index->hdr_out, line);
+                anno_bed_core(index->bed_files[j], hdr, line);
 
             if ( args.flank_seq_is_need == 1 && index->seqidx )
-                bcf_add_flankseq(index->seqidx, index->hdr_out, line);
+                bcf_add_flankseq(index->seqidx, hdr, line);
+
+            if ( index->motif ) {
+                index->motif->bcf_hdr = hdr;
+                anno_vcf_motif_pwm(index->motif, line);
+            }
         }
     }
     // retrieve attributes in chunk
@@ -455,17 +559,22 @@ void *anno_core(void *arg, int idx)
             
             //if ( index->hgvs )
             // anno_hgvs_chunk(index->hgvs, index->hdr_out, pool);
+            // reference window of this chunk, shared by the annotators
+            int no_window = 1;
+            if ( (args.flank_seq_is_need == 1 || index->motif) && index->seqidx )
+                no_window = seqidx_chunk_window(index->seqidx, hdr, pool);
             if ( index->mc_file )
-                anno_mc_chunk(index->mc_file, index->hdr_out, pool);
+                anno_mc_chunk(index->mc_file, hdr, pool);
+            if ( index->motif )
+                anno_motif_chunk(index->motif, hdr, pool, no_window ? NULL : index->seqidx->win.s,
+                                 index->seqidx->win_start, index->seqidx->win.l);
             
             for ( i = 0; i < index->n_vcf; ++i )
-                anno_vcf_chunk(index->vcf_files[i], index->hdr_out, pool);
+                anno_vcf_chunk(index->vcf_files[i], hdr, pool);
             for ( i = 0; i < index->n_bed; ++i )                
-                anno_bed_chunk(index->bed_files[i], index->hdr_out, pool);
-        }
-        if ( args.flank_seq_is_need == 1 && index->seqidx ) {
-            for ( i = 0; i < pool->n_reader; ++i) 
-                bcf_add_flankseq(index->seqidx, index->hdr_out, pool->readers[i]);
+                anno_bed_chunk(index->bed_files[i], hdr, pool);
+            if ( args.flank_seq_is_need == 1 && index->seqidx )
+                bcf_add_flankseq_chunk(index->seqidx, hdr, pool);
         }
     }
     
@@ -494,6 +603,8 @@ int annotate_light()
                 anno_bed_core(idx->bed_files[j], idx->hdr_out, line);
 
             if ( args.flank_seq_is_need == 1 && idx->seqidx ) bcf_add_flankseq(idx->seqidx, idx->hdr_out, line);
+
+            if ( idx->motif ) anno_vcf_motif_pwm(idx->motif, line);
           output_line:
             bcf_write1(args.fp_out, args.hdr, line);
         }
@@ -510,17 +621,22 @@ int annotate_light()
 
                 //  if ( idx->hgvs )
                 //  anno_hgvs_chunk(idx->hgvs, idx->hdr_out, pool);
+                // reference window of this chunk, shared by the annotators
+                int no_window = 1;
+                if ( (args.flank_seq_is_need == 1 || idx->motif) && idx->seqidx )
+                    no_window = seqidx_chunk_window(idx->seqidx, idx->hdr_out, pool);
                 if ( idx->mc_file )
                     anno_mc_chunk(idx->mc_file, idx->hdr_out, pool);
+                if ( idx->motif )
+                    anno_motif_chunk(idx->motif, idx->hdr_out, pool, no_window ? NULL : idx->seqidx->win.s,
+                                     idx->seqidx->win_start, idx->seqidx->win.l);
                 
                 for ( i = 0; i < idx->n_vcf; ++i )
                     anno_vcf_chunk(idx->vcf_files[i], idx->hdr_out, pool);
                 for ( i = 0; i < idx->n_bed; ++i )                
                     anno_bed_chunk(idx->bed_files[i], idx->hdr_out, pool);
-            }
-            if ( args.flank_seq_is_need == 1 && idx->seqidx ) {
-                for ( i = 0; i < pool->n_reader; ++i) 
-                    bcf_add_flankseq(idx->seqidx, idx->hdr_out, pool->readers[i]);                
+                if ( args.flank_seq_is_need == 1 && idx->seqidx )
+                    bcf_add_flankseq_chunk(idx->seqidx, idx->hdr_out, pool);
             }
             for ( i = 0; i < pool->n_reader; ++i) {
                 bcf_write1(args.fp_out, args.hdr, pool->readers[i]);
@@ -533,6 +649,18 @@ int annotate_light()
     return 0;
 }
 
+// write annotated records and release them, return -1 on write failure
+static int anno_pool_write(htsFile *fp, bcf_hdr_t *hdr, struct anno_pool *d)
+{
+    int i, ret = 0;
+    for ( i = 0; i < d->n_reader; ++i) {
+        if ( ret == 0 && bcf_write1(fp, hdr, d->readers[i]) < 0 ) ret = -1;
+        bcf_destroy(d->readers[i]);
+    }
+    free(d->readers);
+    return ret;
+}
+
 int annotate()
 {
     if ( args.test_databases_only == 1) return 0;
@@ -540,12 +668,12 @@ int annotate()
     // lightweight mode
     if ( args.n_thread == 1 ) return annotate_light();
 
-    // keep 1 thread to maintain main stream    
-    args.n_thread = args.n_thread-1;
+    // keep 1 thread to maintain main stream, args.n_thread is still used to release indexes
+    int n_worker = args.n_thread-1;
     
     // multi thread mode
-    struct thread_pool *p = thread_pool_init(args.n_thread);
-    struct thread_pool_process *q = thread_pool_process_init(p, args.n_thread*2, 0);
+    struct thread_pool *p = thread_pool_init(n_worker);
+    struct thread_pool_process *q = thread_pool_process_init(p, n_worker*2, 0);
     struct thread_pool_result  *r;
 
     for ( ;; ) {
@@ -558,13 +686,7 @@ int annotate()
         do {
             block = thread_pool_dispatch2(p, q, anno_core, arg, 1);
             if ( (r = thread_pool_next_result(q))) {
-                struct anno_pool *d = (struct anno_pool*)r->data;
-                int i;
-                for ( i = 0; i < d->n_reader; ++i) {
-                    bcf_write1(args.fp_out, args.hdr, d->readers[i]);
-                    bcf_destroy(d->readers[i]);
-                }
-                free(d->readers);                
+                anno_pool_write(args.fp_out, args.hdr, (struct anno_pool*)r->data);
                 thread_pool_delete_result(r, 1);
             }
         } while (block == -1);
@@ -572,18 +694,508 @@ int annotate()
 
     thread_pool_process_flush(q);
     while (( r = thread_pool_next_result(q) )) {
-        struct anno_pool *d = (struct anno_pool*)r->data;
-        int i;
-        for ( i = 0; i < d->n_reader; ++i) {
-            bcf_write1(args.fp_out, args.hdr, d->readers[i]);
-            bcf_destroy(d->readers[i]);
+        anno_pool_write(args.fp_out, args.hdr, (struct anno_pool*)r->data);
+        thread_pool_delete_result(r, 1);
+    }
+    thread_pool_process_destroy(q);
+    thread_pool_destroy(p);
+
+    return 0;
+}
+
+/*
+  Server mode. Databases and indexs are loaded once and kept resident, each client connection is a session which
+  streams VCF/BCF in and receives the annotated records. Chunks of all sessions are scheduled onto the same worker
+  pool, each session has its own process queue so records are written back in order.
+
+  Protocol : client sends a request line "bcfanno <output type>\n" followed by the input file, and shuts down its
+  write side at the end of input. Server writes the annotated file back and closes the connection.
+ */
+struct serve_session {
+    int id;
+    int fd;
+    struct thread_pool *p;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int n_active;
+    volatile sig_atomic_t stop;
+} serve_state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+    .n_active = 0,
+    .stop = 0,
+};
+
+static void serve_stop(int sig)
+{
+    serve_state.stop = 1;
+}
+
+// Read request line, return output type or -1 on bad request.
+static int serve_read_request(int fd)
+{
+    char buf[64];
+    int l = 0;
+    for ( ;; ) {
+        if ( read(fd, buf+l, 1) != 1 ) return -1;
+        if ( buf[l] == '\n' ) break;
+        if ( ++l == sizeof(buf) ) return -1;
+    }
+    if ( l != 9 || strncmp(buf, "bcfanno ", 8) != 0 ) return -1;
+    return hts_output_type(buf[8]);
+}
+
+/*
+  Annotate one input stream with the resident indexs, used by server and batch mode. Annotation header lines are
+  merged from args.hdr into the header of input, chunks are dispatched to the shared worker pool and written in
+  order by the calling thread. name is used in messages. Return -1 on failure.
+ */
+static int annotate_stream(struct thread_pool *p, htsFile *fp_in, htsFile *fp_out, const char *name, uint64_t *n_record)
+{
+    if ( fp_in->format.format != vcf && fp_in->format.format != bcf ) {
+        error_print("%s : unsupported input format, only accept BCF/VCF format.", name);
+        return -1;
+    }
+    bcf_hdr_t *hdr = bcf_hdr_read(fp_in);
+    if ( hdr == NULL ) {
+        error_print("%s : failed to parse header of input.", name);
+        return -1;
+    }
+    bcf_hdr_merge(hdr, args.hdr);
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "##bcfannoVersion=%s+htslib-%s", BCFANNO_VERSION, hts_version());
+    bcf_hdr_append(hdr, str.s);
+    str.l = 0;
+    ksprintf(&str, "##bcfannoCommand=%s", args.commands.s);
+    bcf_hdr_append(hdr, str.s);
+    free(str.s);
+    bcf_hdr_sync(hdr);
+
+    if ( bcf_hdr_write(fp_out, hdr) < 0 ) {
+        error_print("%s : failed to write output.", name);
+        bcf_hdr_destroy(hdr);
+        return -1;
+    }
+    
+    struct thread_pool_process *q = thread_pool_process_init(p, args.n_thread*2, 0);
+    struct thread_pool_result  *r;
+    // stop reading once output is broken, client may have gone
+    int failed = 0;
+    while ( failed == 0 ) {
+        struct anno_pool *arg = anno_reader(fp_in, hdr, args.n_record);
+        if ( arg->n_reader == 0 ) {
+            free(arg->readers);
+            free(arg);
+            break;
         }
-        free(d->readers);
+        *n_record += (uint64_t)arg->n_reader;
+        arg->arg = hdr;
+        int block;
+        do {
+            block = thread_pool_dispatch2(p, q, anno_core, arg, 1);
+            if ( (r = thread_pool_next_result(q))) {
+                if ( anno_pool_write(fp_out, hdr, (struct anno_pool*)r->data) ) failed = 1;
+                thread_pool_delete_result(r, 1);
+            }
+        } while (block == -1);
+    }
+
+    thread_pool_process_flush(q);
+    while (( r = thread_pool_next_result(q) )) {
+        if ( anno_pool_write(fp_out, hdr, (struct anno_pool*)r->data) ) failed = 1;
         thread_pool_delete_result(r, 1);
     }
     thread_pool_process_destroy(q);
+    bcf_hdr_destroy(hdr);
+    if ( failed ) {
+        error_print("%s : failed to write output.", name);
+        return -1;
+    }
+    return 0;
+}
+
+static int serve_session_core(struct serve_session *s, uint64_t *n_record)
+{
+    int out_type = serve_read_request(s->fd);
+    if ( out_type == -1 ) {
+        close(s->fd);
+        error_print("Session %d : bad request.", s->id);
+        return -1;
+    }
+    int fd_out = dup(s->fd);
+    hFILE *hin = hdopen(s->fd, "r");
+    hFILE *hout = fd_out == -1 ? NULL : hdopen(fd_out, "w");
+    if ( hin == NULL || hout == NULL ) {
+        if ( hin ) hclose_abruptly(hin); else close(s->fd);
+        if ( hout ) hclose_abruptly(hout); else if ( fd_out != -1 ) close(fd_out);
+        error_print("Session %d : failed to open connection. %s", s->id, strerror(errno));
+        return -1;
+    }
+    htsFile *fp_in = hts_hopen(hin, "-", "r");
+    htsFile *fp_out = fp_in == NULL ? NULL : hts_hopen(hout, "-", hts_bcf_wmode(out_type));
+    if ( fp_in == NULL || fp_out == NULL ) {
+        if ( fp_in ) hts_close(fp_in); else hclose_abruptly(hin);
+        hclose_abruptly(hout);
+        error_print("Session %d : failed to open stream.", s->id);
+        return -1;
+    }
+    kstring_t name = {0,0,0};
+    ksprintf(&name, "Session %d", s->id);
+    int ret = annotate_stream(s->p, fp_in, fp_out, name.s, n_record);
+    if ( hts_close(fp_out) ) ret = -1;
+    hts_close(fp_in);
+    free(name.s);
+    return ret;
+}
+
+static void *serve_session(void *arg)
+{
+    struct serve_session *s = (struct serve_session*)arg;
+    uint64_t n_record = 0;
+    if ( serve_session_core(s, &n_record) == 0 && quiet_mode == 0 )
+        LOG_print("Session %d : annotate %llu records.", s->id, (unsigned long long)n_record);
+
+    pthread_mutex_lock(&serve_state.lock);
+    args.total_record += n_record;
+    if ( --serve_state.n_active == 0 ) pthread_cond_signal(&serve_state.idle);
+    pthread_mutex_unlock(&serve_state.lock);
+    free(s);
+    return NULL;
+}
+
+int anno_serve()
+{
+    struct sockaddr_un addr;
+    if ( strlen(args.socket_fname) >= sizeof(addr.sun_path) )
+        error("Socket path is too long. %s", args.socket_fname);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, args.socket_fname);
+
+    // remove stale socket of last server, never touch other files
+    struct stat st;
+    if ( stat(args.socket_fname, &st) == 0 ) {
+        if ( !S_ISSOCK(st.st_mode) ) error("%s exists and is not a socket.", args.socket_fname);
+        unlink(args.socket_fname);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ( fd == -1 ) error("Failed to create socket. %s", strerror(errno));
+    if ( bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 64) )
+        error("Failed to listen on %s. %s", args.socket_fname, strerror(errno));
+
+    // clients may close connection before output finished
+    signal(SIGPIPE, SIG_IGN);
+    // stop accepting new sessions on SIGINT/SIGTERM, accept() is interrupted so no SA_RESTART
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // signals are only handled by this thread, workers and sessions block them
+    sigset_t mask, old;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    struct thread_pool *p = thread_pool_init(args.n_thread);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if ( quiet_mode == 0 ) LOG_print("Listening on %s, %d threads.", args.socket_fname, args.n_thread);
+    
+    int id = 0;
+    while ( serve_state.stop == 0 ) {
+        int c = accept(fd, NULL, NULL);
+        if ( c == -1 ) {
+            if ( errno != EINTR ) warnings("Failed to accept connection. %s", strerror(errno));
+            continue;
+        }
+        struct serve_session *s = malloc(sizeof(*s));
+        s->id = ++id;
+        s->fd = c;
+        s->p = p;
+        pthread_mutex_lock(&serve_state.lock);
+        serve_state.n_active++;
+        pthread_mutex_unlock(&serve_state.lock);
+
+        pthread_t tid;
+        pthread_sigmask(SIG_BLOCK, &mask, &old);
+        int ret = pthread_create(&tid, NULL, serve_session, s);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if ( ret ) {
+            warnings("Failed to create session. %s", strerror(ret));
+            close(c);
+            free(s);
+            pthread_mutex_lock(&serve_state.lock);
+            serve_state.n_active--;
+            pthread_mutex_unlock(&serve_state.lock);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    close(fd);
+    unlink(args.socket_fname);
+
+    if ( quiet_mode == 0 ) LOG_print("Stop server, wait for running sessions.");
+    pthread_mutex_lock(&serve_state.lock);
+    while ( serve_state.n_active ) pthread_cond_wait(&serve_state.idle, &serve_state.lock);
+    pthread_mutex_unlock(&serve_state.lock);
+    
     thread_pool_destroy(p);
+    free(args.commands.s);
+    return 0;
+}
+
+/*
+  Batch mode. Several inputs are annotated at the same time, each input is read and written in order by one batch
+  thread, while its chunks are processed by the shared worker pool.
+ */
+struct batch_job {
+    int n;
+    int i; // next input
+    char **inputs;
+    char **outputs;
+    struct thread_pool *p;
+    pthread_mutex_t lock;
+    int n_failed;
+    uint64_t n_record;
+};
+
+// Output is named after the input without VCF/BCF suffix, plus the suffix of output type.
+static char *batch_output_name(const char *input)
+{
+    static const char *suffix[] = { ".vcf.gz", ".vcf.bgz", ".bcf", ".vcf", NULL };
+    const char *base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+    int i, l = strlen(base);
+    for ( i = 0; suffix[i]; ++i ) {
+        int ls = strlen(suffix[i]);
+        if ( l > ls && strcmp(base + l - ls, suffix[i]) == 0 ) {
+            l -= ls;
+            break;
+        }
+    }
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s/%.*s%s", args.outdir, l, base, args.output_type & FT_BCF ? ".bcf" : args.output_type & FT_GZ ? ".vcf.gz" : ".vcf");
+    return str.s;
+}
+
+static void *batch_worker(void *arg)
+{
+    struct batch_job *b = (struct batch_job*)arg;
+    for ( ;; ) {
+        pthread_mutex_lock(&b->lock);
+        int i = b->i++;
+        pthread_mutex_unlock(&b->lock);
+        if ( i >= b->n ) break;
+
+        uint64_t n_record = 0;
+        int ret = -1;
+        // write into a temporary file, so a failed input leaves no truncated output next to the good ones
+        kstring_t tmp = {0,0,0};
+        ksprintf(&tmp, "%s.tmp", b->outputs[i]);
+        htsFile *fp_in = hts_open(b->inputs[i], "r");
+        htsFile *fp_out = fp_in == NULL ? NULL : hts_open(tmp.s, hts_bcf_wmode(args.output_type));
+        if ( fp_in == NULL || fp_out == NULL )
+            error_print("Failed to open %s.", fp_in == NULL ? b->inputs[i] : tmp.s);
+        else
+            ret = annotate_stream(b->p, fp_in, fp_out, b->inputs[i], &n_record);
+        if ( fp_out && hts_close(fp_out) ) ret = -1;
+        if ( fp_in ) hts_close(fp_in);
+        if ( ret == 0 && rename(tmp.s, b->outputs[i]) ) {
+            error_print("Failed to rename %s : %s.", tmp.s, strerror(errno));
+            ret = -1;
+        }
+        if ( ret && fp_out ) unlink(tmp.s);
+        free(tmp.s);
+        if ( ret == 0 && quiet_mode == 0 )
+            LOG_print("%s : annotate %llu records.", b->inputs[i], (unsigned long long)n_record);
 
+        pthread_mutex_lock(&b->lock);
+        b->n_record += n_record;
+        if ( ret ) b->n_failed++;
+        pthread_mutex_unlock(&b->lock);
+    }
+    return NULL;
+}
+
+int anno_batch()
+{
+    struct batch_job b;
+    memset(&b, 0, sizeof(b));
+    int i, j;
+    b.inputs = hts_readlines(args.batch_fname, &b.n);
+    if ( b.inputs == NULL ) error("Failed to read %s.", args.batch_fname);
+    // skip empty lines and comments
+    for ( i = j = 0; i < b.n; ++i ) {
+        if ( b.inputs[i][0] == '\0' || b.inputs[i][0] == '#' ) {
+            free(b.inputs[i]);
+            continue;
+        }
+        b.inputs[j++] = b.inputs[i];
+    }
+    b.n = j;
+    if ( b.n == 0 ) error("No input found in %s.", args.batch_fname);
+
+    if ( mkdir(args.outdir, 0777) && errno != EEXIST )
+        error("Failed to create %s. %s", args.outdir, strerror(errno));
+    b.outputs = malloc(b.n*sizeof(char*));
+    for ( i = 0; i < b.n; ++i ) {
+        b.outputs[i] = batch_output_name(b.inputs[i]);
+        for ( j = 0; j < i; ++j )
+            if ( strcmp(b.outputs[i], b.outputs[j]) == 0 )
+                error("%s and %s have the same output %s.", b.inputs[j], b.inputs[i], b.outputs[i]);
+    }
+
+    pthread_mutex_init(&b.lock, NULL);
+    b.p = thread_pool_init(args.n_thread);
+    int n_batch = b.n < args.n_thread ? b.n : args.n_thread;
+    pthread_t *tids = malloc(n_batch*sizeof(pthread_t));
+    for ( i = 0; i < n_batch; ++i )
+        if ( pthread_create(&tids[i], NULL, batch_worker, &b) ) error("Failed to create thread.");
+    for ( i = 0; i < n_batch; ++i ) pthread_join(tids[i], NULL);
+    thread_pool_destroy(b.p);
+    pthread_mutex_destroy(&b.lock);
+    free(tids);
+    
+    args.total_record += b.n_record;
+    for ( i = 0; i < b.n; ++i ) {
+        free(b.inputs[i]);
+        free(b.outputs[i]);
+    }
+    free(b.inputs);
+    free(b.outputs);
+    free(args.commands.s);
+    if ( b.n_failed ) {
+        error_print("Failed to annotate %d of %d inputs.", b.n_failed, b.n);
+        return 1;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const char *buf, size_t l)
+{
+    while ( l ) {
+        ssize_t n = write(fd, buf, l);
+        if ( n == -1 ) {
+            if ( errno == EINTR ) continue;
+            return 1;
+        }
+        buf += n;
+        l -= n;
+    }
+    return 0;
+}
+
+struct client_input {
+    int fd_in;
+    int fd;
+};
+
+// send input to server, in another thread so server output is consumed at the same time
+static void *client_send(void *arg)
+{
+    struct client_input *c = (struct client_input*)arg;
+    char buf[1<<16];
+    ssize_t l;
+    while ( (l = read(c->fd_in, buf, sizeof(buf))) != 0 ) {
+        if ( l == -1 ) {
+            if ( errno == EINTR ) continue;
+            warnings("Failed to read input. %s", strerror(errno));
+            break;
+        }
+        if ( write_full(c->fd, buf, l) ) {
+            warnings("Failed to send input to server. %s", strerror(errno));
+            break;
+        }
+    }
+    shutdown(c->fd, SHUT_WR);
+    return NULL;
+}
+
+// Thin client of server mode, bcfanno client --socket PATH [-o output] [-O type] in.vcf.gz
+int client_main(int argc, char **argv)
+{
+    const char *socket_fname = NULL;
+    const char *output = NULL;
+    const char *output_type = "v";
+    const char *input = NULL;
+    int i;
+    for ( i = 1; i < argc; ) {
+        const char *a = argv[i++];
+        if ( strcmp(a, "-h") == 0 || strcmp(a, "--help") == 0 )
+            return usage();
+        const char **var = 0;
+        if ( strcmp(a, "--socket") == 0 )
+            var = &socket_fname;
+        else if ( strcmp(a, "-o") == 0 || strcmp(a, "--output") == 0 )
+            var = &output;
+        else if ( strcmp(a, "-O") == 0 || strcmp(a, "--output-type") == 0 )
+            var = &output_type;
+        if ( var != 0 ) {
+            if ( i == argc ) error("Missing an argument after %s", a);
+            *var = argv[i++];
+            continue;
+        }
+        if ( a[0] == '-' && a[1] ) error("Unknown parameter. %s", a);
+        if ( input == 0 ) {
+            input = a;
+            continue;
+        }
+        error("Unknown argument : %s, use -h see help information.", a);
+    }
+    if ( socket_fname == NULL ) error("No socket is specified. Use --socket PATH.");
+    if ( hts_output_type(output_type[0]) == -1 ) error("The output type \"%s\" not recognised", output_type);
+    if ( input == NULL || strcmp(input, "-") == 0 ) {
+        if ( isatty(fileno(stdin)) ) error("No input file! Use -h for more informations.");
+        input = NULL;
+    }
+    
+    struct client_input c;
+    c.fd_in = input ? open(input, O_RDONLY) : STDIN_FILENO;
+    if ( c.fd_in == -1 ) error("Failed to open %s. %s", input, strerror(errno));
+    int fd_out = output ? open(output, O_WRONLY|O_CREAT|O_TRUNC, 0666) : STDOUT_FILENO;
+    if ( fd_out == -1 ) error("Failed to open %s. %s", output, strerror(errno));
+
+    struct sockaddr_un addr;
+    if ( strlen(socket_fname) >= sizeof(addr.sun_path) )
+        error("Socket path is too long. %s", socket_fname);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_fname);
+    c.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ( c.fd == -1 || connect(c.fd, (struct sockaddr*)&addr, sizeof(addr)) )
+        error("Failed to connect server %s. %s", socket_fname, strerror(errno));
+
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "bcfanno %c\n", output_type[0]);
+    if ( write_full(c.fd, str.s, str.l) ) error("Failed to send request. %s", strerror(errno));
+    free(str.s);
+
+    signal(SIGPIPE, SIG_IGN);
+    pthread_t tid;
+    if ( pthread_create(&tid, NULL, client_send, &c) ) error("Failed to create thread.");
+
+    char buf[1<<16];
+    ssize_t l;
+    uint64_t total = 0;
+    while ( (l = read(c.fd, buf, sizeof(buf))) != 0 ) {
+        if ( l == -1 ) {
+            if ( errno == EINTR ) continue;
+            error("Failed to receive output. %s", strerror(errno));
+        }
+        if ( write_full(fd_out, buf, l) ) error("Failed to write output. %s", strerror(errno));
+        total += l;
+    }
+    pthread_join(tid, NULL);
+    close(c.fd);
+    if ( input ) close(c.fd_in);
+    if ( output && close(fd_out) ) error("Failed to write output. %s", strerror(errno));
+    // server closes connection without output if input is broken
+    if ( total == 0 ) error("No output received, check the log of server.");
     return 0;
 }
 
@@ -591,12 +1203,23 @@ int annotate()
 
 int main(int argc, char **argv)
 {
+    if ( argc > 1 && strcmp(argv[1], "client") == 0 )
+        return client_main(argc-1, argv+1);
+
     clock_t t = clock();
     
     if ( parse_args(argc, argv) )
         return 1;
 
-    if ( annotate() )
+    if ( args.socket_fname ) {
+        if ( anno_serve() )
+            return 1;
+    }
+    else if ( args.batch_fname ) {
+        if ( anno_batch() )
+            return 1;
+    }
+    else if ( annotate() )
         return 1;
 
     memory_release();
@@ -1,12 +1,14 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <limits.h>
 #include "utils.h"
 #include "number.h"
 #include "bed_utils.h"
 #include "htslib/hts.h"
 #include "htslib/khash.h"
 #include "htslib/ksort.h"
+#include "anno_thread_pool.h"
 
 // for very large file, there might be a memory overflow problem to keep all raw data, so here design a read-and-hold
 // structure to read some parts of bed file into memory pool, sort and merge cached data first and then load remain 
@@ -28,6 +30,14 @@ void set_file_size_limit(uint32_t limit)
     file_size_limit = limit;
 }
 
+// threads to sort and merge chromosomes in parallel
+static int bed_threads = 1;
+
+void set_bed_threads(int n)
+{
+    bed_threads = n < 1 ? 1 : n;
+}
+
 KSORT_INIT_GENERIC(uint64_t)
 
 // hash structure, chromosome is key, struct bed_chrom is value
@@ -100,7 +110,7 @@ void bed_destroy(struct bedaux *file)
 	}
     }
     kh_destroy(reg, hash);
-    
+    free(file->names);
     free(file);    
 }
 int get_name_id(struct bedaux *bed, const char *name)
@@ -215,20 +225,51 @@ static int bed_fill(struct bedaux *bed)
     ks_destroy(bed->ks);
     return 0;
 }
+// chromosomes with fewer regions are sorted by introsort
+#define RADIX_SORT_MIN 256
+
+// LSD radix sort of packed regions, 8 bits per pass. Passes on bytes shared by all keys are skipped, usually the
+// high bytes of start and end.
+static void radix_sort64(uint64_t *a, int n)
+{
+    int i, d;
+    uint32_t (*count)[256] = calloc(8, sizeof(*count));
+    for ( i = 0; i < n; ++i )
+        for ( d = 0; d < 8; ++d ) count[d][(a[i]>>(d<<3))&0xff]++;
+
+    uint64_t *b = malloc(n*sizeof(uint64_t));
+    uint64_t *src = a, *dst = b;
+    for ( d = 0; d < 8; ++d ) {
+        uint32_t *c = count[d];
+        if ( c[(a[0]>>(d<<3))&0xff] == n ) continue;
+        uint32_t sum = 0;
+        for ( i = 0; i < 256; ++i ) {
+            uint32_t t = c[i];
+            c[i] = sum;
+            sum += t;
+        }
+        for ( i = 0; i < n; ++i ) dst[c[(src[i]>>(d<<3))&0xff]++] = src[i];
+        uint64_t *t = src; src = dst; dst = t;
+    }
+    if ( src != a ) memcpy(a, src, n*sizeof(uint64_t));
+    free(b);
+    free(count);
+}
 static void chrom_sort(struct bed_chrom *chrom)
 {
-    ks_introsort(uint64_t, chrom->cached, chrom->a);
+    if ( chrom->cached < RADIX_SORT_MIN ) ks_introsort(uint64_t, chrom->cached, chrom->a);
+    else radix_sort64(chrom->a, chrom->cached);
 }
 static void chrom_merge(struct bed_chrom *chrom)
 {    
     chrom_sort(chrom);
     
     int i;
-    uint64_t *b = (uint64_t*)malloc(chrom->cached * sizeof(uint64_t));
     uint32_t start_last = 0;
     uint32_t end_last = 0;
     int l = 0;
     int length = 0;
+    // merged regions are written back in place, l never passes i
     for ( i = 0; i < chrom->cached; ++i ) {
 	uint32_t start = chrom->a[i]>>32;
 	uint32_t end = (uint32_t)chrom->a[i];
@@ -241,7 +282,7 @@ static void chrom_merge(struct bed_chrom *chrom)
 	    if ( end_last < end )
 		end_last = end;	    
 	} else {
-	    b[l++] = (uint64_t) start_last<<32| end_last;
+	    chrom->a[l++] = (uint64_t) start_last<<32| end_last;
 	    length += end_last - start_last;
 	    start_last = start;
 	    end_last = end;
@@ -250,19 +291,55 @@ static void chrom_merge(struct bed_chrom *chrom)
     // tail region
     if (end_last > 0) {
 	length += end_last - start_last;
-	b[l++] = (uint64_t) start_last<<32| end_last;
+	chrom->a[l++] = (uint64_t) start_last<<32| end_last;
     }
-    memset(chrom->a, 0, chrom->cached * sizeof(uint64_t));
-    memcpy(chrom->a, b, l * sizeof(uint64_t));
     chrom->cached = l;
-    free(b);
     chrom->length = length;
 }
+static void *chrom_sort_job(void *arg, int idx)
+{
+    chrom_sort((struct bed_chrom*)arg);
+    return NULL;
+}
+static void *chrom_merge_job(void *arg, int idx)
+{
+    chrom_merge((struct bed_chrom*)arg);
+    return NULL;
+}
+static int cmp_chrom_size(const void *a, const void *b)
+{
+    return (*(struct bed_chrom**)b)->cached - (*(struct bed_chrom**)a)->cached;
+}
+// Apply func to all chromosomes, on a thread pool if set_bed_threads() is greater than 1.
+static void bed_chrom_apply(struct bedaux *bed, void (*func)(struct bed_chrom *), void *(*job)(void *arg, int idx))
+{
+    int i, n = 0;
+    struct bed_chrom **chms = malloc(bed->l_names*sizeof(void*));
+    for ( i = 0; i < bed->l_names; ++i ) {
+	struct bed_chrom *chm = get_chrom(bed, bed->names[i]);
+	if ( chm ) chms[n++] = chm;
+    }
+    if ( bed_threads == 1 || n < 2 ) {
+        for ( i = 0; i < n; ++i ) func(chms[i]);
+        free(chms);
+        return;
+    }
+    // largest first, so threads finish at about the same time
+    qsort(chms, n, sizeof(void*), cmp_chrom_size);
+    struct thread_pool *p = thread_pool_init(bed_threads < n ? bed_threads : n);
+    struct thread_pool_process *q = thread_pool_process_init(p, n, 1);
+    for ( i = 0; i < n; ++i ) thread_pool_dispatch(p, q, job, chms[i]);
+    thread_pool_process_flush(q);
+    thread_pool_process_destroy(q);
+    thread_pool_destroy(p);
+    free(chms);
+}
 void bed_cache_update(struct bedaux *bed)
 {
     int i;
     khiter_t k;
     reghash_type *hash = (reghash_type*)bed->hash;
+    bed_chrom_apply(bed, chrom_merge, chrom_merge_job);
     bed->regions = 0;
     bed->length = 0;
     for (i = 0; i < bed->l_names; ++i) {
@@ -270,7 +347,6 @@ void bed_cache_update(struct bedaux *bed)
 	k = kh_get(reg, hash, name);
 	if (k == kh_end(hash)) continue;
 	struct bed_chrom *chrom = kh_val(hash, k);
-	chrom_merge(chrom);
 	bed->regions += chrom->cached;
 	bed->length += chrom->length;
     }
@@ -286,7 +362,7 @@ int bed_fill_bigdata(struct bedaux *bed)
 	int start = -1;
 	int end = -1;
 	bed->line++;
-	if ( string.l == 0 || string.s[0] ) {
+	if ( string.l == 0 || string.s[0] == '\n' ) {
 	    warnings("%s : line %d is empty. skip ..", bed->fname, bed->line);
 	    continue;
 	}
@@ -337,8 +413,10 @@ int bed_read(struct bedaux *bed, const char *fname)
 	return 1;
     }
 
-    // for huge file, just hold the handler
-    bed->flag |= bed_bit_cached;
+    // for huge file, merge cached regions every block to keep memory bounded
+    bed_fill_bigdata(bed);
+    if ( bed->length == 0 )
+        bed->flag |= bed_bit_empty;
     return 0;
 }
 struct bedaux *bed_fork(struct bed_chrom *chrom, const char *name, int flag)
@@ -430,13 +508,7 @@ int bed_sort(struct bedaux *bed)
     // sorted already
     if ( bed->flag & bed_bit_sorted ) return 1;
     
-    int i;
-    for (i = 0; i < bed->l_names; ++i) {
-	struct bed_chrom *chm = get_chrom(bed, bed->names[i]);
-	if (chm == NULL)
-	    continue;
-	chrom_sort(chm);
-    }
+    bed_chrom_apply(bed, chrom_sort, chrom_sort_job);
     bed->flag |= bed_bit_sorted;
     return 0;
 }
@@ -445,26 +517,175 @@ int bed_merge(struct bedaux *bed)
     if ( bed->flag & bed_bit_merged)
 	return 1;
     // bed_sort(bed);
-    int i;
-    for (i = 0; i < bed->l_names; ++i) {
-	struct bed_chrom *chm = get_chrom(bed, bed->names[i]);
-	if (chm == NULL)
-	    continue;
-	chrom_merge(chm);
-    }
+    bed_chrom_apply(bed, chrom_merge, chrom_merge_job);
     bed->flag |= bed_bit_sorted;
     bed->flag |= bed_bit_merged;
     return 0;
 }
-// todo: 
-// require all bed files sorted
-struct bedaux *bed_merge_several_bigdata(struct bedaux **beds, int n)
+// Min heap of (key, file index), used to merge sorted regions of several files.
+struct bed_heap {
+    int n;
+    uint64_t *key;
+    int *id;
+};
+
+static void bed_heap_push(struct bed_heap *h, uint64_t key, int id)
 {
-    return NULL;
+    int i = h->n++;
+    while ( i > 0 ) {
+        int parent = (i-1)>>1;
+        if ( h->key[parent] <= key ) break;
+        h->key[i] = h->key[parent];
+        h->id[i] = h->id[parent];
+        i = parent;
+    }
+    h->key[i] = key;
+    h->id[i] = id;
+}
+// Remove the top and sift the last node down.
+static void bed_heap_pop(struct bed_heap *h)
+{
+    if ( --h->n == 0 ) return;
+    uint64_t key = h->key[h->n];
+    int id = h->id[h->n];
+    int i = 0;
+    for ( ;; ) {
+        int c = (i<<1) + 1;
+        if ( c >= h->n ) break;
+        if ( c + 1 < h->n && h->key[c+1] < h->key[c] ) ++c;
+        if ( key <= h->key[c] ) break;
+        h->key[i] = h->key[c];
+        h->id[i] = h->id[c];
+        i = c;
+    }
+    h->key[i] = key;
+    h->id[i] = id;
+}
+
+// Append a region to a chromosome filled in coordinate order, overlapped or adjacent regions are merged.
+static void chrom_push_sorted(struct bed_chrom *chm, uint32_t start, uint32_t end)
+{
+    if ( chm->cached > 0 ) {
+        uint64_t *last = &chm->a[chm->cached-1];
+        uint32_t end_last = (uint32_t)*last;
+        if ( end_last >= start ) {
+            if ( end_last < end ) {
+                chm->length += end - end_last;
+                *last = (*last >> 32) << 32 | end;
+            }
+            return;
+        }
+    }
+    if ( chm->cached == chm->max ) {
+        chm->max = chm->max == 0 ? 10 : chm->max << 1;
+        chm->a = (uint64_t*)realloc(chm->a, chm->max * sizeof(uint64_t));
+    }
+    chm->a[chm->cached++] = (uint64_t)start << 32 | end;
+    chm->length += end - start;
+}
+
+// Chromosomes of several files, kept in the order they first show up.
+static struct bedaux *bed_union_names(struct bedaux **beds, int n)
+{
+    struct bedaux *bed = bedaux_init();
+    reghash_type *hash = (reghash_type*)bed->hash;
+    int i, j, ret;
+    for ( i = 0; i < n; ++i ) {
+        if ( beds[i] == NULL || (beds[i]->flag & bed_bit_empty) ) continue;
+        if ( beds[i]->flag & bed_bit_cached ) error("[%s] bed file %s is not filled.", __func__, beds[i]->fname);
+        bed_sort(beds[i]);
+        for ( j = 0; j < beds[i]->l_names; ++j ) {
+            if ( get_chrom(beds[i], beds[i]->names[j]) == NULL ) continue;
+            if ( kh_get(reg, hash, beds[i]->names[j]) != kh_end(hash) ) continue;
+            if ( bed->l_names == bed->m_names ) {
+                bed->m_names = bed->m_names == 0 ? 2 : bed->m_names << 1;
+                bed->names = (char**)realloc(bed->names, bed->m_names*sizeof(char*));
+            }
+            bed->names[bed->l_names] = strdup(beds[i]->names[j]);
+            struct bed_chrom *chm = bedchrom_init();
+            chm->id = bed->l_names;
+            khiter_t k = kh_put(reg, hash, bed->names[bed->l_names], &ret);
+            kh_val(hash, k) = chm;
+            bed->l_names++;
+        }
+    }
+    return bed;
 }
+
+static void bed_union_update(struct bedaux *bed)
+{
+    int i;
+    bed->regions = 0;
+    bed->length = 0;
+    for ( i = 0; i < bed->l_names; ++i ) {
+        struct bed_chrom *chm = get_chrom(bed, bed->names[i]);
+        bed->regions += chm->cached;
+        bed->length += chm->length;
+    }
+    bed->regions_ori = bed->regions;
+    bed->length_ori = bed->length;
+    if ( bed->length == 0 ) bed->flag |= bed_bit_empty;
+}
+
+// Merge regions of several files by a k-way heap merge of the sorted chromosomes, input files are sorted if not yet.
 struct bedaux *bed_merge_several_files(struct bedaux **beds, int n)
 {
-    return NULL;
+    struct bedaux *bed = bed_union_names(beds, n);
+    bed->flag = bed_bit_sorted | bed_bit_merged;
+
+    struct bed_heap h = { 0, malloc(n*sizeof(uint64_t)), malloc(n*sizeof(int)) };
+    struct bed_chrom **chms = malloc(n*sizeof(void*));
+    int *cur = malloc(n*sizeof(int));
+    int i, j;
+    for ( i = 0; i < bed->l_names; ++i ) {
+        struct bed_chrom *out = get_chrom(bed, bed->names[i]);
+        h.n = 0;
+        for ( j = 0; j < n; ++j ) {
+            chms[j] = beds[j] == NULL || (beds[j]->flag & bed_bit_empty) ? NULL : get_chrom(beds[j], bed->names[i]);
+            cur[j] = 0;
+            if ( chms[j] && chms[j]->cached ) bed_heap_push(&h, chms[j]->a[0], j);
+        }
+        while ( h.n ) {
+            uint64_t a = h.key[0];
+            j = h.id[0];
+            bed_heap_pop(&h);
+            if ( ++cur[j] < chms[j]->cached ) bed_heap_push(&h, chms[j]->a[cur[j]], j);
+            // empty region at the beginning, same as chrom_merge()
+            if ( (uint32_t)a == 0 ) continue;
+            chrom_push_sorted(out, a>>32, (uint32_t)a);
+        }
+    }
+    free(h.key);
+    free(h.id);
+    free(chms);
+    free(cur);
+    bed_union_update(bed);
+    return bed;
+}
+struct bedaux *bed_read_several_files(const char *fnames)
+{
+    kstring_t str = {0,0,0};
+    kputs(fnames, &str);
+    int i, n;
+    int *s = ksplit(&str, ',', &n);
+    struct bedaux **beds = malloc(n*sizeof(void*));
+    for ( i = 0; i < n; ++i ) {
+        beds[i] = bedaux_init();
+        bed_read(beds[i], str.s + s[i]);
+    }
+    struct bedaux *bed;
+    if ( n == 1 ) {
+        bed = beds[0];
+        bed_merge(bed);
+    }
+    else {
+        bed = bed_merge_several_files(beds, n);
+        for ( i = 0; i < n; ++i ) bed_destroy(beds[i]);
+    }
+    free(beds);
+    free(s);
+    free(str.s);
+    return bed;
 }
 void bed_flktrim(struct bedaux *bed, int left, int right)
 {
@@ -515,9 +736,54 @@ struct bedaux *bed_overlap(struct bedaux *bed)
 {
     return NULL;
 }
+// Regions covered by only one of the files. Each file is merged first, then the start and end points of all files
+// are swept in order by a k-way heap merge.
 struct bedaux *bed_uniq_several_files(struct bedaux **beds, int n)
 {
-    return NULL;
+    int i, j;
+    for ( i = 0; i < n; ++i )
+        if ( beds[i] && (beds[i]->flag & bed_bit_empty) == 0 ) bed_merge(beds[i]);
+
+    struct bedaux *bed = bed_union_names(beds, n);
+    bed->flag = bed_bit_sorted | bed_bit_merged;
+
+    struct bed_heap h = { 0, malloc(n*sizeof(uint64_t)), malloc(n*sizeof(int)) };
+    struct bed_chrom **chms = malloc(n*sizeof(void*));
+    // cur[j]>>1 is the region index, odd if inside the region
+    int *cur = malloc(n*sizeof(int));
+    for ( i = 0; i < bed->l_names; ++i ) {
+        struct bed_chrom *out = get_chrom(bed, bed->names[i]);
+        h.n = 0;
+        for ( j = 0; j < n; ++j ) {
+            chms[j] = beds[j] == NULL || (beds[j]->flag & bed_bit_empty) ? NULL : get_chrom(beds[j], bed->names[i]);
+            cur[j] = 0;
+            if ( chms[j] && chms[j]->cached ) bed_heap_push(&h, chms[j]->a[0]>>32, j);
+        }
+        int depth = 0;
+        uint32_t last = 0;
+        while ( h.n ) {
+            uint32_t pos = h.key[0];
+            if ( depth == 1 && last < pos ) chrom_push_sorted(out, last, pos);
+            // apply all points at this position
+            while ( h.n && (uint32_t)h.key[0] == pos ) {
+                j = h.id[0];
+                bed_heap_pop(&h);
+                depth += cur[j] & 1 ? -1 : 1;
+                cur[j]++;
+                if ( (cur[j]>>1) < chms[j]->cached ) {
+                    uint64_t a = chms[j]->a[cur[j]>>1];
+                    bed_heap_push(&h, cur[j] & 1 ? (uint32_t)a : a>>32, j);
+                }
+            }
+            last = pos;
+        }
+    }
+    free(h.key);
+    free(h.id);
+    free(chms);
+    free(cur);
+    bed_union_update(bed);
+    return bed;
 }
 struct bedaux *bed_uniq_bigfile(struct bedaux *bed, tbx_t *tbx)
 {
@@ -529,68 +795,103 @@ static void copy_line(struct bed_line *dest, struct bed_line *line)
     dest->start = line->start;
     dest->end = line->end;
 }
+// data region cached by bed_find_rough_bigfile(), beg and end are the coordinates tabix uses for overlap tests
+struct rough_line {
+    int beg, end;
+    struct bed_line l;
+};
 // bed_find_rough_bigfile() is a function to retrieve most nearest or covered regions in the tbx databases for target regions
 // for probe design programs, gap_size is usually slightly smaller than the fragement size.
+// Targets and data are both sorted, so each chromosome of data is read once by one iterator and the regions around the
+// current target are cached.
 struct bedaux *bed_find_rough_bigfile(struct bedaux *target, htsFile *fp, tbx_t *data, int gap_size, int region_limit)
 {
     bed_merge(target);
-    struct bed_line line = BED_LINE_INIT;
 
     kstring_t string = KSTRING_INIT;
     struct bedaux *design = bedaux_init();
     design->flag &= ~bed_bit_empty;
-    while ( bed_getline(target, &line) == 0 ) {
-	// retrieve target in dataset
-	int tid = tbx_name2id(data, target->names[line.chrom_id]);
+    int i, j, k, l;
+    int n = 0, m = 0;
+    struct rough_line *buf = NULL;
+    for ( i = 0; i < target->l_names; ++i ) {
+        struct bed_chrom *chm = get_chrom(target, target->names[i]);
+        if ( chm == NULL || chm->cached == 0 ) continue;
+	int tid = tbx_name2id(data, target->names[i]);
 	if (tid == -1) {
-	    warnings("Chromosome %s is not found data.", target->names[line.chrom_id]);
-	}
-	hts_itr_t *itr = tbx_itr_queryi(data, tid, line.start, line.end);
-	int n_regions = 0;
-	int left = 0;
-	int right = 0;
-	struct bed_line dl = BED_LINE_INIT;
-	while ( tbx_itr_next(fp, data, itr, &string) >= 0) {	    
-	    parse_string(design, &string, &dl);
-	    if ( dl.start < line.start ) dl.start = line.start;
-	    if ( dl.end > line.end ) dl.end = line.end;
-	    if ( left == 0)
-		left = dl.start;
-	    if ( right < line.end )
-		right = line.end;
-	    push_newline1(design, &dl);
-	    n_regions++;
-	    string.l = 0;
+	    warnings("Chromosome %s is not found data.", target->names[i]);
+            continue;
 	}
+        hts_itr_t *itr = tbx_itr_queryi(data, tid, 0, INT_MAX);
+        int eof = itr == NULL;
+        n = 0;
+        for ( j = 0; j < chm->cached; ++j ) {
+            struct bed_line line = { chm->id, chm->a[j]>>32, (uint32_t)chm->a[j] };
+            // window of this target, both ends move forward
+            int win_start = line.start - gap_size > 0 ? line.start - gap_size : 0;
+            int win_end = line.end + gap_size;
+            for ( k = 0, l = 0; k < n; ++k )
+                if ( buf[k].end > win_start ) buf[l++] = buf[k];
+            n = l;
+            while ( eof == 0 && (n == 0 || buf[n-1].beg < win_end) ) {
+                if ( tbx_itr_next(fp, data, itr, &string) < 0 ) {
+                    eof = 1;
+                    break;
+                }
+                if ( n == m ) {
+                    m = m == 0 ? 16 : m << 1;
+                    buf = realloc(buf, m*sizeof(struct rough_line));
+                }
+                buf[n].beg = itr->curr_beg;
+                buf[n].end = itr->curr_end;
+                if ( parse_string(design, &string, &buf[n].l) ) continue;
+                n++;
+            }
 
-	// if there are too much gaps in the edges, or	
-	// if no regions in dataset, find nearby regions	
-
-	// find nearest left side regions
-        if (n_regions == 0 || left - line.start > gap_size) {
-	    uint32_t start = line.start - gap_size > 0 ? line.start - gap_size : 0;
-	    uint32_t end = line.start;
-	    itr = tbx_itr_queryi(data, tid, start, end);
-	    while ( tbx_itr_next(fp, data, itr, &string) >= 0) {
-		parse_string(design, &string, &dl);
-		if (dl.start < start) dl.start = start;
-		push_newline1(design, &dl);
-	    }
-	    string.l = 0;
-	}
-	// find nearest right side regions
-	if (n_regions == 0 ||  line.end - right > gap_size) {
-	    uint32_t start = line.end;
-	    uint32_t end = line.end + gap_size;
-	    itr = tbx_itr_queryi(data, tid, start, end);
-	    while ( tbx_itr_next(fp, data, itr, &string) >= 0) {
-		parse_string(design, &string, &dl);
-		if (dl.end > end) dl.end = end;
-		push_newline1(design, &dl);
-	    }
-	    string.l = 0;
-	}
+            // retrieve target in dataset
+            int n_regions = 0;
+            int left = 0;
+            int right = 0;
+            struct bed_line dl;
+            for ( k = 0; k < n; ++k ) {
+                if ( buf[k].beg >= line.end || buf[k].end <= line.start ) continue;
+                dl = buf[k].l;
+                if ( dl.start < line.start ) dl.start = line.start;
+                if ( dl.end > line.end ) dl.end = line.end;
+                if ( left == 0)
+                    left = dl.start;
+                if ( right < line.end )
+                    right = line.end;
+                push_newline1(design, &dl);
+                n_regions++;
+            }
+
+            // if there are too much gaps in the edges, or
+            // if no regions in dataset, find nearby regions
+
+            // find nearest left side regions
+            if (n_regions == 0 || left - line.start > gap_size) {
+                for ( k = 0; k < n; ++k ) {
+                    if ( buf[k].beg >= line.start || buf[k].end <= win_start ) continue;
+                    dl = buf[k].l;
+                    if (dl.start < win_start) dl.start = win_start;
+                    push_newline1(design, &dl);
+                }
+            }
+            // find nearest right side regions
+            if (n_regions == 0 ||  line.end - right > gap_size) {
+                for ( k = 0; k < n; ++k ) {
+                    if ( buf[k].beg >= win_end || buf[k].end <= line.end ) continue;
+                    dl = buf[k].l;
+                    if (dl.end > win_end) dl.end = win_end;
+                    push_newline1(design, &dl);
+                }
+            }
+        }
+        if ( itr ) tbx_itr_destroy(itr);
     }
+    free(buf);
+    free(string.s);
     bed_merge(design);
     return design;
 }
@@ -699,31 +1000,65 @@ static int rloc(uint64_t a, int pos, int *_s, int *_e)
     }
     return 0;
 }
+// Index of the last region started not after pos, or -1. Regions of chromosome should be merged.
+static int chrom_locate(struct bed_chrom *c, int pos)
+{
+    int lo = 0, hi = c->cached;
+    while ( lo < hi ) {
+        int mid = (lo + hi) >> 1;
+        if ( (uint32_t)(c->a[mid]>>32) <= (uint32_t)pos ) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo - 1;
+}
 int bed_position_covered(struct bedaux *bed, char *chr, int pos, int *_start, int *_end)
 {
-    int start, end;
     struct bed_chrom *c = get_chrom(bed, chr);
     if ( c == NULL ) return 0;
 
     if ( pos < 1 ) error("Trying to find an unreasonable genomic location.");
 
-    int mid, min = 0, max = c->cached -1;    
-    for ( ;; ) {
-        mid = (min + max)/2;
-        if ( rloc(c->a[mid], pos, _start, _end) ||
-             rloc(c->a[min], pos, _start, _end) ||
-             rloc(c->a[max], pos, _start, _end) ) return 1;
-        if ( min == max ) 
-            return rloc(c->a[min], pos, _start, _end);
-        else if ( max - min == 1 ) {
-            if ( rloc(c->a[min], pos, _start, _end) ) return 1;
-            if ( rloc(c->a[max], pos, _start, _end) ) return 1;
-            return 0;
+    int i = chrom_locate(c, pos);
+    return i < 0 ? 0 : rloc(c->a[i], pos, _start, _end);
+}
+
+void bed_cursor_init(struct bed_cursor *cur, struct bedaux *bed)
+{
+    memset(cur, 0, sizeof(*cur));
+    cur->bed = bed;
+}
+// steps to walk forward before falling back to binary search
+#define BED_CURSOR_STEPS 8
+
+int bed_cursor_covered(struct bed_cursor *cur, const char *chr, int pos, int *_start, int *_end)
+{
+    if ( pos < 1 ) error("Trying to find an unreasonable genomic location.");
+    if ( cur->name == NULL || strcmp(cur->name, chr) != 0 ) {
+        // name is the key in hash of bed, chromosomes not in bed are looked up each time
+        reghash_type *hash = (reghash_type*)cur->bed->hash;
+        khiter_t k = kh_get(reg, hash, chr);
+        cur->name = k == kh_end(hash) ? NULL : kh_key(hash, k);
+        cur->chm = k == kh_end(hash) ? NULL : kh_val(hash, k);
+        cur->i = -1;
+    }
+    struct bed_chrom *c = cur->chm;
+    if ( c == NULL ) return 0;
+
+    int i = cur->i;
+    if ( i >= 0 && (uint32_t)(c->a[i]>>32) <= (uint32_t)pos ) {
+        int step;
+        for ( step = 0; step < BED_CURSOR_STEPS; ++step ) {
+            if ( i + 1 == c->cached || (uint32_t)(c->a[i+1]>>32) > (uint32_t)pos ) break;
+            ++i;
         }
-        if ((uint32_t)c->a[mid] < pos ) min = mid;
-        else max = mid;
+        if ( step == BED_CURSOR_STEPS ) i = chrom_locate(c, pos);
     }
-    return 0;
+    else {
+        // first lookup of chromosome, or position behind the cursor
+        i = chrom_locate(c, pos);
+    }
+    cur->i = i;
+    return i < 0 ? 0 : rloc(c->a[i], pos, _start, _end);
 }
 
 #ifdef _MAIN_BED
@@ -731,13 +1066,35 @@ int bed_position_covered(struct bedaux *bed, char *chr, int pos, int *_start, in
 
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
-	error("%s in.bed", argv[0]);
+    int i = 1;
+    if ( argc > 2 && strcmp(argv[1], "-t") == 0 ) {
+        set_bed_threads(str2int(argv[2]));
+        i = 3;
     }
-    LOG_print("read %s ..", argv[1]);
-    struct bedaux *bed = bedaux_init();
-    bed_read(bed, argv[1]);
-    bed_merge(bed);
+    if (argc <= i) {
+	error("%s [-t threads] in.bed [in2.bed ...]", argv[0]);
+    }
+    int n = argc - i;
+    struct bedaux **beds = malloc(n*sizeof(void*));
+    for ( ; i < argc; ++i ) {
+        LOG_print("read %s ..", argv[i]);
+        beds[i+n-argc] = bedaux_init();
+        bed_read(beds[i+n-argc], argv[i]);
+    }
+    struct bedaux *bed;
+    if ( n == 1 ) {
+        bed = beds[0];
+        bed_merge(bed);
+    }
+    else {
+        bed = bed_merge_several_files(beds, n);
+        LOG_print("save uniq regions to uniq.bed ..");
+        struct bedaux *uniq = bed_uniq_several_files(beds, n);
+        bed_save(uniq, "uniq.bed");
+        bed_destroy(uniq);
+        for ( i = 0; i < n; ++i ) bed_destroy(beds[i]);
+    }
+    free(beds);
     LOG_print("save merged target file target.bed ..");
     bed_save(bed, "target.bed");
 
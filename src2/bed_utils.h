@@ -19,7 +19,7 @@
 #define MEMPOOL_LINE 10000 // todo: memory management
 
 // read file handler
-KSTREAM_INIT(BGZF*, bgzf_read, 8193);
+KSTREAM_INIT2(static inline, BGZF*, bgzf_read, 8193);
 
 // flag of bed_file struct
 // bits offset rule : right first
@@ -99,16 +99,20 @@ extern int bed_getline(struct bedaux *bed, struct bed_line *line);
 extern int bed_read_bigfile(struct bedaux *bed, const char *fname);
 extern int bed_read(struct bedaux *bed, const char *fname);
 
+// threads to sort and merge chromosomes, default is 1
+extern void set_bed_threads(int n);
 // sort
 extern int bed_sort(struct bedaux *bed);
 // merge
 extern int bed_merge(struct bedaux *bed);
+// k-way merge of several files, the inputs are sorted in place if not yet
 extern struct bedaux *bed_merge_several_files(struct bedaux **beds, int n);
 // flank | trim
 extern void bed_flktrim(struct bedaux *bed, int left, int right);
 extern void bed_round(struct bedaux *bed, int length);
 // uniq
 extern struct bedaux *bed_overlap(struct bedaux *bed);
+// regions covered by only one of the files, the inputs are merged in place
 extern struct bedaux *bed_uniq_several_files(struct bedaux **beds, int n);
 extern struct bedaux *bed_uniq_bigfile(struct bedaux *bed, tbx_t *tbx);
 
@@ -119,6 +123,8 @@ extern struct bedaux *bed_uniq_bigfile(struct bedaux *bed, tbx_t *tbx);
 // region_limit for generate the length of nearby regions, if find a close enough region, the length of this region
 // will cap to region_limit.
 extern struct bedaux *bed_find_rough_bigfile(struct bedaux *bed, htsFile *fp, tbx_t *tbx, int gap_size, int region_limit);
+// read comma separated BED files, and merge them into one sorted and merged bedaux
+extern struct bedaux *bed_read_several_files(const char *fnames);
 // diff
 extern struct bedaux *bed_diff(struct bedaux *bed1, struct bedaux *bed2);
 extern struct bedaux *bed_diff_bigfile(struct bedaux *bed, tbx_t *tbx);
@@ -133,4 +139,17 @@ extern int bed_save(struct bedaux *bed, const char *fname);
 
 extern int bed_region_covered(struct bedaux *bed, char *name, int start, int end);
 extern int bed_position_covered(struct bedaux *bed, char *chr, int pos, int *_start, int *_end);
+
+// Cursor for covered tests of sorted positions. It keeps the last region found and walks forward from it, so a sorted
+// stream of positions is a merge sweep over the regions. Unsorted positions fall back to binary search. Regions
+// should be merged.
+struct bed_cursor {
+    struct bedaux *bed;
+    const char *name;
+    struct bed_chrom *chm;
+    int i;
+};
+extern void bed_cursor_init(struct bed_cursor *cur, struct bedaux *bed);
+// Same as bed_position_covered(), pos is 1-based.
+extern int bed_cursor_covered(struct bed_cursor *cur, const char *chr, int pos, int *_start, int *_end);
 #endif
@@ -116,6 +116,13 @@ void bcfanno_config_destroy(struct bcfanno_config *config)
 
     for ( i = 0; i < config->module.n_module; ++i ) 
         free(config->module.files[i].fname);
+
+    if ( config->motif.motif_fname )
+        free(config->motif.motif_fname);
+    if ( config->motif.bed_fname )
+        free(config->motif.bed_fname);
+    if ( config->motif.index_fname )
+        free(config->motif.index_fname);
     
     if ( config->refgene.genepred_fname )
         free(config->refgene.genepred_fname);
@@ -309,6 +316,40 @@ static int load_config_core(struct bcfanno_config *config, kson_t *json, char *d
 		free(bed_config->files);
 	    bed_config->n_bed = n_files;	    
 	}
+        else if ( strcasecmp(node->key, "motif") == 0 || strcasecmp(node->key, "motifs") == 0 ) {
+	    if ( node->type != KSON_TYPE_BRACE)
+		error("Format error. Configure for motifs should looks like :\n"
+		      "\"motifs\":{\n \"file\":\"motifs.txt\",\n \"bed\":\"peaks.bed\",\n}"
+		    );
+            struct motif_config *motif_config = &config->motif;
+            motif_config->min = -20;
+            int j;
+            for ( j = 0; j < node->n; ++j ) {
+                const kson_node_t *node1 = kson_by_index(node, j);
+                if ( node1 == NULL || node1->key == NULL )
+                    continue;
+                if ( strcmp(node1->key, "file") == 0 ) {
+                    motif_config->motif_fname = BRANCH_INIT(node1);
+                    BRANCH(motif_config->motif_fname);
+                }
+                else if ( strcmp(node1->key, "bed") == 0 ) {
+                    motif_config->bed_fname = BRANCH_INIT(node1);
+                    BRANCH(motif_config->bed_fname);
+                }
+                else if ( strcmp(node1->key, "index") == 0 ) {
+                    motif_config->index_fname = BRANCH_INIT(node1);
+                    BRANCH(motif_config->index_fname);
+                }
+                else if ( strcmp(node1->key, "min") == 0 ) {
+                    if ( node1->v.str == NULL ) error("Empty value of motif min.");
+                    motif_config->min = atoi(node1->v.str);
+                }
+                else
+                    warnings("Unknown key : %s. skip ..", node1->key);
+            }
+            if ( motif_config->motif_fname == NULL || motif_config->motif_fname[0] == '\0' )
+                error("No motif file specified in motifs configure.");
+        }
         else if ( strcmp(node->key, "module") == 0 || strcmp(node->key, "module") == 0 || strcmp(node->key, "plugins") == 0 || strcmp(node->key, "plugin") == 0 ) {
 	    if ( node->type != KSON_TYPE_BRACKET )
 		error("Format error, configure for vcf databases should looks like :\n"
@@ -394,6 +435,15 @@ int bcfanno_config_debug(struct bcfanno_config *config)
 	if (config->bed.files[i].columns != NULL)
 	    LOG_print("[BED] columns : %s", config->bed.files[i].columns);	    
     }
+
+    if ( config->motif.motif_fname ) {
+        LOG_print("[MOTIF] file : %s", config->motif.motif_fname);
+        if ( config->motif.bed_fname )
+            LOG_print("[MOTIF] regions : %s", config->motif.bed_fname);
+        if ( config->motif.index_fname )
+            LOG_print("[MOTIF] index : %s", config->motif.index_fname);
+        LOG_print("[MOTIF] minimal score : %d", config->motif.min);
+    }
     return 0;
 }
 
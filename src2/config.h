@@ -60,6 +60,17 @@ struct module_config {
     struct file_config *files;
 };
 
+// PWM scores of motifs around variants, reference is required
+struct motif_config {
+    char *motif_fname;
+    // optional, only variants in these regions are annotated
+    char *bed_fname;
+    // optional, motif hits index built by `bcfanno_pwm build`
+    char *index_fname;
+    // skip motifs below this score
+    int min;
+};
+
 // skip other keys except author, config_id and reference_version
 struct bcfanno_config {
     char *author;
@@ -70,6 +81,7 @@ struct bcfanno_config {
     struct bed_config bed;
     struct refgene_config refgene;
     struct module_config module;
+    struct motif_config motif;
 };
 
 extern struct bcfanno_config *bcfanno_config_init(void);
@@ -24,13 +24,15 @@
 
 // Add the FLANKSEQ tag for each variant in the INFO
 #include "utils.h"
-#include "htslib/faidx.h"
 #include "htslib/vcf.h"
 #include "anno_flank.h"
 
 // export flank sequence arount target variant
 static int flank_size = 10;
 
+// chunks spanning longer than this fetch flank sequences record by record
+#define FLANK_WINDOW_MAX (1<<20)
+
 void set_flksize(int size)
 {
     assert(flank_size > 0);
@@ -40,10 +42,11 @@ void set_flksize(int size)
 struct seqidx* load_sequence_index(const char *file)
 {
     struct seqidx *idx = malloc(sizeof(*idx));
+    memset(idx, 0, sizeof(*idx));
     idx->file = file;
-    idx->idx = fai_load(file);
-    if ( idx->idx == NULL ) {
-        warnings("failed to load index of %s.", file);
+    idx->store = ref_store_open(file);
+    if ( idx->store == NULL ) {
+        warnings("failed to load reference %s.", file);
         free(idx);
         return NULL;
     }
@@ -54,20 +57,49 @@ struct seqidx *sequence_index_duplicate(struct seqidx *idx)
     if ( idx == NULL ) return NULL;
              
     struct seqidx *d = malloc(sizeof(*d));
+    memset(d, 0, sizeof(*d));
     d->file = idx->file;
-    d->idx = fai_load(d->file);
-    assert(d->idx);
+    // the mapped genome is read only, share it
+    d->store = ref_store_ref(idx->store);
+    d->margin = idx->margin;
     return d;
 }
 
 void sequence_index_destroy(struct seqidx *idx)
 {
     if ( idx ) {
-        fai_destroy(idx->idx);
+        ref_store_close(idx->store);
+        free(idx->win_name.s);
+        free(idx->win.s);
         free(idx);
     }
 }
 
+int seqidx_fetch(struct seqidx *idx, const char *name, int start, int end, kstring_t *str)
+{
+    int id = ref_store_name2id(idx->store, name);
+    if ( id == -1 ) return -1;
+    return ref_store_fetch(idx->store, id, start, end+1, str);
+}
+
+int seqidx_window_fetch(struct seqidx *idx, const char *name, int start, int end)
+{
+    if ( start < 0 ) start = 0;
+    if ( seqidx_window_seq(idx, name, start, end) ) return 0;
+    idx->win.l = 0;
+    idx->win_name.l = 0;
+    kputs(name, &idx->win_name);
+    idx->win_start = start;
+    return seqidx_fetch(idx, name, start, end, &idx->win) <= 0;
+}
+
+const char *seqidx_window_seq(struct seqidx *idx, const char *name, int start, int end)
+{
+    if ( idx->win.l == 0 || start < idx->win_start || end >= idx->win_start + (int)idx->win.l ) return NULL;
+    if ( strcmp(idx->win_name.s, name) != 0 ) return NULL;
+    return idx->win.s + (start - idx->win_start);
+}
+
 int bcf_header_add_flankseq(bcf_hdr_t *hdr)
 {
     int id = bcf_hdr_id2int(hdr, BCF_DT_ID, "FLKSEQ");
@@ -85,18 +117,64 @@ int bcf_add_flankseq(struct seqidx *idx, bcf_hdr_t *hdr, bcf1_t *line)
     const char *name = bcf_hdr_id2name(hdr, line->rid);
     int end = line->pos + line->rlen + flank_size;
     int start = line->pos + 1 - flank_size;
-    int l_seq = 0;
-    char *seq = faidx_fetch_seq(idx->idx, name, start-1, end-1, &l_seq);
-    if ( seq == NULL || end - start + 1 != l_seq ) {
-        if ( seq ) free(seq);
+    kstring_t seq = { 0, 0, 0,};
+    int l_seq = seqidx_fetch(idx, name, start-1, end-1, &seq);
+    if ( end - start + 1 != l_seq ) {
+        free(seq.s);
         return 1;
     }
     kstring_t str = { 0, 0, 0,};
-    kputsn(seq, flank_size, &str);
+    kputsn(seq.s, flank_size, &str);
     kputc('.', &str);
-    kputsn(seq + (l_seq - flank_size), flank_size, &str);
+    kputsn(seq.s + (l_seq - flank_size), flank_size, &str);
     bcf_update_info_string(hdr, line, "FLKSEQ", str.s);
-    free(seq);
+    free(seq.s);
+    free(str.s);
+    return 0;
+}
+void seqidx_set_margin(struct seqidx *idx, int margin)
+{
+    if ( idx->margin < margin ) idx->margin = margin;
+}
+int seqidx_chunk_window(struct seqidx *idx, bcf_hdr_t *hdr, struct anno_pool *pool)
+{
+    int i;
+    // flank sequence of each record is [pos - flank_size, pos + rlen + flank_size - 1], 0-based
+    int margin = idx->margin > flank_size ? idx->margin : flank_size;
+    int start = pool->curr_start - margin;
+    int end = 0;
+    for ( i = pool->i_chunk; i < pool->n_chunk; ++i ) {
+        bcf1_t *line = pool->readers[i];
+        if ( end < line->pos + line->rlen ) end = line->pos + line->rlen;
+    }
+    end += margin - 1;
+    if ( end - start >= FLANK_WINDOW_MAX ) return 1;
+    return seqidx_window_fetch(idx, bcf_seqname(hdr, pool->readers[pool->i_chunk]), start, end);
+}
+int bcf_add_flankseq_chunk(struct seqidx *idx, bcf_hdr_t *hdr, struct anno_pool *pool)
+{
+    assert(idx);
+    int i;
+    if ( seqidx_chunk_window(idx, hdr, pool) ) {
+        // sparse chunk or unknown contig
+        for ( i = pool->i_chunk; i < pool->n_chunk; ++i ) bcf_add_flankseq(idx, hdr, pool->readers[i]);
+        return 0;
+    }
+
+    const char *name = bcf_seqname(hdr, pool->readers[pool->i_chunk]);
+    kstring_t str = { 0, 0, 0,};
+    for ( i = pool->i_chunk; i < pool->n_chunk; ++i ) {
+        bcf1_t *line = pool->readers[i];
+        int l_seq = line->rlen + 2*flank_size;
+        // out of contig
+        const char *seq = seqidx_window_seq(idx, name, line->pos - flank_size, line->pos + line->rlen + flank_size - 1);
+        if ( seq == NULL ) continue;
+        str.l = 0;
+        kputsn(seq, flank_size, &str);
+        kputc('.', &str);
+        kputsn(seq + (l_seq - flank_size), flank_size, &str);
+        bcf_update_info_string(hdr, line, "FLKSEQ", str.s);
+    }
     free(str.s);
     return 0;
 }
@@ -10,6 +10,7 @@
 #include "hts_internal.h"
 #include "htslib/kseq.h"
 #include "htslib/hfile.h"
+#include "htslib/hts_endian.h"
 
 KHASH_MAP_INIT_STR(vdict, struct gea_id_info)
 typedef khash_t(vdict) vdict_t;
@@ -111,6 +112,12 @@ int gea_hdr_sync(struct gea_hdr *h)
             h->id[i][kh_val(d,k).id].val = &kh_val(d,k);
         }
     }
+    // resolve biotypes used by the annotator, so records can be checked by id instead of string
+    h->mrna_id = gea_hdr_id2int(h, GEA_DT_BIOTYPE, "mRNA");
+    h->nrna_id = gea_hdr_id2int(h, GEA_DT_BIOTYPE, "ncRNA");
+    h->gene_id = gea_hdr_id2int(h, GEA_DT_BIOTYPE, "Gene");
+    if ( h->gene_id == -1 ) h->gene_id = gea_hdr_id2int(h, GEA_DT_BIOTYPE, "gene");
+    h->tfbs_id = gea_hdr_id2int(h, GEA_DT_BIOTYPE, "TFBS");
     h->dirty = 0;
     return 0;
 }
@@ -738,6 +745,7 @@ struct gea_hdr *gea_hdr_init(const char *mode)
     h->mrna_id = -1;
     h->nrna_id = -1;
     h->gene_id = -1;
+    h->tfbs_id = -1;
     
     for (i = 0; i < GEA_DICT_ALL; ++i)
         if ((h->dict[i] = kh_init(vdict)) == NULL) goto fail;
@@ -1386,8 +1394,7 @@ int gea_unpack(const struct gea_hdr *hdr, struct gea_record *b, int which)
         b->unpacked |= GEA_UN_CIGAR;
         
         // only consider alignment state of transcript
-        if ( strcmp(hdr->id[GEA_DT_BIOTYPE][b->biotype].key, "mRNA") != 0 &&
-             strcmp(hdr->id[GEA_DT_BIOTYPE][b->biotype].key, "ncRNA") != 0 )
+        if ( !gea_is_transcript(hdr, b) )
             return 0; 
 
         // alignmentState
@@ -1457,8 +1464,7 @@ int gea_unpack(const struct gea_hdr *hdr, struct gea_record *b, int which)
     
     if ( which & GEA_UN_TRANS && !(b->unpacked&GEA_UN_TRANS) ) {
         // check if gene
-        if ( strcmp(hdr->id[GEA_DT_BIOTYPE][b->biotype].key, "mRNA") != 0 &&
-             strcmp(hdr->id[GEA_DT_BIOTYPE][b->biotype].key, "ncRNA") != 0 )
+        if ( !gea_is_transcript(hdr, b) )
             return 0; 
 
         b->unpacked |= GEA_UN_TRANS;
@@ -1478,7 +1484,7 @@ int gea_unpack(const struct gea_hdr *hdr, struct gea_record *b, int which)
         // int cds_length = 0;
         int loc = 0;
         int exon_start, exon_end, exon_length;
-        int is_coding = strcmp(hdr->id[GEA_DT_BIOTYPE][b->biotype].key, "mRNA") == 0 ? 1 : 0;
+        int is_coding = gea_is_mrna(hdr, b);
         int i;
         for ( i = 0; i < 2; i++ ) {
             c->loc[i] = malloc(b->blockCount*sizeof(int));
@@ -1700,6 +1706,288 @@ int gea_write(htsFile *fp, const struct gea_hdr *h, struct gea_record *v)
     return ret==fp->line.l ? 0 : -1;
 }
 
+/**********************
+ *** BEA record I/O ***
+ **********************/
+
+// Binary GEA (BEA) record layout, all integers are little endian.
+//
+//   uint32_t  l_data : length of the remaining bytes of this record
+//   int32_t   fixed fields, see BEA_F_* below
+//   int32_t   blockPair[0][blockCount], blockPair[1][blockCount]
+//   int32_t   loc[0][blockCount], loc[1][blockCount]      ; only if flags & BEA_HAS_LOC
+//   int32_t   cigars[n_cigar]
+//   char      name[l_name], geneName[l_geneName]          ; NULL terminated, length 0 for '.'
+//   uint8_t   shared[]                                    ; INFO encoded as gea_parse does
+//
+// Records are stored after gea_unpack(GEA_UN_TRANS|GEA_UN_CIGAR), so reading a record back only needs
+// memory copies, no tokenizing, no dictionary lookup and no CIGAR parsing.
+#define BEA_F_RID        0
+#define BEA_F_START      1
+#define BEA_F_END        2
+#define BEA_F_STRAND     3
+#define BEA_F_BIOTYPE    4
+#define BEA_F_CSTART     5
+#define BEA_F_CEND       6
+#define BEA_F_BLOCKS     7
+#define BEA_F_NCIGAR     8
+#define BEA_F_NINFO      9
+#define BEA_F_FLAGS     10
+#define BEA_F_UTR5      11
+#define BEA_F_CDS       12
+#define BEA_F_REFLEN    13
+#define BEA_F_LNAME     14
+#define BEA_F_LGENE     15
+#define BEA_F_ALL       16
+
+#define BEA_HAS_LOC   0x100
+
+static void bea_put_i32s(kstring_t *s, const int *a, int n)
+{
+    if ( n <= 0 ) return;
+    if ( ed_is_big() ) {
+        int i;
+        uint8_t buf[4];
+        for ( i = 0; i < n; ++i ) {
+            i32_to_le(a[i], buf);
+            kputsn((char*)buf, 4, s);
+        }
+    }
+    else kputsn((char*)a, n*sizeof(int32_t), s);
+}
+
+static const uint8_t *bea_get_i32s(const uint8_t *p, int *a, int n)
+{
+    int i;
+    for ( i = 0; i < n; ++i, p += 4 ) a[i] = le_to_i32(p);
+    return p;
+}
+
+int bea_format(const struct gea_hdr *h, struct gea_record *v, kstring_t *s)
+{
+    gea_unpack(h, v, GEA_UN_TRANS|GEA_UN_CIGAR);
+
+    int f[BEA_F_ALL];
+    memset(f, 0, sizeof(f));
+    f[BEA_F_RID]     = v->rid;
+    f[BEA_F_START]   = v->chromStart;
+    f[BEA_F_END]     = v->chromEnd;
+    f[BEA_F_STRAND]  = v->strand;
+    f[BEA_F_BIOTYPE] = v->biotype;
+    f[BEA_F_CSTART]  = v->cStart;
+    f[BEA_F_CEND]    = v->cEnd;
+    f[BEA_F_BLOCKS]  = v->blockCount;
+    f[BEA_F_NCIGAR]  = v->n_cigar;
+    f[BEA_F_NINFO]   = v->n_info;
+    f[BEA_F_FLAGS]   = v->unpacked & (GEA_UN_CIGAR|GEA_UN_TRANS);
+    if ( v->blockCount > 0 && v->c.loc[0] != NULL ) {
+        f[BEA_F_FLAGS] |= BEA_HAS_LOC;
+        f[BEA_F_UTR5]   = v->c.utr5_length;
+        f[BEA_F_CDS]    = v->c.cds_length;
+        f[BEA_F_REFLEN] = v->c.reference_length;
+    }
+    f[BEA_F_LNAME] = v->name ? strlen(v->name) + 1 : 0;
+    f[BEA_F_LGENE] = v->geneName ? strlen(v->geneName) + 1 : 0;
+
+    size_t l0 = s->l;
+    uint8_t buf[4] = {0,0,0,0};
+    kputsn((char*)buf, 4, s); // placeholder of l_data
+    bea_put_i32s(s, f, BEA_F_ALL);
+    bea_put_i32s(s, v->blockPair[0], v->blockCount);
+    bea_put_i32s(s, v->blockPair[1], v->blockCount);
+    if ( f[BEA_F_FLAGS] & BEA_HAS_LOC ) {
+        bea_put_i32s(s, v->c.loc[0], v->blockCount);
+        bea_put_i32s(s, v->c.loc[1], v->blockCount);
+    }
+    bea_put_i32s(s, v->cigars, v->n_cigar);
+    if ( f[BEA_F_LNAME] ) kputsn(v->name, f[BEA_F_LNAME], s);
+    if ( f[BEA_F_LGENE] ) kputsn(v->geneName, f[BEA_F_LGENE], s);
+    if ( v->shared.l ) kputsn(v->shared.s, v->shared.l, s);
+    u32_to_le(s->l - l0 - 4, (uint8_t*)s->s + l0);
+    return 0;
+}
+
+int bea_write(htsFile *fp, const struct gea_hdr *h, struct gea_record *v)
+{
+    if ( fp->is_bgzf == 0 ) return gea_write(fp, h, v);
+    fp->line.l = 0;
+    if ( bea_format(h, v, &fp->line) != 0 ) return -1;
+    return bgzf_write(fp->fp.bgzf, fp->line.s, fp->line.l) == fp->line.l ? 0 : -1;
+}
+
+// Return 0 on success, -1 on end of file, and < -1 on truncated record.
+int bea_read_raw(BGZF *fp, kstring_t *s)
+{
+    uint8_t buf[4];
+    int ret = bgzf_read(fp, buf, 4);
+    if ( ret == 0 ) return -1;
+    if ( ret != 4 ) return -2;
+    uint32_t l_data = le_to_u32(buf);
+    if ( l_data < BEA_F_ALL*sizeof(int32_t) ) {
+        error_print("Corrupted BEA record.");
+        return -2;
+    }
+    s->l = 0;
+    ks_resize(s, l_data);
+    if ( bgzf_read(fp, s->s, l_data) != l_data ) return -2;
+    s->l = l_data;
+    return 0;
+}
+
+int bea_decode(const struct gea_hdr *h, const kstring_t *s, struct gea_record *v)
+{
+    int f[BEA_F_ALL];
+    int i;
+
+    gea_clear(v);
+
+    uint32_t l_data = s->l;
+    const uint8_t *p = bea_get_i32s((const uint8_t*)s->s, f, BEA_F_ALL);
+
+    int l = (BEA_F_ALL + f[BEA_F_BLOCKS]*2 + f[BEA_F_NCIGAR]) * sizeof(int32_t) + f[BEA_F_LNAME] + f[BEA_F_LGENE];
+    if ( f[BEA_F_FLAGS] & BEA_HAS_LOC ) l += f[BEA_F_BLOCKS]*2*sizeof(int32_t);
+    if ( l > l_data ) {
+        error_print("Corrupted BEA record.");
+        return -2;
+    }
+
+    v->rid        = f[BEA_F_RID];
+    v->chromStart = f[BEA_F_START];
+    v->chromEnd   = f[BEA_F_END];
+    v->strand     = f[BEA_F_STRAND];
+    v->biotype    = f[BEA_F_BIOTYPE];
+    v->cStart     = f[BEA_F_CSTART];
+    v->cEnd       = f[BEA_F_CEND];
+    v->n_info     = f[BEA_F_NINFO];
+    v->unpacked   = f[BEA_F_FLAGS] & (GEA_UN_CIGAR|GEA_UN_TRANS);
+
+    if ( f[BEA_F_BLOCKS] > 0 ) {
+        v->blockCount = f[BEA_F_BLOCKS];
+        for ( i = 0; i < 2; ++i ) {
+            v->blockPair[i] = (int*)malloc(v->blockCount*sizeof(int));
+            p = bea_get_i32s(p, v->blockPair[i], v->blockCount);
+        }
+        if ( f[BEA_F_FLAGS] & BEA_HAS_LOC ) {
+            for ( i = 0; i < 2; ++i ) {
+                v->c.loc[i] = (int*)malloc(v->blockCount*sizeof(int));
+                p = bea_get_i32s(p, v->c.loc[i], v->blockCount);
+            }
+            v->c.utr5_length      = f[BEA_F_UTR5];
+            v->c.cds_length       = f[BEA_F_CDS];
+            v->c.reference_length = f[BEA_F_REFLEN];
+        }
+    }
+    if ( f[BEA_F_NCIGAR] > 0 ) {
+        v->n_cigar = f[BEA_F_NCIGAR];
+        v->cigars = (int*)malloc(v->n_cigar*sizeof(int));
+        p = bea_get_i32s(p, v->cigars, v->n_cigar);
+    }
+    if ( f[BEA_F_LNAME] ) {
+        v->name = (char*)malloc(f[BEA_F_LNAME]);
+        memcpy(v->name, p, f[BEA_F_LNAME]);
+        p += f[BEA_F_LNAME];
+    }
+    if ( f[BEA_F_LGENE] ) {
+        v->geneName = (char*)malloc(f[BEA_F_LGENE]);
+        memcpy(v->geneName, p, f[BEA_F_LGENE]);
+        p += f[BEA_F_LGENE];
+    }
+    l = l_data - l;
+    if ( l > 0 ) {
+        ks_resize(&v->shared, l);
+        memcpy(v->shared.s, p, l);
+        v->shared.l = l;
+    }
+    return 0;
+}
+
+int bea_read1(BGZF *fp, const struct gea_hdr *h, struct gea_record *v)
+{
+    kstring_t s = {0,0,0};
+    int ret = bea_read_raw(fp, &s);
+    if ( ret == 0 ) ret = bea_decode(h, &s, v);
+    else gea_clear(v);
+    free(s.s);
+    return ret;
+}
+
+int bea_read(htsFile *fp, const struct gea_hdr *h, struct gea_record *v)
+{
+    if ( fp->is_bgzf == 0 ) return gea_read(fp, h, v);
+    return bea_read1(fp->fp.bgzf, h, v);
+}
+
+// hts_readrec_func for hts_itr_next(), data point to the header
+int bea_readrec(BGZF *fp, void *data, void *r, int *tid, int *beg, int *end)
+{
+    struct gea_record *v = (struct gea_record*)r;
+    int ret = bea_read1(fp, (const struct gea_hdr*)data, v);
+    if ( ret < 0 ) return ret;
+    *tid = v->rid;
+    *beg = v->chromStart;
+    *end = v->chromEnd;
+    return ret;
+}
+
+// hts_readrec_func for hts_itr_next(), r point to a kstring_t, the raw record is decoded later by bea_decode()
+int bea_readrec_raw(BGZF *fp, void *data, void *r, int *tid, int *beg, int *end)
+{
+    kstring_t *s = (kstring_t*)r;
+    int ret = bea_read_raw(fp, s);
+    if ( ret < 0 ) return ret;
+    const uint8_t *p = (const uint8_t*)s->s;
+    *tid = le_to_i32(p + BEA_F_RID*4);
+    *beg = le_to_i32(p + BEA_F_START*4);
+    *end = le_to_i32(p + BEA_F_END*4);
+    return ret;
+}
+
+htsFile *bea_open(const char *fn, const char *mode)
+{
+    // hts_open() does not recognise the BEA magic, so set up the handler by hand
+    htsFile *fp = (htsFile*)calloc(1, sizeof(htsFile));
+    fp->fp.bgzf = bgzf_open(fn, mode);
+    if ( fp->fp.bgzf == NULL ) {
+        free(fp);
+        return NULL;
+    }
+    fp->fn = strdup(fn);
+    fp->is_be = ed_is_big();
+    fp->is_bin = fp->is_bgzf = 1;
+    fp->is_write = strchr(mode, 'w') ? 1 : 0;
+    fp->format.category = region_list;
+    fp->format.format = binary_format;
+    fp->format.compression = bgzf;
+    return fp;
+}
+
+// return 0 for BEA format, -1 for others
+int bea_check_format(const char *fn)
+{
+    BGZF *fp = bgzf_open(fn, "r");
+    if ( fp == NULL ) return -1;
+    char magic[5];
+    int ret = bgzf_read(fp, magic, 5) == 5 && memcmp(magic, "BEA\2\2", 5) == 0 ? 0 : -1;
+    bgzf_close(fp);
+    return ret;
+}
+
+hts_idx_t *bea_index_init(htsFile *fp, const struct gea_hdr *h)
+{
+    return hts_idx_init(h->n[GEA_DT_CTG], HTS_FMT_CSI, bgzf_tell(fp->fp.bgzf), BEA_MIN_SHIFT, BEA_N_LVLS);
+}
+
+int bea_index_push(hts_idx_t *idx, htsFile *fp, struct gea_record *v)
+{
+    return hts_idx_push(idx, v->rid, v->chromStart, v->chromEnd, bgzf_tell(fp->fp.bgzf), 1);
+}
+
+int bea_index_save(hts_idx_t *idx, htsFile *fp, const char *fn)
+{
+    if ( bgzf_flush(fp->fp.bgzf) ) return -1;
+    hts_idx_finish(idx, bgzf_tell(fp->fp.bgzf));
+    return hts_idx_save(idx, fn, HTS_FMT_CSI);
+}
 
 // GEA site I/O
 struct gea_record *gea_init()
@@ -1722,11 +2010,11 @@ void gea_clear(struct gea_record *v)
             v->d.fmt[i].p_free = 0;
         }
     }
-    if ( (v->unpacked | GEA_UN_TRANS) && ( v->blockCount > 0) ) {
-        free(v->c.loc[0]); free(v->c.loc[1]);
-    }
+    if ( v->c.loc[0] ) { free(v->c.loc[0]); v->c.loc[0] = NULL; }
+    if ( v->c.loc[1] ) { free(v->c.loc[1]); v->c.loc[1] = NULL; }
     if ( v->blockCount > 0) {
         free(v->blockPair[0]); free(v->blockPair[1]);
+        v->blockPair[0] = v->blockPair[1] = NULL;
         v->blockCount = 0;
     }
     if ( v->n_cigar ) { free(v->cigars); v->n_cigar = 0; v->cigars = NULL; }
@@ -1744,9 +2032,314 @@ void gea_clear(struct gea_record *v)
 void gea_destroy(struct gea_record *v)
 {
     gea_clear(v);
+    free(v->shared.s);
+    free(v->indiv.s);
+    free(v->d.info);
+    free(v->d.fmt);
     free(v);
 }
 
+/****************************
+ *** GEA in-memory index  ***
+ ****************************/
+
+struct gea_index_key {
+    int rid;
+    int start;
+    int i; // keep the file order for records start at same position
+};
+
+static int gea_index_key_cmp(const void *a, const void *b)
+{
+    const struct gea_index_key *x = (const struct gea_index_key*)a;
+    const struct gea_index_key *y = (const struct gea_index_key*)b;
+    if ( x->rid != y->rid ) return x->rid - y->rid;
+    if ( x->start != y->start ) return x->start < y->start ? -1 : 1;
+    return x->i - y->i;
+}
+
+// Open GEA/BEA file and skip the header, so records could be read by gea_records_next().
+static htsFile *gea_records_open(const char *fn, int *is_bea)
+{
+    htsFile *fp;
+    *is_bea = bea_check_format(fn) == 0;
+    if ( *is_bea ) {
+        fp = bea_open(fn, "r");
+        if ( fp == NULL ) return NULL;
+        // records are encoded with ids of the header, which should be the same with hdr
+        struct gea_hdr *h0 = bea_hdr_read(fp);
+        if ( h0 == NULL ) { hts_close(fp); return NULL; }
+        gea_hdr_destroy(h0);
+    }
+    else {
+        fp = hts_open(fn, "r");
+        if ( fp == NULL ) return NULL;
+        while ( hts_getline(fp, KS_SEP_LINE, &fp->line) >= 0 )
+            if ( fp->line.l && strncmp(fp->line.s, "#chrom", 6) == 0 ) break;
+    }
+    return fp;
+}
+
+// Read next record, 0 on success, -1 on end of file.
+static int gea_records_next(htsFile *fp, int is_bea, const struct gea_hdr *hdr, struct gea_record *v, const char *fn)
+{
+    for ( ;; ) {
+        if ( is_bea ) {
+            int ret = bea_read(fp, hdr, v);
+            if ( ret == -1 ) return -1;
+            if ( ret < -1 ) error("Failed to read %s.", fn);
+            return 0;
+        }
+        if ( hts_getline(fp, KS_SEP_LINE, &fp->line) < 0 ) return -1;
+        if ( fp->line.l == 0 ) continue;
+        if ( gea_parse(&fp->line, hdr, v) ) continue;
+        return 0;
+    }
+}
+
+struct gea_index *gea_index_load(const char *fn, struct gea_hdr *hdr)
+{
+    int is_bea;
+    htsFile *fp = gea_records_open(fn, &is_bea);
+    if ( fp == NULL ) return NULL;
+
+    int i, j, k, n = 0, m = 0;
+    struct gea_record *recs = NULL;
+    struct gea_record *v = gea_init();
+    for ( ;; ) {
+        if ( gea_records_next(fp, is_bea, hdr, v, fn) ) break;
+        // unpack everything here, so the records will never be changed by gea_unpack() later
+        gea_unpack(hdr, v, GEA_UN_TRANS|GEA_UN_CIGAR|GEA_UN_INFO);
+        if ( n == m ) {
+            m = m == 0 ? 1024 : m<<1;
+            recs = (struct gea_record*)realloc(recs, m*sizeof(struct gea_record));
+        }
+        recs[n++] = *v;
+        memset(v, 0, sizeof(*v)); // memory has been moved to recs
+    }
+    gea_destroy(v);
+    hts_close(fp);
+
+    struct gea_index *idx = (struct gea_index*)calloc(1, sizeof(*idx));
+    idx->hdr = hdr;
+    idx->n = n;
+
+    struct gea_index_key *keys = (struct gea_index_key*)malloc(n*sizeof(*keys));
+    for ( i = 0; i < n; ++i ) {
+        keys[i].rid = recs[i].rid;
+        keys[i].start = recs[i].chromStart;
+        keys[i].i = i;
+    }
+    qsort(keys, n, sizeof(*keys), gea_index_key_cmp);
+
+    int n_block = 0;
+    idx->records = (struct gea_record*)malloc(n*sizeof(struct gea_record));
+    for ( i = 0; i < n; ++i ) {
+        idx->records[i] = recs[keys[i].i];
+        if ( idx->records[i].blockCount > 0 ) n_block += idx->records[i].blockCount;
+    }
+    free(keys);
+    free(recs);
+
+    idx->rid        = (int*)malloc(n*sizeof(int));
+    idx->chromStart = (int*)malloc(n*sizeof(int));
+    idx->chromEnd   = (int*)malloc(n*sizeof(int));
+    idx->maxEnd     = (int*)malloc(n*sizeof(int));
+    for ( k = 0; k < 2; ++k ) {
+        idx->blocks[k] = (int*)malloc(n_block*sizeof(int));
+        idx->locs[k]   = (int*)calloc(n_block, sizeof(int));
+    }
+
+    for ( i = 0, j = 0; i < n; ++i ) {
+        struct gea_record *r = &idx->records[i];
+        idx->rid[i]        = r->rid;
+        idx->chromStart[i] = r->chromStart;
+        idx->chromEnd[i]   = r->chromEnd;
+        idx->maxEnd[i]     = i > 0 && idx->rid[i-1] == r->rid && idx->maxEnd[i-1] > r->chromEnd ? idx->maxEnd[i-1] : r->chromEnd;
+        for ( k = 0; k < 2; ++k ) {
+            if ( r->blockCount > 0 ) memcpy(idx->blocks[k]+j, r->blockPair[k], r->blockCount*sizeof(int));
+            free(r->blockPair[k]);
+            r->blockPair[k] = r->blockCount > 0 ? idx->blocks[k]+j : NULL;
+            if ( r->c.loc[k] ) {
+                memcpy(idx->locs[k]+j, r->c.loc[k], r->blockCount*sizeof(int));
+                free(r->c.loc[k]);
+                r->c.loc[k] = idx->locs[k]+j;
+            }
+        }
+        if ( r->blockCount > 0 ) j += r->blockCount;
+    }
+
+    idx->n_ctg = hdr->n[GEA_DT_CTG];
+    idx->ctg_first = (int*)malloc((idx->n_ctg+1)*sizeof(int));
+    for ( i = 0, k = 0; k <= idx->n_ctg; ++k ) {
+        while ( i < n && idx->rid[i] < k ) i++;
+        idx->ctg_first[k] = i;
+    }
+    return idx;
+}
+
+void gea_index_destroy(struct gea_index *idx)
+{
+    int i, k;
+    for ( i = 0; i < idx->n; ++i ) {
+        struct gea_record *r = &idx->records[i];
+        free(r->name);
+        free(r->geneName);
+        free(r->cigars);
+        free(r->shared.s);
+        free(r->indiv.s);
+        free(r->d.info);
+        free(r->d.fmt);
+    }
+    free(idx->records);
+    free(idx->rid);
+    free(idx->chromStart);
+    free(idx->chromEnd);
+    free(idx->maxEnd);
+    for ( k = 0; k < 2; ++k ) {
+        free(idx->blocks[k]);
+        free(idx->locs[k]);
+    }
+    free(idx->ctg_first);
+    free(idx);
+}
+
+int gea_index_query(const struct gea_index *idx, int rid, int beg, int end, int *lo, int *hi)
+{
+    *lo = *hi = 0;
+    if ( rid < 0 || rid >= idx->n_ctg ) return 0;
+    int a = idx->ctg_first[rid], b = idx->ctg_first[rid+1], mid;
+    // first record end after beg, maxEnd is sorted on each contig
+    while ( a < b ) {
+        mid = (a + b) >> 1;
+        if ( idx->maxEnd[mid] > beg ) b = mid;
+        else a = mid + 1;
+    }
+    *lo = a;
+    // first record start at or after end
+    b = idx->ctg_first[rid+1];
+    while ( a < b ) {
+        mid = (a + b) >> 1;
+        if ( idx->chromStart[mid] < end ) a = mid + 1;
+        else b = mid;
+    }
+    *hi = a;
+    return *hi - *lo;
+}
+
+static int gea_bound_start_cmp(const void *a, const void *b)
+{
+    const struct gea_bound *x = (const struct gea_bound*)a;
+    const struct gea_bound *y = (const struct gea_bound*)b;
+    if ( x->rid != y->rid ) return x->rid - y->rid;
+    if ( x->start != y->start ) return x->start < y->start ? -1 : 1;
+    return x->end < y->end ? -1 : x->end > y->end;
+}
+
+static int gea_bound_end_cmp(const void *a, const void *b)
+{
+    const struct gea_bound *x = (const struct gea_bound*)a;
+    const struct gea_bound *y = (const struct gea_bound*)b;
+    if ( x->rid != y->rid ) return x->rid - y->rid;
+    if ( x->end != y->end ) return x->end < y->end ? -1 : 1;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static void gea_bound_push(struct gea_bound **a, int *n, int *m, const struct gea_record *v, int rid, int name)
+{
+    if ( *n == *m ) {
+        *m = *m == 0 ? 1024 : *m<<1;
+        *a = (struct gea_bound*)realloc(*a, *m*sizeof(struct gea_bound));
+    }
+    struct gea_bound *b = &(*a)[(*n)++];
+    b->rid = rid;
+    b->start = v->chromStart;
+    b->end = v->chromEnd;
+    b->strand = v->strand;
+    b->name = name;
+}
+
+struct gea_bounds *gea_bounds_init(const struct gea_hdr *hdr)
+{
+    struct gea_bounds *b = (struct gea_bounds*)calloc(1, sizeof(*b));
+    b->n_ctg = hdr->n[GEA_DT_CTG];
+    b->ctg = (struct gea_ctg_bounds*)calloc(b->n_ctg > 0 ? b->n_ctg : 1, sizeof(struct gea_ctg_bounds));
+    pthread_mutex_init(&b->lock, NULL);
+    return b;
+}
+
+void gea_bounds_push(struct gea_bounds *b, const struct gea_hdr *hdr, int rid, const struct gea_record *v)
+{
+    int is_last = gea_is_mrna(hdr, v) || gea_is_gene(hdr, v);
+    int is_next = gea_is_transcript(hdr, v) || gea_is_gene(hdr, v);
+    if ( is_last == 0 && is_next == 0 ) return;
+    if ( rid < 0 || rid >= b->n_ctg ) return;
+    struct gea_ctg_bounds *c = &b->ctg[rid];
+    int name = -1;
+    if ( v->geneName ) {
+        name = c->names.l;
+        kputs(v->geneName, &c->names);
+        kputc('\0', &c->names);
+    }
+    if ( is_last ) gea_bound_push(&c->last, &c->n_last, &c->m_last, v, rid, name);
+    if ( is_next ) gea_bound_push(&c->next, &c->n_next, &c->m_next, v, rid, name);
+}
+
+void gea_bounds_finish(struct gea_bounds *b, int rid)
+{
+    if ( rid < 0 || rid >= b->n_ctg ) return;
+    struct gea_ctg_bounds *c = &b->ctg[rid];
+    if ( c->n_last ) qsort(c->last, c->n_last, sizeof(struct gea_bound), gea_bound_end_cmp);
+    if ( c->n_next ) qsort(c->next, c->n_next, sizeof(struct gea_bound), gea_bound_start_cmp);
+    c->loaded = 1;
+}
+
+void gea_bounds_destroy(struct gea_bounds *b)
+{
+    if ( b == NULL ) return;
+    int i;
+    for ( i = 0; i < b->n_ctg; ++i ) {
+        free(b->ctg[i].last);
+        free(b->ctg[i].next);
+        free(b->ctg[i].names.s);
+    }
+    free(b->ctg);
+    pthread_mutex_destroy(&b->lock);
+    free(b);
+}
+
+const struct gea_bound *gea_bounds_upstream(const struct gea_bounds *b, int rid, int pos, int max_gap)
+{
+    if ( rid < 0 || rid >= b->n_ctg ) return NULL;
+    const struct gea_ctg_bounds *c = &b->ctg[rid];
+    int lo = 0, hi = c->n_last;
+    // first bound end at or after pos, the one before it is the nearest
+    while ( lo < hi ) {
+        int mid = (lo + hi) >> 1;
+        if ( c->last[mid].end < pos ) lo = mid + 1;
+        else hi = mid;
+    }
+    if ( lo == 0 ) return NULL;
+    const struct gea_bound *g = &c->last[lo-1];
+    return pos - g->end > max_gap ? NULL : g;
+}
+
+const struct gea_bound *gea_bounds_downstream(const struct gea_bounds *b, int rid, int pos, int max_gap)
+{
+    if ( rid < 0 || rid >= b->n_ctg ) return NULL;
+    const struct gea_ctg_bounds *c = &b->ctg[rid];
+    int lo = 0, hi = c->n_next;
+    // first bound start after pos
+    while ( lo < hi ) {
+        int mid = (lo + hi) >> 1;
+        if ( c->next[mid].start <= pos ) lo = mid + 1;
+        else hi = mid;
+    }
+    if ( lo == c->n_next ) return NULL;
+    const struct gea_bound *g = &c->next[lo];
+    return g->start - pos > max_gap ? NULL : g;
+}
+
 #ifdef GEA_MAIN_TEST
 
 int main(int argc, char **argv)
@@ -1782,7 +2375,7 @@ int main(int argc, char **argv)
     struct gea_record *v = gea_init();
     for (;;) {
         if ( gea_read(fp, hdr, v) ) break;
-        if ( strcmp(hdr->id[GEA_DT_BIOTYPE][v->biotype].key, "mRNA") && strcmp(hdr->id[GEA_DT_BIOTYPE][v->biotype].key, "ncRNA") ) continue;
+        if ( !gea_is_transcript(hdr, v) ) continue;
         gea_unpack(hdr, v, GEA_UN_CIGAR|GEA_UN_TRANS);
         int i;
         for ( i = 0; i < v->blockCount; ++i ) {
@@ -1813,6 +2406,52 @@ int main(int argc, char **argv)
     hts_close(fp);
 }
 
+#elif defined GEA2BEA_MAIN
+
+int main(int argc, char **argv)
+{
+    if ( argc != 3 )
+        error("Usage: gea2bea in.gea.gz out.bea\n"
+              "Convert text GEA to binary GEA, the CSI index out.bea.csi will be created at the same time.\n"
+              "Records of input file should be sorted by position.");
+
+    htsFile *fp = hts_open(argv[1], "r");
+    if ( fp == NULL ) error("%s : %s.", argv[1], strerror(errno));
+    struct gea_hdr *hdr = gea_hdr_read(fp);
+    if ( hdr == NULL ) error("Failed to read header of %s.", argv[1]);
+    struct gea_record *v = gea_init();
+
+    // First pass, register the contigs, bioTypes and INFO tags not defined in the header. Header of BEA
+    // is written before records, so all the dictionaries should be complete here.
+    while ( gea_read(fp, hdr, v) == 0 );
+    hts_close(fp);
+    if ( hdr->dirty ) gea_hdr_sync(hdr);
 
+    fp = hts_open(argv[1], "r");
+    if ( fp == NULL ) error("%s : %s.", argv[1], strerror(errno));
+    // skip header lines
+    while ( hts_getline(fp, KS_SEP_LINE, &fp->line) >= 0 )
+        if ( fp->line.l && strncmp(fp->line.s, "#chrom", 6) == 0 ) break;
+
+    htsFile *out = hts_open(argv[2], "wb");
+    if ( out == NULL ) error("%s : %s.", argv[2], strerror(errno));
+    if ( bea_hdr_write(out, hdr) ) error("Failed to write header.");
+    hts_idx_t *idx = bea_index_init(out, hdr);
+    if ( idx == NULL ) error("Failed to init index.");
+
+    for ( ;; ) {
+        if ( gea_read(fp, hdr, v) ) break;
+        if ( bea_write(out, hdr, v) ) error("Failed to write record. %s", v->name);
+        if ( bea_index_push(idx, out, v) < 0 )
+            error("Failed to index %s:%d-%d. Is the input sorted?", hdr->id[GEA_DT_CTG][v->rid].key, v->chromStart, v->chromEnd);
+    }
+    if ( bea_index_save(idx, out, argv[2]) ) error("Failed to save index of %s.", argv[2]);
+    hts_idx_destroy(idx);
+    gea_destroy(v);
+    gea_hdr_destroy(hdr);
+    hts_close(fp);
+    hts_close(out);
+    return 0;
+}
 
 #endif
@@ -1,10 +1,12 @@
 #ifndef GEA_HEADER
 #define GEA_HEADER
 
+#include <pthread.h>
 #include "utils.h"
 #include "htslib/hts.h"
 #include "htslib/vcf.h"
 #include "htslib/tbx.h"
+#include "htslib/bgzf.h"
 
 // The design of GEA header structure borrow a lot of definitions from VCF/BCF format and UCSC genepred format,
 // this design makes GEA flexible and extensible. Meanwhile, some definitions in VCF/BCF format are not suitable
@@ -157,10 +159,11 @@ struct gea_hdr {
     int32_t m[GEA_DICT_ALL]; // m : allocated size of each dict block
     char *version; // version of gea format, prserved for further update
 
-    // cached id for fast access
+    // cached id for fast access, resolved in gea_hdr_sync, -1 if not defined
     int mrna_id;
     int nrna_id;
-    int gene_id;
+    int gene_id; // "gene" or "Gene"
+    int tfbs_id;
     
     struct gea_id_pair *id[GEA_DICT_ALL];
     void *dict[GEA_DICT_ALL];
@@ -171,6 +174,12 @@ struct gea_hdr {
     kstring_t mem;
 };
 
+#define gea_is_mrna(hdr, v) ((v)->biotype == (hdr)->mrna_id)
+#define gea_is_ncrna(hdr, v) ((v)->biotype == (hdr)->nrna_id)
+#define gea_is_transcript(hdr, v) (gea_is_mrna(hdr, v) || gea_is_ncrna(hdr, v))
+#define gea_is_gene(hdr, v) ((v)->biotype == (hdr)->gene_id)
+#define gea_is_tfbs(hdr, v) ((v)->biotype == (hdr)->tfbs_id)
+
 #define gea_hdr_id2type(hdr, id) ((hdr)->id[GEA_DT_ID][id].val->info>>4 & 0xf)
 #define gea_hdr_id2length(hdr, id) ((hdr)->id[GEA_DT_ID][id].val->info>>8 & 0xf)
 #define gea_hdr_id2number(hdr, id) ((hdr)->id[GEA_DT_ID][id].val->info>>12)
@@ -313,6 +322,36 @@ int gea_hdr_append(struct gea_hdr *hdr, const char *line);
 int gea_read(htsFile *fp,const struct gea_hdr *hdr, struct gea_record *rec);
 int gea_write(htsFile *fp, const struct gea_hdr *hdr, struct gea_record *rec);
 
+int gea_hdr_id2int(const struct gea_hdr *hdr, int which, const char *id);
+
+// Binary GEA (BEA). BGZF compressed, records are stored pre-unpacked (block arrays, transcript locations,
+// packed CIGARs and encoded INFO), and indexed by CSI. Use gea2bea to convert a text GEA file.
+#define BEA_MIN_SHIFT 14
+#define BEA_N_LVLS    6
+
+// return 0 for BEA format, -1 for others
+int bea_check_format(const char *fn);
+// hts_open() cannot detect BEA, open BEA file with this function and close by hts_close()
+htsFile *bea_open(const char *fn, const char *mode);
+struct gea_hdr *bea_hdr_read(htsFile *fp);
+int bea_hdr_write(htsFile *fp, struct gea_hdr *hdr);
+int bea_read(htsFile *fp, const struct gea_hdr *hdr, struct gea_record *rec);
+int bea_read1(BGZF *fp, const struct gea_hdr *hdr, struct gea_record *rec);
+int bea_write(htsFile *fp, const struct gea_hdr *hdr, struct gea_record *rec);
+int bea_format(const struct gea_hdr *hdr, struct gea_record *rec, kstring_t *s);
+// hts_readrec_func, used by hts_itr_query()/hts_itr_next()
+int bea_readrec(BGZF *fp, void *hdr, void *rec, int *tid, int *beg, int *end);
+// Read bytes of next record without decoding, so cached records could be skipped by the virtual offset.
+// Return 0 on success, -1 on end of file, -2 on error.
+int bea_read_raw(BGZF *fp, kstring_t *s);
+int bea_decode(const struct gea_hdr *hdr, const kstring_t *s, struct gea_record *rec);
+// hts_readrec_func of raw records, rec point to a kstring_t
+int bea_readrec_raw(BGZF *fp, void *hdr, void *rec, int *tid, int *beg, int *end);
+
+hts_idx_t *bea_index_init(htsFile *fp, const struct gea_hdr *hdr);
+int bea_index_push(hts_idx_t *idx, htsFile *fp, struct gea_record *rec);
+int bea_index_save(hts_idx_t *idx, htsFile *fp, const char *fn);
+
 struct gea_format *gea_get_fmt(const struct gea_hdr *hdr, struct gea_record *rec, const char *key);
 bcf_info_t   *gea_get_info(const struct gea_hdr *hdr, struct gea_record *rec, const char *key);
 
@@ -332,5 +371,74 @@ struct gea_reader *gea_read_file(const char *fn);
 int gea_reader_destroy(struct gea_reader *reader);
 int gea_reader_next_line(struct gea_reader *reader, struct gea_record *rec);
 
+// Whole-genome in-memory index. All records of a GEA/BEA file are loaded and unpacked once, positions used to
+// locate records are kept in contiguous arrays, sorted by contig and chromStart. After loading, the index is
+// read only, so it could be shared by all threads.
+struct gea_index {
+    struct gea_hdr *hdr; // point to header used to parse records, do NOT free it
+    int n;
+    int *rid;
+    int *chromStart;
+    int *chromEnd;
+    // running maximum of chromEnd on each contig, used to find the first record overlapped with a region
+    int *maxEnd;
+    // block pairs and locations of all records, one allocation each instead of two per record
+    int *blocks[2];
+    int *locs[2];
+
+    // records on contig i are in [ctg_first[i], ctg_first[i+1])
+    int n_ctg;
+    int *ctg_first;
+
+    // record views for the annotators, block pairs and locations point to the arrays above
+    struct gea_record *records;
+};
+
+struct gea_index *gea_index_load(const char *fn, struct gea_hdr *hdr);
+void gea_index_destroy(struct gea_index *idx);
+// Records overlapped with [beg,end) are in [*lo, *hi), and skip those chromEnd <= beg. Return *hi - *lo.
+int gea_index_query(const struct gea_index *idx, int rid, int beg, int end, int *lo, int *hi);
+
+// Boundaries of genes and transcripts on each contig, used to find the nearest gene of intergenic variants by
+// binary search instead of retrieving the flanking regions of each chunk. Contigs are loaded on first use, see
+// gea_bounds_push() and gea_bounds_finish().
+struct gea_bound {
+    int rid;
+    int start;
+    int end;
+    int strand;
+    int name; // offset of gene name in names of the contig, -1 for unknown
+};
+
+struct gea_ctg_bounds {
+    int loaded;
+    // mRNA and gene records sorted by chromEnd, used to find the upstream gene
+    int n_last, m_last;
+    struct gea_bound *last;
+    // transcript and gene records sorted by chromStart, used to find the downstream gene
+    int n_next, m_next;
+    struct gea_bound *next;
+    kstring_t names;
+};
+
+struct gea_bounds {
+    int n_ctg;
+    struct gea_ctg_bounds *ctg;
+    // bounds are shared by threads, hold it while loading a contig
+    pthread_mutex_t lock;
+};
+
+struct gea_bounds *gea_bounds_init(const struct gea_hdr *hdr);
+void gea_bounds_destroy(struct gea_bounds *b);
+#define gea_bounds_loaded(b, rid) ((b)->ctg[rid].loaded)
+// Add record to the bounds of contig rid, skip if it is not a gene or transcript.
+void gea_bounds_push(struct gea_bounds *b, const struct gea_hdr *hdr, int rid, const struct gea_record *v);
+// Sort bounds of contig rid and mark it loaded.
+void gea_bounds_finish(struct gea_bounds *b, int rid);
+#define gea_bound_name(b, g) ((g)->name == -1 ? NULL : (b)->ctg[(g)->rid].names.s + (g)->name)
+// Nearest bound end before pos, or start after pos, NULL if not found within max_gap. Contig rid should be loaded.
+const struct gea_bound *gea_bounds_upstream(const struct gea_bounds *b, int rid, int pos, int max_gap);
+const struct gea_bound *gea_bounds_downstream(const struct gea_bounds *b, int rid, int pos, int max_gap);
+
 
 #endif
@@ -3,6 +3,19 @@
 #include "motif_encode.h"
 #include "anno_pool.h"
 #include "number.h"
+#include "htslib/khash.h"
+
+KHASH_MAP_INIT_STR(motif_name, int)
+
+// hits of this range are cached from the index each time
+#define MOTIF_HITS_WINDOW (1<<16)
+
+static int motif_quiet = 0;
+
+void motif_set_quiet(int quiet)
+{
+    motif_quiet = quiet;
+}
 
 /* encode bitcodes */
 
@@ -323,6 +336,151 @@ int encode_query(struct encode *q, struct encode *r, int m)
     else                       return _enc64_enc64_query(q, r, m);
 }
 */
+void motif_scan_all(struct motif_scan *s, const char *seq, int l, uint64_t *state, int **_hits, int *_n, int *_m)
+{
+    uint64_t *d0 = state, *d1 = state + s->n_word;
+    memset(state, 0, 2*s->n_word*sizeof(uint64_t));
+    int i, w;
+    int n = *_n, m = *_m;
+    int *hits = *_hits;
+    for ( i = 0; i < l; ++i ) {
+        int c = _enc[(uint8_t)seq[i]] & 0xf;
+        for ( w = 0; w < s->n_word; ++w ) {
+            uint64_t b = s->mask[w*16+c];
+            uint64_t x0 = (d0[w]<<1) | s->init[w];
+            d0[w] = x0 & b;
+            d1[w] = (((d1[w]<<1) | s->init[w]) & b) | x0;
+            uint64_t h = d1[w] & s->last[w];
+            while ( h ) {
+                if ( n + 2 > m ) {
+                    m = m == 0 ? 1024 : m*2;
+                    hits = realloc(hits, m*sizeof(int));
+                }
+                hits[n++] = s->bit2pat[w*64 + __builtin_ctzll(h)];
+                hits[n++] = i;
+                h &= h - 1;
+            }
+        }
+    }
+    *_n = n;
+    *_m = m;
+    *_hits = hits;
+}
+
+// CRC32 of the motif file, written into the index so hits are only used with the same motifs.
+static uint32_t motif_file_checksum(const char *fname)
+{
+    BGZF *fp = bgzf_open(fname, "r");
+    if ( fp == NULL ) error("%s : %s.", fname, strerror(errno));
+    uint8_t buf[65536];
+    uLong crc = crc32(0L, Z_NULL, 0);
+    ssize_t l;
+    while ( (l = bgzf_read(fp, buf, sizeof buf)) > 0 ) crc = crc32(crc, buf, l);
+    if ( l < 0 ) error("Failed to read %s.", fname);
+    bgzf_close(fp);
+    return (uint32_t)crc;
+}
+
+// Check the build information in the header of index, sites below the minimal score of building are not in the
+// index, so a lower min or other motifs give different scores from scanning the reference.
+static void motif_index_check(const char *fname, const char *motif_fname, int min)
+{
+    htsFile *fp = hts_open(fname, "r");
+    if ( fp == NULL ) error("%s : %s.", fname, strerror(errno));
+    int build_min = 0, has_min = 0, has_crc = 0;
+    uint32_t crc = 0;
+    while ( hts_getline(fp, KS_SEP_LINE, &fp->line) >= 0 ) {
+        if ( fp->line.s[0] != '#' ) break;
+        if ( strncmp(fp->line.s, "##min=", 6) == 0 ) {
+            build_min = atoi(fp->line.s + 6);
+            has_min = 1;
+        }
+        else if ( strncmp(fp->line.s, "##motif=", 8) == 0 ) {
+            crc = strtoul(fp->line.s + 8, NULL, 16);
+            has_crc = 1;
+        }
+    }
+    hts_close(fp);
+    if ( has_min == 0 || has_crc == 0 ) error("No build information in %s, rebuild it by `bcfanno_pwm build`.", fname);
+    if ( crc != motif_file_checksum(motif_fname) ) error("%s is not built from motifs of %s, rebuild it.", fname, motif_fname);
+    if ( min < build_min ) error("Minimal PWM score %d is lower than %d, which %s is built with.", min, build_min, fname);
+}
+
+struct motif_index *motif_index_load(const char *fname, const char *motif_fname, int min, struct motif **mm, int n, int max_len)
+{
+    motif_index_check(fname, motif_fname, min);
+    struct motif_index *idx = malloc(sizeof(*idx));
+    idx->fname = fname;
+    idx->max_len = max_len;
+    idx->tbx = tbx_index_load(fname);
+    if ( idx->tbx == NULL ) error("Failed to load index of %s.", fname);
+    khash_t(motif_name) *hash = kh_init(motif_name);
+    int i, ret;
+    for ( i = 0; i < n; ++i ) {
+        khiter_t k = kh_put(motif_name, hash, mm[i]->name, &ret);
+        if ( ret == 0 ) warnings("Duplicated motif %s, only the first one is annotated with index.", mm[i]->name);
+        else kh_val(hash, k) = i;
+    }
+    idx->hash = hash;
+    return idx;
+}
+void motif_index_destroy(struct motif_index *idx)
+{
+    if ( idx == NULL ) return;
+    tbx_destroy(idx->tbx);
+    kh_destroy(motif_name, (khash_t(motif_name)*)idx->hash);
+    free(idx);
+}
+struct motif_hits *motif_hits_init(struct motif_index *idx)
+{
+    struct motif_hits *h = malloc(sizeof(*h));
+    memset(h, 0, sizeof(*h));
+    h->idx = idx;
+    h->tid = -2;
+    h->fp = hts_open(idx->fname, "r");
+    if ( h->fp == NULL ) error("%s : %s.", idx->fname, strerror(errno));
+    return h;
+}
+void motif_hits_destroy(struct motif_hits *h)
+{
+    if ( h == NULL ) return;
+    hts_close(h->fp);
+    free(h->a);
+    free(h->str.s);
+    free(h->off);
+    free(h);
+}
+// Cache hits overlapping [beg, beg + MOTIF_HITS_WINDOW).
+static void motif_hits_fetch(struct motif_hits *h, int tid, int beg)
+{
+    struct motif_index *idx = h->idx;
+    khash_t(motif_name) *hash = (khash_t(motif_name)*)idx->hash;
+    h->tid = tid;
+    h->beg = beg;
+    h->end = beg + MOTIF_HITS_WINDOW;
+    h->n = 0;
+    if ( tid < 0 ) return;
+    hts_itr_t *itr = tbx_itr_queryi(idx->tbx, tid, beg, h->end);
+    if ( itr == NULL ) return;
+    while ( tbx_itr_next(h->fp, idx->tbx, itr, &h->str) >= 0 ) {
+        int n = ksplit_core(h->str.s, '\t', &h->m_off, &h->off);
+        if ( n < 6 ) error("Truncated line in %s.", idx->fname);
+        khiter_t k = kh_get(motif_name, hash, h->str.s + h->off[3]);
+        // motif not annotated
+        if ( k == kh_end(hash) ) continue;
+        if ( h->n == h->m ) {
+            h->m = h->m == 0 ? 64 : h->m*2;
+            h->a = realloc(h->a, h->m*sizeof(struct motif_hit));
+        }
+        struct motif_hit *x = &h->a[h->n++];
+        x->start = atoi(h->str.s + h->off[1]);
+        x->motif = kh_val(hash, k);
+        x->strand = h->str.s[h->off[4]] == '-';
+        x->score = atof(h->str.s + h->off[5]);
+    }
+    hts_itr_destroy(itr);
+}
+
 static int _enc16_seq_query(struct encode16 *q, const char *s, int l, int m)
 {
     int i;
@@ -378,6 +536,8 @@ void motif_destroy(struct motif *m)
     free(m->map[1]);
     free(m->map[2]);
     free(m->map[3]);
+    free(m->pwm);
+    free(m->pwm_rc);
     free(m);    
 }
 static void motif_put_value_line(struct motif *m, float a_v, float c_v, float g_v, float t_v)
@@ -466,7 +626,96 @@ static void motif_sync(struct motif *m)
 
     // reversed motif sequence
     m->rev = encode_rev(m->enc);
+
+    // transposed matrix for scoring, the reverse strand is scored with complemented bases
+    m->pwm = malloc(m->n*4*sizeof(float));
+    m->pwm_rc = malloc(m->n*4*sizeof(float));
+    int i, j;
+    for ( i = 0; i < m->n; ++i ) {
+        for ( j = 0; j < 4; ++j ) {
+            m->pwm[i*4+j] = m->map[j][i];
+            m->pwm_rc[i*4+j] = m->map[3-j][i];
+        }
+    }
+}
+// Scalar kernel, also used for the tail windows of vector kernels.
+static void pwm_score_scalar(const float *T, int n, const uint8_t *codes, const int *win, int n_win, int rev, float *out)
+{
+    int i, k;
+    for ( k = 0; k < n_win; ++k ) {
+        const uint8_t *c = codes + win[k];
+        float pwm = 0;
+        for ( i = 0; i < n; ++i ) pwm += T[i*4 + (c[rev ? n-i-1 : i]&3)];
+        out[k] = pwm;
+    }
 }
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// 8 windows per loop, bases of each position are gathered and used to permute the row of matrix.
+__attribute__((target("avx2")))
+static void pwm_score_avx2(const float *T, int n, const uint8_t *codes, const int *win, int n_win, int rev, float *out)
+{
+    int i, k;
+    const __m256i mask = _mm256_set1_epi32(3);
+    for ( k = 0; k + 8 <= n_win; k += 8 ) {
+        __m256i base = _mm256_loadu_si256((const __m256i*)(win+k));
+        __m256 pwm = _mm256_setzero_ps();
+        for ( i = 0; i < n; ++i ) {
+            __m256i idx = _mm256_add_epi32(base, _mm256_set1_epi32(rev ? n-i-1 : i));
+            __m256i c = _mm256_and_si256(_mm256_i32gather_epi32((const int*)codes, idx, 1), mask);
+            __m256 row = _mm256_broadcast_ps((const __m128*)(T + i*4));
+            pwm = _mm256_add_ps(pwm, _mm256_permutevar8x32_ps(row, c));
+        }
+        _mm256_storeu_ps(out+k, pwm);
+    }
+    pwm_score_scalar(T, n, codes, win+k, n_win-k, rev, out+k);
+}
+
+// 4 windows per loop, the row of matrix is shuffled by bytes.
+__attribute__((target("ssse3")))
+static void pwm_score_ssse3(const float *T, int n, const uint8_t *codes, const int *win, int n_win, int rev, float *out)
+{
+    int i, k;
+    const __m128i spread = _mm_set_epi8(3,3,3,3, 2,2,2,2, 1,1,1,1, 0,0,0,0);
+    const __m128i bytes = _mm_set1_epi32(0x03020100);
+    for ( k = 0; k + 4 <= n_win; k += 4 ) {
+        const uint8_t *c0 = codes + win[k], *c1 = codes + win[k+1], *c2 = codes + win[k+2], *c3 = codes + win[k+3];
+        __m128 pwm = _mm_setzero_ps();
+        for ( i = 0; i < n; ++i ) {
+            int j = rev ? n-i-1 : i;
+            uint32_t c = (c0[j]&3) | (c1[j]&3)<<8 | (c2[j]&3)<<16 | (uint32_t)(c3[j]&3)<<24;
+            __m128i idx = _mm_shuffle_epi8(_mm_cvtsi32_si128(c), spread);
+            idx = _mm_add_epi8(_mm_slli_epi16(idx, 2), bytes);
+            __m128i row = _mm_castps_si128(_mm_loadu_ps(T + i*4));
+            pwm = _mm_add_ps(pwm, _mm_castsi128_ps(_mm_shuffle_epi8(row, idx)));
+        }
+        _mm_storeu_ps(out+k, pwm);
+    }
+    pwm_score_scalar(T, n, codes, win+k, n_win-k, rev, out+k);
+}
+#endif
+
+typedef void (*pwm_kernel_func)(const float *T, int n, const uint8_t *codes, const int *win, int n_win, int rev, float *out);
+
+static pwm_kernel_func pwm_kernel = pwm_score_scalar;
+
+// Pick the kernel for this CPU, called at loading motifs.
+static void pwm_kernel_init()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx2") ) pwm_kernel = pwm_score_avx2;
+    else if ( __builtin_cpu_supports("ssse3") ) pwm_kernel = pwm_score_ssse3;
+#endif
+}
+
+void motif_pwm_score(struct motif *m, const uint8_t *codes, const int *win, int n_win, int strand, float *out)
+{
+    pwm_kernel(strand == 0 ? m->pwm : m->pwm_rc, m->n, codes, win, n_win, strand, out);
+}
+
 struct motif **motif_read(const char *fname, int *_n)
 {
     BGZF *fp = bgzf_open(fname, "r");    
@@ -505,6 +754,7 @@ struct motif **motif_read(const char *fname, int *_n)
     }
     int i;    
     for ( i = 0; i < n_motif; ++i ) motif_sync(mm[i]);
+    pwm_kernel_init();
     bgzf_close(fp);
     *_n = n_motif;
     if ( n_motif == 0 ) { free(mm); return NULL; }
@@ -524,86 +774,203 @@ static int test_motif(const char *fname)
     }
     return 0;
 }
-float motif_pwm_score(struct motif *m, char *s, int r)
+struct motif_scan *motif_scan_init(struct motif **mm, int n)
 {
-    int l;
-    l = strlen(s);
-    if ( l < m->n ) error("Sequence is shorter than motif length.");
-    float pwm = 0;
-    int i;
-    for ( i = 0; i < m->n; ++i ) {
-        int b = r == 0 ? B4[s[i]] : 5-B4[s[m->n-i-1]];
-        if ( b == 0 ) error("Unknown base at %s.",s);
-        b -= 1;
-        pwm += m->map[b][i];
+    struct motif_scan *s = malloc(sizeof(*s));
+    memset(s, 0, sizeof(*s));
+    s->n_pat = n*2;
+    int i, j, m_word = 0, bit = 64;
+    for ( i = 0; i < s->n_pat; ++i ) {
+        struct motif *m = mm[i/2];
+        struct encode *e = i & 1 ? m->rev : m->enc;
+        if ( e->l == 0 || e->l > 16 ) continue;
+        if ( s->max_len < e->l ) s->max_len = e->l;
+        // patterns do not cross words
+        if ( bit + e->l > 64 ) {
+            if ( s->n_word == m_word ) {
+                m_word = m_word == 0 ? 4 : m_word*2;
+                s->init = realloc(s->init, m_word*sizeof(uint64_t));
+                s->last = realloc(s->last, m_word*sizeof(uint64_t));
+                s->mask = realloc(s->mask, m_word*16*sizeof(uint64_t));
+                s->bit2pat = realloc(s->bit2pat, m_word*64*sizeof(int));
+            }
+            s->init[s->n_word] = s->last[s->n_word] = 0;
+            memset(s->mask + s->n_word*16, 0, 16*sizeof(uint64_t));
+            s->n_word++;
+            bit = 0;
+        }
+        int w = s->n_word - 1;
+        uint64_t x = ((struct encode16*)e->x)->x;
+        // position j of the pattern is nibble l-j-1 of the encode, the last base is matched with the lowest nibble
+        for ( j = 0; j < e->l; ++j ) {
+            int b = (x >> ((e->l-j-1)*4)) & 0xf;
+            int c;
+            for ( c = 0; c < 16; ++c )
+                if ( b & c ) s->mask[w*16+c] |= 1ULL << (bit+j);
+        }
+        s->init[w] |= 1ULL << bit;
+        s->last[w] |= 1ULL << (bit + e->l - 1);
+        s->bit2pat[w*64 + bit + e->l - 1] = i;
+        bit += e->l;
     }
-    return pwm;
+    return s;
+}
+
+void motif_scan_destroy(struct motif_scan *s)
+{
+    free(s->init);
+    free(s->last);
+    free(s->mask);
+    free(s->bit2pat);
+    free(s);
 }
+
+void motif_scan_seq(struct motif_scan *s, const char *seq, int l, const int *min_end, const int *max_end, int *hit, uint64_t *state)
+{
+    uint64_t *d0 = state, *d1 = state + s->n_word;
+    memset(state, 0, 2*s->n_word*sizeof(uint64_t));
+    int i, w;
+    for ( i = 0; i < s->n_pat; ++i ) hit[i] = -1;
+    for ( i = 0; i < l; ++i ) {
+        int c = _enc[(uint8_t)seq[i]] & 0xf;
+        for ( w = 0; w < s->n_word; ++w ) {
+            uint64_t b = s->mask[w*16+c];
+            uint64_t x0 = (d0[w]<<1) | s->init[w];
+            // exactly matched, or matched with one mismatch
+            d0[w] = x0 & b;
+            d1[w] = (((d1[w]<<1) | s->init[w]) & b) | x0;
+            uint64_t h = d1[w] & s->last[w];
+            while ( h ) {
+                int p = s->bit2pat[w*64 + __builtin_ctzll(h)];
+                if ( hit[p] == -1 && i >= min_end[p] && i < max_end[p] ) hit[p] = i;
+                h &= h - 1;
+            }
+        }
+    }
+}
+
 struct MTF *MTF_init()
 {
     struct MTF *MTF = malloc(sizeof(struct MTF));
     memset(MTF, 0, sizeof(struct MTF));
     MTF->tid = -1;
-    //static struct plp_ref ref = {{NULL, NULL}, {-1, -1}, {0,0}};
-    MTF->r = malloc(sizeof(struct plp_ref));//  &ref; // this alias will be used only in one thread
-    MTF->r->ref_id[0] = -1;
-    MTF->r->ref_id[1] = -1;
-    MTF->r->ref[0] = NULL;
-    MTF->r->ref[1] = NULL;
-    MTF->r->ref_len[0] = 0;
-    MTF->r->ref_len[1] = 1;
+    MTF->r = malloc(sizeof(struct plp_ref)); // this alias will be used only in one thread
+    plp_ref_init(MTF->r, NULL);
     return MTF;
 }
 void MTF_destory(struct MTF *m)
 {
-    fai_destroy(m->fai);
-    if (m->r->ref[0]) free(m->r->ref[0]);
-    if (m->r->ref[1]) free(m->r->ref[1]);
+    plp_ref_destroy(m->r);
+    free(m->r);
+    motif_hits_destroy(m->hits);
+    free(m->scan_state);
+    free(m->hit);
+    free(m->min_end);
+    free(m->max_end);
+    free(m->codes);
+    free(m->win);
+    free(m->score);
     free(m);
 }
 //  PWM_score_change
 //  CTCF_PWM_score_change
 static int MTF_new_region_init(struct MTF *MTF, int tid, int pos)
 {
-    int ret;
-    int has_ref;
     struct bedaux *bed = MTF->bed;
+    // no regions, annotate all variants
+    if ( bed == NULL ) return 1;
+    if ( MTF->cursor.bed != bed ) bed_cursor_init(&MTF->cursor, bed);
     char *seqname = (char*)MTF->bcf_hdr->id[BCF_DT_CTG][tid].key;
-    ret = bed_position_covered(bed, seqname, pos, &MTF->start, &MTF->end);
-    if (ret == 0) return 0;
-    
-    has_ref = plp_get_ref(MTF->r, seqname, MTF->fai, tid, &MTF->ref, &MTF->ref_len);
-    if ( has_ref == 0 ) error("No such chromosome %s at reference.", seqname);
+    if ( bed_cursor_covered(&MTF->cursor, seqname, pos, &MTF->start, &MTF->end) == 0 ) return 0;
 
+    // check reference once for each chromosome
+    if ( MTF->tid != tid ) {
+        if ( ref_store_name2id(MTF->r->store, seqname) == -1 ) error("No such chromosome %s at reference.", seqname);
+        MTF->tid = tid;
+    }
     return 1;
 }
 static int MTF_vcf_sync(struct MTF *MTF, bcf1_t *l)
 {
-    if ( MTF->tid != l->rid || MTF->end < l->pos ) 
-        return MTF_new_region_init(MTF, l->rid, l->pos+1);
-    return 1;
+    return MTF_new_region_init(MTF, l->rid, l->pos+1);
 }
 int anno_motif_setter_info_float(bcf_hdr_t *hdr, bcf1_t *line, struct anno_col *col, int n, float *v)
 {
     return bcf_update_info_float_fixed(hdr, line, col->hdr_key, v, n);
 }
-/*
-  annotate PWM changes in VCF
- */
-static char *_construct_alt_seq(char *s, int loc, char *ref, char *alt, int l)
-{    
-    if (ref != NULL && _enc[s[loc]] != _enc[*ref]) error("Inconsistant ref bases, %c vs %s", s[loc], ref);
-    kstring_t str = {0,0,0};
-    // put capped bases into string
-    if (loc) kputsn(s, loc, &str);
-    l = l - str.l;
-    // put alternative sequences into string
-    if (alt) kputs(alt, &str);
-    // s point to the next position of ref
-    s = s+loc+strlen(ref);
-    // put enough sequences into string
-    kputsn(s, l, &str);
-    return str.s;
+// Set MTF::hit from the index in the same way as motif_scan_seq(), hit ends are relative to start. Return the number
+// of hits passing the minimal score.
+static int MTF_index_hits(struct MTF *MTF, const char *seqname, int pos, int start)
+{
+    struct motif_hits *h = MTF->hits;
+    int i;
+    for ( i = 0; i < MTF->n*2; ++i ) MTF->hit[i] = -1;
+
+    int tid = tbx_name2id(h->idx->tbx, seqname);
+    int beg = pos - h->idx->max_len;
+    if ( beg < 0 ) beg = 0;
+    if ( tid != h->tid || beg < h->beg || pos >= h->end ) motif_hits_fetch(h, tid, beg);
+
+    // first hit started after beg
+    int lo = 0, hi = h->n;
+    while ( lo < hi ) {
+        int mid = (lo + hi)/2;
+        if ( h->a[mid].start <= beg ) lo = mid + 1;
+        else hi = mid;
+    }
+    int n = 0;
+    for ( i = lo; i < h->n && h->a[i].start < pos; ++i ) {
+        struct motif_hit *x = &h->a[i];
+        struct motif *m = MTF->mm[x->motif];
+        // not scanned motif, or the index is built from other motif file
+        if ( m->n > h->idx->max_len ) continue;
+        // scan region of each motif is [pos - n, pos + n), scored window is one base before the matched end
+        if ( x->start <= pos - m->n ) continue;
+        int p = x->motif*2 + x->strand;
+        if ( MTF->hit[p] != -1 ) continue;
+        MTF->hit[p] = x->start + m->n - start;
+        if ( x->score >= MTF->min ) n++;
+    }
+    return n;
+}
+
+// Encode the scan region of each allele into row of codes, row k starts at k*stride. Bases not A/C/G/T are
+// encoded as 0xff.
+static int MTF_encode_alleles(struct MTF *MTF, bcf1_t *line, const char *seq, int l_seq, int start)
+{
+    int k, j;
+    int l_head = line->pos - start;
+    int l_ref = strlen(line->d.allele[0]);
+    int l_alt = 0;
+    for ( k = 0; k < line->n_allele; ++k ) {
+        int l = strlen(line->d.allele[k]);
+        if ( l > l_alt ) l_alt = l;
+    }
+    // the vector kernel reads 4 bytes for each base
+    int stride = l_head + l_alt + MTF->scan->max_len + 4;
+    if ( MTF->m_codes < line->n_allele*stride ) {
+        MTF->m_codes = line->n_allele*stride;
+        MTF->codes = realloc(MTF->codes, MTF->m_codes);
+    }
+    if ( MTF->m_allele < line->n_allele ) {
+        MTF->m_allele = line->n_allele;
+        MTF->win = realloc(MTF->win, MTF->m_allele*sizeof(int));
+        MTF->score = realloc(MTF->score, MTF->m_allele*sizeof(float));
+    }
+    memset(MTF->codes, 0xff, line->n_allele*stride);
+    for ( k = 0; k < line->n_allele; ++k ) {
+        uint8_t *c = MTF->codes + k*stride;
+        const char *a = line->d.allele[k];
+        for ( j = 0; j < l_head; ++j ) *c++ = B4[(uint8_t)seq[j]] - 1;
+        for ( ; *a; ++a ) *c++ = B4[(uint8_t)*a] - 1;
+        for ( j = l_head + l_ref; j < l_seq && c < MTF->codes + (k+1)*stride - 4; ++j ) *c++ = B4[(uint8_t)seq[j]] - 1;
+    }
+    return stride;
+}
+
+static void MTF_check_window(const uint8_t *codes, const char *s, int n)
+{
+    if ( memchr(codes, 0xff, n) ) error("Unknown base at %.*s.", n, s);
 }
 
 int anno_vcf_motif_pwm(struct MTF *MTF, bcf1_t *line)
@@ -612,49 +979,98 @@ int anno_vcf_motif_pwm(struct MTF *MTF, bcf1_t *line)
 
     float pwm_change = 0.0;
     int i;
-    // debug_print("%s\t%d",MTF->bcf_hdr->id[BCF_DT_CTG][line->rid].key, line->pos+1);
-    for ( i = 0; i < MTF->n; ++i ) { // for each motif, calculate PWM
+    const char *seqname = MTF->bcf_hdr->id[BCF_DT_CTG][line->rid].key;
+    struct motif_scan *scan = MTF->scan;
+    if ( MTF->hit == NULL ) {
+        MTF->scan_state = malloc(2*scan->n_word*sizeof(uint64_t));
+        MTF->hit = malloc(scan->n_pat*sizeof(int));
+        MTF->min_end = malloc(scan->n_pat*sizeof(int));
+        MTF->max_end = malloc(scan->n_pat*sizeof(int));
+    }
 
-        // motif struct
+    // scan region of each motif is [pos - n, pos + n), scan the union of them in one pass
+    int start = line->pos - scan->max_len;
+    if ( start < 0 ) start = 0;
+
+    // no motif around, skip fetching reference
+    if ( MTF->hits && MTF_index_hits(MTF, seqname, line->pos, start) == 0 ) return 0;
+
+    // also cover the reference allele, for constructing the alternative sequence
+    int l_ref;
+    int end = line->pos + scan->max_len + line->rlen;
+    const char *seq;
+    // slice from the reference window of chunk if covered
+    if ( MTF->chunk_seq && start >= MTF->chunk_start && end <= MTF->chunk_start + MTF->l_chunk ) {
+        seq = MTF->chunk_seq + (start - MTF->chunk_start);
+        l_ref = end - start;
+    }
+    else {
+        seq = plp_get_ref(MTF->r, seqname, start, end, &l_ref);
+        if ( seq == NULL ) return 0;
+    }
+    
+    for ( i = 0; i < MTF->n && MTF->hits == NULL; ++i ) {
         struct motif *m = MTF->mm[i];
-        
-        // variant must located inside the motif
-        int start = line->pos - m->n;        
+        int s = line->pos - m->n;
         int l = m->n*2; // length of scan region
-        
+        // in case at the begin of chromosome
+        if ( s < 0 ) {
+            l += s;
+            s = 0;
+        }
         // in case at the end of chromosome
-        if ( start +l > MTF->ref_len) l = MTF->ref_len - start;
-        // if scan region smaller than motif length
-        if ( l < m->n ) continue;
+        if ( s - start + l > l_ref ) l = l_ref - (s - start);
+        // if scan region smaller than motif length, never hit
+        int *min_end = MTF->min_end + i*2, *max_end = MTF->max_end + i*2;
+        if ( l < m->n ) {
+            min_end[0] = min_end[1] = 1;
+            max_end[0] = max_end[1] = 0;
+            continue;
+        }
+        // like encode_query_seq_n(), only the bases after the first n+1 bases of the region are checked
+        min_end[0] = min_end[1] = s - start + m->n + 1;
+        max_end[0] = max_end[1] = s - start + l;
+    }
+    int l_scan = line->pos + scan->max_len - start;
+    if ( MTF->hits == NULL )
+        motif_scan_seq(scan, seq, l_scan < l_ref ? l_scan : l_ref, MTF->min_end, MTF->max_end, MTF->hit, MTF->scan_state);
 
-        int loc;
-        char *ref = MTF->ref + start;
+    // debug_print("%s\t%d",MTF->bcf_hdr->id[BCF_DT_CTG][line->rid].key, line->pos+1);
+    int stride = -1;
+    for ( i = 0; i < MTF->n; ++i ) { // for each motif, calculate PWM
+
+        // motif struct
+        struct motif *m = MTF->mm[i];
         int strand = 0;
-        loc = encode_query_seq_n(m->enc, ref, l, 1);
-        if ( loc == -1 ) { // found
-            loc = encode_query_seq_n(m->rev, ref, l, 1);
-            if ( loc != -1) strand = 1;
+        int end = MTF->hit[i*2];
+        if ( end == -1 ) {
+            end = MTF->hit[i*2+1];
+            if ( end != -1 ) strand = 1;
             else continue;
         }
+        // encode the reference and alternative alleles once for all motifs
+        if ( stride == -1 ) stride = MTF_encode_alleles(MTF, line, seq, l_ref, start);
 
-        ref = ref + loc;
-        double ref_v = motif_pwm_score(m, ref, strand); // need test
-        if (ref_v < MTF->min) continue;
+        // matched location, in the same way as encode_query_seq_n()
+        int loc = end - m->n;
         int k;
-        float *d = malloc((line->n_allele)*sizeof(float));
-        d[0] = ref_v;
-        int var_loc = line->pos - start - loc;
+        for ( k = 0; k < line->n_allele; ++k ) MTF->win[k] = k*stride + loc;
+        MTF_check_window(MTF->codes + loc, seq + loc, m->n);
+        motif_pwm_score(m, MTF->codes, MTF->win, line->n_allele, strand, MTF->score);
+        float *d = MTF->score;
+        double ref_v = d[0];
+        if (ref_v < MTF->min) continue;
+        if ( line->n_allele > 1 && _enc[(uint8_t)seq[line->pos - start]] != _enc[(uint8_t)*line->d.allele[0]] )
+            error("Inconsistant ref bases, %c vs %s", seq[line->pos - start], line->d.allele[0]);
         for ( k =1; k < line->n_allele; ++k ) {
-            char *alt = _construct_alt_seq(ref, var_loc, line->d.allele[0], line->d.allele[k], m->n);
-            d[k] = motif_pwm_score(m, alt, strand);
+            MTF_check_window(MTF->codes + MTF->win[k], line->d.allele[k], m->n);
             float change = d[k] - d[0];
             if ( fabsf(change) > fabsf(pwm_change) ) pwm_change = change;
-            free(alt);
             // looks like a regularory variants?
-            if ( (d[0] >= 0 || d[k] >=0) && fabsf(d[k]) > 20.0 )
+            if ( motif_quiet == 0 && (d[0] >= 0 || d[k] >=0) && fabsf(d[k]) > 20.0 )
                 LOG_print("Regulatory variants candidate: %s\t%d\t%s\t%s\t%.4f\n",
                           MTF->bcf_hdr->id[BCF_DT_CTG][line->rid].key, line->pos+1,
-                          line->d.allele[k] == NULL ? "." : line->d.allele[k], m->name, d[k-1]);
+                          line->d.allele[k] == NULL ? "." : line->d.allele[k], m->name, d[k]);
         }
         
         // update INFO MOTIF_PWMscore
@@ -668,11 +1084,127 @@ int anno_vcf_motif_pwm(struct MTF *MTF, bcf1_t *line)
     return 0;
 }
 
+struct anno_col *motif_cols_init(bcf_hdr_t *hdr, struct motif **mm, int n, struct anno_col **pcs)
+{
+    int i;
+#define BRANCH(_key, _description, _num) do {                           \
+        int id;                                                         \
+        id = bcf_hdr_id2int(hdr, BCF_DT_ID, _key);                      \
+        if (id == -1) {                                                 \
+            bcf_hdr_append(hdr, _description);                          \
+            bcf_hdr_sync(hdr);                                          \
+            id = bcf_hdr_id2int(hdr, BCF_DT_ID, _key);                  \
+            assert(bcf_hdr_idinfo_exists(hdr, BCF_HL_INFO, id));        \
+            _num = bcf_hdr_id2length(hdr, BCF_HL_INFO, id);             \
+        }                                                               \
+    } while(0)
+
+    struct anno_col *cols = malloc(n *sizeof(struct anno_col));
+    
+    for ( i = 0; i < n; ++i ) {
+        struct motif *m = mm[i];
+        kstring_t str = {0,0,0};
+        kputs(m->name, &str);
+        kputs("_PWM_score", &str);
+        struct anno_col *col = &cols[i];
+        col->hdr_key = strdup(str.s);
+        col->func.pwm = anno_motif_setter_info_float;
+        // col->replace = REPLACE_MISSING;
+        str.l = 0;
+        ksprintf(&str, "##INFO=<ID=%s,Number=R,Type=Float,Description=\"%s PWM score for each allele.\"", col->hdr_key, m->name);
+        //debug_print("%s", str.s);
+        BRANCH(col->hdr_key, str.s, col->number);
+        free(str.s);
+    }
+
+    // Pwm Change Score column
+    struct anno_col *col = malloc(sizeof(struct anno_col));
+    col->hdr_key = strdup("PWM_score_change");
+    col->func.pwm = anno_motif_setter_info_float;
+    // col->replace = REPLACE_MISSING;
+    BRANCH(col->hdr_key, "##INFO=<ID=PWM_score_change,Number=1,Type=Float,Description=\"PWM score changes.\"", col->number);
+    *pcs = col;
+    
+#undef BRANCH
+    return cols;
+}
+
+struct MTF *anno_motif_file_init(bcf_hdr_t *hdr, const char *motif_fname, const char *bed_fname,
+                                 const char *index_fname, struct ref_store *store, int min)
+{
+    struct MTF *m = MTF_init();
+    m->r->store = store;
+    m->bcf_hdr = hdr;
+    m->min = min;
+    m->mm = motif_read(motif_fname, &m->n);
+    if ( m->n == 0 ) error("No motif records. %s", motif_fname);
+    m->scan = motif_scan_init(m->mm, m->n);
+    if ( bed_fname ) {
+        m->bed = bed_read_several_files(bed_fname);
+        if ( m->bed->flag & bed_bit_empty ) error("Cannot load BED file. %s", bed_fname);
+    }
+    if ( index_fname ) m->hits = motif_hits_init(motif_index_load(index_fname, motif_fname, min, m->mm, m->n, m->scan->max_len));
+    m->cols = motif_cols_init(hdr, m->mm, m->n, &m->ccol);
+    return m;
+}
+struct MTF *anno_motif_file_duplicate(struct MTF *m)
+{
+    struct MTF *d = MTF_init();
+    d->r->store = m->r->store;
+    d->bcf_hdr = m->bcf_hdr;
+    d->min = m->min;
+    d->n = m->n;
+    d->mm = m->mm;
+    d->scan = m->scan;
+    d->bed = m->bed;
+    if ( m->hits ) d->hits = motif_hits_init(m->hits->idx);
+    d->cols = m->cols;
+    d->ccol = m->ccol;
+    return d;
+}
+void anno_motif_file_destroy(struct MTF *m, int l)
+{
+    if ( l == 0 ) {
+        int i;
+        for ( i = 0; i < m->n; ++i ) {
+            motif_destroy(m->mm[i]);
+            free(m->cols[i].hdr_key);
+        }
+        free(m->mm);
+        free(m->cols);
+        free(m->ccol->hdr_key);
+        free(m->ccol);
+        motif_scan_destroy(m->scan);
+        if ( m->bed ) bed_destroy(m->bed);
+        if ( m->hits ) motif_index_destroy(m->hits->idx);
+    }
+    MTF_destory(m);
+}
+int anno_motif_chunk(struct MTF *m, bcf_hdr_t *hdr, struct anno_pool *pool, const char *win, int win_start, int l_win)
+{
+    int i;
+    m->bcf_hdr = hdr;
+    m->chunk_seq = win;
+    m->chunk_start = win_start;
+    m->l_chunk = l_win;
+    for ( i = pool->i_chunk; i < pool->n_chunk; ++i ) {
+        bcf1_t *line = pool->readers[i];
+        if ( line->rid == -1 ) continue;
+        if ( bcf_get_variant_types(line) == VCF_REF ) continue;
+        anno_vcf_motif_pwm(m, line);
+    }
+    m->chunk_seq = NULL;
+    return 0;
+}
+
+#ifdef MOTIF_MAIN
 int usage()
 {
     fprintf(stderr, "pwmscore\n");
+    fprintf(stderr, "Usage: bcfanno_pwm [options]\n");
+    fprintf(stderr, "       bcfanno_pwm build [options]   Build genome-wide motif hits index.\n");
     fprintf(stderr, " -vcf          Variants in BCF/VCF format.\n");
-    fprintf(stderr, " -bed          ATAC peak region in bed format.\n");
+    fprintf(stderr, " -bed          ATAC peak region in bed format, several files separated by comma are merged.\n");
     fprintf(stderr, " -motif        Motif file.\n");    
     fprintf(stderr, " -ref          Reference in FASTA format.\n");
     fprintf(stderr, " -O <b|u|z|v>  Output format.\n");
@@ -680,6 +1212,8 @@ int usage()
     fprintf(stderr, " -t            Threads.\n");
     fprintf(stderr, " -min          Mininal PWM score, skip motifs below this value.\n");
     fprintf(stderr, " -record       Records per thread.\n");
+    fprintf(stderr, " -index        Motif hits index built by `bcfanno_pwm build`, skip scanning reference.\n");
+    fprintf(stderr, "               -min should not be lower than the one of building index, and motifs should be the same.\n");
     fprintf(stderr, "\n");
     return 1;
 }
@@ -696,14 +1230,17 @@ struct args {
     const char *bed_fname;
     const char *motif_fname;
     const char *ref_fname;
+    const char *index_fname;
     
     int n;
     struct motif **mm;    
+    struct motif_scan *scan;
+    struct motif_index *index;
     struct anno_col *pwm_cols;
 
     int motif_min;
     
-    //faidx_t *fai;
+    struct ref_store *store; // 2-bit reference genome, shared by all threads
     bcf_hdr_t *bcf_hdr;
     struct bedaux *bed;
     htsFile *fp_in;
@@ -717,11 +1254,14 @@ struct args {
     .bed_fname = NULL,
     .motif_fname = NULL,
     .ref_fname = NULL,
+    .index_fname = NULL,
     .n = 0,
     .mm = NULL,
+    .scan = NULL,
+    .index = NULL,
     .pwm_cols = NULL,
     .motif_min = -20,
-    //.fai = NULL,
+    .store = NULL,
     .bcf_hdr = NULL,
     .bed = NULL,
     .fp_in = NULL,
@@ -762,6 +1302,8 @@ int parse_args(int argc, char **argv)
             var = &record;
         else if ( strcmp(a, "-min") == 0 )
             var = &motif_min;
+        else if ( strcmp(a, "-index") == 0 )
+            var = &args.index_fname;
         
         if ( var != 0 ) {
             if ( i == argc ) error("Missing an argument after %s.", a);
@@ -777,23 +1319,26 @@ int parse_args(int argc, char **argv)
     if ( args.motif_fname == NULL ) error("Parameter -motif is required.");
     if ( args.ref_fname == NULL ) error("Parameter -ref is required.");
     
-    args.bed = bedaux_init();
-    bed_read(args.bed, args.bed_fname);
+    if ( thread ) args.n_thread = str2int((char*)thread);
+    if ( args.n_thread < 1 ) args.n_thread = 1;
+    // regions are sorted and merged by chromosomes in parallel
+    set_bed_threads(args.n_thread);
+    args.bed = bed_read_several_files(args.bed_fname);
     if (args.bed->flag & bed_bit_empty ) error("Cannot load BED file. %s", args.bed_fname);
-    bed_merge(args.bed);
 
     args.fp_in = hts_open(args.input_fname, "r");
     if ( args.fp_in == NULL ) error("%s : %s.", args.input_fname, strerror(errno));
 
     args.mm = motif_read(args.motif_fname, &args.n);
     if ( args.n == 0 ) error("No motif records.");
+    args.scan = motif_scan_init(args.mm, args.n);
 
-    //args.fai = fai_load(args.ref_fname);
-    //if ( args.fai == NULL ) error("Failed to load index of %s.", args.ref_fname);
+    args.store = ref_store_open(args.ref_fname);
+    if ( args.store == NULL ) error("Failed to load reference %s.", args.ref_fname);
 
-    if ( thread ) args.n_thread = str2int((char*)thread);
     if ( record ) args.n_record = str2int((char*)record);
     if ( motif_min ) args.motif_min = str2int((char*)motif_min);
+    if ( args.index_fname ) args.index = motif_index_load(args.index_fname, args.motif_fname, args.motif_min, args.mm, args.n, args.scan->max_len);
     int out_type = FT_VCF;
     if ( output_format != 0 ) {
 	switch (output_format[0]) {
@@ -815,45 +1360,7 @@ int parse_args(int argc, char **argv)
     
     args.bcf_hdr = bcf_hdr_read(args.fp_in);
     
-#define BRANCH(_key, _description, _num) do {                           \
-        int id;                                                         \
-        id = bcf_hdr_id2int(args.bcf_hdr, BCF_DT_ID, _key);             \
-        if (id == -1) {                                                 \
-            bcf_hdr_append(args.bcf_hdr, _description);                 \
-            bcf_hdr_sync(args.bcf_hdr);                                 \
-            id = bcf_hdr_id2int(args.bcf_hdr, BCF_DT_ID, _key);         \
-            assert(bcf_hdr_idinfo_exists(args.bcf_hdr, BCF_HL_INFO, id)); \
-            _num = bcf_hdr_id2length(args.bcf_hdr, BCF_HL_INFO, id);    \
-        }                                                               \
-    } while(0)
-
-    args.pwm_cols = malloc(args.n *sizeof(struct anno_col));
-    
-    for ( i = 0; i < args.n; ++i ) {
-        struct motif *m = args.mm[i];
-        kstring_t str = {0,0,0};
-        kputs(m->name, &str);
-        kputs("_PWM_score", &str);
-        struct anno_col *col = &args.pwm_cols[i];
-        col->hdr_key = strdup(str.s);
-        col->func.pwm = anno_motif_setter_info_float;
-        // col->replace = REPLACE_MISSING;
-        str.l = 0;
-        ksprintf(&str, "##INFO=<ID=%s,Number=R,Type=Float,Description=\"%s PWM score for each allele.\"", col->hdr_key, m->name);
-        //debug_print("%s", str.s);
-        BRANCH(col->hdr_key, str.s, col->number);
-        free(str.s);
-    }
-
-    // Pwm Change Score column
-    args.pcs_col = malloc(sizeof(struct anno_col));
-    args.pcs_col->hdr_key = strdup("PWM_score_change");
-    args.pcs_col->func.pwm = anno_motif_setter_info_float;
-    // args.pcs_col->replace = REPLACE_MISSING;
-    BRANCH(args.pcs_col->hdr_key, "##INFO=<ID=PWM_score_change,Number=1,Type=Float,Description=\"PWM score changes.\"", args.pcs_col->number);
-
-    
-#undef BRANCH
+    args.pwm_cols = motif_cols_init(args.bcf_hdr, args.mm, args.n, &args.pcs_col);
     
     
     bcf_hdr_write(args.fp_out, args.bcf_hdr);
@@ -871,10 +1378,13 @@ void memory_release()
         free(args.pwm_cols[i].hdr_key);
     }
     free(args.mm);
+    motif_scan_destroy(args.scan);
+    motif_index_destroy(args.index);
     free(args.pcs_col->hdr_key);
     
     bcf_hdr_destroy(args.bcf_hdr);
     bed_destroy(args.bed);    
+    ref_store_close(args.store);
 }
 
 void *anno_pwm(void *arg, int idx)
@@ -896,8 +1406,277 @@ void *anno_pwm(void *arg, int idx)
 #include "anno_thread_pool.h"
 
 
+// Build genome-wide motif hits index. The reference is split into blocks of scored windows, each block is scanned
+// and scored by one thread, and written in order so the output is sorted for tabix.
+#define MOTIF_BUILD_BLOCK (1<<20)
+
+static int build_usage()
+{
+    fprintf(stderr, "Usage: bcfanno_pwm build -motif motif.txt -ref ref.fa -o hits.bed.gz\n");
+    fprintf(stderr, " -motif        Motif file.\n");
+    fprintf(stderr, " -ref          Reference in FASTA format.\n");
+    fprintf(stderr, " -o            Output file, bgzipped and tabix indexed.\n");
+    fprintf(stderr, " -t            Threads.\n");
+    fprintf(stderr, " -min          Mininal PWM score, skip sites below this value.\n");
+    fprintf(stderr, "\n");
+    return 1;
+}
+
+struct build_job {
+    int id; // sequence id of reference
+    int beg, end; // scored windows started in [beg, end)
+    kstring_t str; // output lines
+};
+
+// scratch of each thread
+struct build_worker {
+    kstring_t seq;
+    uint64_t *state;
+    int n_hit, m_hit;
+    int *hits;
+    int m_codes;
+    uint8_t *codes;
+    int m_site;
+    int *win;
+    float *score;
+    int *off; // offset of each pattern in win
+};
+
+struct motif_site {
+    int start;
+    int pat;
+    float score;
+};
+
+static int motif_site_cmp(const void *a, const void *b)
+{
+    const struct motif_site *x = a, *y = b;
+    if ( x->start != y->start ) return x->start < y->start ? -1 : 1;
+    return x->pat - y->pat;
+}
+
+static struct build_worker *build_workers;
+
+static void *build_block(void *arg, int idx)
+{
+    struct build_job *job = (struct build_job*)arg;
+    struct build_worker *w = &build_workers[idx];
+    struct motif_scan *scan = args.scan;
+    struct ref_store_seq *rs = &args.store->seqs[job->id];
+    int i;
+
+    // windows started in [beg, end + max_len) are scored, the ones after end are only checked for shadowing
+    w->seq.l = 0;
+    int l = ref_store_fetch(args.store, job->id, job->beg, job->end + 2*scan->max_len, &w->seq);
+    if ( l <= 0 ) return job;
+    if ( w->m_codes < l + 4 ) {
+        w->m_codes = l + 4;
+        w->codes = realloc(w->codes, w->m_codes);
+    }
+    for ( i = 0; i < l; ++i ) w->codes[i] = B4[(uint8_t)w->seq.s[i]] - 1;
+    memset(w->codes + l, 0xff, 4);
+
+    // scan runs of A/C/G/T only, windows with other bases can not be scored and N matches all patterns
+    w->n_hit = 0;
+    int a, b;
+    for ( a = 0; a < l; a = b ) {
+        for ( ; a < l && w->codes[a] == 0xff; ++a );
+        for ( b = a; b < l && w->codes[b] != 0xff; ++b );
+        if ( b - a < 2 ) continue;
+        int j, n = w->n_hit;
+        // the matched end is one base after the scored window
+        motif_scan_all(scan, w->seq.s + a, (b < l ? b + 1 : b) - a, w->state, &w->hits, &w->n_hit, &w->m_hit);
+        // keep windows in this run
+        for ( j = n; j < w->n_hit; j += 2 ) {
+            if ( w->hits[j+1] < args.mm[w->hits[j]/2]->n ) continue;
+            w->hits[n++] = w->hits[j];
+            w->hits[n++] = w->hits[j+1] + a;
+        }
+        w->n_hit = n;
+    }
+    int n_hit = w->n_hit/2;
+    if ( n_hit == 0 ) return job;
+    if ( w->m_site < n_hit ) {
+        w->m_site = n_hit;
+        w->win = realloc(w->win, n_hit*sizeof(int));
+        w->score = realloc(w->score, n_hit*sizeof(float));
+    }
+
+    // group windows by pattern, each pattern is scored in one call
+    int n_win = 0;
+    for ( i = 0; i < n_hit; ++i ) {
+        int p = w->hits[i*2];
+        int start = w->hits[i*2+1] - args.mm[p/2]->n;
+        // scored window is one base before the matched end, the same as annotation
+        if ( job->beg + start < 1 || job->beg + start >= job->end + scan->max_len ) continue;
+        w->hits[n_win*2] = p;
+        w->hits[n_win*2+1] = start;
+        n_win++;
+    }
+    memset(w->off, 0, (scan->n_pat+1)*sizeof(int));
+    for ( i = 0; i < n_win; ++i ) w->off[w->hits[i*2]+1]++;
+    for ( i = 0; i < scan->n_pat; ++i ) w->off[i+1] += w->off[i];
+    int *cnt = calloc(scan->n_pat, sizeof(int));
+    for ( i = 0; i < n_win; ++i ) {
+        int p = w->hits[i*2];
+        w->win[w->off[p] + cnt[p]++] = w->hits[i*2+1];
+    }
+    for ( i = 0; i < scan->n_pat; ++i )
+        if ( cnt[i] ) motif_pwm_score(args.mm[i/2], w->codes, w->win + w->off[i], cnt[i], i&1, w->score + w->off[i]);
+
+    struct motif_site *sites = malloc(n_win*sizeof(*sites));
+    int n_site = 0;
+    for ( i = 0; i < scan->n_pat; ++i ) {
+        int j, next = -1;
+        int n = args.mm[i/2]->n;
+        // annotation takes the first hit around the variant, a site below minimal score hides the passing sites of
+        // same pattern in next n-2 bases, keep it
+        for ( j = w->off[i] + cnt[i] - 1; j >= w->off[i]; --j ) {
+            if ( w->score[j] >= args.motif_min ) next = w->win[j];
+            else if ( next == -1 || next - w->win[j] > n - 2 ) continue;
+            if ( w->win[j] >= job->end - job->beg ) continue;
+            sites[n_site].start = job->beg + w->win[j];
+            sites[n_site].pat = i;
+            sites[n_site].score = w->score[j];
+            n_site++;
+        }
+    }
+    qsort(sites, n_site, sizeof(*sites), motif_site_cmp);
+    for ( i = 0; i < n_site; ++i ) {
+        struct motif *m = args.mm[sites[i].pat/2];
+        ksprintf(&job->str, "%s\t%d\t%d\t%s\t%c\t%.4f\n", rs->name, sites[i].start, sites[i].start + m->n, m->name,
+                 sites[i].pat & 1 ? '-' : '+', sites[i].score);
+    }
+    free(sites);
+    free(cnt);
+    return job;
+}
+
+static void build_write(BGZF *fp, struct build_job *job)
+{
+    if ( job->str.l && bgzf_write(fp, job->str.s, job->str.l) != job->str.l ) error("Failed to write index.");
+    free(job->str.s);
+}
+
+static int build_main(int argc, char **argv)
+{
+    int i;
+    const char *thread = NULL;
+    const char *motif_min = NULL;
+    for ( i = 1; i < argc; ) {
+        const char *a = argv[i++];
+        const char **var = 0;
+
+        if ( strcmp(a, "-h") == 0 || strcmp(a, "--help") == 0 ) return build_usage();
+
+        if ( strcmp(a, "-motif") == 0 )
+            var = &args.motif_fname;
+        else if ( strcmp(a, "-ref") == 0 )
+            var = &args.ref_fname;
+        else if ( strcmp(a, "-o") == 0 )
+            var = &args.output_fname;
+        else if ( strcmp(a, "-t") == 0 )
+            var = &thread;
+        else if ( strcmp(a, "-min") == 0 )
+            var = &motif_min;
+
+        if ( var != 0 ) {
+            if ( i == argc ) error("Missing an argument after %s.", a);
+            *var = argv[i++];
+            continue;
+        }
+        error("Unknown argument: %s, use -h see help information", a);
+    }
+    if ( args.motif_fname == NULL ) error("Parameter -motif is required.");
+    if ( args.ref_fname == NULL ) error("Parameter -ref is required.");
+    if ( args.output_fname == NULL ) error("Parameter -o is required.");
+    if ( thread ) args.n_thread = str2int((char*)thread);
+    if ( motif_min ) args.motif_min = str2int((char*)motif_min);
+    if ( args.n_thread < 1 ) args.n_thread = 1;
+
+    args.mm = motif_read(args.motif_fname, &args.n);
+    if ( args.n == 0 ) error("No motif records.");
+    args.scan = motif_scan_init(args.mm, args.n);
+    if ( args.scan->n_word == 0 ) error("No motif shorter than 17 bases.");
+    args.store = ref_store_open(args.ref_fname);
+    if ( args.store == NULL ) error("Failed to load reference %s.", args.ref_fname);
+
+    BGZF *fp = bgzf_open(args.output_fname, "w");
+    if ( fp == NULL ) error("%s : %s.", args.output_fname, strerror(errno));
+    kstring_t header = {0,0,0};
+    // build information, checked by motif_index_load()
+    ksprintf(&header, "##min=%d\n##motif=%08x\n", args.motif_min, motif_file_checksum(args.motif_fname));
+    kputs("#chrom\tstart\tend\tmotif\tstrand\tscore\n", &header);
+    if ( bgzf_write(fp, header.s, header.l) < 0 ) error("Failed to write index.");
+    free(header.s);
+
+    build_workers = calloc(args.n_thread, sizeof(struct build_worker));
+    for ( i = 0; i < args.n_thread; ++i ) {
+        build_workers[i].state = malloc(2*args.scan->n_word*sizeof(uint64_t));
+        build_workers[i].off = malloc((args.scan->n_pat+1)*sizeof(int));
+    }
+
+    struct thread_pool *p = args.n_thread > 1 ? thread_pool_init(args.n_thread) : NULL;
+    struct thread_pool_process *q = p ? thread_pool_process_init(p, args.n_thread*2, 0) : NULL;
+    struct thread_pool_result *r;
+    int id;
+    for ( id = 0; id < args.store->n_seq; ++id ) {
+        int beg;
+        for ( beg = 0; beg < ref_store_seq_len(args.store, id); beg += MOTIF_BUILD_BLOCK ) {
+            struct build_job *job = malloc(sizeof(*job));
+            memset(job, 0, sizeof(*job));
+            job->id = id;
+            job->beg = beg;
+            job->end = beg + MOTIF_BUILD_BLOCK;
+            if ( p == NULL ) {
+                build_block(job, 0);
+                build_write(fp, job);
+                free(job);
+                continue;
+            }
+            int block;
+            do {
+                block = thread_pool_dispatch2(p, q, build_block, job, 1);
+                if ( ( r = thread_pool_next_result(q) ) ) {
+                    build_write(fp, (struct build_job*)r->data);
+                    thread_pool_delete_result(r, 1);
+                }
+            } while ( block == -1 );
+        }
+    }
+    if ( p ) {
+        thread_pool_process_flush(q);
+        while ( (r = thread_pool_next_result(q)) ) {
+            build_write(fp, (struct build_job*)r->data);
+            thread_pool_delete_result(r, 1);
+        }
+        thread_pool_process_destroy(q);
+        thread_pool_destroy(p);
+    }
+    if ( bgzf_close(fp) ) error("Failed to write index.");
+    if ( tbx_index_build(args.output_fname, 0, &tbx_conf_bed) ) error("Failed to index %s.", args.output_fname);
+
+    for ( i = 0; i < args.n_thread; ++i ) {
+        struct build_worker *w = &build_workers[i];
+        free(w->seq.s);
+        free(w->state);
+        free(w->hits);
+        free(w->codes);
+        free(w->win);
+        free(w->score);
+        free(w->off);
+    }
+    free(build_workers);
+    for ( i = 0; i < args.n; ++i ) motif_destroy(args.mm[i]);
+    free(args.mm);
+    motif_scan_destroy(args.scan);
+    ref_store_close(args.store);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
+    if ( argc > 1 && strcmp(argv[1], "build") == 0 ) return build_main(argc-1, argv+1);
 
     if ( parse_args(argc, argv) ) return 1;
     if ( args.n_thread > 1 ) {
@@ -906,10 +1685,11 @@ int main(int argc, char **argv)
         // initize MTF
         for ( i = 0; i < args.n_thread; ++i ) {
             M[i] = MTF_init();
-            M[i]->fai = fai_load(args.ref_fname);
-            if (M[i]->fai == NULL ) error("Failed to load index of %s.", args.ref_fname);
+            M[i]->r->store = args.store;
             M[i]->n = args.n;
             M[i]->mm = args.mm;
+            M[i]->scan = args.scan;
+            if ( args.index ) M[i]->hits = motif_hits_init(args.index);
             M[i]->bcf_hdr = args.bcf_hdr;
             M[i]->bed = args.bed;
             M[i]->cols = args.pwm_cols;
@@ -963,17 +1743,18 @@ int main(int argc, char **argv)
         }
         thread_pool_process_destroy(q);
         thread_pool_destroy(p);
-        for ( i = 0; i < args.n; ++i ) MTF_destory(M[i]);
+        for ( i = 0; i < args.n_thread; ++i ) MTF_destory(M[i]);
         free(M);
     }
     else {                           
         // initise MTF for each thread
         struct MTF *MTF = MTF_init();
-        MTF->fai = fai_load(args.ref_fname);
-        if (MTF->fai == NULL ) error("Failed to load index of %s.", args.ref_fname);
+        MTF->r->store = args.store;
 
         MTF->n = args.n;
         MTF->mm = args.mm;
+        MTF->scan = args.scan;
+        if ( args.index ) MTF->hits = motif_hits_init(args.index);
         MTF->bcf_hdr = args.bcf_hdr;
         MTF->bed = args.bed;
         MTF->cols = args.pwm_cols;
@@ -997,3 +1778,4 @@ int main(int argc, char **argv)
     memory_release();
     return 0;
 }
+#endif
@@ -7,10 +7,12 @@
 
 #include "htslib/faidx.h"
 #include "htslib/vcf.h"
+#include "htslib/tbx.h"
 #include "wrap_pileup.h"
 #include "htslib/kseq.h"
 #include "bed_utils.h"
 #include "anno_col.h"
+#include "anno_pool.h"
 
 #define BASEA 1
 #define BASEC 2
@@ -164,9 +166,76 @@ struct motif {
     int m; // allocated memory
     int n; // motif length
     float *map[4];
+    // transposed matrix, row i is scores of A,C,G,T at position i, complemented rows for the reverse strand
+    float *pwm;
+    float *pwm_rc;
 };
 
 extern struct motif **motif_read(const char *fname, int *_n);
+// Score n_win windows, window k starts at codes+win[k], bases are coded 0..3 for A,C,G,T. Windows of the reverse
+// strand are read backward. Vectorized by AVX2 or SSSE3 if the CPU supports, each window is summed in position order
+// so all kernels return the same scores. codes should be readable 3 bytes after the last window.
+extern void motif_pwm_score(struct motif *m, const uint8_t *codes, const int *win, int n_win, int strand, float *out);
+
+// Scanner of all motifs on both strands, built once after motif_read and shared by all threads.
+// Each motif is a shift-and pattern over the IUPAC encode masks allowing one mismatch, same as
+// encode_query_seq_n(). Patterns are packed into 64 bits words, so one pass over the sequence finds all motifs.
+// Motifs longer than 16 bases are not encoded for query, they are skipped.
+struct motif_scan {
+    unsigned int n_pat; // pattern 2*i is forward motif i, 2*i+1 is the reversed one
+    int n_word;
+    int max_len; // longest scanned motif
+    uint64_t *init; // first bit of each pattern
+    uint64_t *last; // last bit of each pattern
+    uint64_t *mask; // n_word x 16, matched pattern bits for each base code
+    int *bit2pat; // n_word x 64, pattern id of the last bits
+};
+
+extern struct motif_scan *motif_scan_init(struct motif **mm, int n);
+extern void motif_scan_destroy(struct motif_scan *s);
+// Scan seq once, hit[p] set to the first end position e of pattern p, min_end[p] <= e < max_end[p], or -1 if not
+// found. state is scratch of 2*n_word.
+extern void motif_scan_seq(struct motif_scan *s, const char *seq, int l, const int *min_end, const int *max_end, int *hit, uint64_t *state);
+// Scan seq once and append all hits to *_hits as pairs of pattern id and end position, *_n is the length of *_hits.
+// Used to build the genome-wide index.
+extern void motif_scan_all(struct motif_scan *s, const char *seq, int l, uint64_t *state, int **_hits, int *_n, int *_m);
+
+// Genome-wide motif hits built by `bcfanno_pwm build`, bgzipped and tabix indexed, BED like :
+//   chrom, start, end, motif, strand, reference PWM score
+// start is the window scored for a scanner hit, so annotating with the index reports the same windows as scanning,
+// except sites below the minimal score of building are not kept.
+struct motif_hit {
+    int start;
+    int motif; // index in motif file of annotation
+    int strand;
+    float score;
+};
+
+struct motif_index {
+    const char *fname;
+    tbx_t *tbx; // shared by all handlers
+    void *hash; // motif name to index
+    int max_len; // longest scanned motif
+};
+
+// Hits of a reference window cached by each handler.
+struct motif_hits {
+    struct motif_index *idx;
+    htsFile *fp;
+    int tid;
+    int beg, end;
+    int n, m;
+    struct motif_hit *a;
+    kstring_t str;
+    int m_off;
+    int *off;
+};
+
+// Load hits index built by `bcfanno_pwm build`, exit if it is built with other motifs or a higher minimal score.
+extern struct motif_index *motif_index_load(const char *fname, const char *motif_fname, int min, struct motif **mm, int n, int max_len);
+extern void motif_index_destroy(struct motif_index *idx);
+extern struct motif_hits *motif_hits_init(struct motif_index *idx);
+extern void motif_hits_destroy(struct motif_hits *h);
 
 //
 //  PWM_score_change
@@ -175,25 +244,55 @@ extern struct motif **motif_read(const char *fname, int *_n);
 struct MTF {
     int n;
     struct motif **mm; // point to args::mm
+    struct motif_scan *scan; // point to args::scan
+    struct motif_hits *hits; // hits from index, scan the reference if NULL
+    // scratch of scanner, allocated at first use
+    uint64_t *scan_state;
+    int *hit, *min_end, *max_end;
+    // encoded alleles of current variant and their scores
+    uint8_t *codes;
+    int m_codes;
+    int m_allele;
+    int *win;
+    float *score;
     int tid;
     int start, end;
     bcf_hdr_t *bcf_hdr; // point to args::bcf_hdr
     struct bedaux *bed; // point to args::bed
+    struct bed_cursor cursor; // lookup of regions, reset if bed changed
     int id; // maximal PWM_score_change
     int *motif_IDs; // point args::motif_IDs
-    struct plp_ref *r;
-    char *ref;
-    int ref_len;
-    faidx_t *fai;
+    struct plp_ref *r; // reference window of this handler
+    // reference window of current chunk, shared with other annotators, NULL if not set
+    const char *chunk_seq;
+    int chunk_start;
+    int l_chunk;
     struct anno_col *cols; // point to args::pwm_cols
     struct anno_col *ccol; // point to args::pcs_col
 
     int min;
 };
 
+// Do not log regulatory variant candidates, used by quiet mode.
+extern void motif_set_quiet(int quiet);
 extern struct MTF *MTF_init();
 extern void MTF_destory(struct MTF *m);
 extern int anno_vcf_motif_pwm(struct MTF *MTF, bcf1_t *line);
 
+// Add INFO headers of PWM scores, return columns of each motif, *pcs is set to the column of PWM_score_change.
+extern struct anno_col *motif_cols_init(bcf_hdr_t *hdr, struct motif **mm, int n, struct anno_col **pcs);
+
+// Motif annotation in the bcfanno chunk pipeline. The first handler owns motifs, scanner, regions, index and
+// columns, duplicates share them. store is the reference genome of bcfanno, shared.
+extern struct MTF *anno_motif_file_init(bcf_hdr_t *hdr, const char *motif_fname, const char *bed_fname,
+                                        const char *index_fname, struct ref_store *store, int min);
+extern struct MTF *anno_motif_file_duplicate(struct MTF *m);
+extern void anno_motif_file_destroy(struct MTF *m, int l);
+// Reference bases needed around each record, for the chunk window.
+#define anno_motif_margin(m) ((m)->scan->max_len)
+// Annotate records of current chunk, win is reference window of the chunk starting at win_start, or NULL if not
+// fetched, then bases are decoded for each handler.
+extern int anno_motif_chunk(struct MTF *m, bcf_hdr_t *hdr, struct anno_pool *pool, const char *win, int win_start, int l_win);
+
 
 #endif
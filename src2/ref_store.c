@@ -0,0 +1,381 @@
+// 2-bit packed reference genome cache, see ref_store.h for the file layout.
+#include "utils.h"
+#include "htslib/faidx.h"
+#include "htslib/khash.h"
+#include "htslib/kstring.h"
+#include "ref_store.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+KHASH_MAP_INIT_STR(ref_store, int)
+
+static const char ref_store_magic[4] = { 'B', 'R', 'C', 1 };
+static const char ref_store_bases[4] = { 'A', 'C', 'G', 'T' };
+static int ref_store_quiet = 0;
+
+void ref_store_set_quiet(int quiet)
+{
+    ref_store_quiet = quiet;
+}
+
+static inline uint32_t rs_get_u32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+static inline uint64_t rs_get_u64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+static inline void rs_put_u32(kstring_t *str, uint32_t v)
+{
+    kputsn((char*)&v, 4, str);
+}
+static inline void rs_put_u64(kstring_t *str, uint64_t v)
+{
+    kputsn((char*)&v, 8, str);
+}
+static inline int rs_code(char c)
+{
+    switch (c) {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        default : return -1;
+    }
+}
+
+// Runs of N blocks or mask blocks of one sequence.
+struct rs_runs {
+    int n, m;
+    uint32_t *pos, *len;
+    uint8_t *base;
+};
+
+static void rs_runs_push(struct rs_runs *r, uint32_t pos, uint32_t len, uint8_t base)
+{
+    if ( r->n == r->m ) {
+        r->m = r->m == 0 ? 32 : r->m<<1;
+        r->pos  = realloc(r->pos,  r->m*sizeof(uint32_t));
+        r->len  = realloc(r->len,  r->m*sizeof(uint32_t));
+        r->base = realloc(r->base, r->m);
+    }
+    r->pos[r->n] = pos;
+    r->len[r->n] = len;
+    r->base[r->n] = base;
+    r->n++;
+}
+
+// Encode one sequence into a block, see ref_store.h.
+static void rs_encode(const char *seq, int l, struct rs_runs *nb, struct rs_runs *mask, kstring_t *str)
+{
+    nb->n = mask->n = 0;
+    int i, j;
+    for ( i = 0; i < l; i = j ) {
+        uint8_t c = toupper((uint8_t)seq[i]);
+        for ( j = i+1; j < l && toupper((uint8_t)seq[j]) == c; ++j );
+        if ( rs_code(c) < 0 ) rs_runs_push(nb, i, j-i, c);
+    }
+    for ( i = 0; i < l; i = j ) {
+        for ( j = i; j < l && islower((uint8_t)seq[j]); ++j );
+        if ( j > i ) rs_runs_push(mask, i, j-i, 0);
+        for ( ; j < l && !islower((uint8_t)seq[j]); ++j );
+    }
+
+    // runs are not allocated if the sequence has no N or soft-masked bases
+    if ( nb->n ) {
+        kputsn((char*)nb->pos, nb->n*4, str);
+        kputsn((char*)nb->len, nb->n*4, str);
+    }
+    if ( mask->n ) {
+        kputsn((char*)mask->pos, mask->n*4, str);
+        kputsn((char*)mask->len, mask->n*4, str);
+    }
+    if ( nb->n ) kputsn((char*)nb->base, nb->n, str);
+
+    size_t l_packed = (l+3)>>2;
+    ks_resize(str, str->l + l_packed + 1);
+    uint8_t *p = (uint8_t*)str->s + str->l;
+    memset(p, 0, l_packed);
+    for ( i = 0; i < l; ++i ) {
+        int c = rs_code(toupper((uint8_t)seq[i]));
+        if ( c > 0 ) p[i>>2] |= c << ((i&3)<<1);
+    }
+    str->l += l_packed;
+}
+
+// Write the cache of FASTA to fp. Return 0 on success.
+static int ref_store_write(const char *fasta, struct stat *st, FILE *fp)
+{
+    faidx_t *fai = fai_load(fasta);
+    if ( fai == NULL ) return 1;
+
+    kstring_t str = {0,0,0};
+    kstring_t dir = {0,0,0};
+    kputsn(ref_store_magic, 4, &str);
+    rs_put_u64(&str, st->st_size);
+    rs_put_u64(&str, st->st_mtime);
+    rs_put_u64(&str, 0); // directory offset, updated at last
+    uint64_t offset = str.l;
+    if ( fwrite(str.s, 1, str.l, fp) != str.l ) goto write_failed;
+
+    struct rs_runs nb, mask;
+    memset(&nb, 0, sizeof(nb));
+    memset(&mask, 0, sizeof(mask));
+    int i, n = faidx_nseq(fai);
+    rs_put_u32(&dir, n);
+    for ( i = 0; i < n; ++i ) {
+        const char *name = faidx_iseq(fai, i);
+        int l = 0;
+        char *seq = faidx_fetch_seq(fai, name, 0, faidx_seq_len(fai, name)-1, &l);
+        if ( seq == NULL || l < 0 ) {
+            warnings("Failed to load sequence %s from %s.", name, fasta);
+            if ( seq ) free(seq);
+            l = 0;
+            seq = strdup("");
+        }
+        // pad the block to 8 bytes
+        str.l = 0;
+        while ( (offset + str.l) & 7 ) kputc('\0', &str);
+        uint64_t block = offset + str.l;
+        rs_encode(seq, l, &nb, &mask, &str);
+        free(seq);
+        offset += str.l;
+        if ( fwrite(str.s, 1, str.l, fp) != str.l ) break;
+
+        rs_put_u32(&dir, strlen(name));
+        kputs(name, &dir);
+        rs_put_u32(&dir, l);
+        rs_put_u32(&dir, nb.n);
+        rs_put_u32(&dir, mask.n);
+        rs_put_u64(&dir, block);
+    }
+    free(nb.pos); free(nb.len); free(nb.base);
+    free(mask.pos); free(mask.len); free(mask.base);
+
+    if ( i < n || fwrite(dir.s, 1, dir.l, fp) != dir.l ) goto write_failed;
+    if ( fseek(fp, 20, SEEK_SET) || fwrite(&offset, 8, 1, fp) != 1 || fflush(fp) ) goto write_failed;
+
+    fai_destroy(fai);
+    free(str.s);
+    free(dir.s);
+    return 0;
+
+  write_failed:
+    fai_destroy(fai);
+    free(str.s);
+    free(dir.s);
+    return 1;
+}
+
+// Map the cache, return 1 if it is out of date or truncated.
+static int ref_store_map(struct ref_store *s, int fd, struct stat *st_fasta)
+{
+    struct stat st;
+    if ( fstat(fd, &st) || st.st_size < 28 ) return 1;
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if ( map == MAP_FAILED ) {
+        warnings("Failed to map %s : %s.", s->fname, strerror(errno));
+        return 1;
+    }
+    s->map = map;
+    s->l_map = st.st_size;
+
+    const uint8_t *p = s->map, *e = s->map + s->l_map;
+    if ( memcmp(p, ref_store_magic, 4) ) goto bad_file;
+    if ( rs_get_u64(p+4) != (uint64_t)st_fasta->st_size || rs_get_u64(p+12) != (uint64_t)st_fasta->st_mtime ) goto bad_file;
+    uint64_t offset = rs_get_u64(p+20);
+    if ( offset == 0 || offset + 4 > s->l_map ) goto bad_file;
+    p = s->map + offset;
+    s->n_seq = rs_get_u32(p); p += 4;
+    s->seqs = calloc(s->n_seq, sizeof(struct ref_store_seq));
+    khash_t(ref_store) *hash = kh_init(ref_store);
+    s->hash = hash;
+    int i;
+    for ( i = 0; i < s->n_seq; ++i ) {
+        struct ref_store_seq *q = &s->seqs[i];
+        if ( p + 4 > e ) goto bad_file;
+        uint32_t l_name = rs_get_u32(p); p += 4;
+        if ( p + l_name + 20 > e ) goto bad_file;
+        q->name = malloc(l_name+1);
+        memcpy(q->name, p, l_name);
+        q->name[l_name] = '\0';
+        p += l_name;
+        q->len = rs_get_u32(p);
+        q->n_nblock = rs_get_u32(p+4);
+        q->n_mask = rs_get_u32(p+8);
+        uint64_t block = rs_get_u64(p+12);
+        p += 20;
+        if ( block & 7 || block + 9*(uint64_t)q->n_nblock + 8*(uint64_t)q->n_mask + ((q->len+3)>>2) > s->l_map ) goto bad_file;
+        const uint8_t *b = s->map + block;
+        q->nblock_pos = (const uint32_t*)b;  b += 4*q->n_nblock;
+        q->nblock_len = (const uint32_t*)b;  b += 4*q->n_nblock;
+        q->mask_pos = (const uint32_t*)b;    b += 4*q->n_mask;
+        q->mask_len = (const uint32_t*)b;    b += 4*q->n_mask;
+        q->nblock_base = b;                  b += q->n_nblock;
+        q->packed = b;
+        int ret;
+        khint_t k = kh_put(ref_store, hash, q->name, &ret);
+        kh_val(hash, k) = i;
+    }
+    return 0;
+
+  bad_file:
+    for ( i = 0; i < s->n_seq; ++i ) free(s->seqs[i].name);
+    free(s->seqs);
+    s->seqs = NULL;
+    s->n_seq = 0;
+    if ( s->hash ) kh_destroy(ref_store, (khash_t(ref_store)*)s->hash);
+    s->hash = NULL;
+    munmap(s->map, s->l_map);
+    s->map = NULL;
+    s->l_map = 0;
+    return 1;
+}
+
+// Build the cache next to FASTA, or in a temporary file if the directory is not writable. Return the open file
+// descriptor or -1 on failure.
+static int ref_store_build(struct ref_store *s, const char *fasta, struct stat *st)
+{
+    if ( ref_store_quiet == 0 ) LOG_print("Build reference cache %s.", s->fname);
+    kstring_t tmp = {0,0,0};
+    ksprintf(&tmp, "%s.tmp.%d", s->fname, (int)getpid());
+    FILE *fp = fopen(tmp.s, "w+b");
+    int fd = -1;
+    if ( fp && ref_store_write(fasta, st, fp) == 0 && rename(tmp.s, s->fname) == 0 ) fd = dup(fileno(fp));
+    else {
+        warnings("Failed to write %s : %s, build reference cache in temporary file.", s->fname, strerror(errno));
+        if ( fp ) unlink(tmp.s);
+    }
+    if ( fp ) fclose(fp);
+    if ( fd == -1 && (fp = tmpfile()) ) {
+        if ( ref_store_write(fasta, st, fp) == 0 ) fd = dup(fileno(fp));
+        fclose(fp);
+    }
+    free(tmp.s);
+    return fd;
+}
+
+struct ref_store *ref_store_open(const char *fasta)
+{
+    struct stat st;
+    if ( stat(fasta, &st) ) {
+        warnings("%s : %s.", fasta, strerror(errno));
+        return NULL;
+    }
+    struct ref_store *s = calloc(1, sizeof(*s));
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.brc", fasta);
+    s->fname = str.s;
+    s->ref = 1;
+    pthread_mutex_init(&s->lock, NULL);
+
+    int fd = open(s->fname, O_RDONLY);
+    if ( fd != -1 && ref_store_map(s, fd, &st) == 0 ) {
+        close(fd);
+        return s;
+    }
+    if ( fd != -1 ) close(fd);
+    fd = ref_store_build(s, fasta, &st);
+    if ( fd != -1 && ref_store_map(s, fd, &st) == 0 ) {
+        close(fd);
+        return s;
+    }
+    if ( fd != -1 ) close(fd);
+    warnings("Failed to build reference cache of %s.", fasta);
+    ref_store_close(s);
+    return NULL;
+}
+
+struct ref_store *ref_store_ref(struct ref_store *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->ref++;
+    pthread_mutex_unlock(&s->lock);
+    return s;
+}
+
+void ref_store_close(struct ref_store *s)
+{
+    if ( s == NULL ) return;
+    pthread_mutex_lock(&s->lock);
+    int ref = --s->ref;
+    pthread_mutex_unlock(&s->lock);
+    if ( ref > 0 ) return;
+
+    int i;
+    for ( i = 0; i < s->n_seq; ++i ) free(s->seqs[i].name);
+    free(s->seqs);
+    if ( s->hash ) kh_destroy(ref_store, (khash_t(ref_store)*)s->hash);
+    if ( s->map ) munmap(s->map, s->l_map);
+    pthread_mutex_destroy(&s->lock);
+    free(s->fname);
+    free(s);
+}
+
+int ref_store_name2id(struct ref_store *s, const char *name)
+{
+    khash_t(ref_store) *hash = (khash_t(ref_store)*)s->hash;
+    khint_t k = kh_get(ref_store, hash, name);
+    return k == kh_end(hash) ? -1 : kh_val(hash, k);
+}
+
+// Return the first run ending after beg.
+static int rs_first_run(const uint32_t *pos, const uint32_t *len, int n, int beg)
+{
+    int min = 0, max = n;
+    while ( min < max ) {
+        int mid = (min + max)/2;
+        if ( pos[mid] + len[mid] <= (uint32_t)beg ) min = mid + 1;
+        else max = mid;
+    }
+    return min;
+}
+
+int ref_store_fetch(struct ref_store *s, int id, int beg, int end, kstring_t *str)
+{
+    struct ref_store_seq *q = &s->seqs[id];
+    if ( beg < 0 ) beg = 0;
+    if ( end > q->len ) end = q->len;
+    if ( beg >= end ) return 0;
+
+    int l = end - beg;
+    ks_resize(str, str->l + l + 1);
+    char *p = str->s + str->l;
+    int i = beg;
+    // decode head to byte boundary, then 4 bases per byte
+    for ( ; i < end && (i&3); ++i ) *p++ = ref_store_bases[q->packed[i>>2] >> ((i&3)<<1) & 3];
+    for ( ; i + 4 <= end; i += 4 ) {
+        uint8_t b = q->packed[i>>2];
+        p[0] = ref_store_bases[b & 3];
+        p[1] = ref_store_bases[b>>2 & 3];
+        p[2] = ref_store_bases[b>>4 & 3];
+        p[3] = ref_store_bases[b>>6];
+        p += 4;
+    }
+    for ( ; i < end; ++i ) *p++ = ref_store_bases[q->packed[i>>2] >> ((i&3)<<1) & 3];
+
+    // patch N blocks and soft masked bases overlapping [beg, end)
+    char *s0 = str->s + str->l - beg;
+    int j;
+    for ( j = rs_first_run(q->nblock_pos, q->nblock_len, q->n_nblock, beg); j < q->n_nblock && q->nblock_pos[j] < (uint32_t)end; ++j ) {
+        int b = q->nblock_pos[j] < (uint32_t)beg ? beg : q->nblock_pos[j];
+        int e = q->nblock_pos[j] + q->nblock_len[j] > (uint32_t)end ? end : q->nblock_pos[j] + q->nblock_len[j];
+        memset(s0 + b, q->nblock_base[j], e - b);
+    }
+    for ( j = rs_first_run(q->mask_pos, q->mask_len, q->n_mask, beg); j < q->n_mask && q->mask_pos[j] < (uint32_t)end; ++j ) {
+        int b = q->mask_pos[j] < (uint32_t)beg ? beg : q->mask_pos[j];
+        int e = q->mask_pos[j] + q->mask_len[j] > (uint32_t)end ? end : q->mask_pos[j] + q->mask_len[j];
+        for ( ; b < e; ++b ) s0[b] = tolower((uint8_t)s0[b]);
+    }
+    str->l += l;
+    str->s[str->l] = '\0';
+    return l;
+}
@@ -0,0 +1,64 @@
+#ifndef REF_STORE_HEADER
+#define REF_STORE_HEADER
+
+#include <stdint.h>
+#include <pthread.h>
+#include "htslib/kstring.h"
+
+// Reference genome packed in 2 bits per base. The cache file is written once from the indexed FASTA, next to it as
+// FASTA.brc, and memory mapped read only, so all handlers and threads share one copy of the genome.
+//
+// Bases other than A/C/G/T are kept as runs of the same base (N blocks) and soft masked bases as lower case runs
+// (mask blocks), so decoded slices are the same as faidx_fetch_seq.
+//
+// File layout, all integers in host order :
+//   char[4]   magic "BRC\1"
+//   uint64    size of FASTA, int64 mtime of FASTA, the cache is rebuilt if FASTA changed
+//   uint64    offset of sequence directory
+//   sequence blocks, 8 bytes aligned :
+//     uint32[n_nblock] start, uint32[n_nblock] length, uint32[n_mask] start, uint32[n_mask] length,
+//     uint8[n_nblock] base, uint8[(len+3)/4] packed bases, 4 bases per byte, N blocks are packed as A
+//   uint32    n_seq
+//   n_seq x { uint32 l_name, char[l_name] name, uint32 len, uint32 n_nblock, uint32 n_mask, uint64 offset }
+
+struct ref_store_seq {
+    char *name;
+    int len;
+    int n_nblock;
+    int n_mask;
+    const uint32_t *nblock_pos;
+    const uint32_t *nblock_len;
+    const uint8_t *nblock_base;
+    const uint32_t *mask_pos;
+    const uint32_t *mask_len;
+    const uint8_t *packed;
+};
+
+struct ref_store {
+    char *fname;
+    uint8_t *map;
+    size_t l_map;
+    int n_seq;
+    struct ref_store_seq *seqs;
+    void *hash;
+    // number of handlers sharing this store
+    pthread_mutex_t lock;
+    int ref;
+};
+
+// Do not log building of reference cache, used by quiet mode.
+extern void ref_store_set_quiet(int quiet);
+// Open the reference cache of an indexed FASTA, build it if not exists or out of date. If the cache can not be
+// written next to FASTA, it is built in a temporary file. Return NULL on failure.
+extern struct ref_store *ref_store_open(const char *fasta);
+extern struct ref_store *ref_store_ref(struct ref_store *s);
+// Release one handler, the last one unmaps the cache.
+extern void ref_store_close(struct ref_store *s);
+// Return sequence id or -1 if not found.
+extern int ref_store_name2id(struct ref_store *s, const char *name);
+#define ref_store_seq_len(s, id) ((s)->seqs[id].len)
+// Decode bases [beg, end) of sequence id, clipped to the sequence, and append them to str. Return the number of
+// bases appended.
+extern int ref_store_fetch(struct ref_store *s, int id, int beg, int end, kstring_t *str);
+
+#endif
@@ -0,0 +1,162 @@
+// 2-bit packed transcript sequences, loaded once and shared by all threads.
+#include "utils.h"
+#include "htslib/faidx.h"
+#include "htslib/khash.h"
+#include "htslib/kstring.h"
+#include "rna_store.h"
+
+KHASH_MAP_INIT_STR(rna_store, int)
+
+static const char rna_store_bases[4] = { 'A', 'C', 'G', 'T' };
+
+static inline int rna_store_code(char c)
+{
+    switch (c) {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        default : return -1;
+    }
+}
+
+static void rna_store_push_exc(struct rna_store *s, int pos, const char *seq, int l)
+{
+    if ( s->n_exc == s->m_exc ) {
+        s->m_exc = s->m_exc == 0 ? 32 : s->m_exc<<1;
+        s->exc_pos    = realloc(s->exc_pos,    s->m_exc*sizeof(int));
+        s->exc_len    = realloc(s->exc_len,    s->m_exc*sizeof(int));
+        s->exc_offset = realloc(s->exc_offset, s->m_exc*sizeof(int));
+    }
+    s->exc_pos[s->n_exc] = pos;
+    s->exc_len[s->n_exc] = l;
+    s->exc_offset[s->n_exc] = s->exc_bases.l;
+    kputsn(seq, l, &s->exc_bases);
+    s->n_exc++;
+}
+
+static void rna_store_pack(struct rna_store *s, struct rna_store_seq *q, const char *seq)
+{
+    uint64_t need = (q->offset + q->len + 3) >> 2;
+    if ( need > s->m_packed ) {
+        uint64_t m = s->m_packed;
+        while ( m < need ) m = m == 0 ? 1<<20 : m<<1;
+        s->packed = realloc(s->packed, m);
+        memset(s->packed + s->m_packed, 0, m - s->m_packed);
+        s->m_packed = m;
+    }
+    int i;
+    for ( i = 0; i < q->len; ) {
+        int c = rna_store_code(seq[i]);
+        if ( c >= 0 ) {
+            uint64_t p = q->offset + i;
+            s->packed[p>>2] |= c << ((p&3)<<1);
+            i++;
+            continue;
+        }
+        // exception run, stored verbatim, packed bases are left as A
+        int j;
+        for ( j = i+1; j < q->len && rna_store_code(seq[j]) < 0; ++j );
+        rna_store_push_exc(s, i, seq+i, j-i);
+        q->n_exc++;
+        i = j;
+    }
+    s->l_packed = q->offset + q->len;
+}
+
+struct rna_store *rna_store_load(const char *fname)
+{
+    faidx_t *fai = fai_load(fname);
+    if ( fai == NULL ) return NULL;
+
+    struct rna_store *s = calloc(1, sizeof(*s));
+    khash_t(rna_store) *hash = kh_init(rna_store);
+    s->hash = hash;
+    s->m = faidx_nseq(fai);
+    s->seqs = calloc(s->m, sizeof(struct rna_store_seq));
+    int i;
+    for ( i = 0; i < s->m; ++i ) {
+        const char *name = faidx_iseq(fai, i);
+        int l = 0;
+        char *seq = faidx_fetch_seq(fai, name, 0, faidx_seq_len(fai, name)-1, &l);
+        if ( seq == NULL || l < 0 ) {
+            warnings("Failed to load sequence %s from %s.", name, fname);
+            if ( seq ) free(seq);
+            continue;
+        }
+        struct rna_store_seq *q = &s->seqs[s->n];
+        q->name = strdup(name);
+        q->len = l;
+        q->offset = s->l_packed;
+        q->exc_first = s->n_exc;
+        rna_store_pack(s, q, seq);
+        free(seq);
+
+        int ret;
+        khint_t k = kh_put(rna_store, hash, q->name, &ret);
+        kh_val(hash, k) = s->n;
+        s->n++;
+    }
+    fai_destroy(fai);
+    return s;
+}
+
+void rna_store_destroy(struct rna_store *s)
+{
+    if ( s == NULL ) return;
+    int i;
+    for ( i = 0; i < s->n; ++i ) free(s->seqs[i].name);
+    free(s->seqs);
+    free(s->packed);
+    free(s->exc_pos);
+    free(s->exc_len);
+    free(s->exc_offset);
+    if ( s->exc_bases.m ) free(s->exc_bases.s);
+    kh_destroy(rna_store, (khash_t(rna_store)*)s->hash);
+    free(s);
+}
+
+int rna_store_name2id(struct rna_store *s, const char *name)
+{
+    khash_t(rna_store) *hash = (khash_t(rna_store)*)s->hash;
+    khint_t k = kh_get(rna_store, hash, name);
+    return k == kh_end(hash) ? -1 : kh_val(hash, k);
+}
+
+int rna_store_fetch(struct rna_store *s, int id, int beg, int end, kstring_t *str)
+{
+    struct rna_store_seq *q = &s->seqs[id];
+    if ( beg < 0 ) beg = 0;
+    if ( end > q->len ) end = q->len;
+    if ( beg >= end ) return 0;
+
+    int l = end - beg;
+    ks_resize(str, str->l + l + 1);
+    char *p = str->s + str->l;
+    uint64_t i = q->offset + beg, e = q->offset + end;
+    // decode head to byte boundary, then 4 bases per byte
+    for ( ; i < e && (i&3); ++i ) *p++ = rna_store_bases[s->packed[i>>2] >> ((i&3)<<1) & 3];
+    for ( ; i + 4 <= e; i += 4 ) {
+        uint8_t b = s->packed[i>>2];
+        p[0] = rna_store_bases[b & 3];
+        p[1] = rna_store_bases[b>>2 & 3];
+        p[2] = rna_store_bases[b>>4 & 3];
+        p[3] = rna_store_bases[b>>6];
+        p += 4;
+    }
+    for ( ; i < e; ++i ) *p++ = rna_store_bases[s->packed[i>>2] >> ((i&3)<<1) & 3];
+
+    // patch exception runs overlapping [beg, end)
+    int j;
+    for ( j = q->exc_first; j < q->exc_first + q->n_exc; ++j ) {
+        int s0 = s->exc_pos[j], e0 = s0 + s->exc_len[j];
+        if ( e0 <= beg ) continue;
+        if ( s0 >= end ) break;
+        int a = s0 > beg ? s0 : beg;
+        int b = e0 < end ? e0 : end;
+        memcpy(str->s + str->l + a - beg, s->exc_bases.s + s->exc_offset[j] + a - s0, b - a);
+    }
+    str->l += l;
+    str->s[str->l] = '\0';
+    return l;
+}
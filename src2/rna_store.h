@@ -0,0 +1,40 @@
+#ifndef RNA_STORE_HEADER
+#define RNA_STORE_HEADER
+
+#include <stdint.h>
+#include "htslib/kstring.h"
+
+// Transcript sequences loaded from the refseq FASTA, packed in 2 bits per base.
+// Bases other than A/C/G/T (N, IUPAC codes, soft masked) are kept as exception runs
+// and patched back when decoding, so fetched windows are the same as faidx_fetch_seq.
+struct rna_store_seq {
+    char *name;
+    int len;
+    uint64_t offset; // offset of first base in the packed pool
+    int exc_first;   // first exception run of this sequence
+    int n_exc;
+};
+
+struct rna_store {
+    int n, m;
+    struct rna_store_seq *seqs;
+    // packed bases, 4 bases per byte
+    uint8_t *packed;
+    uint64_t l_packed, m_packed;
+    // exception runs, bases stored in exc_bases
+    int n_exc, m_exc;
+    int *exc_pos, *exc_len, *exc_offset;
+    kstring_t exc_bases;
+    void *hash;
+};
+
+// Load all sequences of an indexed FASTA. Return NULL on failure.
+extern struct rna_store *rna_store_load(const char *fname);
+extern void rna_store_destroy(struct rna_store *s);
+// Return sequence id or -1 if not found.
+extern int rna_store_name2id(struct rna_store *s, const char *name);
+#define rna_store_seq_len(s, id) ((s)->seqs[id].len)
+// Decode bases [beg, end) of sequence id and append them to str. Return the number of bases appended.
+extern int rna_store_fetch(struct rna_store *s, int id, int beg, int end, kstring_t *str);
+
+#endif
@@ -24,6 +24,8 @@
 
 #include "utils.h"
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "htslib/hts.h"
 #include "htslib/faidx.h"
 #include "variant_type.h"
@@ -32,22 +34,9 @@
 // Return -1 if no found.
 int check_stop_codon(char *seq, char *p_end, int mito)
 {
-    char *ss = seq;
-    char *se = p_end;
-    int i, l = 0;
-    if ( se == NULL ) {
-        for ( se = ss; se != NULL && *se; ++se, ++l );        
-    }
-
-    l /= 3;
-    
-    for ( i = 0; i < l;  ++i) {
-        if ( codon2aminoid(ss,mito) == C4_Stop ) {
-            return i+1;
-        }
-        ss += 3;
-    }
-    return -1;
+    int l = p_end == NULL ? strlen(seq) : p_end - seq;
+    int i = find_stop_codon(seq, l, mito);
+    return i == -1 ? -1 : i+1;
 }
 
 void compl_seq(char *seq, int l)
@@ -124,6 +113,188 @@ int codon2aminoid(char *codon, int mito)
         return mitomap_codon_matrix[seq2code4(codon[0])][seq2code4(codon[1])][seq2code4(codon[2])];
 }
 
+// Codon translation kernel. Bases are packed to 2-bit codes and codons are translated through a
+// 64 entry table, 5 codons per SSE register or 10 codons per AVX2 register. A block with any base
+// other than A/C/G/T/U falls back to codon2aminoid(), so results are always the same as the scalar path.
+static uint8_t codon_table64[2][64];
+
+static void codon_table64_init(void)
+{
+    int i, j, k;
+    for ( i = 0; i < 4; ++i )
+        for ( j = 0; j < 4; ++j )
+            for ( k = 0; k < 4; ++k ) {
+                codon_table64[0][i<<4|j<<2|k] = codon_matrix[i][j][k];
+                codon_table64[1][i<<4|j<<2|k] = mitomap_codon_matrix[i][j][k];
+            }
+}
+
+static int translate_codons_scalar(const char *seq, int n, uint8_t *aa, int mito, int stop)
+{
+    int i;
+    for ( i = 0; i < n; ++i ) {
+        aa[i] = codon2aminoid((char*)seq+i*3, mito);
+        if ( stop && aa[i] == C4_Stop ) return i+1;
+    }
+    return n;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CODON_SIMD 1
+
+// translate 5 codons in seq[0,15), invalid is set if any base is not A/C/G/T/U
+__attribute__((target("sse4.1")))
+static inline __m128i translate5_sse(const char *seq, const uint8_t *table, int *invalid)
+{
+    const __m128i code = _mm_setr_epi8(-1,0,-1,1, 3,3,-1,2, -1,-1,-1,-1, -1,-1,-1,-1);
+    const __m128i sh0 = _mm_setr_epi8(0,3,6,9,12, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+    const __m128i sh1 = _mm_setr_epi8(1,4,7,10,13, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+    const __m128i sh2 = _mm_setr_epi8(2,5,8,11,14, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+    __m128i s = _mm_and_si128(_mm_loadu_si128((const __m128i*)seq), _mm_set1_epi8((char)0xDF));
+    // A=0x41, C=0x43, G=0x47, T=0x54, U=0x55 after upper case, low nibble picks the code
+    __m128i c = _mm_shuffle_epi8(code, _mm_and_si128(s, _mm_set1_epi8(0x0F)));
+    // A/C/G are valid in 0x4?, T/U in 0x5?
+    __m128i lo = _mm_and_si128(s, _mm_set1_epi8(0x0F));
+    __m128i hi = _mm_and_si128(s, _mm_set1_epi8((char)0xF0));
+    __m128i row4 = _mm_cmpeq_epi8(hi, _mm_set1_epi8(0x40));
+    __m128i row5 = _mm_cmpeq_epi8(hi, _mm_set1_epi8(0x50));
+    __m128i is_tu = _mm_or_si128(_mm_cmpeq_epi8(lo, _mm_set1_epi8(4)), _mm_cmpeq_epi8(lo, _mm_set1_epi8(5)));
+    __m128i ok = _mm_or_si128(_mm_andnot_si128(is_tu, row4), _mm_and_si128(is_tu, row5));
+    ok = _mm_andnot_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(-1)), ok);
+    *invalid = (~_mm_movemask_epi8(ok)) & 0x7FFF;
+
+    __m128i b0 = _mm_shuffle_epi8(c, sh0);
+    __m128i b1 = _mm_shuffle_epi8(c, sh1);
+    __m128i b2 = _mm_shuffle_epi8(c, sh2);
+    __m128i idx = _mm_or_si128(_mm_slli_epi16(b1, 2), b2);
+    __m128i r = _mm_setzero_si128();
+    int k;
+    for ( k = 0; k < 4; ++k ) {
+        __m128i t = _mm_loadu_si128((const __m128i*)(table + k*16));
+        __m128i m = _mm_cmpeq_epi8(b0, _mm_set1_epi8(k));
+        r = _mm_or_si128(r, _mm_and_si128(m, _mm_shuffle_epi8(t, idx)));
+    }
+    return r;
+}
+
+__attribute__((target("sse4.1")))
+static int translate_codons_sse(const char *seq, int n, uint8_t *aa, int mito, int stop)
+{
+    const uint8_t *table = codon_table64[mito != 0];
+    uint8_t tmp[16];
+    int i = 0;
+    // loads read 16 bytes for 15 bases
+    for ( ; i + 6 <= n; i += 5 ) {
+        int invalid;
+        __m128i r = translate5_sse(seq + i*3, table, &invalid);
+        if ( invalid ) {
+            int ret = translate_codons_scalar(seq + i*3, 5, aa + i, mito, stop);
+            if ( stop && aa[i+ret-1] == C4_Stop ) return i + ret;
+            continue;
+        }
+        _mm_storeu_si128((__m128i*)tmp, r);
+        memcpy(aa + i, tmp, 5);
+        if ( stop ) {
+            int m = _mm_movemask_epi8(_mm_cmpeq_epi8(r, _mm_setzero_si128())) & 0x1F;
+            if ( m ) return i + __builtin_ctz(m) + 1;
+        }
+    }
+    return i + translate_codons_scalar(seq + i*3, n - i, aa + i, mito, stop);
+}
+
+__attribute__((target("avx2")))
+static int translate_codons_avx2(const char *seq, int n, uint8_t *aa, int mito, int stop)
+{
+    const uint8_t *table = codon_table64[mito != 0];
+    const __m256i code = _mm256_setr_epi8(-1,0,-1,1, 3,3,-1,2, -1,-1,-1,-1, -1,-1,-1,-1,
+                                          -1,0,-1,1, 3,3,-1,2, -1,-1,-1,-1, -1,-1,-1,-1);
+    const __m256i sh0 = _mm256_setr_epi8(0,3,6,9,12, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                                         0,3,6,9,12, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+    const __m256i sh1 = _mm256_setr_epi8(1,4,7,10,13, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                                         1,4,7,10,13, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+    const __m256i sh2 = _mm256_setr_epi8(2,5,8,11,14, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                                         2,5,8,11,14, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+    __m256i t[4];
+    int k;
+    for ( k = 0; k < 4; ++k ) t[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(table + k*16)));
+
+    uint8_t tmp[32];
+    int i = 0;
+    // two lanes of 15 bases, the second load reads 16 bytes from base 15
+    for ( ; i + 11 <= n; i += 10 ) {
+        const char *p = seq + i*3;
+        __m256i s = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)),
+                                            _mm_loadu_si128((const __m128i*)(p+15)), 1);
+        s = _mm256_and_si256(s, _mm256_set1_epi8((char)0xDF));
+        __m256i lo = _mm256_and_si256(s, _mm256_set1_epi8(0x0F));
+        __m256i hi = _mm256_and_si256(s, _mm256_set1_epi8((char)0xF0));
+        __m256i c = _mm256_shuffle_epi8(code, lo);
+        __m256i row4 = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(0x40));
+        __m256i row5 = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(0x50));
+        __m256i is_tu = _mm256_or_si256(_mm256_cmpeq_epi8(lo, _mm256_set1_epi8(4)), _mm256_cmpeq_epi8(lo, _mm256_set1_epi8(5)));
+        __m256i ok = _mm256_or_si256(_mm256_andnot_si256(is_tu, row4), _mm256_and_si256(is_tu, row5));
+        ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(-1)), ok);
+        if ( (~_mm256_movemask_epi8(ok)) & 0x7FFF7FFF ) {
+            int ret = translate_codons_scalar(p, 10, aa + i, mito, stop);
+            if ( stop && aa[i+ret-1] == C4_Stop ) return i + ret;
+            continue;
+        }
+        __m256i b0 = _mm256_shuffle_epi8(c, sh0);
+        __m256i idx = _mm256_or_si256(_mm256_slli_epi16(_mm256_shuffle_epi8(c, sh1), 2), _mm256_shuffle_epi8(c, sh2));
+        __m256i r = _mm256_setzero_si256();
+        for ( k = 0; k < 4; ++k ) {
+            __m256i m = _mm256_cmpeq_epi8(b0, _mm256_set1_epi8(k));
+            r = _mm256_or_si256(r, _mm256_and_si256(m, _mm256_shuffle_epi8(t[k], idx)));
+        }
+        _mm256_storeu_si256((__m256i*)tmp, r);
+        memcpy(aa + i, tmp, 5);
+        memcpy(aa + i + 5, tmp + 16, 5);
+        if ( stop ) {
+            int m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(r, _mm256_setzero_si256()));
+            m = (m & 0x1F) | (m >> 11 & 0x3E0);
+            if ( m ) return i + __builtin_ctz(m) + 1;
+        }
+    }
+    return i + translate_codons_sse(seq + i*3, n - i, aa + i, mito, stop);
+}
+#endif
+
+static int (*translate_codons_func)(const char *, int, uint8_t *, int, int) = NULL;
+
+static void translate_codons_init(void)
+{
+    codon_table64_init();
+#ifdef CODON_SIMD
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx2") ) translate_codons_func = translate_codons_avx2;
+    else if ( __builtin_cpu_supports("sse4.1") ) translate_codons_func = translate_codons_sse;
+    else translate_codons_func = translate_codons_scalar;
+#else
+    translate_codons_func = translate_codons_scalar;
+#endif
+}
+
+int translate_codons(const char *seq, int l, uint8_t *aa, int mito, int stop)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, translate_codons_init);
+    return translate_codons_func(seq, l/3, aa, mito, stop);
+}
+
+int find_stop_codon(const char *seq, int l, int mito)
+{
+    uint8_t aa[64];
+    int i, n = l/3;
+    // translate in small blocks, stop at the first block with a stop codon
+    for ( i = 0; i < n; i += 60 ) {
+        int m = n - i < 60 ? n - i : 60;
+        int ret = translate_codons(seq + i*3, m*3, aa, mito, 1);
+        if ( ret > 0 && aa[ret-1] == C4_Stop ) return i + ret - 1;
+    }
+    return -1;
+}
+
 char *rev_seqs(const char *dna_seqs, unsigned long n)
 {
     if ( n == 0 )
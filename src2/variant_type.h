@@ -30,6 +30,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #if defined(_MSC_VER) && !defined(__clang__)
 # define inline __inline
@@ -54,6 +55,11 @@ extern void compl_seq(char *seq, int l);
 extern int seq2code4(int seq);
 extern int same_DNA_seqs(const char *a, const char *b, int l );
 extern int codon2aminoid(char *codon,int mito);
+// Translate the codons of seq[0,l) into amino acid ids, SIMD accelerated if possible. If stop is set,
+// translation ends at the first stop codon. Return the number of amino acids written to aa.
+extern int translate_codons(const char *seq, int l, uint8_t *aa, int mito, int stop);
+// Return the index of the first in-frame stop codon in seq[0,l), -1 if not found.
+extern int find_stop_codon(const char *seq, int l, int mito);
 extern char *rev_seqs(const char *dna_seqs, unsigned long n);
 
 #define X_CODO   0
@@ -0,0 +1,526 @@
+// Persistent variant consequence cache, see vc_cache.h for the file layout.
+#include "utils.h"
+#include "htslib/khash.h"
+#include "htslib/kstring.h"
+#include "vc_cache.h"
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+KHASH_MAP_INIT_STR(vc_cache, int)
+
+static const char vc_cache_magic[4] = { 'V', 'C', 'C', 1 };
+
+static inline uint32_t vc_get_u32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+static inline uint64_t vc_get_u64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+static inline void vc_put_u32(kstring_t *str, uint32_t v)
+{
+    kputsn((char*)&v, 4, str);
+}
+static inline void vc_put_u64(kstring_t *str, uint64_t v)
+{
+    kputsn((char*)&v, 8, str);
+}
+
+uint32_t vc_cache_file_checksum(const char *fname, uint32_t crc)
+{
+    // size and modification time, same as ref_store checks the FASTA, reading whole databases is too slow
+    struct stat st;
+    if ( stat(fname, &st) ) return crc;
+    uint64_t v[2] = { st.st_size, st.st_mtime };
+    return crc32(crc, (unsigned char*)v, sizeof v);
+}
+
+static void vc_cache_header(kstring_t *str, uint32_t checksum, const char *key)
+{
+    kputsn(vc_cache_magic, 4, str);
+    vc_put_u32(str, checksum);
+    vc_put_u32(str, strlen(key));
+    kputs(key, str);
+}
+
+// Check the header, return its length or -1 if built from another database or configure.
+static int vc_cache_check_header(struct vc_cache *c, const uint8_t *p, size_t l)
+{
+    if ( l < 12 || memcmp(p, vc_cache_magic, 4) ) return -1;
+    if ( vc_get_u32(p+4) != c->checksum ) return -1;
+    uint32_t l_key = vc_get_u32(p+8);
+    if ( l < 12 + l_key || l_key != strlen(c->key) || memcmp(p+12, c->key, l_key) ) return -1;
+    return 12 + l_key;
+}
+
+static void vc_cache_unmap(struct vc_cache *c)
+{
+    int i;
+    for ( i = 0; i < c->n_ctg; ++i ) free(c->ctgs[i].name);
+    free(c->ctgs);
+    c->ctgs = NULL;
+    c->n_ctg = 0;
+    if ( c->ctg_hash ) kh_destroy(vc_cache, (khash_t(vc_cache)*)c->ctg_hash);
+    c->ctg_hash = NULL;
+    if ( c->map ) munmap(c->map, c->l_map);
+    c->map = NULL;
+    c->l_map = 0;
+}
+
+static int vc_cache_map(struct vc_cache *c)
+{
+    int fd = open(c->fname, O_RDONLY);
+    if ( fd == -1 ) return 1;
+    struct stat st;
+    if ( fstat(fd, &st) || st.st_size == 0 ) {
+        close(fd);
+        return 1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( map == MAP_FAILED ) {
+        warnings("Failed to map %s : %s.", c->fname, strerror(errno));
+        return 1;
+    }
+    c->map = map;
+    c->l_map = st.st_size;
+
+    const uint8_t *p = c->map, *e = c->map + c->l_map;
+    int l = vc_cache_check_header(c, p, c->l_map);
+    if ( l == -1 || p + l + 4 > e ) goto bad_file;
+    p += l;
+    c->n_ctg = vc_get_u32(p); p += 4;
+    c->ctgs = calloc(c->n_ctg, sizeof(struct vc_cache_ctg));
+    khash_t(vc_cache) *hash = kh_init(vc_cache);
+    c->ctg_hash = hash;
+    int i;
+    for ( i = 0; i < c->n_ctg; ++i ) {
+        struct vc_cache_ctg *ctg = &c->ctgs[i];
+        if ( p + 4 > e ) goto bad_file;
+        uint32_t l_name = vc_get_u32(p); p += 4;
+        if ( p + l_name + 4 > e ) goto bad_file;
+        ctg->name = malloc(l_name+1);
+        memcpy(ctg->name, p, l_name);
+        ctg->name[l_name] = '\0';
+        p += l_name;
+        ctg->n_bin = vc_get_u32(p); p += 4;
+        ctg->bins = p;
+        p += 8*(ctg->n_bin+1);
+        if ( p > e || vc_get_u64(ctg->bins + 8*ctg->n_bin) > c->l_map ) goto bad_file;
+        int ret;
+        khint_t k = kh_put(vc_cache, hash, ctg->name, &ret);
+        kh_val(hash, k) = i;
+    }
+    return 0;
+
+  bad_file:
+    warnings("%s was built from another database or configure, or truncated, ignore it.", c->fname);
+    vc_cache_unmap(c);
+    return 1;
+}
+
+// Lock FILE.lock, other runs sharing the cache wait here to create their logs or merge. Return the file
+// descriptor, or -1 on failure.
+static int vc_cache_lock(const char *fname)
+{
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.lock", fname);
+    int fd = open(str.s, O_RDWR|O_CREAT, 0644);
+    if ( fd == -1 ) warnings("%s : %s.", str.s, strerror(errno));
+    else if ( flock(fd, LOCK_EX) ) {
+        warnings("Failed to lock %s : %s.", str.s, strerror(errno));
+        close(fd);
+        fd = -1;
+    }
+    free(str.s);
+    return fd;
+}
+
+static void vc_cache_unlock(int fd)
+{
+    if ( fd == -1 ) return;
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+// Open the log of new records, FILE.new.<pid>. The log is locked until it is closed, so other runs could tell
+// it from the logs of interrupted runs. A log left by an interrupted run with the same pid is kept if built
+// from the same database.
+static int vc_cache_open_log(struct vc_cache *c)
+{
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.new.%d", c->fname, (int)getpid());
+    kstring_t hdr = {0,0,0};
+    vc_cache_header(&hdr, c->checksum, c->key);
+
+    // do not let a merge see the log before it is locked
+    int lock = vc_cache_lock(c->fname);
+    FILE *fp = fopen(str.s, "rb");
+    int keep = 0;
+    if ( fp ) {
+        uint8_t *buf = malloc(hdr.l);
+        if ( fread(buf, 1, hdr.l, fp) == hdr.l && vc_cache_check_header(c, buf, hdr.l) == hdr.l ) keep = 1;
+        free(buf);
+        fclose(fp);
+    }
+    c->fp_new = fopen(str.s, keep ? "ab" : "wb");
+    if ( c->fp_new ) {
+        if ( flock(fileno(c->fp_new), LOCK_EX) ) warnings("Failed to lock %s : %s.", str.s, strerror(errno));
+        if ( keep == 0 ) fwrite(hdr.s, 1, hdr.l, c->fp_new);
+        fflush(c->fp_new);
+    }
+    else warnings("%s : %s.", str.s, strerror(errno));
+    vc_cache_unlock(lock);
+    free(str.s);
+    free(hdr.s);
+    return c->fp_new == NULL;
+}
+
+struct vc_cache *vc_cache_open(const char *fname, uint32_t checksum, const char *key)
+{
+    struct vc_cache *c = calloc(1, sizeof(*c));
+    c->fname = strdup(fname);
+    c->checksum = checksum;
+    c->key = strdup(key);
+    c->ref = 1;
+    pthread_mutex_init(&c->lock, NULL);
+    vc_cache_map(c);
+    if ( vc_cache_open_log(c) ) {
+        vc_cache_close(c);
+        return NULL;
+    }
+    return c;
+}
+
+struct vc_cache *vc_cache_ref(struct vc_cache *c)
+{
+    pthread_mutex_lock(&c->lock);
+    c->ref++;
+    pthread_mutex_unlock(&c->lock);
+    return c;
+}
+
+int vc_cache_get(struct vc_cache *c, const char *chrom, int pos, const char *alleles, int l_alleles, const char **val, int *l_val)
+{
+    if ( c->ctg_hash == NULL ) return 0;
+    khash_t(vc_cache) *hash = (khash_t(vc_cache)*)c->ctg_hash;
+    khint_t k = kh_get(vc_cache, hash, chrom);
+    if ( k == kh_end(hash) ) return 0;
+    struct vc_cache_ctg *ctg = &c->ctgs[kh_val(hash, k)];
+    int bin = pos >> VC_CACHE_BIN_SHIFT;
+    if ( bin >= ctg->n_bin ) return 0;
+    const uint8_t *p = c->map + vc_get_u64(ctg->bins + 8*bin);
+    const uint8_t *e = c->map + vc_get_u64(ctg->bins + 8*(bin+1));
+    while ( p < e ) {
+        int rpos = vc_get_u32(p);
+        int rl_key = vc_get_u32(p+4);
+        int rl_val = vc_get_u32(p+8);
+        if ( rpos > pos ) break;
+        if ( rpos == pos && rl_key == l_alleles && memcmp(p+12, alleles, l_alleles) == 0 ) {
+            *val = (const char*)p + 12 + rl_key;
+            *l_val = rl_val;
+            return 1;
+        }
+        p += 12 + rl_key + (rl_val > 0 ? rl_val : 0);
+    }
+    return 0;
+}
+
+void vc_cache_push(struct vc_cache_batch *b, const char *chrom, int pos, const char *alleles, int l_alleles, const char *val, int l_val)
+{
+    vc_put_u32(&b->buf, strlen(chrom));
+    kputs(chrom, &b->buf);
+    vc_put_u32(&b->buf, pos);
+    vc_put_u32(&b->buf, l_alleles);
+    vc_put_u32(&b->buf, l_val);
+    kputsn(alleles, l_alleles, &b->buf);
+    if ( l_val > 0 ) kputsn(val, l_val, &b->buf);
+    b->n++;
+}
+
+void vc_cache_flush(struct vc_cache *c, struct vc_cache_batch *b)
+{
+    if ( b->n == 0 ) return;
+    pthread_mutex_lock(&c->lock);
+    if ( fwrite(b->buf.s, 1, b->buf.l, c->fp_new) != b->buf.l ) warnings("Failed to write the log of %s.", c->fname);
+    c->n_new += b->n;
+    pthread_mutex_unlock(&c->lock);
+    b->buf.l = 0;
+    b->n = 0;
+}
+
+struct vc_rec {
+    const char *chrom;
+    int l_chrom;
+    int pos;
+    int l_key;
+    int l_val;
+    const uint8_t *key; // followed by val
+    int order;
+};
+
+static int vc_rec_cmp(const void *_a, const void *_b)
+{
+    const struct vc_rec *a = _a, *b = _b;
+    int l = a->l_chrom < b->l_chrom ? a->l_chrom : b->l_chrom;
+    int r = memcmp(a->chrom, b->chrom, l);
+    if ( r ) return r;
+    if ( a->l_chrom != b->l_chrom ) return a->l_chrom - b->l_chrom;
+    if ( a->pos != b->pos ) return a->pos < b->pos ? -1 : 1;
+    l = a->l_key < b->l_key ? a->l_key : b->l_key;
+    r = memcmp(a->key, b->key, l);
+    if ( r ) return r;
+    if ( a->l_key != b->l_key ) return a->l_key - b->l_key;
+    return a->order - b->order;
+}
+
+static void vc_rec_push(struct vc_rec **recs, int *n, int *m, struct vc_rec *r)
+{
+    if ( *n == *m ) {
+        *m = *m == 0 ? 1024 : *m<<1;
+        *recs = realloc(*recs, *m*sizeof(struct vc_rec));
+    }
+    r->order = *n;
+    (*recs)[(*n)++] = *r;
+}
+
+// Logs of this cache not locked by a running process, including the log of this run after it is closed.
+struct vc_log {
+    char *fname;
+    kstring_t data;
+    int l_hdr; // -1 if built from another database or configure
+};
+
+static int vc_cache_logs(struct vc_cache *c, struct vc_log **logs)
+{
+    const char *base = strrchr(c->fname, '/');
+    kstring_t dir = {0,0,0};
+    if ( base ) {
+        kputsn(c->fname, base - c->fname + 1, &dir);
+        base++;
+    }
+    else {
+        kputs("./", &dir);
+        base = c->fname;
+    }
+    DIR *d = opendir(dir.s);
+    if ( d == NULL ) {
+        free(dir.s);
+        return 0;
+    }
+    kstring_t prefix = {0,0,0};
+    ksprintf(&prefix, "%s.new", base);
+    int n = 0, m = 0;
+    struct dirent *e;
+    while ( (e = readdir(d)) != NULL ) {
+        // FILE.new.<pid>, or FILE.new of older versions
+        if ( strncmp(e->d_name, prefix.s, prefix.l) ) continue;
+        if ( e->d_name[prefix.l] != '\0' && e->d_name[prefix.l] != '.' ) continue;
+        kstring_t fname = {0,0,0};
+        ksprintf(&fname, "%s%s", dir.s, e->d_name);
+        int fd = open(fname.s, O_RDONLY);
+        // still written by another run
+        if ( fd == -1 || flock(fd, LOCK_EX|LOCK_NB) ) {
+            if ( fd != -1 ) close(fd);
+            free(fname.s);
+            continue;
+        }
+        if ( n == m ) {
+            m = m == 0 ? 4 : m<<1;
+            *logs = realloc(*logs, m*sizeof(struct vc_log));
+        }
+        struct vc_log *log = &(*logs)[n++];
+        log->fname = fname.s;
+        memset(&log->data, 0, sizeof(kstring_t));
+        char buf[1<<16];
+        ssize_t l;
+        while ( (l = read(fd, buf, sizeof buf)) > 0 ) kputsn(buf, l, &log->data);
+        close(fd);
+        log->l_hdr = vc_cache_check_header(c, (uint8_t*)log->data.s, log->data.l);
+    }
+    closedir(d);
+    free(prefix.s);
+    free(dir.s);
+    return n;
+}
+
+// Write mapped records of c and records in logs into a new sorted file.
+static int vc_cache_write(struct vc_cache *c, struct vc_log *logs, int n_log)
+{
+    struct vc_rec *recs = NULL, r;
+    int n = 0, m = 0, i;
+    // mapped records, stored contiguously per contig
+    for ( i = 0; i < c->n_ctg; ++i ) {
+        struct vc_cache_ctg *ctg = &c->ctgs[i];
+        const uint8_t *p = c->map + vc_get_u64(ctg->bins);
+        const uint8_t *e = c->map + vc_get_u64(ctg->bins + 8*ctg->n_bin);
+        while ( p < e ) {
+            r.chrom = ctg->name;
+            r.l_chrom = strlen(ctg->name);
+            r.pos = vc_get_u32(p);
+            r.l_key = vc_get_u32(p+4);
+            r.l_val = vc_get_u32(p+8);
+            r.key = p + 12;
+            vc_rec_push(&recs, &n, &m, &r);
+            p += 12 + r.l_key + (r.l_val > 0 ? r.l_val : 0);
+        }
+    }
+    // new records, a truncated tail of an interrupted run is dropped
+    int k;
+    for ( k = 0; k < n_log; ++k ) {
+        if ( logs[k].l_hdr == -1 ) continue;
+        const uint8_t *p = (uint8_t*)logs[k].data.s + logs[k].l_hdr, *e = (uint8_t*)logs[k].data.s + logs[k].data.l;
+        while ( p + 4 <= e ) {
+            r.l_chrom = vc_get_u32(p);
+            if ( p + 4 + r.l_chrom + 12 > e ) break;
+            r.chrom = (const char*)p + 4;
+            p += 4 + r.l_chrom;
+            r.pos = vc_get_u32(p);
+            r.l_key = vc_get_u32(p+4);
+            r.l_val = vc_get_u32(p+8);
+            r.key = p + 12;
+            p += 12 + r.l_key + (r.l_val > 0 ? r.l_val : 0);
+            if ( p > e ) break;
+            vc_rec_push(&recs, &n, &m, &r);
+        }
+    }
+    qsort(recs, n, sizeof(struct vc_rec), vc_rec_cmp);
+
+    // drop duplicates, keep the first one
+    int j = 0;
+    for ( i = 0; i < n; ++i ) {
+        if ( j > 0 ) {
+            struct vc_rec *a = &recs[j-1], *b = &recs[i];
+            if ( a->l_chrom == b->l_chrom && memcmp(a->chrom, b->chrom, a->l_chrom) == 0 && a->pos == b->pos
+                 && a->l_key == b->l_key && memcmp(a->key, b->key, a->l_key) == 0 ) continue;
+        }
+        recs[j++] = recs[i];
+    }
+    n = j;
+
+    // contig table
+    kstring_t hdr = {0,0,0};
+    kstring_t body = {0,0,0};
+    vc_cache_header(&hdr, c->checksum, c->key);
+    int n_ctg = 0;
+    for ( i = 0; i < n; ) {
+        for ( j = i+1; j < n && recs[j].l_chrom == recs[i].l_chrom && memcmp(recs[j].chrom, recs[i].chrom, recs[i].l_chrom) == 0; ++j );
+        n_ctg++;
+        i = j;
+    }
+    vc_put_u32(&hdr, n_ctg);
+    size_t l_table = hdr.l;
+    for ( i = 0; i < n; ) {
+        for ( j = i+1; j < n && recs[j].l_chrom == recs[i].l_chrom && memcmp(recs[j].chrom, recs[i].chrom, recs[i].l_chrom) == 0; ++j );
+        int n_bin = (recs[j-1].pos >> VC_CACHE_BIN_SHIFT) + 1;
+        l_table += 4 + recs[i].l_chrom + 4 + 8*(n_bin+1);
+        i = j;
+    }
+    for ( i = 0; i < n; ) {
+        for ( j = i+1; j < n && recs[j].l_chrom == recs[i].l_chrom && memcmp(recs[j].chrom, recs[i].chrom, recs[i].l_chrom) == 0; ++j );
+        int n_bin = (recs[j-1].pos >> VC_CACHE_BIN_SHIFT) + 1;
+        vc_put_u32(&hdr, recs[i].l_chrom);
+        kputsn(recs[i].chrom, recs[i].l_chrom, &hdr);
+        vc_put_u32(&hdr, n_bin);
+        int k, bin = 0;
+        for ( k = i; k < j; ++k ) {
+            struct vc_rec *a = &recs[k];
+            for ( ; bin <= a->pos >> VC_CACHE_BIN_SHIFT; ++bin ) vc_put_u64(&hdr, l_table + body.l);
+            vc_put_u32(&body, a->pos);
+            vc_put_u32(&body, a->l_key);
+            vc_put_u32(&body, a->l_val);
+            kputsn((char*)a->key, a->l_key + (a->l_val > 0 ? a->l_val : 0), &body);
+        }
+        for ( ; bin <= n_bin; ++bin ) vc_put_u64(&hdr, l_table + body.l);
+        i = j;
+    }
+    assert(hdr.l == l_table);
+
+    kstring_t tmp_fname = {0,0,0};
+    ksprintf(&tmp_fname, "%s.tmp.%d", c->fname, (int)getpid());
+    int ret = 0;
+    FILE *fp = fopen(tmp_fname.s, "wb");
+    if ( fp == NULL || fwrite(hdr.s, 1, hdr.l, fp) != hdr.l || fwrite(body.s, 1, body.l, fp) != body.l ) {
+        warnings("Failed to write %s : %s.", tmp_fname.s, strerror(errno));
+        ret = 1;
+    }
+    if ( fp && fclose(fp) ) ret = 1;
+    if ( ret == 0 ) {
+        if ( rename(tmp_fname.s, c->fname) ) {
+            warnings("Failed to rename %s : %s.", tmp_fname.s, strerror(errno));
+            ret = 1;
+        }
+    }
+    if ( ret ) unlink(tmp_fname.s);
+    free(tmp_fname.s);
+    free(hdr.s);
+    free(body.s);
+    free(recs);
+    return ret;
+}
+
+// Merge the cache file and logs of finished runs into a new sorted file. Merges are serialized by FILE.lock,
+// and the cache file is mapped again, it may be rewritten by other runs since this run opened it.
+static int vc_cache_merge(struct vc_cache *c)
+{
+    int lock = vc_cache_lock(c->fname);
+    // logs are kept, and merged by the next run
+    if ( lock == -1 ) return 1;
+
+    struct vc_log *logs = NULL;
+    int n_log = vc_cache_logs(c, &logs);
+    int i, n_new = 0;
+    for ( i = 0; i < n_log; ++i )
+        if ( logs[i].l_hdr != -1 && logs[i].data.l > logs[i].l_hdr ) n_new++;
+
+    struct vc_cache cur;
+    memset(&cur, 0, sizeof(cur));
+    cur.fname = c->fname;
+    cur.checksum = c->checksum;
+    cur.key = c->key;
+    if ( n_new ) vc_cache_map(&cur);
+
+    int ret = n_new ? vc_cache_write(&cur, logs, n_log) : 0;
+    // logs of other databases are useless
+    if ( ret == 0 )
+        for ( i = 0; i < n_log; ++i ) unlink(logs[i].fname);
+
+    vc_cache_unmap(&cur);
+    for ( i = 0; i < n_log; ++i ) {
+        free(logs[i].fname);
+        free(logs[i].data.s);
+    }
+    free(logs);
+    vc_cache_unlock(lock);
+    return ret;
+}
+
+void vc_cache_close(struct vc_cache *c)
+{
+    if ( c == NULL ) return;
+    pthread_mutex_lock(&c->lock);
+    int ref = --c->ref;
+    pthread_mutex_unlock(&c->lock);
+    if ( ref > 0 ) return;
+
+    // closing the log releases its lock, so it could be merged
+    if ( c->fp_new ) {
+        fclose(c->fp_new);
+        vc_cache_merge(c);
+    }
+    vc_cache_unmap(c);
+    pthread_mutex_destroy(&c->lock);
+    free(c->fname);
+    free(c->key);
+    free(c);
+}
@@ -0,0 +1,74 @@
+#ifndef VC_CACHE_HEADER
+#define VC_CACHE_HEADER
+
+#include <stdint.h>
+#include <pthread.h>
+#include "htslib/kstring.h"
+
+// Persistent variant consequence cache, stores the generated tag strings of each variant so the consequence
+// prediction can be skipped for variants annotated in previous runs.
+//
+// The cache file is sorted by contig, position and alleles, and partitioned into bins of 1<<VC_CACHE_BIN_SHIFT
+// bases, it is memory mapped and read only during the run. New records are appended to FILE.new.<pid> in
+// batches, and merged into a new sorted file when the last handler closes the cache. Runs sharing one cache
+// are serialized by flock() on FILE.lock when creating logs and merging; each log is locked by its run, so a
+// merge only takes logs of finished or interrupted runs.
+//
+// File layout, all integers in host order :
+//   char[4]   magic "VCC\1"
+//   uint32    checksum of the GEA database
+//   uint32    l_key, char[l_key] configure key (columns and mito chromosome)
+//   uint32    n_ctg
+//   n_ctg x { uint32 l_name, char[l_name] name, uint32 n_bin, uint64[n_bin+1] offsets of bins }
+//   records : { int32 pos, int32 l_key, int32 l_val, char[l_key] alleles, char[l_val] tags }
+// alleles are "REF\tALT1,ALT2..", tags are tab separated strings in column order, l_val is -1 if no tag generated.
+
+#define VC_CACHE_BIN_SHIFT 12
+#define VC_CACHE_BATCH     4096
+
+struct vc_cache_ctg {
+    char *name;
+    int n_bin;
+    const uint8_t *bins; // n_bin+1 offsets, not aligned
+};
+
+struct vc_cache {
+    char *fname;
+    uint32_t checksum;
+    char *key;
+    // sorted file
+    uint8_t *map;
+    size_t l_map;
+    int n_ctg;
+    struct vc_cache_ctg *ctgs;
+    void *ctg_hash;
+    // new records, appended to fname.new
+    pthread_mutex_t lock;
+    FILE *fp_new;
+    int n_new;
+    // number of handlers sharing this cache
+    int ref;
+};
+
+// New records of one handler, flushed in batches.
+struct vc_cache_batch {
+    int n;
+    kstring_t buf;
+};
+
+// Checksum of file size and modification time, chained by crc, used to invalidate the cache when the databases
+// changed.
+extern uint32_t vc_cache_file_checksum(const char *fname, uint32_t crc);
+// Open cache file, create it if not exists. The existing file is ignored if it was built from another database or
+// configure. Return NULL on failure.
+extern struct vc_cache *vc_cache_open(const char *fname, uint32_t checksum, const char *key);
+extern struct vc_cache *vc_cache_ref(struct vc_cache *c);
+// Release one handler, the last one merges the new records into the cache file.
+extern void vc_cache_close(struct vc_cache *c);
+
+// Return 1 on hit, *val points to the mapped tags, *l_val is -1 for empty tags.
+extern int vc_cache_get(struct vc_cache *c, const char *chrom, int pos, const char *alleles, int l_alleles, const char **val, int *l_val);
+extern void vc_cache_push(struct vc_cache_batch *b, const char *chrom, int pos, const char *alleles, int l_alleles, const char *val, int l_val);
+extern void vc_cache_flush(struct vc_cache *c, struct vc_cache_batch *b);
+
+#endif
@@ -1,67 +1,45 @@
 #include "utils.h"
 #include "wrap_pileup.h"
-#include <limits.h>
 //
 // Assume input bam or VCF records are sorted by chromosome and genomic positions,
-// so we just need load the reference sequence one time, and cached in the memory.
-// This function was designed to check the memory and retrieve the cached sequence
-// or update the memory.
+// so we just need decode a window of reference around the records, and keep it
+// until the records move out of the window.
 //
-// return 1 on success, 0 on failure.
+// Whole chromosomes used to be loaded by faidx and cached in two slots for each
+// handler, now the genome is memory mapped once in 2-bit and shared by all threads.
 //
-// This function is copied and edited from bam_plcmd.c, all credit of this code
-// goes to Li Heng's samtools.
-//
-int plp_get_ref(struct plp_ref *r, char *seqname, faidx_t *fai, int tid, char **ref, int *ref_len)
+void plp_ref_init(struct plp_ref *r, struct ref_store *store)
 {
-    if ( !fai || !r ) {
-        ref = NULL;
-        *ref_len = 0;
-        return 0;
-    }
-
-    if ( tid == r->ref_id[0] ) {
-        *ref = r->ref[0];
-        *ref_len = r->ref_len[0];
-        return 1;
-    }
-
-    if ( tid == r->ref_id[1] ) {
-        // Last, swap over
-        int tmp;
-        tmp = r->ref_id[0];  r->ref_id[0]  = r->ref_id[1];  r->ref_id[1]  = tmp;
-        tmp = r->ref_len[0]; r->ref_len[0] = r->ref_len[1]; r->ref_len[1] = tmp;
+    memset(r, 0, sizeof(*r));
+    r->store = store;
+    r->id = -1;
+}
 
-        char *tc;
-        tc = r->ref[0]; r->ref[0] = r->ref[1]; r->ref[1] = tc;
-        *ref = r->ref[0];
-        *ref_len = r->ref_len[0];
-        return 1;
-    }
+void plp_ref_destroy(struct plp_ref *r)
+{
+    free(r->seq.s);
+    memset(r, 0, sizeof(*r));
+    r->id = -1;
+}
 
-    // New, so migrate to old and load new
-    if ( r->ref[1] != NULL ) free(r->ref[1]);
-    
-    r->ref[1]     = r->ref[0];
-    r->ref_id[1]  = r->ref_id[0];
-    r->ref_len[1] = r->ref_len[0];
+char *plp_get_ref(struct plp_ref *r, const char *seqname, int beg, int end, int *l)
+{
+    *l = 0;
+    if ( r->store == NULL ) return NULL;
+    int id = r->id != -1 && strcmp(r->store->seqs[r->id].name, seqname) == 0 ? r->id : ref_store_name2id(r->store, seqname);
+    if ( id == -1 ) return NULL;
+    if ( beg < 0 ) beg = 0;
+    int len = ref_store_seq_len(r->store, id);
+    if ( end > len ) end = len;
 
-    r->ref_id[0] = tid;
-    r->ref[0] = faidx_fetch_seq(fai,
-                                seqname,
-                                0,
-                                INT_MAX,
-                                &r->ref_len[0]);
-    if (!r->ref[0]) {
-        r->ref[0] = NULL;
-        r->ref_id[0] = -1;
-        r->ref_len[0] = 0;
-        *ref = NULL;
-        return 0;
+    // new chromosome or out of the window, decode a new window
+    if ( id != r->id || beg < r->beg || end > r->beg + (int)r->seq.l ) {
+        r->id = id;
+        r->beg = beg;
+        r->seq.l = 0;
+        ref_store_fetch(r->store, id, beg, end - beg < PLP_REF_WINDOW ? beg + PLP_REF_WINDOW : end, &r->seq);
+        if ( r->seq.s == NULL ) kputs("", &r->seq);
     }
-
-    *ref = r->ref[0];
-    *ref_len = r->ref_len[0];
-    return 1;
+    if ( end > beg ) *l = end - beg;
+    return r->seq.s + (beg - r->beg);
 }
-
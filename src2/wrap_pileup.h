@@ -3,14 +3,24 @@
 
 #include <stdlib.h>
 //#include "htslib/sam.h"
-#include "htslib/faidx.h"
+#include "htslib/kstring.h"
+#include "ref_store.h"
 
+// Reference window of one handler, decoded from the 2-bit genome shared by all threads.
 struct plp_ref {
-    char *ref[2];
-    int ref_id[2];
-    int ref_len[2];
+    struct ref_store *store; // shared, do NOT free it
+    int id;  // sequence id of window, -1 for empty
+    int beg; // 0-based start of window
+    kstring_t seq;
 };
 
-extern int plp_get_ref(struct plp_ref *r, char *seqname, faidx_t *fai, int tid, char **ref, int *ref_len);
+// windows are extended to at least this length, so neighbour queries hit the same window
+#define PLP_REF_WINDOW (1<<16)
+
+extern void plp_ref_init(struct plp_ref *r, struct ref_store *store);
+extern void plp_ref_destroy(struct plp_ref *r);
+// Return reference bases start from 0-based beg, *l is set to the number of bases before end, clipped to the
+// chromosome. Return NULL if no such chromosome.
+extern char *plp_get_ref(struct plp_ref *r, const char *seqname, int beg, int end, int *l);
 
 #endif